@@ -20,195 +20,1255 @@
 
 #include "gcusbadapter.h"
 
+#include <IOKit/IOSubMemoryDescriptor.h>
+#include <IOKit/IOWorkLoop.h>
+#include <kern/clock.h>
+
 #define super IOUSBHIDDriver
 
-OSDefineMetaClassAndStructors(GCUSBAdapter, super);
+OSDefineMetaClassAndStructors(GCUSBAdapter, super);
+
+static_assert (9 == GCUSBPortReportLength, "GCUSBPortStateWrite publishes a 9 byte port report");
+
+static uint64_t GCUSBNanoseconds (void) {
+    uint64_t ns;
+    absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+    return ns;
+}
+
+/**
+ * @brief Player slots shared by all adapters
+ *
+ * The lock is allocated by the first adapter that needs it. Adapters may start in
+ * parallel so the allocation is published with a compare and swap.
+ */
+class GCUSBPlayerSlots {
+public:
+    ~GCUSBPlayerSlots () {
+        if (_lock) {
+            IOLockFree(_lock);
+        }
+    }
+
+    int acquire (uint32_t location, int port) {
+        IOLock *lock = getLock();
+        int slot;
+
+        if (!lock) {
+            return -1;
+        }
+
+        IOLockLock(lock);
+        slot = _table.acquire(location, port);
+        IOLockUnlock(lock);
+
+        return slot;
+    }
+
+    void release (uint32_t location, int port) {
+        IOLock *lock = getLock();
+
+        if (lock) {
+            IOLockLock(lock);
+            _table.release(location, port);
+            IOLockUnlock(lock);
+        }
+    }
+
+private:
+    IOLock *getLock (void) {
+        IOLock *lock = __atomic_load_n(&_lock, __ATOMIC_ACQUIRE), *new_lock;
+
+        if (lock) {
+            return lock;
+        }
+
+        new_lock = IOLockAlloc();
+        if (new_lock && !__atomic_compare_exchange_n(&_lock, &lock, new_lock, false, __ATOMIC_ACQ_REL,
+                                                     __ATOMIC_ACQUIRE)) {
+            /* another adapter got there first */
+            IOLockFree(new_lock);
+            return lock;
+        }
+
+        return new_lock;
+    }
+
+    GCUSBSlotTable _table;
+    IOLock *_lock = nullptr;
+};
+
+static GCUSBPlayerSlots GCUSBPlayers;
+
+bool GCUSBAdapter::start(IOService *provider) {
+    bool ret = super::start (provider);
+
+    if (!ret) {
+        return false;
+    }
+
+    do {
+        IOLog ("Starting GC Adpater Driver for vid: 0x%04x, pid: 0x%04x, location: 0x%08x\n", _device->GetVendorID(),
+               _device->GetProductID(), _device->GetLocationID());
+
+        _location = _device->GetLocationID();
+
+        setProperty("Product", "GameCube USB Adapter WUP-028");
+        setProperty("KeepAliveInterval", 0ULL, 32);
+        setProperty("ConnectDebounce", _hotplug.connectThreshold(), 32);
+        setProperty("DisconnectDebounce", _hotplug.disconnectThreshold(), 32);
+        setProperty("RumbleInterval", _rumble_interval, 32);
+        setProperty("GapThreshold", _poll_rate.gapThreshold(), 32);
+        setProperty("MeasuredReportInterval", _measured_interval);
+
+        /* the endpoint's polling interval (us) is what the adapter should deliver */
+        OSNumber *interval = super::newReportIntervalNumber();
+        if (interval) {
+            _poll_rate.setNominal(interval->unsigned64BitValue() * 1000ULL);
+            interval->release();
+        }
+
+        /* add CFPlugIn for rumble support. the dictionary is shared by all ports */
+        OSString *plugin_path = OSString::withCString("gcusbadapter.kext/Contents/PlugIns/gcusbrumble.bundle");
+        _plugin_types = OSDictionary::withCapacity(1);
+        if (nullptr == plugin_path || nullptr == _plugin_types) {
+            if (plugin_path) {
+                plugin_path->release();
+            }
+            break;
+        }
+
+        _plugin_types->setObject("f4545ce5-bf5b-11d6-a4bb-0003933e3e3e", plugin_path);
+        plugin_path->release();
+
+        /* report descriptors are shared by all ports and point at constant storage */
+        _wired_descriptor = IOMemoryDescriptor::withAddress((void *) GCUSBWiredDescriptor::data,
+                                                            GCUSBWiredDescriptor::length, kIODirectionIn);
+        _wavebird_descriptor = IOMemoryDescriptor::withAddress((void *) GCUSBWaveBirdDescriptor::data,
+                                                               GCUSBWaveBirdDescriptor::length, kIODirectionIn);
+        if (nullptr == _wired_descriptor || nullptr == _wavebird_descriptor) {
+            break;
+        }
+
+        /* product names are built once so a connect does not allocate them */
+        int i;
+        for (i = 0 ; i < 4 ; ++i) {
+            char product_name[64];
+
+            snprintf (product_name, sizeof (product_name), "GameCube Wired Controller %d", i + 1);
+            _product_strings[0][i] = OSString::withCString(product_name);
+            snprintf (product_name, sizeof (product_name), "GameCube WaveBird Controller %d", i + 1);
+            _product_strings[1][i] = OSString::withCString(product_name);
+            if (nullptr == _product_strings[0][i] || nullptr == _product_strings[1][i]) {
+                break;
+            }
+        }
+
+        if (i < 4) {
+            break;
+        }
+
+        /* Allocate staging buffer for the 0x21 report */
+        _report = IOBufferMemoryDescriptor::withCapacity(GCUSBInputReportLength, kIODirectionInOut);
+
+        /* Allocate a buffer for rumble reports */
+        _rumble_descriptor = IOBufferMemoryDescriptor::withCapacity(GCUSBRumbleReportLength, kIODirectionOut);
+        if (nullptr == _report || nullptr == _rumble_descriptor) {
+            break;
+        }
+
+        /* controllers are attached and detached on the work loop instead of the report path */
+        _hotplug_source = IOInterruptEventSource::interruptEventSource(this, hotplugAction);
+        if (nullptr == _hotplug_source || kIOReturnSuccess != getWorkLoop()->addEventSource(_hotplug_source)) {
+            break;
+        }
+
+        /* rumble reports are transferred from a thread call so no caller waits on USB */
+        _rumble_lock = IOLockAlloc();
+        _rumble_call = thread_call_allocate(rumbleTransferAction, this);
+        if (nullptr == _rumble_lock || nullptr == _rumble_call) {
+            break;
+        }
+
+        /* rumble reports are flushed from the work loop */
+        _rumble_timer = IOTimerEventSource::timerEventSource(this, rumbleAction);
+        if (nullptr == _rumble_timer || kIOReturnSuccess != getWorkLoop()->addEventSource(_rumble_timer)) {
+            break;
+        }
+
+        /* Each port reads its report directly out of the staging buffer */
+        for (i = 0 ; i < 4 ; ++i) {
+            _port_reports[i] = IOSubMemoryDescriptor::withSubRange(_report, GCUSBReportDecoder::portOffset(i),
+                                                                   GCUSBPortReportLength, kIODirectionIn);
+            _backlog_reports[i] = IOBufferMemoryDescriptor::withCapacity(GCUSBPortReportLength, kIODirectionInOut);
+            if (nullptr == _port_reports[i] || nullptr == _backlog_reports[i]) {
+                break;
+            }
+        }
+
+        if (i < 4) {
+            break;
+        }
+
+        /* rumble rings can be mapped by the rumble plug-in. they stay in place until the
+         * adapter is freed so a mapping never outlives its memory */
+        for (i = 0 ; i < 4 ; ++i) {
+            _rumble_ring_memory[i] = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                                           round_page(sizeof (GCUSBRumbleRing)),
+                                                                           page_size);
+            if (nullptr == _rumble_ring_memory[i]) {
+                break;
+            }
+
+            _rumble_rings[i] = (GCUSBRumbleRing *) _rumble_ring_memory[i]->getBytesNoCopy();
+            GCUSBRumbleRingInit(_rumble_rings[i]);
+        }
+
+        if (i < 4) {
+            break;
+        }
+
+        /* the latest state of every port is published here for memory-mapped readers */
+        _state_memory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                              round_page(sizeof (GCUSBStateRegion)), page_size);
+        if (nullptr == _state_memory) {
+            break;
+        }
+
+        _state = (GCUSBStateRegion *) _state_memory->getBytesNoCopy();
+        GCUSBStateRegionInit(_state);
+
+        /* a capture can be requested from the personality to include the start report */
+        _capture_lock = IOSimpleLockAlloc();
+        if (nullptr == _capture_lock) {
+            break;
+        }
+
+        OSNumber *capture_size = OSDynamicCast(OSNumber, getProperty("Capture"));
+        if (capture_size && capture_size->unsigned32BitValue()) {
+            startCapture(capture_size->unsigned32BitValue());
+        }
+
+        /* start reports from the device. this is done last so everything needed by
+         * handleReportWithTime is in place */
+        unsigned char _payload[1] = {GCUSBStartReportID};
+        IOBufferMemoryDescriptor *startReport = IOBufferMemoryDescriptor::withBytes(_payload, 1, kIODirectionOut);
+        if (!startReport) {
+            break;
+        }
+
+        captureReport(GCUSBNanoseconds(), GCUSBCaptureOutput, _payload, 1);
+        setReport(startReport, kIOHIDReportTypeOutput, 0);
+        startReport->release ();
+
+        return true;
+    } while (0);
+
+    cleanup();
+
+    return false;
+}
+
+void GCUSBAdapter::cleanup (void) {
+    if (_rumble_timer) {
+        _rumble_timer->cancelTimeout();
+        getWorkLoop()->removeEventSource(_rumble_timer);
+        _rumble_timer->release();
+        _rumble_timer = nullptr;
+    }
+
+    if (_rumble_call && thread_call_cancel(_rumble_call)) {
+        /* drop the reference taken for the cancelled transfer */
+        release();
+    }
+
+    if (_hotplug_source) {
+        getWorkLoop()->removeEventSource(_hotplug_source);
+        _hotplug_source->release();
+        _hotplug_source = nullptr;
+    }
+
+    for (int i = 0 ; i < 4 ; ++i) {
+        if (_ports[i]) {
+            GCUSBPlayers.release(_location, i);
+            _ports[i]->terminate();
+            _ports[i]->release ();
+            _ports[i] = nullptr;
+        }
+
+        if (_port_reports[i]) {
+            _port_reports[i]->release ();
+            _port_reports[i] = nullptr;
+        }
+
+        if (_backlog_reports[i]) {
+            _backlog_reports[i]->release ();
+            _backlog_reports[i] = nullptr;
+        }
+    }
+
+    if (_plugin_types) {
+        _plugin_types->release ();
+        _plugin_types = nullptr;
+    }
+
+    if (_wired_descriptor) {
+        _wired_descriptor->release();
+        _wired_descriptor = nullptr;
+    }
+
+    if (_wavebird_descriptor) {
+        _wavebird_descriptor->release();
+        _wavebird_descriptor = nullptr;
+    }
+
+    for (int i = 0 ; i < 4 ; ++i) {
+        for (int j = 0 ; j < 2 ; ++j) {
+            if (_product_strings[j][i]) {
+                _product_strings[j][i]->release();
+                _product_strings[j][i] = nullptr;
+            }
+        }
+    }
+
+    if (_capture_lock) {
+        startCapture(0);
+        IOSimpleLockFree(_capture_lock);
+        _capture_lock = nullptr;
+    }
+
+    if (_report) {
+        _report->release();
+        _report = nullptr;
+    }
+
+}
+
+void GCUSBAdapter::stop(IOService *provider) {
+    super::stop (provider);
+    cleanup();
+}
+
+void GCUSBAdapter::free (void) {
+    /* a transfer may still have been running during stop. the thread call, the lock
+     * and the rumble buffer can only go away once the last reference is gone */
+    if (_rumble_call) {
+        thread_call_free(_rumble_call);
+        _rumble_call = nullptr;
+    }
+
+    if (_rumble_lock) {
+        IOLockFree(_rumble_lock);
+        _rumble_lock = nullptr;
+    }
+
+    if (_rumble_descriptor) {
+        _rumble_descriptor->release ();
+        _rumble_descriptor = nullptr;
+    }
+
+    if (_state_memory) {
+        _state_memory->release();
+        _state_memory = nullptr;
+        _state = nullptr;
+    }
+
+    for (int i = 0 ; i < 4 ; ++i) {
+        if (_rumble_ring_memory[i]) {
+            _rumble_ring_memory[i]->release();
+            _rumble_ring_memory[i] = nullptr;
+            _rumble_rings[i] = nullptr;
+        }
+    }
+
+    super::free();
+}
+
+/**
+ * @brief Request a new rumble state for a port
+ *
+ * The request only updates the merged rumble state and never waits on USB. The 0x11
+ * report is queued by flushRumble() at most once every RumbleInterval ms or earlier if
+ * an input report arrives first, and is transferred asynchronously.
+ */
+IOReturn GCUSBAdapter::setRumble(int port, int data) {
+    if (!rumbleAllowed(port, data)) {
+        return kIOReturnSuccess;
+    }
+
+    if (_rumble.set(port, data) && _rumble_timer) {
+        _rumble_timer->setTimeoutMS(_rumble_interval);
+    }
+
+    return kIOReturnSuccess;
+}
+
+/**
+ * @brief Check a rumble request against the state of the port
+ *
+ * Turning the motor on is pointless without rumble power (the adapter's second USB
+ * cable) or with a WaveBird so those requests are dropped before they cost a transfer.
+ * Turning it off is always allowed so a stale state is not left behind.
+ */
+bool GCUSBAdapter::rumbleAllowed (int port, uint8_t value) {
+    if (0 == value || (__atomic_load_n(&_rumble_power, __ATOMIC_RELAXED) & (1 << port))) {
+        return true;
+    }
+
+    __atomic_fetch_add(&_rumble_unpowered, 1, __ATOMIC_RELAXED);
+
+    return false;
+}
+
+void GCUSBAdapter::rumbleAction (OSObject *owner, IOTimerEventSource *sender) {
+    GCUSBAdapter *adapter = OSDynamicCast(GCUSBAdapter, owner);
+    if (adapter) {
+        adapter->flushRumble();
+    }
+}
+
+IOReturn GCUSBAdapter::rumbleRingAction (OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3) {
+    GCUSBAdapter *adapter = OSDynamicCast(GCUSBAdapter, owner);
+    IOMemoryDescriptor **memory = (IOMemoryDescriptor **) arg2;
+    int port = (int)(uintptr_t) arg0;
+    uint32_t mask = 1 << port;
+
+    if (!adapter || !adapter->_rumble_rings[port]) {
+        return kIOReturnNotReady;
+    }
+
+    if (memory) {
+        if (adapter->_rumble_ring_open & mask) {
+            return kIOReturnExclusiveAccess;
+        }
+
+        /* anything left behind by the previous producer is stale */
+        GCUSBRumbleRingDiscard(adapter->_rumble_rings[port]);
+        __atomic_store_n(&adapter->_rumble_ring_open, adapter->_rumble_ring_open | mask, __ATOMIC_RELEASE);
+
+        adapter->_rumble_ring_memory[port]->retain();
+        *memory = adapter->_rumble_ring_memory[port];
+    } else if (adapter->_rumble_ring_open & mask) {
+        /* the last command from the producer (usually motor off) still has to go out */
+        adapter->flushRumble();
+        __atomic_store_n(&adapter->_rumble_ring_open, adapter->_rumble_ring_open & ~mask, __ATOMIC_RELEASE);
+    }
+
+    return kIOReturnSuccess;
+}
+
+/**
+ * @brief Hand the rumble ring of a port to a new producer
+ *
+ * Opening and closing run on the work loop so they are serialized with the drain in
+ * flushRumble().
+ */
+IOMemoryDescriptor *GCUSBAdapter::openRumbleRing (int port) {
+    IOMemoryDescriptor *memory = nullptr;
+    IOWorkLoop *workLoop = getWorkLoop();
+
+    if (!workLoop || kIOReturnSuccess != workLoop->runAction(rumbleRingAction, this, (void *)(uintptr_t) port,
+                                                             nullptr, &memory)) {
+        return nullptr;
+    }
+
+    return memory;
+}
+
+void GCUSBAdapter::closeRumbleRing (int port) {
+    IOWorkLoop *workLoop = getWorkLoop();
+
+    if (workLoop) {
+        workLoop->runAction(rumbleRingAction, this, (void *)(uintptr_t) port, nullptr, nullptr);
+    }
+}
+
+/**
+ * @brief Check the open rumble rings for new commands
+ *
+ * Called on the report path. The input reports arrive continuously so this is how the
+ * rings are polled while they are open.
+ */
+bool GCUSBAdapter::rumbleRingsPending (void) const {
+    uint32_t open = __atomic_load_n(&_rumble_ring_open, __ATOMIC_ACQUIRE);
+
+    for (int i = 0 ; open && i < 4 ; ++i) {
+        if ((open & (1 << i)) && GCUSBRumbleRingPending(_rumble_rings[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Move commands from the open rumble rings into the rumble state
+ *
+ * Runs on the work loop. Only the newest command of each ring affects the merged state
+ * so a burst of commands turns into a single rumble report. The ring indices are
+ * writable by the client so a drain never pops more than one ring's worth of commands
+ * and a ring claiming more than that is treated as corrupt and emptied.
+ */
+void GCUSBAdapter::drainRumbleRings (void) {
+    for (int i = 0 ; i < 4 ; ++i) {
+        uint8_t value, last = 0;
+        uint32_t queued;
+
+        if (!(_rumble_ring_open & (1 << i))) {
+            continue;
+        }
+
+        queued = GCUSBRumbleRingQueued(_rumble_rings[i]);
+        if (queued > GCUSBRumbleRingSize) {
+            GCUSBRumbleRingDiscard(_rumble_rings[i]);
+            ++_rumble_ring_errors;
+            continue;
+        }
+
+        for (uint32_t n = 0 ; n < queued ; ++n) {
+            if (!GCUSBRumbleRingPop(_rumble_rings[i], &value)) {
+                queued = n;
+                break;
+            }
+
+            last = value;
+            ++_rumble_ring_commands;
+        }
+
+        if (queued && rumbleAllowed(i, last)) {
+            _rumble.set(i, last);
+        }
+    }
+}
+
+void GCUSBAdapter::flushRumble (void) {
+    uint8_t report[GCUSBRumbleReportLength];
+    bool start = false;
+
+    drainRumbleRings();
+
+    IOLockLock(_rumble_lock);
+    if (_rumble.flush(report)) {
+        start = _rumble_queue.submit(report);
+    }
+    IOLockUnlock(_rumble_lock);
+
+    if (start) {
+        retain();
+        if (thread_call_enter(_rumble_call)) {
+            /* already pending. the queued report will be picked up by that transfer */
+            release();
+        }
+    }
+}
+
+void GCUSBAdapter::rumbleTransferAction (thread_call_param_t param0, thread_call_param_t param1) {
+    GCUSBAdapter *adapter = (GCUSBAdapter *) param0;
+
+    adapter->transferRumble();
+    adapter->release();
+}
+
+/**
+ * @brief Transfer queued rumble reports to the adapter
+ *
+ * Runs from a thread call. Reports queued while a transfer is in flight replace each
+ * other so only the newest merged state is sent next. The transfer itself is still a
+ * synchronous setReport so the thread call, not the work loop, waits for the adapter.
+ * This keeps flushes off the work loop but does not shorten the time until a request
+ * reaches the adapter (see gcusbreplay -L).
+ */
+void GCUSBAdapter::transferRumble (void) {
+    uint8_t report[GCUSBRumbleReportLength];
+
+    IOLockLock(_rumble_lock);
+    while (_rumble_queue.next(report)) {
+        IOLockUnlock(_rumble_lock);
+
+        captureReport(GCUSBNanoseconds(), GCUSBCaptureOutput, report, sizeof (report));
+        _rumble_descriptor->writeBytes(0, report, sizeof (report));
+        IOReturn ret = super::setReport(_rumble_descriptor, kIOHIDReportTypeOutput, kIOHIDOptionsTypeNone);
+
+        IOLockLock(_rumble_lock);
+        rumbleComplete(ret);
+    }
+    IOLockUnlock(_rumble_lock);
+}
+
+/**
+ * @brief Completion for a rumble transfer. Called with the rumble lock held.
+ */
+void GCUSBAdapter::rumbleComplete (IOReturn status) {
+    _rumble_queue.complete();
+
+    if (kIOReturnSuccess == status) {
+        _rumble.transmitted();
+    } else {
+        /* resend the current state on the next flush */
+        _rumble.failed();
+    }
+}
+
+/**
+ * @brief Start or stop capturing raw reports
+ *
+ * @param[in] size  size of the capture buffer in bytes. 0 stops the capture and
+ *                  discards the captured data.
+ */
+IOReturn GCUSBAdapter::startCapture (uint32_t size) {
+    IOBufferMemoryDescriptor *buffer = nullptr, *old_buffer;
+
+    if (size > GCUSBMaxCaptureSize) {
+        return kIOReturnBadArgument;
+    }
+
+    if (size) {
+        buffer = IOBufferMemoryDescriptor::withCapacity(size, kIODirectionInOut);
+        if (!buffer) {
+            return kIOReturnNoMemory;
+        }
+    }
+
+    IOSimpleLockLock(_capture_lock);
+    old_buffer = _capture_buffer;
+    _capture_buffer = buffer;
+    if (buffer) {
+        _capture.start((uint8_t *) buffer->getBytesNoCopy(), size);
+    } else {
+        _capture.stop();
+    }
+    IOSimpleLockUnlock(_capture_lock);
+
+    if (old_buffer) {
+        old_buffer->release();
+    }
+
+    return kIOReturnSuccess;
+}
+
+void GCUSBAdapter::captureReport (uint64_t timestamp, GCUSBCaptureDirection direction, const uint8_t *report,
+                                  size_t length) {
+    if (!_capture.active()) {
+        return;
+    }
+
+    IOSimpleLockLock(_capture_lock);
+    _capture.append(timestamp, direction, report, length);
+    IOSimpleLockUnlock(_capture_lock);
+}
+
+void GCUSBAdapter::recenter (int port) {
+    _decoder.recenter(port);
+}
+
+IOReturn GCUSBAdapter::buttonProfileAction (OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3) {
+    GCUSBAdapter *adapter = OSDynamicCast(GCUSBAdapter, owner);
+    GCUSBButtonProfile *profile = (GCUSBButtonProfile *) arg1;
+
+    if (!adapter) {
+        return kIOReturnBadArgument;
+    }
+
+    *profile = adapter->_buttons.configure((int)(uintptr_t) arg0, *profile);
+
+    return kIOReturnSuccess;
+}
+
+/**
+ * @brief Set the button remap profile of a port
+ *
+ * The tables are built on the work loop so profile changes are serialized. The report
+ * path switches to the new tables with the next report.
+ */
+GCUSBButtonProfile GCUSBAdapter::setButtonProfile (int port, const GCUSBButtonProfile &profile) {
+    GCUSBButtonProfile result = profile;
+
+    if (kIOReturnSuccess != getWorkLoop()->runAction(buttonProfileAction, this, (void *)(uintptr_t) port, &result)) {
+        return _buttons.profile(port);
+    }
+
+    return result;
+}
+
+IOReturn GCUSBAdapter::axisConfigAction (OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3) {
+    GCUSBAdapter *adapter = OSDynamicCast(GCUSBAdapter, owner);
+    GCUSBAxisConfig *config = (GCUSBAxisConfig *) arg1;
+
+    if (!adapter) {
+        return kIOReturnBadArgument;
+    }
+
+    *config = adapter->_axes.configure((int)(uintptr_t) arg0, *config);
+
+    return kIOReturnSuccess;
+}
+
+/**
+ * @brief Set the dead zones and response curves of a port
+ *
+ * The lookup tables are rebuilt on the work loop so concurrent changes are serialized.
+ * The report path switches to the new tables with the next report.
+ */
+GCUSBAxisConfig GCUSBAdapter::setAxisConfig (int port, const GCUSBAxisConfig &config) {
+    GCUSBAxisConfig result = config;
+
+    if (kIOReturnSuccess != getWorkLoop()->runAction(axisConfigAction, this, (void *)(uintptr_t) port, &result)) {
+        return _axes.config(port);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Handle property writes from user space
+ *
+ * KeepAliveInterval (ms) forces delivery of an unchanged controller state after the
+ * given interval. 0 (the default) only delivers changed states. ConnectDebounce and
+ * DisconnectDebounce set the number of consecutive reports a controller has to be
+ * present (absent) before its virtual gamepad is created (destroyed). RumbleInterval (ms)
+ * is the longest a rumble request waits before it is sent to the adapter. GapThreshold
+ * is the number of polling intervals between two reports that is counted as a gap.
+ * MeasuredReportInterval makes the ports report the measured instead of the nominal
+ * polling interval. Writing any value to ResetStatistics clears the latency histograms
+ * and the poll rate monitor. Capture sets the size (bytes)
+ * of a buffer recording all raw reports (0 stops capturing). The recorded data is
+ * published as CaptureData.
+ */
+IOReturn GCUSBAdapter::setProperties (OSObject *properties) {
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    OSNumber *number, *number2;
+    bool handled = false;
+
+    if (!dict) {
+        return kIOReturnBadArgument;
+    }
+
+    number = OSDynamicCast(OSNumber, dict->getObject("KeepAliveInterval"));
+    if (number) {
+        _filter.setKeepAlive(number->unsigned64BitValue() * 1000000ULL);
+        setProperty("KeepAliveInterval", number);
+        handled = true;
+    }
+
+    number = OSDynamicCast(OSNumber, dict->getObject("ConnectDebounce"));
+    number2 = OSDynamicCast(OSNumber, dict->getObject("DisconnectDebounce"));
+    if (number || number2) {
+        _hotplug.setThresholds(number ? number->unsigned32BitValue() : _hotplug.connectThreshold(),
+                               number2 ? number2->unsigned32BitValue() : _hotplug.disconnectThreshold());
+        setProperty("ConnectDebounce", _hotplug.connectThreshold(), 32);
+        setProperty("DisconnectDebounce", _hotplug.disconnectThreshold(), 32);
+        handled = true;
+    }
+
+    number = OSDynamicCast(OSNumber, dict->getObject("RumbleInterval"));
+    if (number) {
+        _rumble_interval = number->unsigned32BitValue();
+        setProperty("RumbleInterval", _rumble_interval, 32);
+        handled = true;
+    }
+
+    number = OSDynamicCast(OSNumber, dict->getObject("GapThreshold"));
+    if (number) {
+        _poll_rate.setGapThreshold(number->unsigned32BitValue());
+        setProperty("GapThreshold", _poll_rate.gapThreshold(), 32);
+        handled = true;
+    }
+
+    OSBoolean *boolean = OSDynamicCast(OSBoolean, dict->getObject("MeasuredReportInterval"));
+    if (boolean) {
+        _measured_interval = boolean->getValue();
+        setProperty("MeasuredReportInterval", _measured_interval);
+        handled = true;
+    }
+
+    number = OSDynamicCast(OSNumber, dict->getObject("Capture"));
+    if (number) {
+        IOReturn ret = startCapture(number->unsigned32BitValue());
+        if (kIOReturnSuccess != ret) {
+            return ret;
+        }
+        setProperty("Capture", number);
+        handled = true;
+    }
+
+    if (dict->getObject("ResetStatistics")) {
+        _decode_latency.reset();
+        _inject_latency.reset();
+        _hotplug_latency.reset();
+        for (int i = 0 ; i < 4 ; ++i) {
+            _port_latency[i].reset();
+        }
+        _report_interval.reset();
+        _poll_rate.reset();
+        handled = true;
+    }
+
+    return handled ? kIOReturnSuccess : super::setProperties(properties);
+}
+
+static void GCUSBSetStatistic (OSDictionary *stats, const char *key, uint64_t value) {
+    OSNumber *number = OSNumber::withNumber(value, 64);
+    if (number) {
+        stats->setObject(key, number);
+        number->release();
+    }
+}
+
+/**
+ * @brief Convert a latency histogram into a registry dictionary
+ *
+ * Buckets holds the sample count of each power-of-two bucket. Bucket i > 0 counts
+ * latencies in [2^(i-1), 2^i) ns.
+ */
+static OSDictionary *GCUSBHistogramDictionary (const GCUSBHistogram &histogram) {
+    OSDictionary *dict = OSDictionary::withCapacity(6);
+    OSArray *buckets = OSArray::withCapacity(GCUSBHistogramBuckets);
+
+    if (dict && buckets) {
+        for (unsigned int i = 0 ; i < GCUSBHistogramBuckets ; ++i) {
+            OSNumber *number = OSNumber::withNumber(histogram.bucketCount(i), 64);
+            if (number) {
+                buckets->setObject(number);
+                number->release();
+            }
+        }
+
+        GCUSBSetStatistic(dict, "Count", histogram.count());
+        GCUSBSetStatistic(dict, "Total", histogram.sum());
+        GCUSBSetStatistic(dict, "P50", histogram.percentile(50));
+        GCUSBSetStatistic(dict, "P99", histogram.percentile(99));
+        GCUSBSetStatistic(dict, "Max", histogram.max());
+        dict->setObject("Buckets", buckets);
+    }
+
+    if (buckets) {
+        buckets->release();
+    }
+
+    return dict;
+}
+
+static void GCUSBSetHistogram (OSDictionary *dict, const char *key, const GCUSBHistogram &histogram) {
+    OSDictionary *value = GCUSBHistogramDictionary(histogram);
+    if (value) {
+        dict->setObject(key, value);
+        value->release();
+    }
+}
+
+/**
+ * @brief Publish the adapter statistics
+ *
+ * The counters are maintained without locks on the report path and are only converted
+ * to registry properties when someone reads the registry entry.
+ */
+void GCUSBAdapter::updateStatistics (void) {
+    OSDictionary *stats = OSDictionary::withCapacity(17);
+    if (!stats) {
+        return;
+    }
+
+    GCUSBSetStatistic(stats, "ReportsDelivered", _filter.deliveredCount());
+    GCUSBSetStatistic(stats, "ReportsSuppressed", _filter.suppressedCount());
+    GCUSBSetStatistic(stats, "ReportsQueued", _mailbox.queuedCount());
+    GCUSBSetStatistic(stats, "ReportsCoalesced", _mailbox.coalescedCount());
+    GCUSBSetStatistic(stats, "ReportsMerged", _mailbox.mergedCount());
+    GCUSBSetStatistic(stats, "ReportsDropped", _mailbox.droppedCount());
+    GCUSBSetStatistic(stats, "PortReportFailures", _port_report_failures);
+    GCUSBSetStatistic(stats, "RumbleRequested", _rumble.requestedCount());
+    GCUSBSetStatistic(stats, "RumbleTransmitted", _rumble.transmittedCount());
+    GCUSBSetStatistic(stats, "RumbleReplaced", _rumble_queue.replacedCount());
+    GCUSBSetStatistic(stats, "RumbleRingCommands", _rumble_ring_commands);
+    GCUSBSetStatistic(stats, "RumbleRingErrors", _rumble_ring_errors);
+    GCUSBSetStatistic(stats, "RumbleUnpowered", _rumble_unpowered);
+    uint64_t ring_dropped = 0;
+    for (int i = 0 ; i < 4 ; ++i) {
+        if (_rumble_rings[i]) {
+            ring_dropped += __atomic_load_n(&_rumble_rings[i]->dropped, __ATOMIC_RELAXED);
+        }
+    }
+    GCUSBSetStatistic(stats, "RumbleRingDropped", ring_dropped);
+    GCUSBSetStatistic(stats, "GetReportHits", _get_report_hits);
+    GCUSBSetStatistic(stats, "GetReportMisses", _get_report_misses);
+    GCUSBSetStatistic(stats, "CaptureDropped", _capture.dropped());
+
+    setProperty("Statistics", stats);
+    stats->release();
+
+    OSDictionary *poll_rate = OSDictionary::withCapacity(8);
+    if (poll_rate) {
+        GCUSBSetStatistic(poll_rate, "NominalInterval", _poll_rate.nominal());
+        GCUSBSetStatistic(poll_rate, "MeanInterval", _poll_rate.mean());
+        GCUSBSetStatistic(poll_rate, "Jitter", _poll_rate.jitter());
+        GCUSBSetStatistic(poll_rate, "MaxInterval", _poll_rate.max());
+        GCUSBSetStatistic(poll_rate, "Rate", _poll_rate.rate());
+        GCUSBSetStatistic(poll_rate, "Intervals", _poll_rate.samples());
+        GCUSBSetStatistic(poll_rate, "Gaps", _poll_rate.gaps());
+        GCUSBSetStatistic(poll_rate, "MissedReports", _poll_rate.missed());
+        setProperty("PollRate", poll_rate);
+        poll_rate->release();
+    }
+
+    OSDictionary *latency = OSDictionary::withCapacity(7);
+    if (!latency) {
+        return;
+    }
+
+    GCUSBSetHistogram(latency, "Decode", _decode_latency);
+    GCUSBSetHistogram(latency, "Injection", _inject_latency);
+    GCUSBSetHistogram(latency, "Hotplug", _hotplug_latency);
+    GCUSBSetHistogram(latency, "ReportInterval", _report_interval);
+    for (int i = 0 ; i < 4 ; ++i) {
+        char key[8];
+        snprintf (key, sizeof (key), "Port %d", i + 1);
+        GCUSBSetHistogram(latency, key, _port_latency[i]);
+    }
+
+    setProperty("Latency", latency);
+    latency->release();
+
+    /* the captured records before used() never change so they can be copied without
+     * holding the capture lock */
+    IOBufferMemoryDescriptor *capture_buffer;
+    size_t capture_used;
+
+    if (!_capture_lock) {
+        return;
+    }
+
+    IOSimpleLockLock(_capture_lock);
+    capture_buffer = _capture_buffer;
+    capture_used = _capture.used();
+    if (capture_buffer) {
+        capture_buffer->retain();
+    }
+    IOSimpleLockUnlock(_capture_lock);
+
+    if (capture_buffer) {
+        OSData *data = OSData::withBytes(capture_buffer->getBytesNoCopy(), (unsigned int) capture_used);
+        if (data) {
+            setProperty("CaptureData", data);
+            data->release();
+        }
+        capture_buffer->release();
+    } else {
+        removeProperty("CaptureData");
+    }
+}
+
+bool GCUSBAdapter::serializeProperties (OSSerialize *s) const {
+    const_cast<GCUSBAdapter *>(this)->updateStatistics();
+    return super::serializeProperties(s);
+}
+
+/**
+ * @brief Polling interval (us) of the adapter
+ *
+ * Normally the nominal interval of the interrupt endpoint. With MeasuredReportInterval
+ * set the measured mean interval is reported once enough reports have arrived, so hubs
+ * or host controllers that poll the adapter less often than requested are visible to
+ * clients.
+ */
+OSNumber *GCUSBAdapter::newReportIntervalNumber () const {
+    if (_measured_interval && _poll_rate.samples() >= (1u << GCUSBRateMonitorShift)) {
+        return OSNumber::withNumber((_poll_rate.mean() + 500) / 1000, 32);
+    }
+
+    return super::newReportIntervalNumber();
+}
+
+IOReturn GCUSBAdapter::getReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
+                                  IOOptionBits options) {
+    return super::getReport(report, reportType, options);
+}
 
-/* Report to inject for each WUP-028 port */
-static uint8_t GCUSBAdapterInjectedDescriptor[] = {
-    0x05, 0x01, /* USAGE_PAGE (Generic Desktop) */
-    0x09, 0x05, /* USAGE (Game Pad) */
-
-    /* Fake reports for Gamecube controllers */
-    0xA1, 0x01,               /* COLLECTION (Application) */
-        0xA1, 0x01,           /* COLLECTION (Application) */
-            0x85, 0x50,       /* REPORT_ID (0x50) */
-            0x05, 0x09,       /* USAGE_PAGE (Button) */
-            0x19, 0x01,       /* USAGE_MINIMUM (Button 1) */
-            0x29, 0x10,       /* USAGE_MAXIMUM (Button 16) */
-            0x15, 0x00,       /* LOGICAL_MINIMUM (0) */
-            0x25, 0x01,       /* LOGICAL_MAXIMUM (1) */
-            0x75, 0x01,       /* REPORT_SIZE (1) */
-            0x95, 0x10,       /* REPORT_COUNT (16) */
-            0x81, 0x02,       /* INPUT (Data,Var,Abs) */
-            0x05, 0x01,       /* USAGE_PAGE (Genertic Desktop) */
-            0x09, 0x30,       /* USAGE (X) */
-            0x09, 0x31,       /* USAGE (Y) */
-            0x09, 0x33,       /* USAGE (Rx) */
-            0x09, 0x34,       /* USAGE (Ry) */
-            0x15, 0x9a,       /* LOGICAL_MINIMUM (-102) -- scaled from original */
-            0x25, 0x66,       /* LOGICAL_MAXIMUM (102) -- scaled from original */
-            0x75, 0x08,       /* REPORT_SIZE (8 bits) */
-            0x95, 0x04,       /* REPORT_COUNT (4) */
-            0x81, 0x02,       /* INPUT(Data,Var,Abs) */
-            0x05, 0x01,       /* USAGE_PAGE (Genertic Desktop) */
-            0x09, 0x32,       /* USAGE (Z) -- Left trigger */
-            0x09, 0x35,       /* USAGE (Rz) -- Right trigger */
-            0x15, 0x18,       /* LOGICAL_MINIMUM (0x18) -- Observed */
-            0x26, 0xf0, 0x00, /* LOGICAL_MAXIMUM (0xf0) -- Observed */
-            0x75, 0x08,       /* REPORT_SIZE (8 bits) */
-            0x95, 0x02,       /* REPORT_COUNT (2) */
-            0x81, 0x02,       /* INPUT(Data,Var,Abs) */
-        0xC0,                 /* END_COLLECTION */
-        0xA1, 0x01,           /* COLLECTION (Application) */
-            0x85, 0x60,       /* REPORT_ID (0x50) */
-            0x06, 0x00, 0xff, /* USAGE_PAGE (Vendor Defined) */
-            0x09, 0x03,       /* USAGE (3) */
-            0x75, 0x08,       /* REPORT_SIZE (8 bits) */
-            0x95, 0x01,       /* REPORT_COUNT (1) */
-            0x91, 0x02,       /* OUTPUT(Data,Var,Abs) */
-        0xC0,                 /* END_COLLECTION */
-    0xC0,                     /* END_COLLECTION */
-};
+/**
+ * @brief Get a report for a port
+ *
+ * Input report 0x50 is built from the state published by the report path so polling
+ * clients never wait on a control transfer (which would also hold up rumble). Everything
+ * else, including a port that has not seen a report yet, goes to the device.
+ */
+IOReturn GCUSBAdapter::getPortReport (int port, IOMemoryDescriptor *report, IOHIDReportType reportType,
+                                      IOOptionBits options) {
+    GCUSBPortSnapshot snapshot;
 
-bool GCUSBAdapter::start(IOService *provider) {
-    bool ret = super::start (provider);
+    /* the low byte of options is the report id */
+    if (kIOHIDReportTypeInput == reportType && GCUSBPortReportID == (options & 0xff) && _state &&
+        GCUSBPortStateRead(_state->port + port, &snapshot, 16) && snapshot.count) {
+        IOBufferMemoryDescriptor *buffer = OSDynamicCast(IOBufferMemoryDescriptor, report);
 
-    if (!ret) {
-        return false;
+        /* never hand back a truncated report as if it were complete */
+        if (report->getLength() < GCUSBPortReportLength) {
+            return kIOReturnNoSpace;
+        }
+
+        snapshot.report[0] = GCUSBPortReportID;
+        if (GCUSBPortReportLength != report->writeBytes(0, snapshot.report, GCUSBPortReportLength)) {
+            return kIOReturnIOError;
+        }
+
+        if (buffer) {
+            buffer->setLength(GCUSBPortReportLength);
+        }
+
+        __atomic_fetch_add(&_get_report_hits, 1, __ATOMIC_RELAXED);
+
+        return kIOReturnSuccess;
     }
 
-    do {
-        IOLog ("Starting GC Adpater Driver for vid: 0x%04x, pid: 0x%04x, location: 0x%08x\n", _device->GetVendorID(),
-               _device->GetProductID(), _device->GetLocationID());
+    __atomic_fetch_add(&_get_report_misses, 1, __ATOMIC_RELAXED);
 
-        setProperty("Product", "GameCube USB Adapter WUP-028");
+    return getReport(report, reportType, options);
+}
 
-        /* start reports from the device */
-        unsigned char _payload[1] = {0x13};
-        IOBufferMemoryDescriptor *startReport = IOBufferMemoryDescriptor::withBytes(_payload, 1, kIODirectionOut);
-        if (!startReport) {
-            break;
+/**
+ * @brief Intercept the incoming 0x21 report and break it down into individual controller reports
+ *
+ * This function is responsible for breaking the Nintendo reports into reports for individual
+ * controllers. There are other possible ways to handle the 37 byte controller reports but this
+ * one seems to be logical. The report is copied once into a staging buffer (the original is
+ * still passed on unmodified to IOUSBHIDDriver) and decoded in place. Each port is then handed
+ * a view of its slice of the staging buffer.
+ */
+IOReturn GCUSBAdapter::handleReportWithTime (AbsoluteTime timeStamp, IOMemoryDescriptor *report,
+                                             IOHIDReportType reportType, IOOptionBits options)
+{
+    uint8_t *report_data = (uint8_t *) _report->getBytesNoCopy();
+    IOByteCount length = report->getLength();
+    bool decoded = false;
+    uint64_t now;
+
+    absolutetime_to_nanoseconds(timeStamp, &now);
+
+    if (GCUSBInputReportLength == length && length == report->readBytes(0, report_data, length)) {
+        uint64_t interval = _poll_rate.record(now);
+        if (interval) {
+            _report_interval.record(interval);
         }
 
-        setReport(startReport, kIOHIDReportTypeOutput, 0);
-        startReport->release ();
+        captureReport(now, GCUSBCaptureInput, report_data, length);
+        decoded = _decoder.decode(report_data, length);
+        if (decoded) {
+            _axes.apply(report_data);
+            _buttons.apply(report_data);
+        }
+    }
 
-        /* Allocate buffer for virtual report */
-        _vreport = IOBufferMemoryDescriptor::withCapacity(9, kIODirectionIn);
+    if (decoded) {
+        unsigned int connected = 0, deliver, power = _decoder.rumble();
+        unsigned int lost = _rumble_power & ~power;
+        bool hotplug_work = false;
 
-        /* Allocate a buffer for rumble reports */
-        _rumble_descriptor = IOBufferMemoryDescriptor::withCapacity(6, kIODirectionOut);
-        if (nullptr == _vreport || nullptr == _rumble_descriptor) {
-            break;
+        _decode_latency.record(GCUSBNanoseconds() - now);
+
+        if (power != _rumble_power) {
+            __atomic_store_n(&_rumble_power, power, __ATOMIC_RELAXED);
         }
 
-        return true;
-    } while (0);
+        for (int i = 0; i < 4; ++i) {
+            uint8_t status = _decoder.status(i);
+            uint8_t state[GCUSBPortReportLength];
 
-    cleanup();
+            /* a motor that lost its power is off. record that so it does not start up again
+             * with a stale state when the power comes back */
+            if ((lost & (1 << i)) && _rumble.pending(i)) {
+                _rumble.set(i, 0);
+            }
 
-    return false;
-}
+            /* let the rumble plug-in see the type and power flags without a call into the kernel */
+            GCUSBRumbleRingSetStatus(_rumble_rings[i], status);
 
-void GCUSBAdapter::cleanup (void) {
-    if (_vreport) {
-        _vreport->release();
-        _vreport = nullptr;
-    }
-    
-    for (int i = 0 ; i < 4 ; ++i) {
-        if (_ports[i]) {
-            _ports[i]->terminate();
-            _ports[i]->release ();
-            _ports[i] = nullptr;
+            hotplug_work |= _hotplug.update(i, status);
+            if (status && _hotplug.active(i)) {
+                connected |= 1 << i;
+            }
+
+            /* the first byte of the decoded slice is the report id. publish the status instead */
+            state[0] = status;
+            memcpy(state + 1, GCUSBReportDecoder::portReport(report_data, i) + 1, GCUSBPortReportLength - 1);
+            GCUSBPortStateWrite(_state->port + i, now, state);
         }
-    }
 
-    if (_rumble_descriptor) {
-        _rumble_descriptor->release ();
-        _rumble_descriptor = nullptr;
+        if (hotplug_work) {
+            _hotplug_source->interruptOccurred(nullptr, nullptr, 0);
+        }
+
+        /* pull a pending rumble flush forward to this report */
+        if (_rumble.dirty() || rumbleRingsPending()) {
+            _rumble_timer->setTimeoutUS(0);
+        }
+
+        /* only pass on controller states that changed since they were last delivered. a port
+         * that does not take its report keeps a backlog and does not hold up the other ports */
+        deliver = _filter.filter(report_data, connected, now);
+        for (int i = 0; i < 4; ++i) {
+            if (!(connected & (1 << i))) {
+                _mailbox.reset(i);
+                continue;
+            }
+
+            _mailbox.deliver(i, GCUSBReportDecoder::portReport(report_data, i), deliver & (1 << i), now, *this);
+        }
     }
+
+    return super::handleReportWithTime(timeStamp, report, reportType, options);
 }
 
-void GCUSBAdapter::stop(IOService *provider) {
-    super::stop (provider);
-    cleanup();
+/**
+ * @brief Inject a port report into a port
+ *
+ * The current report is handed over through its view of the staging buffer. A report
+ * from the mailbox is copied into the port's backlog buffer first. Either way the event
+ * carries the time the adapter delivered the report, not the time it was injected, and
+ * the port latency is measured from that time.
+ */
+bool GCUSBAdapter::sendPortReport (int port, const uint8_t *report, bool queued, uint64_t timestamp) {
+    IOMemoryDescriptor *descriptor = _port_reports[port];
+    AbsoluteTime time_stamp;
+    uint64_t start, end;
+    IOReturn ret;
+
+    if (queued) {
+        _backlog_reports[port]->writeBytes(0, report, GCUSBPortReportLength);
+        descriptor = _backlog_reports[port];
+    }
+
+    nanoseconds_to_absolutetime(timestamp, &time_stamp);
+
+    start = GCUSBNanoseconds();
+    ret = _ports[port]->handleReportWithTime(time_stamp, descriptor);
+    end = GCUSBNanoseconds();
+
+    _inject_latency.record(end - start);
+    if (kIOReturnSuccess != ret) {
+        ++_port_report_failures;
+        return false;
+    }
+
+    _port_latency[port].record(end - timestamp);
+    _filter.deliveredPort(port, report, timestamp);
+
+    return true;
 }
 
-IOReturn GCUSBAdapter::setRumble(int port, int data) {
-    /* update internal state and set the real rumble report */
-    _rumble_data[port + 1] = data;
+/**
+ * @brief Create a user client
+ *
+ * GCUSBStateClientType maps the state region holding the latest decoded and
+ * calibrated report of every port. All other types are handled by the superclass.
+ */
+IOReturn GCUSBAdapter::newUserClient (task_t owningTask, void *securityID, UInt32 type,
+                                      OSDictionary *properties, IOUserClient **handler) {
+    GCUSBStateClient *client;
+
+    if (GCUSBStateClientType != type) {
+        return super::newUserClient(owningTask, securityID, type, properties, handler);
+    }
+
+    client = new GCUSBStateClient;
+    if (!client) {
+        return kIOReturnNoMemory;
+    }
+
+    if (!client->initWithTask(owningTask, securityID, type, properties) || !client->attach(this)) {
+        client->release();
+        return kIOReturnError;
+    }
+
+    if (!client->start(this)) {
+        client->detach(this);
+        client->release();
+        return kIOReturnError;
+    }
+
+    *handler = client;
 
-    _rumble_descriptor->writeBytes(0, _rumble_data, 5);
-    return super::setReport(_rumble_descriptor, kIOHIDReportTypeOutput, kIOHIDOptionsTypeNone);
+    return kIOReturnSuccess;
 }
 
-IOReturn GCUSBAdapter::getReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
-                                  IOOptionBits options) {
-    return super::getReport(report, reportType, options);
+void GCUSBAdapter::hotplugAction (OSObject *owner, IOInterruptEventSource *sender, int count) {
+    GCUSBAdapter *adapter = OSDynamicCast(GCUSBAdapter, owner);
+    if (adapter) {
+        adapter->hotplug();
+    }
 }
 
 /**
- * @brief Intercept the incoming 0x21 report and break it down into individual controller reports
+ * @brief Attach or detach controllers flagged by the report path
  *
- * This function is responsible for breaking the Nintendo reports into reports for individual
- * controllers. There are other possible ways to handle the 37 byte controller reports but this
- * one seems to be logical.
+ * Runs on the work loop so port creation and termination never stall report delivery.
  */
-IOReturn GCUSBAdapter::handleReportWithTime (AbsoluteTime timeStamp, IOMemoryDescriptor *report,
-                                             IOHIDReportType reportType, IOOptionBits options)
-{
-    uint8_t report_id, report_data[9];
+void GCUSBAdapter::hotplug (void) {
+    for (int i = 0 ; i < 4 ; ++i) {
+        switch (_hotplug.pending(i)) {
+        case GCUSBHotplug::ActionAttach: {
+            uint64_t start = GCUSBNanoseconds();
+            GCUSBAdapterPort *newPort = GCUSBAdapterPort::withAdapter(this, i, _hotplug.type(i));
+            if (!newPort) {
+                IOLog ("Could not create GCUSBAdapterPort for port %d\n", i);
+                _hotplug.attached(i, false);
+                break;
+            }
+
+            if (!newPort->attach(this)) {
+                newPort->release();
+                _hotplug.attached(i, false);
+                break;
+            }
 
-    report->readBytes(0, &report_id, 1);
+            if (!newPort->start(this)) {
+                newPort->detach(this);
+                newPort->release();
+                _hotplug.attached(i, false);
+                break;
+            }
 
-    if (0x21 == report_id && 37 == report->getLength()) {
-        for (int i = 0; i < 4; ++i) {
-            report->readBytes(1 + i * 9, report_data, 9);
-            if (report_data[0]) {
-                if (!_ports[i]) {
-                    GCUSBAdapterPort *newPort = GCUSBAdapterPort::withAdapter(this, i, report_data[0]);
-                    if (!newPort) {
-                        IOLog ("Could not create GCUSBAdapterPort for port %d\n", i);
-                        continue;
-                    }
-
-                    if (!newPort->attach(this)) {
-                        continue;
-                    }
-
-                    if (!newPort->start(this)) {
-                        newPort->detach(this);
-                        continue;
-                    }
-
-                    newPort->registerService(kIOServiceAsynchronous);
-                    _ports[i] = newPort;
-                }
-
-                /* rescale analog sticks to elimitate bias. other sticks may
-                 * have different biases */
-                report_data[0] = 0x50; /* report id */
-                report_data[3] = (uint8_t)((int8_t)report_data[3] - 122);
-                report_data[4] = (uint8_t)((int8_t)report_data[4] - 144);
-                report_data[5] = (uint8_t)((int8_t)report_data[5] - 133);
-                report_data[6] = (uint8_t)((int8_t)report_data[6] - 133);
-
-                _vreport->writeBytes(1, report_data, 9);
-                int ret = _ports[i]->handleReport(_vreport);
-                if (kIOReturnSuccess != ret) {
-                    return ret;
-                }
-            } else if (_ports[i]) {
+            /* the slot is published before registering so matching on PlayerSlot works */
+            newPort->setPlayerSlot(GCUSBPlayers.acquire(_location, i));
+            newPort->registerService(kIOServiceAsynchronous);
+            _ports[i] = newPort;
+            _hotplug.attached(i, true);
+            _hotplug_latency.record(GCUSBNanoseconds() - start);
+            updatePlayerSlots();
+            break;
+        }
+        case GCUSBHotplug::ActionDetach:
+            if (_ports[i]) {
+                GCUSBPlayers.release(_location, i);
                 _ports[i]->terminate();
                 _ports[i]->release();
                 _ports[i] = nullptr;
             }
+            _hotplug.detached(i);
+            updatePlayerSlots();
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Publish the player slot of every port as PlayerSlots (1 based, 0 for none)
+ */
+void GCUSBAdapter::updatePlayerSlots (void) {
+    OSArray *slots = OSArray::withCapacity(4);
+
+    if (!slots) {
+        return;
+    }
+
+    for (int i = 0 ; i < 4 ; ++i) {
+        OSNumber *number = OSNumber::withNumber(_ports[i] ? _ports[i]->playerSlot() + 1 : 0, 32);
+        if (number) {
+            slots->setObject(number);
+            number->release();
         }
     }
 
-    return super::handleReportWithTime(timeStamp, report, reportType, options);
+    setProperty("PlayerSlots", slots);
+    slots->release();
 }
 
 /* ports */
@@ -229,21 +1289,14 @@ GCUSBAdapterPort *GCUSBAdapterPort::withAdapter (GCUSBAdapter *adapter, int port
 }
 
 bool GCUSBAdapterPort::init (GCUSBAdapter *adapter, int port, uint8_t type) {
-    OSDictionary *plugin_types;
-
     if (!super::init()) {
         return false;
     }
 
-    /* set properties */
-    plugin_types = OSDictionary::withCapacity(1);
-    if (!plugin_types) {
-        return false;
-    }
-
     /* add CFPlugIn for rumble support */
-    plugin_types->setObject("f4545ce5-bf5b-11d6-a4bb-0003933e3e3e", OSString::withCString("gcusbadapter.kext/Contents/PlugIns/gcusbrumble.bundle"));
-    setProperty("IOCFPlugInTypes", plugin_types);
+    if (adapter->pluginTypes()) {
+        setProperty("IOCFPlugInTypes", adapter->pluginTypes());
+    }
 
     /* store the port in the registry entry */
     setProperty("Port", port, 32);
@@ -252,14 +1305,65 @@ bool GCUSBAdapterPort::init (GCUSBAdapter *adapter, int port, uint8_t type) {
     _port = port;
     _adapter = adapter;
     _type = type;
+    _slot = -1;
+
+    /* the axis configuration and button profile belong to the adapter port and survive reconnects */
+    updateAxisProperties();
+    updateButtonProperties();
 
     return true;
 }
 
+void GCUSBAdapterPort::updateAxisProperties (void) {
+    const GCUSBAxisConfig &config = _adapter->axisConfig(_port);
+
+    setProperty("StickDeadZone", config.stick_dead_zone, 32);
+    setProperty("StickCurve", config.stick_curve, 32);
+    setProperty("TriggerDeadZone", config.trigger_dead_zone, 32);
+    setProperty("TriggerCurve", config.trigger_curve, 32);
+}
+
+void GCUSBAdapterPort::updateButtonProperties (void) {
+    const GCUSBButtonProfile &profile = _adapter->buttonProfile(_port);
+    OSArray *map = OSArray::withCapacity(GCUSBButtonCount);
+
+    if (!map) {
+        return;
+    }
+
+    for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+        OSNumber *output = OSNumber::withNumber(profile.output[i], 32);
+        if (output) {
+            map->setObject(output);
+            output->release();
+        }
+    }
+
+    setProperty("ButtonMap", map);
+    map->release();
+}
+
+void GCUSBAdapterPort::setPlayerSlot (int slot) {
+    _slot = slot;
+    if (slot >= 0) {
+        setProperty("PlayerSlot", slot + 1, 32);
+    } else {
+        removeProperty("PlayerSlot");
+    }
+}
+
 IOReturn GCUSBAdapterPort::newReportDescriptor(IOMemoryDescriptor ** desc) const {
-    *desc = IOBufferMemoryDescriptor::withBytes(GCUSBAdapterInjectedDescriptor, sizeof (GCUSBAdapterInjectedDescriptor), kIODirectionIn);
+    IOMemoryDescriptor *descriptor = _adapter ? _adapter->reportDescriptor(_type) : nullptr;
+
+    if (!descriptor) {
+        return kIOReturnNoMemory;
+    }
 
-    return *desc ? kIOReturnSuccess : kIOReturnNoMemory;
+    /* the caller releases the descriptor */
+    descriptor->retain();
+    *desc = descriptor;
+
+    return kIOReturnSuccess;
 }
 
 IOReturn GCUSBAdapterPort::setReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
@@ -271,7 +1375,7 @@ IOReturn GCUSBAdapterPort::setReport (IOMemoryDescriptor *report, IOHIDReportTyp
     }
 
     report->readBytes(0, report_data, 2);
-    if (0x60 == report_data[0]) {
+    if (GCUSBPortRumbleReportID == report_data[0]) {
         _adapter->setRumble(_port, report_data[1]);
     }
 
@@ -279,24 +1383,141 @@ IOReturn GCUSBAdapterPort::setReport (IOMemoryDescriptor *report, IOHIDReportTyp
     return kIOReturnSuccess;
 }
 
+/**
+ * @brief Handle property writes from user space
+ *
+ * Writing any value to the Recenter property captures a new stick origin from the
+ * next report for this controller. StickDeadZone and TriggerDeadZone set the dead zones
+ * in raw units and StickCurve and TriggerCurve select a response curve (0 linear,
+ * 1 quadratic, 2 cubic). ButtonMap is an array holding the output button (0 - 15) of
+ * every input button in the order A, B, X, Y, D-pad left, right, down, up, Start, Z,
+ * R, L. Any other output drops the button and missing entries map to themselves. The
+ * axis settings and the button map stay with the adapter port when the controller is
+ * replaced.
+ */
+IOReturn GCUSBAdapterPort::setProperties (OSObject *properties) {
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    static const char *axis_keys[4] = {"StickDeadZone", "StickCurve", "TriggerDeadZone", "TriggerCurve"};
+    bool handled = false, axis = false;
+    GCUSBAxisConfig config;
+    uint8_t *values[4];
+
+    if (!dict || !_adapter) {
+        return kIOReturnBadArgument;
+    }
+
+    if (dict->getObject("Recenter")) {
+        _adapter->recenter(_port);
+        handled = true;
+    }
+
+    config = _adapter->axisConfig(_port);
+    values[0] = &config.stick_dead_zone;
+    values[1] = &config.stick_curve;
+    values[2] = &config.trigger_dead_zone;
+    values[3] = &config.trigger_curve;
+
+    for (int i = 0 ; i < 4 ; ++i) {
+        OSNumber *number = OSDynamicCast(OSNumber, dict->getObject(axis_keys[i]));
+        if (number) {
+            uint32_t value = number->unsigned32BitValue();
+            *values[i] = value > 0xff ? 0xff : (uint8_t) value;
+            axis = true;
+        }
+    }
+
+    if (axis) {
+        _adapter->setAxisConfig(_port, config);
+        updateAxisProperties();
+        handled = true;
+    }
+
+    OSArray *map = OSDynamicCast(OSArray, dict->getObject("ButtonMap"));
+    if (map) {
+        GCUSBButtonProfile profile = GCUSBButtonIdentity();
+
+        for (unsigned int i = 0 ; i < GCUSBButtonCount && i < map->getCount() ; ++i) {
+            OSNumber *output = OSDynamicCast(OSNumber, map->getObject(i));
+            if (output) {
+                uint32_t value = output->unsigned32BitValue();
+                profile.output[i] = value < GCUSBButtonCount ? (uint8_t) value : (uint8_t) GCUSBButtonNone;
+            }
+        }
+
+        _adapter->setButtonProfile(_port, profile);
+        updateButtonProperties();
+        handled = true;
+    }
+
+    return handled ? kIOReturnSuccess : super::setProperties(properties);
+}
+
+bool GCUSBAdapterPort::serializeProperties (OSSerialize *s) const {
+    if (_adapter) {
+        OSDictionary *latency = GCUSBHistogramDictionary(_adapter->portLatency(_port));
+        if (latency) {
+            const_cast<GCUSBAdapterPort *>(this)->setProperty("Latency", latency);
+            latency->release();
+        }
+    }
+
+    return super::serializeProperties(s);
+}
+
 IOReturn GCUSBAdapterPort::getReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
                                       IOOptionBits options) {
-    /* pass through get reports */
-    return _adapter ? _adapter->getReport(report, reportType, options) : kIOReturnInvalid;
+    return _adapter ? _adapter->getPortReport(_port, report, reportType, options) : kIOReturnInvalid;
+}
+
+/**
+ * @brief Create a user client
+ *
+ * GCUSBRumbleRingClientType maps the shared rumble ring of this port. All other types
+ * are handled by IOHIDDevice.
+ */
+IOReturn GCUSBAdapterPort::newUserClient (task_t owningTask, void *securityID, UInt32 type,
+                                          OSDictionary *properties, IOUserClient **handler) {
+    GCUSBRumbleRingClient *client;
+
+    if (GCUSBRumbleRingClientType != type) {
+        return super::newUserClient(owningTask, securityID, type, properties, handler);
+    }
+
+    client = new GCUSBRumbleRingClient;
+    if (!client) {
+        return kIOReturnNoMemory;
+    }
+
+    if (!client->initWithTask(owningTask, securityID, type, properties) || !client->attach(this)) {
+        client->release();
+        return kIOReturnError;
+    }
+
+    if (!client->start(this)) {
+        client->detach(this);
+        client->release();
+        return kIOReturnExclusiveAccess;
+    }
+
+    *handler = client;
+
+    return kIOReturnSuccess;
 }
 
 OSString *GCUSBAdapterPort::newProductString() const {
-    char product_name[64];
-    if (GCUSBControllerTypeNormal == _type) {
-        snprintf (product_name, 64, "GameCube Wired Controller %d", _port + 1);
-    } else if (GCUSBControllerTypeWaveBird == _type) {
-        snprintf (product_name, 64, "GameCube WaveBird Controller %d", _port + 1);
+    OSString *product = _adapter ? _adapter->productString(_port, _type) : nullptr;
+
+    /* the caller releases the string */
+    if (product) {
+        product->retain();
     }
-    return OSString::withCString(product_name);
+
+    return product;
 }
 
 OSNumber *GCUSBAdapterPort::newLocationIDNumber() const {
-    return _adapter ? _adapter->newLocationIDNumber() : nullptr;
+    /* every pad gets its own location so clients can tell pads on the same adapter apart */
+    return _adapter ? OSNumber::withNumber(GCUSBPortLocation(_adapter->location(), _port), 32) : nullptr;
 }
 
 OSString *GCUSBAdapterPort::newManufacturerString() const {
@@ -327,3 +1548,95 @@ OSNumber *GCUSBAdapterPort::newVendorIDNumber() const {
     return _adapter ? _adapter->newVendorIDNumber() : nullptr;
 }
 
+/* user clients */
+#undef super
+#define super IOUserClient
+
+OSDefineMetaClassAndStructors(GCUSBRumbleRingClient, super);
+
+bool GCUSBRumbleRingClient::start (IOService *provider) {
+    GCUSBAdapterPort *port = OSDynamicCast(GCUSBAdapterPort, provider);
+
+    if (!port || !port->adapter() || !super::start(provider)) {
+        return false;
+    }
+
+    /* fails if another client already owns the ring */
+    _ring = port->adapter()->openRumbleRing(port->port());
+    if (!_ring) {
+        super::stop(provider);
+        return false;
+    }
+
+    _owner = port;
+
+    return true;
+}
+
+void GCUSBRumbleRingClient::close (void) {
+    if (_ring) {
+        _owner->adapter()->closeRumbleRing(_owner->port());
+        _ring->release();
+        _ring = nullptr;
+    }
+}
+
+void GCUSBRumbleRingClient::stop (IOService *provider) {
+    close();
+    super::stop(provider);
+}
+
+IOReturn GCUSBRumbleRingClient::clientClose (void) {
+    close();
+    terminate();
+
+    return kIOReturnSuccess;
+}
+
+IOReturn GCUSBRumbleRingClient::clientMemoryForType (UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    if (0 != type || !_ring) {
+        return kIOReturnBadArgument;
+    }
+
+    /* the reference is consumed by the caller */
+    _ring->retain();
+    *memory = _ring;
+    *options = 0;
+
+    return kIOReturnSuccess;
+}
+
+OSDefineMetaClassAndStructors(GCUSBStateClient, super);
+
+bool GCUSBStateClient::start (IOService *provider) {
+    GCUSBAdapter *adapter = OSDynamicCast(GCUSBAdapter, provider);
+
+    if (!adapter || !adapter->stateMemory() || !super::start(provider)) {
+        return false;
+    }
+
+    _owner = adapter;
+
+    return true;
+}
+
+IOReturn GCUSBStateClient::clientClose (void) {
+    terminate();
+
+    return kIOReturnSuccess;
+}
+
+IOReturn GCUSBStateClient::clientMemoryForType (UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    IOMemoryDescriptor *state = _owner ? _owner->stateMemory() : nullptr;
+
+    if (0 != type || !state) {
+        return kIOReturnBadArgument;
+    }
+
+    /* the reference is consumed by the caller. readers never write to the region */
+    state->retain();
+    *memory = state;
+    *options = kIOMapReadOnly;
+
+    return kIOReturnSuccess;
+}
@@ -22,41 +22,189 @@
 #define GCUSB_H
 
 #include <mach/mach_types.h>
+#include <kern/thread_call.h>
+#include <IOKit/IOLocks.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOUserClient.h>
 #include <IOKit/usb/IOUSBHIDDriver.h>
 
+#include "gcusbreport.h"
+#include "gcusbhotplug.h"
+#include "gcusbstats.h"
+#include "gcusbcapture.h"
+#include "gcusbslots.h"
+#include "gcusbaxis.h"
+#include "gcusbbuttons.h"
+#include "gcusbdescriptor.h"
+#include "gcusbshared.h"
+
 class GCUSBAdapterPort;
 
+/** largest capture buffer that can be requested (bytes) */
+#define GCUSBMaxCaptureSize (64 * 1024 * 1024)
+
 /**
- * Controller types
+ * Controller types (type bits of the status byte, see GCUSBPortFlags)
  */
 enum {
     /** No controller is connected */
     GCUSBControllerTypeNone     = 0x00,
     /** Normal (wired) controller */
-    GCUSBControllerTypeNormal   = 0x10,
+    GCUSBControllerTypeNormal   = GCUSBStatusWired,
     /** Nintendo WaveBird */
-    GCUSBControllerTypeWaveBird = 0x20,
+    GCUSBControllerTypeWaveBird = GCUSBStatusWireless,
 };
 
 class GCUSBAdapter : public IOUSBHIDDriver {
     OSDeclareDefaultStructors(GCUSBAdapter);
+    friend class GCUSBPortMailbox;
 public:
     virtual bool start (IOService *provider);
     virtual void stop(IOService *provider);
+    virtual void free (void);
     virtual IOReturn handleReportWithTime (AbsoluteTime timeStamp, IOMemoryDescriptor *report,
                                            IOHIDReportType reportType, IOOptionBits options);
     virtual IOReturn getReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
                                 IOOptionBits options);
+    virtual IOReturn setProperties (OSObject *properties);
+    virtual bool serializeProperties (OSSerialize *s) const;
+    virtual IOReturn newUserClient (task_t owningTask, void *securityID, UInt32 type,
+                                    OSDictionary *properties, IOUserClient **handler);
+    virtual OSNumber *newReportIntervalNumber () const;
 
+    /** answer a get report for a port. input report 0x50 is served from the latest state */
+    IOReturn getPortReport (int port, IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options);
     IOReturn setRumble (int port, int data);
+    /** hand the rumble ring of a port to a new producer. returns the ring memory (retained)
+     * or nullptr if the ring is already in use */
+    IOMemoryDescriptor *openRumbleRing (int port);
+    /** apply the remaining commands and stop draining the rumble ring of a port */
+    void closeRumbleRing (int port);
+    /** capture a new stick origin for a port from the next report */
+    void recenter (int port);
+    /** IOCFPlugInTypes shared by all ports of this adapter */
+    OSDictionary *pluginTypes (void) const {
+        return _plugin_types;
+    }
+    /** set the dead zones and response curves of a port. returns the configuration in effect */
+    GCUSBAxisConfig setAxisConfig (int port, const GCUSBAxisConfig &config);
+    const GCUSBAxisConfig &axisConfig (int port) const {
+        return _axes.config(port);
+    }
+    /** set the button remap profile of a port. returns the profile in effect */
+    GCUSBButtonProfile setButtonProfile (int port, const GCUSBButtonProfile &profile);
+    const GCUSBButtonProfile &buttonProfile (int port) const {
+        return _buttons.profile(port);
+    }
+    /** product name of a port for a status byte (shared, not retained) */
+    OSString *productString (int port, uint8_t status) const {
+        return _product_strings[GCUSBPortFlags(status).wireless() ? 1 : 0][port];
+    }
+    /** shared report descriptor for a status byte */
+    IOMemoryDescriptor *reportDescriptor (uint8_t status) const {
+        return GCUSBPortFlags(status).wireless() ? _wavebird_descriptor : _wired_descriptor;
+    }
+    /** region holding the latest state of every port (GCUSBStateRegion) */
+    IOMemoryDescriptor *stateMemory (void) const {
+        return _state_memory;
+    }
+    /** USB location ID of the adapter */
+    uint32_t location (void) const {
+        return _location;
+    }
+    /** latency from USB completion to the end of HID injection for a port */
+    const GCUSBHistogram &portLatency (int port) const {
+        return _port_latency[port];
+    }
 private:
     void cleanup (void);
-    /* report 0x11 is the rumble report */
-    uint8_t _rumble_data[5] = {0x11, 0x00, 0x00, 0x00, 0x00};
-    IOBufferMemoryDescriptor *_vreport = nullptr;
+    void updateStatistics (void);
+    static void hotplugAction (OSObject *owner, IOInterruptEventSource *sender, int count);
+    void hotplug (void);
+    void updatePlayerSlots (void);
+    static IOReturn axisConfigAction (OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    static IOReturn buttonProfileAction (OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    static void rumbleAction (OSObject *owner, IOTimerEventSource *sender);
+    static IOReturn rumbleRingAction (OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    bool rumbleRingsPending (void) const;
+    void drainRumbleRings (void);
+    bool rumbleAllowed (int port, uint8_t value);
+    void flushRumble (void);
+    static void rumbleTransferAction (thread_call_param_t param0, thread_call_param_t param1);
+    void transferRumble (void);
+    void rumbleComplete (IOReturn status);
+    IOReturn startCapture (uint32_t size);
+    void captureReport (uint64_t timestamp, GCUSBCaptureDirection direction, const uint8_t *report, size_t length);
+    /** hand a report that arrived at timestamp (ns) to a port (called by _mailbox). returns
+     * false if the port did not take it */
+    bool sendPortReport (int port, const uint8_t *report, bool queued, uint64_t timestamp);
+    /* merges rumble requests from all ports into one 0x11 report */
+    GCUSBRumbleScheduler _rumble;
+    IOTimerEventSource *_rumble_timer = nullptr;
+    /* rumble reports waiting for or in an asynchronous transfer */
+    GCUSBRumbleQueue _rumble_queue;
+    /* protects _rumble and _rumble_queue against the transfer thread */
+    IOLock *_rumble_lock = nullptr;
+    thread_call_t _rumble_call = nullptr;
+    uint32_t _rumble_interval = 4;
+    /* shared rumble rings written by the rumble plug-in. one page per port */
+    IOBufferMemoryDescriptor *_rumble_ring_memory[4] = {nullptr, nullptr, nullptr, nullptr};
+    GCUSBRumbleRing *_rumble_rings[4] = {nullptr, nullptr, nullptr, nullptr};
+    /* ports with an open ring. only changed on the work loop */
+    uint32_t _rumble_ring_open = 0;
+    uint64_t _rumble_ring_commands = 0;
+    uint64_t _rumble_ring_errors = 0;
+    /* ports whose motor has power (GCUSBReportDecoder::rumble() of the last report) */
+    uint32_t _rumble_power = 0;
+    /* rumble requests dropped because the motor had no power */
+    uint64_t _rumble_unpowered = 0;
+    /* staging buffer for the 0x21 report. the port reports are decoded in place */
+    IOBufferMemoryDescriptor *_report = nullptr;
+    /* views of each port slice of _report handed to the ports */
+    IOMemoryDescriptor *_port_reports[4] = {nullptr, nullptr, nullptr, nullptr};
+    /* reports a port did not accept wait here until it accepts reports again */
+    GCUSBPortMailbox _mailbox;
+    /* buffers queued reports are handed to the ports from */
+    IOBufferMemoryDescriptor *_backlog_reports[4] = {nullptr, nullptr, nullptr, nullptr};
+    uint64_t _port_report_failures = 0;
+    GCUSBReportDecoder _decoder;
+    /* dead zones and response curves applied after decoding */
+    GCUSBAxisMap _axes;
+    /* button remap tables applied after the axes */
+    GCUSBButtonMap _buttons;
+    GCUSBChangeFilter _filter;
+    GCUSBHotplug _hotplug;
+    /* runs controller attach/detach on the work loop */
+    IOInterruptEventSource *_hotplug_source = nullptr;
     IOBufferMemoryDescriptor *_rumble_descriptor = nullptr;
     GCUSBAdapterPort *_ports[4] = {nullptr, nullptr, nullptr, nullptr};
+    /* latency from USB completion until the report is decoded */
+    GCUSBHistogram _decode_latency;
+    /* time spent in GCUSBAdapterPort::handleReportWithTime */
+    GCUSBHistogram _inject_latency;
+    /* time spent attaching a controller on the work loop */
+    GCUSBHistogram _hotplug_latency;
+    GCUSBHistogram _port_latency[4];
+    /* time between consecutive reports from the adapter */
+    GCUSBRateMonitor _poll_rate;
+    GCUSBHistogram _report_interval;
+    /* report the measured instead of the nominal interval in newReportIntervalNumber */
+    bool _measured_interval = false;
+    /* optional capture of raw reports */
+    GCUSBCaptureWriter _capture;
+    IOBufferMemoryDescriptor *_capture_buffer = nullptr;
+    IOSimpleLock *_capture_lock = nullptr;
+    OSDictionary *_plugin_types = nullptr;
+    /* latest decoded state of every port for memory-mapped readers */
+    IOBufferMemoryDescriptor *_state_memory = nullptr;
+    GCUSBStateRegion *_state = nullptr;
+    uint64_t _get_report_hits = 0, _get_report_misses = 0;
+    IOMemoryDescriptor *_wired_descriptor = nullptr;
+    IOMemoryDescriptor *_wavebird_descriptor = nullptr;
+    /* product names of the ports for wired controllers and WaveBirds */
+    OSString *_product_strings[2][4] = {{nullptr, nullptr, nullptr, nullptr}, {nullptr, nullptr, nullptr, nullptr}};
+    uint32_t _location = 0;
 };
 
 class GCUSBAdapterPort : public IOHIDDevice {
@@ -64,12 +212,32 @@ class GCUSBAdapterPort : public IOHIDDevice {
 public:
     static GCUSBAdapterPort *withAdapter (GCUSBAdapter *adapter, int port, uint8_t type);
     bool init (GCUSBAdapter *adapter, int port, uint8_t type);
+    /** set the player slot (0 based, -1 for none) published as PlayerSlot */
+    void setPlayerSlot (int slot);
+    /** publish the axis configuration of the port */
+    void updateAxisProperties (void);
+    /** publish the button remap profile of the port */
+    void updateButtonProperties (void);
+    int playerSlot (void) const {
+        return _slot;
+    }
 
     virtual IOReturn newReportDescriptor(IOMemoryDescriptor ** desc) const;
     virtual IOReturn getReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
                                 IOOptionBits options);
     virtual IOReturn setReport (IOMemoryDescriptor *report, IOHIDReportType reportType,
                                 IOOptionBits options);
+    virtual IOReturn setProperties (OSObject *properties);
+    virtual bool serializeProperties (OSSerialize *s) const;
+    virtual IOReturn newUserClient (task_t owningTask, void *securityID, UInt32 type,
+                                    OSDictionary *properties, IOUserClient **handler);
+
+    GCUSBAdapter *adapter (void) const {
+        return _adapter;
+    }
+    int port (void) const {
+        return _port;
+    }
 
     virtual OSString * 	newTransportString() const;
     virtual OSNumber * 	newVendorIDNumber() const;
@@ -83,7 +251,44 @@ public:
 
 private:
     GCUSBAdapter *_adapter;
-    int _port, _rumble, _type;
+    int _port, _rumble, _type, _slot;
+};
+
+/**
+ * @brief User client mapping the rumble ring of a port (GCUSBRumbleRingClientType)
+ *
+ * Memory type 0 is the GCUSBRumbleRing of the port. Only one client per port can be
+ * open at a time since the ring has a single producer.
+ */
+class GCUSBRumbleRingClient : public IOUserClient {
+    OSDeclareDefaultStructors(GCUSBRumbleRingClient);
+public:
+    virtual bool start (IOService *provider);
+    virtual void stop (IOService *provider);
+    virtual IOReturn clientClose (void);
+    virtual IOReturn clientMemoryForType (UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+
+private:
+    void close (void);
+    GCUSBAdapterPort *_owner = nullptr;
+    IOMemoryDescriptor *_ring = nullptr;
+};
+
+/**
+ * @brief User client mapping the controller state region (GCUSBStateClientType)
+ *
+ * Memory type 0 is the GCUSBStateRegion of the adapter, mapped read-only. Any number of
+ * clients can be open at the same time.
+ */
+class GCUSBStateClient : public IOUserClient {
+    OSDeclareDefaultStructors(GCUSBStateClient);
+public:
+    virtual bool start (IOService *provider);
+    virtual IOReturn clientClose (void);
+    virtual IOReturn clientMemoryForType (UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+
+private:
+    GCUSBAdapter *_owner = nullptr;
 };
 
 
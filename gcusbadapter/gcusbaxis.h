@@ -0,0 +1,232 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBAXIS_H)
+#define GCUSBAXIS_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stdint.h>
+#include <string.h>
+
+#include "gcusbreport.h"
+
+/**
+ * Analog ranges declared by the injected report descriptor
+ */
+enum {
+    /** largest stick deflection from the origin */
+    GCUSBStickRange     = 102,
+    /** trigger at rest */
+    GCUSBTriggerMinimum = 0x18,
+    /** trigger fully pressed */
+    GCUSBTriggerMaximum = 0xf0,
+    GCUSBTriggerRange   = GCUSBTriggerMaximum - GCUSBTriggerMinimum,
+    /** offset of the first trigger byte within a port slice */
+    GCUSBPortTriggerOffset = GCUSBPortStickOffset + GCUSBPortStickCount,
+    GCUSBPortTriggerCount  = 2,
+};
+
+/**
+ * Response curves
+ */
+enum GCUSBCurve {
+    GCUSBCurveLinear    = 0,
+    /** finer control near the center */
+    GCUSBCurveQuadratic = 1,
+    /** even finer control near the center */
+    GCUSBCurveCubic     = 2,
+    GCUSBCurveCount,
+};
+
+/* The table entries are computed with C++11 constexpr functions (a single return
+ * statement each) so the same code fills the default tables at compile time and custom
+ * tables at run time. Only integer math is used so it is safe in the kernel. */
+
+/** rescale a magnitude so the dead zone maps to 0 and range stays range */
+constexpr unsigned int GCUSBAxisScale (unsigned int magnitude, unsigned int dead_zone, unsigned int range) {
+    return magnitude <= dead_zone ? 0 : magnitude >= range ? range :
+        ((magnitude - dead_zone) * range + (range - dead_zone) / 2) / (range - dead_zone);
+}
+
+/** apply a response curve to a magnitude in [0, range] */
+constexpr unsigned int GCUSBAxisCurve (unsigned int n, unsigned int range, unsigned int curve) {
+    return GCUSBCurveQuadratic == curve ? (n * n + range / 2) / range :
+        GCUSBCurveCubic == curve ? (n * n * n + range * range / 2) / (range * range) : n;
+}
+
+/** corrected stick value for a decoded stick byte (two's complement offset from the origin) */
+constexpr uint8_t GCUSBStickValue (unsigned int index, unsigned int dead_zone, unsigned int curve) {
+    return index < 128 ?
+        (uint8_t) GCUSBAxisCurve (GCUSBAxisScale (index, dead_zone, GCUSBStickRange), GCUSBStickRange, curve) :
+        (uint8_t) (256 - GCUSBAxisCurve (GCUSBAxisScale (256 - index, dead_zone, GCUSBStickRange),
+                                         GCUSBStickRange, curve));
+}
+
+/** corrected trigger value for a raw trigger byte */
+constexpr uint8_t GCUSBTriggerValue (unsigned int index, unsigned int dead_zone, unsigned int curve) {
+    return (uint8_t) (GCUSBTriggerMinimum +
+                      GCUSBAxisCurve (GCUSBAxisScale (index > GCUSBTriggerMinimum ? index - GCUSBTriggerMinimum : 0,
+                                                      dead_zone, GCUSBTriggerRange), GCUSBTriggerRange, curve));
+}
+
+/** 256 entry lookup table for one kind of axis */
+struct GCUSBAxisTable {
+    uint8_t value[256];
+};
+
+template <unsigned int... I> struct GCUSBIndices {};
+
+/* GCUSBMakeIndices<N>::type is GCUSBIndices<0, 1, ..., N - 1> */
+template <unsigned int N, unsigned int... I> struct GCUSBMakeIndices : GCUSBMakeIndices<N - 1, N - 1, I...> {};
+template <unsigned int... I> struct GCUSBMakeIndices<0, I...> {
+    typedef GCUSBIndices<I...> type;
+};
+
+template <unsigned int... I>
+constexpr GCUSBAxisTable GCUSBStickTable (unsigned int dead_zone, unsigned int curve, GCUSBIndices<I...>) {
+    return GCUSBAxisTable {{GCUSBStickValue (I, dead_zone, curve)...}};
+}
+
+template <unsigned int... I>
+constexpr GCUSBAxisTable GCUSBTriggerTable (unsigned int dead_zone, unsigned int curve, GCUSBIndices<I...>) {
+    return GCUSBAxisTable {{GCUSBTriggerValue (I, dead_zone, curve)...}};
+}
+
+/** default stick table: no dead zone, linear, clamped to the declared range */
+static constexpr GCUSBAxisTable GCUSBDefaultStickTable =
+    GCUSBStickTable (0, GCUSBCurveLinear, GCUSBMakeIndices<256>::type ());
+/** default trigger table: no dead zone, linear, clamped to the declared range */
+static constexpr GCUSBAxisTable GCUSBDefaultTriggerTable =
+    GCUSBTriggerTable (0, GCUSBCurveLinear, GCUSBMakeIndices<256>::type ());
+
+static_assert (0 == GCUSBDefaultStickTable.value[0] && 50 == GCUSBDefaultStickTable.value[50] &&
+               (uint8_t) -50 == GCUSBDefaultStickTable.value[256 - 50], "default stick table is not the identity");
+static_assert (GCUSBStickRange == GCUSBDefaultStickTable.value[127] &&
+               (uint8_t) -GCUSBStickRange == GCUSBDefaultStickTable.value[128], "stick table is not clamped");
+static_assert (GCUSBTriggerMinimum == GCUSBDefaultTriggerTable.value[0] &&
+               GCUSBTriggerMaximum == GCUSBDefaultTriggerTable.value[255] &&
+               0x80 == GCUSBDefaultTriggerTable.value[0x80], "trigger table is not clamped");
+static_assert (0 == GCUSBStickValue (10, 10, GCUSBCurveLinear) && 1 == GCUSBStickValue (11, 10, GCUSBCurveLinear) &&
+               GCUSBStickRange == GCUSBStickValue (GCUSBStickRange, 10, GCUSBCurveCubic), "bad stick dead zone");
+static_assert (GCUSBTriggerMinimum == GCUSBTriggerValue (0x30, 0x18, GCUSBCurveQuadratic) &&
+               GCUSBTriggerMaximum == GCUSBTriggerValue (0xf0, 0x18, GCUSBCurveQuadratic), "bad trigger dead zone");
+
+/**
+ * Dead zone and response curve of a port. Dead zones are in raw units (stick: offset
+ * from the origin, trigger: offset from GCUSBTriggerMinimum).
+ */
+struct GCUSBAxisConfig {
+    uint8_t stick_dead_zone;
+    uint8_t stick_curve;
+    uint8_t trigger_dead_zone;
+    uint8_t trigger_curve;
+};
+
+/**
+ * @brief Per-port dead zone and response curve mapping
+ *
+ * Runs on the decoded report and replaces every stick and trigger byte of all four
+ * ports with a single table load. Each port has two sets of tables. A new configuration
+ * is built into the inactive set and then published so the report path never sees a
+ * partially built table. A GCUSBTableGate per port keeps configure() from overwriting
+ * a set that a report which started before the previous change is still mapping.
+ * Configuration changes must be serialized by the caller (the kext runs them on the
+ * work loop).
+ */
+class GCUSBAxisMap {
+public:
+    GCUSBAxisMap () {
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            memset (_config + i, 0, sizeof (_config[i]));
+            _tables[i][0].stick = GCUSBDefaultStickTable;
+            _tables[i][0].trigger = GCUSBDefaultTriggerTable;
+        }
+    }
+
+    /**
+     * @brief Set the dead zones and curves of a port
+     *
+     * Out of range values are clamped. Returns the configuration in effect.
+     */
+    const GCUSBAxisConfig &configure (int port, const GCUSBAxisConfig &config) {
+        GCUSBAxisConfig clamped = config;
+        unsigned int next = _gate[port].acquire ();
+        Tables *tables = &_tables[port][next];
+
+        if (clamped.stick_dead_zone >= GCUSBStickRange) {
+            clamped.stick_dead_zone = GCUSBStickRange - 1;
+        }
+        if (clamped.trigger_dead_zone >= GCUSBTriggerRange) {
+            clamped.trigger_dead_zone = GCUSBTriggerRange - 1;
+        }
+        if (clamped.stick_curve >= GCUSBCurveCount) {
+            clamped.stick_curve = GCUSBCurveLinear;
+        }
+        if (clamped.trigger_curve >= GCUSBCurveCount) {
+            clamped.trigger_curve = GCUSBCurveLinear;
+        }
+
+        for (unsigned int i = 0 ; i < 256 ; ++i) {
+            tables->stick.value[i] = GCUSBStickValue (i, clamped.stick_dead_zone, clamped.stick_curve);
+            tables->trigger.value[i] = GCUSBTriggerValue (i, clamped.trigger_dead_zone, clamped.trigger_curve);
+        }
+
+        _config[port] = clamped;
+        _gate[port].publish (next);
+
+        return _config[port];
+    }
+
+    const GCUSBAxisConfig &config (int port) const {
+        return _config[port];
+    }
+
+    /** map the sticks and triggers of every port in a decoded 0x21 report */
+    void apply (uint8_t *report) const {
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            unsigned int set = _gate[i].enter ();
+            const Tables &tables = _tables[i][set];
+            uint8_t *port_report = GCUSBReportDecoder::portReport (report, i);
+
+            for (int j = 0 ; j < GCUSBPortStickCount ; ++j) {
+                port_report[GCUSBPortStickOffset + j] = tables.stick.value[port_report[GCUSBPortStickOffset + j]];
+            }
+
+            for (int j = 0 ; j < GCUSBPortTriggerCount ; ++j) {
+                port_report[GCUSBPortTriggerOffset + j] = tables.trigger.value[port_report[GCUSBPortTriggerOffset + j]];
+            }
+
+            _gate[i].leave (set);
+        }
+    }
+
+private:
+    struct Tables {
+        GCUSBAxisTable stick;
+        GCUSBAxisTable trigger;
+    };
+
+    Tables _tables[GCUSBPortCount][2];
+    GCUSBAxisConfig _config[GCUSBPortCount];
+    GCUSBTableGate _gate[GCUSBPortCount];
+};
+
+#endif
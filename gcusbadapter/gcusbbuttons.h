@@ -0,0 +1,187 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBBUTTONS_H)
+#define GCUSBBUTTONS_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stdint.h>
+#include <string.h>
+
+#include "gcusbreport.h"
+
+/**
+ * Buttons of a port report. The index is the bit in the 16-bit button word made of the
+ * first button byte (low) and the second button byte (high).
+ */
+enum GCUSBButton {
+    GCUSBButtonA         = 0,
+    GCUSBButtonB         = 1,
+    GCUSBButtonX         = 2,
+    GCUSBButtonY         = 3,
+    GCUSBButtonDPadLeft  = 4,
+    GCUSBButtonDPadRight = 5,
+    GCUSBButtonDPadDown  = 6,
+    GCUSBButtonDPadUp    = 7,
+    GCUSBButtonStart     = 8,
+    GCUSBButtonZ         = 9,
+    GCUSBButtonR         = 10,
+    GCUSBButtonL         = 11,
+    /** number of bits in the button word (the top four are unused by the controller) */
+    GCUSBButtonCount     = 16,
+    /** output of an input button that is not reported */
+    GCUSBButtonNone      = 0xff,
+};
+
+/**
+ * Remap profile of a port: the output bit of every input bit or GCUSBButtonNone.
+ * Several inputs may share an output.
+ */
+struct GCUSBButtonProfile {
+    uint8_t output[GCUSBButtonCount];
+};
+
+/** profile that reports every button as itself */
+static inline GCUSBButtonProfile GCUSBButtonIdentity (void) {
+    GCUSBButtonProfile profile;
+
+    for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+        profile.output[i] = (uint8_t) i;
+    }
+
+    return profile;
+}
+
+/**
+ * @brief Remap a button word one bit at a time
+ *
+ * Reference for the lookup tables built by GCUSBButtonMap. Too slow for the report path.
+ */
+static inline uint16_t GCUSBButtonRemap (const GCUSBButtonProfile &profile, uint16_t buttons) {
+    uint16_t output = 0;
+
+    for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+        if ((buttons & (1u << i)) && profile.output[i] < GCUSBButtonCount) {
+            output |= (uint16_t) (1u << profile.output[i]);
+        }
+    }
+
+    return output;
+}
+
+/**
+ * @brief Per-port button remapping
+ *
+ * Each port has one 256 entry table per button byte holding the output mask for every
+ * value of that byte, so the remapped button word is two table loads and an OR. Each
+ * port has two sets of tables. A new profile is built into the inactive set and then
+ * published so the report path never sees a partially built table. remap() and apply()
+ * enter the port's GCUSBTableGate, so configure() only waits for readers of the set it
+ * is about to rebuild. Profile changes must be serialized by the caller.
+ */
+class GCUSBButtonMap {
+public:
+    GCUSBButtonMap () {
+        GCUSBButtonProfile identity = GCUSBButtonIdentity ();
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            configure (i, identity);
+        }
+    }
+
+    /**
+     * @brief Set the remap profile of a port
+     *
+     * Outputs beyond the button word are treated as GCUSBButtonNone. Returns the profile
+     * in effect.
+     */
+    const GCUSBButtonProfile &configure (int port, const GCUSBButtonProfile &profile) {
+        unsigned int next = _gate[port].acquire ();
+        Tables *tables = &_tables[port][next];
+        GCUSBButtonProfile clamped = profile;
+        uint16_t bits[GCUSBButtonCount];
+
+        for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+            if (clamped.output[i] >= GCUSBButtonCount) {
+                clamped.output[i] = GCUSBButtonNone;
+                bits[i] = 0;
+            } else {
+                bits[i] = (uint16_t) (1u << clamped.output[i]);
+            }
+        }
+
+        /* every entry is an entry with one bit less plus the output of that bit */
+        tables->low[0] = tables->high[0] = 0;
+        for (unsigned int value = 1 ; value < 256 ; ++value) {
+            unsigned int bit = __builtin_ctz (value);
+
+            tables->low[value] = tables->low[value & (value - 1)] | bits[bit];
+            tables->high[value] = tables->high[value & (value - 1)] | bits[bit + 8];
+        }
+
+        _profile[port] = clamped;
+        _gate[port].publish (next);
+
+        return _profile[port];
+    }
+
+    const GCUSBButtonProfile &profile (int port) const {
+        return _profile[port];
+    }
+
+    /** remap a button word of a port */
+    uint16_t remap (int port, uint16_t buttons) const {
+        unsigned int set = _gate[port].enter ();
+        const Tables &tables = _tables[port][set];
+        uint16_t output = tables.low[buttons & 0xff] | tables.high[buttons >> 8];
+
+        _gate[port].leave (set);
+
+        return output;
+    }
+
+    /** remap the buttons of every port in a decoded 0x21 report */
+    void apply (uint8_t *report) const {
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            unsigned int set = _gate[i].enter ();
+            const Tables &tables = _tables[i][set];
+            uint8_t *buttons = GCUSBReportDecoder::portReport (report, i) + GCUSBPortButtonOffset;
+            uint16_t output = tables.low[buttons[0]] | tables.high[buttons[1]];
+
+            buttons[0] = (uint8_t) output;
+            buttons[1] = (uint8_t) (output >> 8);
+
+            _gate[i].leave (set);
+        }
+    }
+
+private:
+    struct Tables {
+        uint16_t low[256];
+        uint16_t high[256];
+    };
+
+    Tables _tables[GCUSBPortCount][2];
+    GCUSBButtonProfile _profile[GCUSBPortCount];
+    GCUSBTableGate _gate[GCUSBPortCount];
+};
+
+#endif
@@ -0,0 +1,210 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBCAPTURE_H)
+#define GCUSBCAPTURE_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Capture format
+ *
+ * A capture starts with a 16 byte file header followed by back-to-back records. All
+ * multi-byte fields are little endian.
+ *
+ *   header:  "GCUSBCAP" (8 bytes) | version (u16) | reserved (u16) | reserved (u32)
+ *   record:  timestamp in ns (u64) | direction (u8) | length (u8) | report (length bytes)
+ *
+ * The report includes its report id so 0x21 input reports and 0x11/0x13 output reports
+ * are recorded as they were sent on the wire. A capture is append-only and a truncated
+ * final record is ignored by readers.
+ */
+
+enum {
+    GCUSBCaptureVersion      = 1,
+    GCUSBCaptureHeaderLength = 16,
+    GCUSBCaptureRecordHeader = 10,
+    /** longest report that is recorded */
+    GCUSBCaptureMaxReport    = 64,
+};
+
+enum GCUSBCaptureDirection {
+    /** report received from the adapter */
+    GCUSBCaptureInput  = 0,
+    /** report sent to the adapter */
+    GCUSBCaptureOutput = 1,
+};
+
+struct GCUSBCaptureRecord {
+    uint64_t timestamp;
+    uint8_t direction;
+    uint8_t length;
+    const uint8_t *report;
+};
+
+static inline void GCUSBCapturePut64 (uint8_t *p, uint64_t value) {
+    for (int i = 0 ; i < 8 ; ++i) {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static inline uint64_t GCUSBCaptureGet64 (const uint8_t *p) {
+    uint64_t value = 0;
+
+    for (int i = 0 ; i < 8 ; ++i) {
+        value |= (uint64_t) p[i] << (8 * i);
+    }
+
+    return value;
+}
+
+/**
+ * @brief Append-only capture writer over a caller-provided buffer
+ *
+ * The writer never allocates. Records that do not fit are dropped and counted. The
+ * writer does no locking; concurrent writers must be serialized by the caller.
+ * Everything before used() is complete and is never modified again so a reader may
+ * copy it out without holding the writer's lock.
+ */
+class GCUSBCaptureWriter {
+public:
+    GCUSBCaptureWriter () : _buffer(nullptr), _capacity(0), _used(0), _dropped(0) {
+    }
+
+    /** start a new capture in a buffer. returns false if the buffer is too small */
+    bool start (uint8_t *buffer, size_t capacity) {
+        _buffer = nullptr;
+        _capacity = _used = 0;
+        _dropped = 0;
+
+        if (!buffer || capacity < GCUSBCaptureHeaderLength) {
+            return false;
+        }
+
+        memset (buffer, 0, GCUSBCaptureHeaderLength);
+        memcpy (buffer, "GCUSBCAP", 8);
+        buffer[8] = GCUSBCaptureVersion & 0xff;
+        buffer[9] = GCUSBCaptureVersion >> 8;
+
+        _buffer = buffer;
+        _capacity = capacity;
+        __atomic_store_n (&_used, (size_t) GCUSBCaptureHeaderLength, __ATOMIC_RELEASE);
+
+        return true;
+    }
+
+    /** stop capturing. the buffer is no longer referenced */
+    void stop (void) {
+        _buffer = nullptr;
+        _capacity = 0;
+        __atomic_store_n (&_used, (size_t) 0, __ATOMIC_RELEASE);
+    }
+
+    bool active (void) const {
+        return nullptr != _buffer;
+    }
+
+    /** append a record. returns false if the record was dropped */
+    bool append (uint64_t timestamp, GCUSBCaptureDirection direction, const uint8_t *report, size_t length) {
+        if (!_buffer) {
+            return false;
+        }
+
+        if (length > GCUSBCaptureMaxReport || _used + GCUSBCaptureRecordHeader + length > _capacity) {
+            ++_dropped;
+            return false;
+        }
+
+        uint8_t *record = _buffer + _used;
+        GCUSBCapturePut64 (record, timestamp);
+        record[8] = (uint8_t) direction;
+        record[9] = (uint8_t) length;
+        memcpy (record + GCUSBCaptureRecordHeader, report, length);
+
+        __atomic_store_n (&_used, _used + GCUSBCaptureRecordHeader + length, __ATOMIC_RELEASE);
+
+        return true;
+    }
+
+    /** bytes of the buffer holding complete records (including the file header) */
+    size_t used (void) const {
+        return __atomic_load_n (&_used, __ATOMIC_ACQUIRE);
+    }
+
+    uint64_t dropped (void) const {
+        return _dropped;
+    }
+
+private:
+    uint8_t *_buffer;
+    size_t _capacity, _used;
+    uint64_t _dropped;
+};
+
+/**
+ * @brief Sequential reader for a capture held in memory (e.g. a mapped file)
+ */
+class GCUSBCaptureReader {
+public:
+    GCUSBCaptureReader (const uint8_t *data, size_t length) : _data(data), _length(length),
+                                                             _offset(GCUSBCaptureHeaderLength) {
+    }
+
+    /** check the file header */
+    bool valid (void) const {
+        return _length >= GCUSBCaptureHeaderLength && 0 == memcmp (_data, "GCUSBCAP", 8) &&
+            GCUSBCaptureVersion == (_data[8] | (_data[9] << 8));
+    }
+
+    /** read the next record. returns false at the end of the capture */
+    bool next (GCUSBCaptureRecord *record) {
+        if (_offset + GCUSBCaptureRecordHeader > _length) {
+            return false;
+        }
+
+        const uint8_t *p = _data + _offset;
+        if (_offset + GCUSBCaptureRecordHeader + p[9] > _length) {
+            /* truncated record */
+            return false;
+        }
+
+        record->timestamp = GCUSBCaptureGet64 (p);
+        record->direction = p[8];
+        record->length = p[9];
+        record->report = p + GCUSBCaptureRecordHeader;
+        _offset += GCUSBCaptureRecordHeader + record->length;
+
+        return true;
+    }
+
+    void rewind (void) {
+        _offset = GCUSBCaptureHeaderLength;
+    }
+
+private:
+    const uint8_t *_data;
+    size_t _length, _offset;
+};
+
+#endif
@@ -0,0 +1,265 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBDESCRIPTOR_H)
+#define GCUSBDESCRIPTOR_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gcusbreport.h"
+#include "gcusbaxis.h"
+
+/*
+ * HID report descriptor builder
+ *
+ * A descriptor is a type: GCUSBHIDBytes<...> holding the descriptor bytes as template
+ * arguments. Items are alias templates that expand to GCUSBHIDBytes and are joined
+ * with GCUSBHIDJoin, so a whole descriptor is assembled by the compiler and the bytes
+ * end up in a single constant array (GCUSBHIDDescriptor<>::data). Short items pick the
+ * smallest data size that holds their value, signed for logical minimum/maximum.
+ */
+
+template <uint8_t... B> struct GCUSBHIDBytes {};
+
+template <class... T> struct GCUSBHIDJoin;
+template <> struct GCUSBHIDJoin<> {
+    typedef GCUSBHIDBytes<> type;
+};
+template <uint8_t... A> struct GCUSBHIDJoin<GCUSBHIDBytes<A...>> {
+    typedef GCUSBHIDBytes<A...> type;
+};
+template <uint8_t... A, uint8_t... B, class... T>
+struct GCUSBHIDJoin<GCUSBHIDBytes<A...>, GCUSBHIDBytes<B...>, T...> : GCUSBHIDJoin<GCUSBHIDBytes<A..., B...>, T...> {};
+
+/** number of data bytes needed for a short item value */
+constexpr unsigned int GCUSBHIDValueSize (int64_t value, bool is_signed) {
+    return is_signed ? (value >= -128 && value <= 127 ? 1 : value >= -32768 && value <= 32767 ? 2 : 4) :
+        (value <= 0xff ? 1 : value <= 0xffff ? 2 : 4);
+}
+
+template <uint8_t Prefix, int64_t Value, unsigned int Size> struct GCUSBHIDShortItem;
+template <uint8_t Prefix, int64_t Value> struct GCUSBHIDShortItem<Prefix, Value, 1> {
+    typedef GCUSBHIDBytes<Prefix | 1, (uint8_t) Value> type;
+};
+template <uint8_t Prefix, int64_t Value> struct GCUSBHIDShortItem<Prefix, Value, 2> {
+    typedef GCUSBHIDBytes<Prefix | 2, (uint8_t) Value, (uint8_t) (Value >> 8)> type;
+};
+template <uint8_t Prefix, int64_t Value> struct GCUSBHIDShortItem<Prefix, Value, 4> {
+    typedef GCUSBHIDBytes<Prefix | 3, (uint8_t) Value, (uint8_t) (Value >> 8), (uint8_t) (Value >> 16),
+                          (uint8_t) (Value >> 24)> type;
+};
+
+template <uint8_t Prefix, int64_t Value>
+using GCUSBHIDUnsignedItem = typename GCUSBHIDShortItem<Prefix, Value, GCUSBHIDValueSize (Value, false)>::type;
+template <uint8_t Prefix, int64_t Value>
+using GCUSBHIDSignedItem = typename GCUSBHIDShortItem<Prefix, Value, GCUSBHIDValueSize (Value, true)>::type;
+
+/**
+ * Item prefixes (tag and type, without the size bits)
+ */
+enum {
+    GCUSBHIDInputTag          = 0x80,
+    GCUSBHIDOutputTag         = 0x90,
+    GCUSBHIDCollectionTag     = 0xa0,
+    GCUSBHIDEndCollectionTag  = 0xc0,
+    GCUSBHIDUsagePageTag      = 0x04,
+    GCUSBHIDLogicalMinimumTag = 0x14,
+    GCUSBHIDLogicalMaximumTag = 0x24,
+    GCUSBHIDReportSizeTag     = 0x74,
+    GCUSBHIDReportIDTag       = 0x84,
+    GCUSBHIDReportCountTag    = 0x94,
+    GCUSBHIDUsageTag          = 0x08,
+    GCUSBHIDUsageMinimumTag   = 0x18,
+    GCUSBHIDUsageMaximumTag   = 0x28,
+};
+
+/* main item flags */
+enum {
+    GCUSBHIDData     = 0x00,
+    GCUSBHIDConstant = 0x01,
+    GCUSBHIDVariable = 0x02,
+    GCUSBHIDRelative = 0x04,
+};
+
+enum {
+    GCUSBHIDCollectionPhysical    = 0x00,
+    GCUSBHIDCollectionApplication = 0x01,
+};
+
+template <int64_t V> using GCUSBHIDUsagePage = GCUSBHIDUnsignedItem<GCUSBHIDUsagePageTag, V>;
+template <int64_t V> using GCUSBHIDUsage = GCUSBHIDUnsignedItem<GCUSBHIDUsageTag, V>;
+template <int64_t V> using GCUSBHIDUsageMinimum = GCUSBHIDUnsignedItem<GCUSBHIDUsageMinimumTag, V>;
+template <int64_t V> using GCUSBHIDUsageMaximum = GCUSBHIDUnsignedItem<GCUSBHIDUsageMaximumTag, V>;
+template <int64_t V> using GCUSBHIDLogicalMinimum = GCUSBHIDSignedItem<GCUSBHIDLogicalMinimumTag, V>;
+template <int64_t V> using GCUSBHIDLogicalMaximum = GCUSBHIDSignedItem<GCUSBHIDLogicalMaximumTag, V>;
+template <int64_t V> using GCUSBHIDReportSize = GCUSBHIDUnsignedItem<GCUSBHIDReportSizeTag, V>;
+template <int64_t V> using GCUSBHIDReportCount = GCUSBHIDUnsignedItem<GCUSBHIDReportCountTag, V>;
+template <int64_t V> using GCUSBHIDReportID = GCUSBHIDUnsignedItem<GCUSBHIDReportIDTag, V>;
+template <int64_t Flags> using GCUSBHIDInput = GCUSBHIDUnsignedItem<GCUSBHIDInputTag, Flags>;
+template <int64_t Flags> using GCUSBHIDOutput = GCUSBHIDUnsignedItem<GCUSBHIDOutputTag, Flags>;
+
+template <uint8_t Type, class... Items>
+using GCUSBHIDCollection = typename GCUSBHIDJoin<GCUSBHIDBytes<GCUSBHIDCollectionTag | 1, Type>, Items...,
+                                                 GCUSBHIDBytes<GCUSBHIDEndCollectionTag>>::type;
+
+template <class... Items> using GCUSBHIDItems = typename GCUSBHIDJoin<Items...>::type;
+
+/** constant storage for the bytes of a descriptor */
+template <class Bytes> struct GCUSBHIDDescriptor;
+template <uint8_t... B> struct GCUSBHIDDescriptor<GCUSBHIDBytes<B...>> {
+    static constexpr uint8_t data[sizeof... (B)] = {B...};
+    static constexpr size_t length = sizeof... (B);
+};
+template <uint8_t... B> constexpr uint8_t GCUSBHIDDescriptor<GCUSBHIDBytes<B...>>::data[sizeof... (B)];
+template <uint8_t... B> constexpr size_t GCUSBHIDDescriptor<GCUSBHIDBytes<B...>>::length;
+
+/*
+ * Descriptor parser
+ *
+ * The same constexpr functions validate the descriptors with static_assert and can be
+ * called at run time by tools. Only short items are supported.
+ */
+
+/** number of data bytes of a short item */
+constexpr size_t GCUSBHIDItemDataSize (uint8_t prefix) {
+    return 3 == (prefix & 3) ? 4 : (prefix & 3);
+}
+
+/** unsigned data of the short item at pos */
+constexpr uint32_t GCUSBHIDItemData (const uint8_t *d, size_t pos) {
+    return 0 == GCUSBHIDItemDataSize (d[pos]) ? 0 :
+        1 == GCUSBHIDItemDataSize (d[pos]) ? d[pos + 1] :
+        2 == GCUSBHIDItemDataSize (d[pos]) ? (uint32_t) d[pos + 1] | ((uint32_t) d[pos + 2] << 8) :
+        (uint32_t) d[pos + 1] | ((uint32_t) d[pos + 2] << 8) | ((uint32_t) d[pos + 3] << 16) |
+        ((uint32_t) d[pos + 4] << 24);
+}
+
+constexpr size_t GCUSBHIDNextItem (const uint8_t *d, size_t pos) {
+    return pos + 1 + GCUSBHIDItemDataSize (d[pos]);
+}
+
+/** every item is complete and every collection is closed */
+constexpr bool GCUSBHIDWellFormed (const uint8_t *d, size_t length, size_t pos = 0, int depth = 0) {
+    return depth < 0 ? false : pos == length ? 0 == depth : pos > length ? false :
+        0xfe == d[pos] ? false :
+        GCUSBHIDWellFormed (d, length, GCUSBHIDNextItem (d, pos),
+                            depth + (GCUSBHIDCollectionTag == (d[pos] & 0xfc)) -
+                            (GCUSBHIDEndCollectionTag == (d[pos] & 0xfc)));
+}
+
+/**
+ * @brief Size in bits of a report
+ *
+ * @param[in] id   report id
+ * @param[in] tag  GCUSBHIDInputTag or GCUSBHIDOutputTag
+ *
+ * Only report size, report count and report id are tracked (no push/pop).
+ */
+constexpr uint32_t GCUSBHIDReportBits (const uint8_t *d, size_t length, uint8_t id, uint8_t tag, size_t pos = 0,
+                                       uint32_t size = 0, uint32_t count = 0, uint32_t current = 0) {
+    return pos >= length ? 0 :
+        (tag == (d[pos] & 0xfc) && current == id ? size * count : 0) +
+        GCUSBHIDReportBits (d, length, id, tag, GCUSBHIDNextItem (d, pos),
+                            GCUSBHIDReportSizeTag == (d[pos] & 0xfc) ? GCUSBHIDItemData (d, pos) : size,
+                            GCUSBHIDReportCountTag == (d[pos] & 0xfc) ? GCUSBHIDItemData (d, pos) : count,
+                            GCUSBHIDReportIDTag == (d[pos] & 0xfc) ? GCUSBHIDItemData (d, pos) : current);
+}
+
+/*
+ * Descriptors injected for each WUP-028 port
+ */
+
+/** 0x50 input report: 16 buttons, 4 stick axes and 2 trigger axes */
+typedef GCUSBHIDCollection<GCUSBHIDCollectionApplication,
+    GCUSBHIDReportID<GCUSBPortReportID>,
+    GCUSBHIDUsagePage<0x09>,                /* Button */
+    GCUSBHIDUsageMinimum<1>,
+    GCUSBHIDUsageMaximum<16>,
+    GCUSBHIDLogicalMinimum<0>,
+    GCUSBHIDLogicalMaximum<1>,
+    GCUSBHIDReportSize<1>,
+    GCUSBHIDReportCount<16>,
+    GCUSBHIDInput<GCUSBHIDData | GCUSBHIDVariable>,
+    GCUSBHIDUsagePage<0x01>,                /* Generic Desktop */
+    GCUSBHIDUsage<0x30>,                    /* X */
+    GCUSBHIDUsage<0x31>,                    /* Y */
+    GCUSBHIDUsage<0x33>,                    /* Rx */
+    GCUSBHIDUsage<0x34>,                    /* Ry */
+    GCUSBHIDLogicalMinimum<-GCUSBStickRange>,
+    GCUSBHIDLogicalMaximum<GCUSBStickRange>,
+    GCUSBHIDReportSize<8>,
+    GCUSBHIDReportCount<GCUSBPortStickCount>,
+    GCUSBHIDInput<GCUSBHIDData | GCUSBHIDVariable>,
+    GCUSBHIDUsage<0x32>,                    /* Z -- left trigger */
+    GCUSBHIDUsage<0x35>,                    /* Rz -- right trigger */
+    GCUSBHIDLogicalMinimum<GCUSBTriggerMinimum>,
+    GCUSBHIDLogicalMaximum<GCUSBTriggerMaximum>,
+    GCUSBHIDReportSize<8>,
+    GCUSBHIDReportCount<GCUSBPortTriggerCount>,
+    GCUSBHIDInput<GCUSBHIDData | GCUSBHIDVariable>> GCUSBHIDPadCollection;
+
+/** report id of the per-port rumble output report */
+enum {
+    GCUSBPortRumbleReportID = 0x60,
+};
+
+/** 0x60 output report: rumble motor on/off */
+typedef GCUSBHIDCollection<GCUSBHIDCollectionApplication,
+    GCUSBHIDReportID<GCUSBPortRumbleReportID>,
+    GCUSBHIDUsagePage<0xff00>,              /* Vendor Defined */
+    GCUSBHIDUsage<0x03>,
+    GCUSBHIDReportSize<8>,
+    GCUSBHIDReportCount<1>,
+    GCUSBHIDOutput<GCUSBHIDData | GCUSBHIDVariable>> GCUSBHIDRumbleCollection;
+
+/** wired controller: pad and rumble */
+typedef GCUSBHIDDescriptor<GCUSBHIDItems<
+    GCUSBHIDUsagePage<0x01>,                /* Generic Desktop */
+    GCUSBHIDUsage<0x05>,                    /* Game Pad */
+    GCUSBHIDCollection<GCUSBHIDCollectionApplication, GCUSBHIDPadCollection, GCUSBHIDRumbleCollection>>>
+    GCUSBWiredDescriptor;
+
+/** WaveBird: no rumble motor */
+typedef GCUSBHIDDescriptor<GCUSBHIDItems<
+    GCUSBHIDUsagePage<0x01>,                /* Generic Desktop */
+    GCUSBHIDUsage<0x05>,                    /* Game Pad */
+    GCUSBHIDCollection<GCUSBHIDCollectionApplication, GCUSBHIDPadCollection>>>
+    GCUSBWaveBirdDescriptor;
+
+static_assert (GCUSBHIDWellFormed (GCUSBWiredDescriptor::data, GCUSBWiredDescriptor::length),
+               "wired descriptor is malformed");
+static_assert (GCUSBHIDWellFormed (GCUSBWaveBirdDescriptor::data, GCUSBWaveBirdDescriptor::length),
+               "WaveBird descriptor is malformed");
+/* the 0x50 report is the port slice after the decoder replaced the status byte with the report id */
+static_assert (8 * (GCUSBPortReportLength - 1) ==
+               GCUSBHIDReportBits (GCUSBWiredDescriptor::data, GCUSBWiredDescriptor::length, GCUSBPortReportID,
+                                   GCUSBHIDInputTag), "wired 0x50 report does not match the decoder");
+static_assert (8 * (GCUSBPortReportLength - 1) ==
+               GCUSBHIDReportBits (GCUSBWaveBirdDescriptor::data, GCUSBWaveBirdDescriptor::length,
+                                   GCUSBPortReportID, GCUSBHIDInputTag), "WaveBird 0x50 report does not match the decoder");
+static_assert (8 == GCUSBHIDReportBits (GCUSBWiredDescriptor::data, GCUSBWiredDescriptor::length,
+                                        GCUSBPortRumbleReportID, GCUSBHIDOutputTag), "wired 0x60 report is not one byte");
+static_assert (0 == GCUSBHIDReportBits (GCUSBWaveBirdDescriptor::data, GCUSBWaveBirdDescriptor::length,
+                                        GCUSBPortRumbleReportID, GCUSBHIDOutputTag), "WaveBird has a rumble report");
+
+#endif
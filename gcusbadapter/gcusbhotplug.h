@@ -0,0 +1,203 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBHOTPLUG_H)
+#define GCUSBHOTPLUG_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stdint.h>
+
+#include "gcusbreport.h"
+
+/**
+ * @brief Debounced controller hotplug state machine
+ *
+ * The report path feeds the status byte of every port into update(). A controller has
+ * to be seen in a number of consecutive reports before it is attached and has to be
+ * missing from a number of consecutive reports before it is detached. The attach and
+ * detach work itself is left to a work loop which queries pending() and reports back
+ * with attached() or detached().
+ *
+ * Ports in the Attaching or Detaching state are owned by the work loop. All other
+ * states are owned by the report path. The hand-off is done with release/acquire
+ * stores and loads so the two sides never need a lock.
+ */
+class GCUSBHotplug {
+public:
+    enum State {
+        /** no controller */
+        StateEmpty = 0,
+        /** controller seen, waiting for the connect threshold */
+        StateArming,
+        /** attach requested from the work loop */
+        StateAttaching,
+        /** controller attached and delivering reports */
+        StateActive,
+        /** controller missing, waiting for the disconnect threshold */
+        StateReleasing,
+        /** detach requested from the work loop */
+        StateDetaching,
+    };
+
+    enum Action {
+        ActionNone = 0,
+        ActionAttach,
+        ActionDetach,
+    };
+
+    GCUSBHotplug () : _connect_threshold(2), _disconnect_threshold(8) {
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            _state[i] = StateEmpty;
+            _count[i] = 0;
+            _type[i] = 0;
+        }
+    }
+
+    /**
+     * @brief Set the debounce thresholds
+     *
+     * @param[in] connect     consecutive reports with a controller before attaching
+     * @param[in] disconnect  consecutive reports without a controller before detaching
+     */
+    void setThresholds (unsigned int connect, unsigned int disconnect) {
+        _connect_threshold = connect ? connect : 1;
+        _disconnect_threshold = disconnect ? disconnect : 1;
+    }
+
+    unsigned int connectThreshold (void) const {
+        return _connect_threshold;
+    }
+
+    unsigned int disconnectThreshold (void) const {
+        return _disconnect_threshold;
+    }
+
+    /**
+     * @brief Feed the status byte of a port from an input report
+     *
+     * @returns true if the port now needs work from the work loop
+     */
+    bool update (int port, uint8_t status) {
+        switch (state (port)) {
+        case StateEmpty:
+            if (status) {
+                _count[port] = 0;
+                return arm (port, status);
+            }
+            break;
+        case StateArming:
+            if (status) {
+                return arm (port, status);
+            }
+            setState (port, StateEmpty);
+            break;
+        case StateActive:
+            if (!status) {
+                _count[port] = 0;
+                return release (port);
+            }
+            _type[port] = status;
+            break;
+        case StateReleasing:
+            if (status) {
+                /* the controller came back before the threshold. keep the port */
+                _type[port] = status;
+                setState (port, StateActive);
+                break;
+            }
+            return release (port);
+        default:
+            /* owned by the work loop */
+            break;
+        }
+
+        return false;
+    }
+
+    /** work pending for a port */
+    Action pending (int port) const {
+        switch (state (port)) {
+        case StateAttaching:
+            return ActionAttach;
+        case StateDetaching:
+            return ActionDetach;
+        default:
+            return ActionNone;
+        }
+    }
+
+    /** called by the work loop when an attach finished */
+    void attached (int port, bool success) {
+        setState (port, success ? StateActive : StateEmpty);
+    }
+
+    /** called by the work loop when a detach finished */
+    void detached (int port) {
+        setState (port, StateEmpty);
+    }
+
+    /** port has an attached controller that should receive reports */
+    bool active (int port) const {
+        return StateActive == state (port);
+    }
+
+    /** status byte of the controller in a port */
+    uint8_t type (int port) const {
+        return _type[port];
+    }
+
+    State state (int port) const {
+        return (State) __atomic_load_n (_state + port, __ATOMIC_ACQUIRE);
+    }
+
+private:
+    void setState (int port, State state) {
+        __atomic_store_n (_state + port, (uint8_t) state, __ATOMIC_RELEASE);
+    }
+
+    bool arm (int port, uint8_t status) {
+        _type[port] = status;
+        if (++_count[port] < _connect_threshold) {
+            setState (port, StateArming);
+            return false;
+        }
+
+        setState (port, StateAttaching);
+        return true;
+    }
+
+    bool release (int port) {
+        if (++_count[port] < _disconnect_threshold) {
+            setState (port, StateReleasing);
+            return false;
+        }
+
+        setState (port, StateDetaching);
+        return true;
+    }
+
+    uint8_t _state[GCUSBPortCount];
+    uint8_t _type[GCUSBPortCount];
+    unsigned int _count[GCUSBPortCount];
+    unsigned int _connect_threshold, _disconnect_threshold;
+};
+
+#endif
@@ -0,0 +1,800 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBREPORT_H)
+#define GCUSBREPORT_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gcusbshared.h"
+
+/**
+ * Layout of the WUP-028 reports
+ */
+enum {
+    /** report id of the combined input report */
+    GCUSBInputReportID     = 0x21,
+    /** length of the combined input report (id + 4 port slices) */
+    GCUSBInputReportLength = 37,
+    /** number of controller ports on the adapter */
+    GCUSBPortCount         = 4,
+    /** length of a single port slice (status + 8 bytes of pad state) */
+    GCUSBPortReportLength  = 9,
+    /** report id of the per-port report injected into GCUSBAdapterPort */
+    GCUSBPortReportID      = 0x50,
+    /** length of the port data following the report id (4 port slices) */
+    GCUSBPayloadLength     = GCUSBInputReportLength - 1,
+    /** offset of the first button byte within a port slice */
+    GCUSBPortButtonOffset  = 1,
+    /** offset of the first analog stick byte within a port slice */
+    GCUSBPortStickOffset   = 3,
+    /** number of analog stick bytes (main X/Y, C X/Y) */
+    GCUSBPortStickCount    = 4,
+    /** report id of the rumble output report */
+    GCUSBRumbleReportID    = 0x11,
+    /** length of the rumble output report (id + 1 byte per port) */
+    GCUSBRumbleReportLength = 5,
+    /** report id of the output report that starts input reports */
+    GCUSBStartReportID     = 0x13,
+};
+
+/**
+ * @brief Flags decoded from the status byte of a port slice
+ *
+ * The high nibble holds the controller type and the low nibble flags such as rumble
+ * power. Compare the decoded fields rather than the raw byte since the flags change
+ * while a controller stays connected.
+ */
+class GCUSBPortFlags {
+public:
+    explicit GCUSBPortFlags (uint8_t status = 0) : _status(status) {}
+
+    uint8_t raw (void) const {
+        return _status;
+    }
+
+    /** any status at all means a controller is present */
+    bool connected (void) const {
+        return 0 != _status;
+    }
+
+    /** controller type (GCUSBStatusWired, GCUSBStatusWireless or 0 if unknown) */
+    uint8_t type (void) const {
+        return _status & GCUSBStatusTypeMask;
+    }
+
+    bool wireless (void) const {
+        return 0 != (_status & GCUSBStatusWireless);
+    }
+
+    /** the adapter supplies power for the rumble motors */
+    bool rumblePower (void) const {
+        return 0 != (_status & GCUSBStatusRumblePower);
+    }
+
+    /** the controller has a motor and the motor has power */
+    bool rumble (void) const {
+        return (GCUSBStatusWired | GCUSBStatusRumblePower) == (_status & (GCUSBStatusTypeMask | GCUSBStatusRumblePower));
+    }
+
+private:
+    uint8_t _status;
+};
+
+/**
+ * @brief Decoder for the combined 0x21 input report
+ *
+ * The decoder works on a single view of the 37 byte report. Each 9 byte port slice is
+ * rewritten in place into a 0x50 port report (report id, 2 button bytes, 4 stick bytes,
+ * 2 trigger bytes) so the caller can hand the slices to the ports without copying them.
+ * The status byte of each slice is saved before it is overwritten.
+ *
+ * Analog sticks are corrected against an origin captured per port when a controller is
+ * connected or when a recenter is requested. The origins are kept in a table laid out
+ * like the 36 byte payload (zero for every non-stick byte) so the correction is a single
+ * branch-free subtract over the whole payload that the compiler can vectorize.
+ */
+class GCUSBReportDecoder {
+public:
+    GCUSBReportDecoder () : _rumble(0) {
+        memset (_status, 0, sizeof (_status));
+        memset (_recenter, 0, sizeof (_recenter));
+        memset (_origin, 0, sizeof (_origin));
+    }
+
+    /** offset of a port slice within the combined report */
+    static size_t portOffset (int port) {
+        return 1 + port * GCUSBPortReportLength;
+    }
+
+    /** pointer to a port slice within the combined report */
+    static uint8_t *portReport (uint8_t *report, int port) {
+        return report + portOffset (port);
+    }
+
+    /** status byte seen for a port in the last decoded report (0 if no controller) */
+    uint8_t status (int port) const {
+        return _status[port];
+    }
+
+    GCUSBPortFlags flags (int port) const {
+        return GCUSBPortFlags (_status[port]);
+    }
+
+    /** mask of the ports that could rumble in the last decoded report (see GCUSBPortFlags::rumble) */
+    unsigned int rumble (void) const {
+        return _rumble;
+    }
+
+    /** capture a new stick origin for a port from the next report */
+    void recenter (int port) {
+        _recenter[port] = 1;
+    }
+
+    /** stick origin for a port (main X, main Y, C X, C Y) */
+    const uint8_t *origin (int port) const {
+        return _origin + originOffset (port);
+    }
+
+    /**
+     * @brief Decode a combined report in place
+     *
+     * @param[in,out] report  report buffer
+     * @param[in]     length  length of the report buffer
+     *
+     * @returns false if the buffer does not hold a 0x21 report. The buffer is not
+     * modified in that case.
+     */
+    bool decode (uint8_t *report, size_t length) {
+        if (GCUSBInputReportLength != length || GCUSBInputReportID != report[0]) {
+            return false;
+        }
+
+        _rumble = 0;
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            uint8_t *port_report = portReport (report, i);
+            uint8_t status = port_report[0];
+
+            if (status && (!_status[i] || _recenter[i])) {
+                captureOrigin (i, port_report);
+            }
+
+            _status[i] = status;
+            _rumble |= (unsigned int) GCUSBPortFlags (status).rumble () << i;
+        }
+
+        /* correct all four ports at once. slices of empty ports are corrected as well
+         * but never delivered */
+        uint8_t *payload = report + 1;
+        for (int i = 0 ; i < GCUSBPayloadLength ; ++i) {
+            payload[i] = (uint8_t)(payload[i] - _origin[i]);
+        }
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            if (_status[i]) {
+                portReport (report, i)[0] = GCUSBPortReportID;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    /** offset of a port's stick origin in the origin table */
+    static size_t originOffset (int port) {
+        return portOffset (port) - 1 + GCUSBPortStickOffset;
+    }
+
+    void captureOrigin (int port, const uint8_t *port_report) {
+        const uint8_t *sticks = port_report + GCUSBPortStickOffset;
+
+        /* a WaveBird reports a status before the pad is powered up. the sticks read
+         * zero until then */
+        for (int i = 0 ; i < GCUSBPortStickCount ; ++i) {
+            if (0 == sticks[i]) {
+                _recenter[port] = 1;
+                return;
+            }
+        }
+
+        memcpy (_origin + originOffset (port), sticks, GCUSBPortStickCount);
+        _recenter[port] = 0;
+    }
+
+    uint8_t _status[GCUSBPortCount];
+    unsigned int _rumble;
+    uint8_t _recenter[GCUSBPortCount];
+    /** stick origins laid out like the payload of the 0x21 report */
+    uint8_t _origin[GCUSBPayloadLength] __attribute__((aligned(16)));
+};
+
+/**
+ * @brief Filter that suppresses port reports identical to the last delivered one
+ *
+ * A shadow of the last delivered state of every port is kept in the same layout as the
+ * decoded payload so the common case (nothing changed on any port) is a single 36 byte
+ * compare. An optional keep-alive interval forces delivery of an unchanged state.
+ */
+class GCUSBChangeFilter {
+public:
+    GCUSBChangeFilter () : _keep_alive(0), _delivered(0), _suppressed(0) {
+        memset (_shadow, 0, sizeof (_shadow));
+        memset (_valid, 0, sizeof (_valid));
+        memset (_last_delivery, 0, sizeof (_last_delivery));
+    }
+
+    /** set the keep-alive interval in ns (0 disables keep-alive) */
+    void setKeepAlive (uint64_t interval) {
+        _keep_alive = interval;
+    }
+
+    uint64_t keepAlive (void) const {
+        return _keep_alive;
+    }
+
+    /** forget the shadow of a port. the next report for the port will be delivered */
+    void reset (int port) {
+        _valid[port] = 0;
+    }
+
+    /**
+     * @brief Determine which ports have a report that needs to be delivered
+     *
+     * @param[in] report     decoded 0x21 report
+     * @param[in] connected  mask of ports with a controller attached
+     * @param[in] now        time of the report in ns
+     *
+     * @returns mask of ports to deliver. suppressed ports are counted.
+     */
+    unsigned int filter (const uint8_t *report, unsigned int connected, uint64_t now) {
+        const uint8_t *payload = report + 1;
+        unsigned int deliver = 0;
+
+        /* track the contents of empty slices so they do not defeat the full compare */
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            if (!(connected & (1u << i))) {
+                size_t offset = GCUSBReportDecoder::portOffset (i) - 1;
+                memcpy (_shadow + offset, payload + offset, GCUSBPortReportLength);
+                _valid[i] = 0;
+            }
+        }
+
+        if (0 == memcmp (payload, _shadow, GCUSBPayloadLength) && !_keep_alive) {
+            /* nothing changed. only ports that have never been delivered need to go out */
+            for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+                if (!_valid[i]) {
+                    deliver |= 1u << i;
+                }
+            }
+        } else {
+            for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+                size_t offset = GCUSBReportDecoder::portOffset (i) - 1;
+
+                if (!_valid[i] || memcmp (payload + offset, _shadow + offset, GCUSBPortReportLength) ||
+                    (_keep_alive && now - _last_delivery[i] >= _keep_alive)) {
+                    deliver |= 1u << i;
+                }
+            }
+        }
+
+        deliver &= connected;
+        _suppressed += popcount (connected & ~deliver);
+
+        return deliver;
+    }
+
+    /** record a successful delivery of a port report */
+    void delivered (int port, const uint8_t *report, uint64_t now) {
+        deliveredPort (port, report + GCUSBReportDecoder::portOffset (port), now);
+    }
+
+    /** record a successful delivery of a port report held outside the 0x21 report */
+    void deliveredPort (int port, const uint8_t *port_report, uint64_t now) {
+        memcpy (_shadow + GCUSBReportDecoder::portOffset (port) - 1, port_report, GCUSBPortReportLength);
+        _last_delivery[port] = now;
+        _valid[port] = 1;
+        ++_delivered;
+    }
+
+    uint64_t deliveredCount (void) const {
+        return _delivered;
+    }
+
+    uint64_t suppressedCount (void) const {
+        return _suppressed;
+    }
+
+private:
+    static unsigned int popcount (unsigned int mask) {
+        return __builtin_popcount (mask);
+    }
+
+    uint8_t _shadow[GCUSBPayloadLength] __attribute__((aligned(16)));
+    uint8_t _valid[GCUSBPortCount];
+    uint64_t _last_delivery[GCUSBPortCount];
+    uint64_t _keep_alive;
+    uint64_t _delivered, _suppressed;
+};
+
+enum {
+    /** number of port reports a mailbox holds while its port does not accept reports */
+    GCUSBMailboxDepth = 8,
+    /** number of button bytes at the start of a port report (after the report id) */
+    GCUSBPortButtonCount = 2,
+};
+
+/**
+ * @brief Per-port backlog of reports a port failed to accept
+ *
+ * Reports only enter a mailbox while its port has undelivered reports. A new report
+ * replaces the newest queued one (and its timestamp) if both have the same buttons, so
+ * stale stick and trigger states collapse into the latest one while every button edge
+ * keeps its own entry and the time it arrived.
+ *
+ * Once the mailbox is full a report with new buttons is merged into the newest entry.
+ * The buttons that the replaced state pressed or released relative to the entry before
+ * it are remembered, and on delivery the merged entry is preceded by a copy of the last
+ * replaced report whose buttons show those presses and releases. Every button that
+ * changes while the mailbox is full therefore changes for the client too. Only a button
+ * that changes back and forth within one merged entry loses a press and release pair;
+ * those are counted as dropped. The mailbox does no locking; the caller serializes all
+ * calls.
+ */
+class GCUSBPortMailbox {
+public:
+    GCUSBPortMailbox () : _queued(0), _coalesced(0), _merged(0), _dropped(0) {
+        memset (_reports, 0, sizeof (_reports));
+        memset (_timestamps, 0, sizeof (_timestamps));
+        memset (_edges, 0, sizeof (_edges));
+        memset (_edge_timestamps, 0, sizeof (_edge_timestamps));
+        memset (_pressed, 0, sizeof (_pressed));
+        memset (_released, 0, sizeof (_released));
+        memset (_head, 0, sizeof (_head));
+        memset (_count, 0, sizeof (_count));
+    }
+
+    bool empty (int port) const {
+        return 0 == _count[port];
+    }
+
+    unsigned int count (int port) const {
+        return _count[port];
+    }
+
+    /** oldest queued port report */
+    const uint8_t *front (int port) const {
+        return _reports[port][_head[port]];
+    }
+
+    /** time (ns) the oldest port report arrived */
+    uint64_t frontTimestamp (int port) const {
+        return _timestamps[port][_head[port]];
+    }
+
+    /** remove the oldest port report after it was delivered */
+    void pop (int port) {
+        _pressed[port][_head[port]] = _released[port][_head[port]] = 0;
+        _head[port] = (_head[port] + 1) % GCUSBMailboxDepth;
+        --_count[port];
+    }
+
+    /** queue a port report (GCUSBPortReportLength bytes starting with the report id) */
+    void push (int port, const uint8_t *port_report, uint64_t timestamp) {
+        unsigned int tail;
+
+        if (_count[port]) {
+            tail = (_head[port] + _count[port] - 1) % GCUSBMailboxDepth;
+            if (0 == memcmp (_reports[port][tail] + 1, port_report + 1, GCUSBPortButtonCount)) {
+                memcpy (_reports[port][tail], port_report, GCUSBPortReportLength);
+                _timestamps[port][tail] = timestamp;
+                ++_coalesced;
+                return;
+            }
+
+            if (GCUSBMailboxDepth == _count[port]) {
+                merge (port, tail);
+                memcpy (_reports[port][tail], port_report, GCUSBPortReportLength);
+                _timestamps[port][tail] = timestamp;
+                ++_merged;
+                return;
+            }
+        }
+
+        tail = (_head[port] + _count[port]) % GCUSBMailboxDepth;
+        memcpy (_reports[port][tail], port_report, GCUSBPortReportLength);
+        _timestamps[port][tail] = timestamp;
+        _pressed[port][tail] = _released[port][tail] = 0;
+        ++_count[port];
+        ++_queued;
+    }
+
+    /**
+     * @brief Deliver the current report of a port
+     *
+     * With an empty mailbox a changed report is sent directly and only queued if the
+     * port does not accept it. Otherwise the report is queued behind the backlog and the
+     * backlog is sent oldest first until the port stops accepting reports.
+     *
+     * @param[in] port_report  current port report
+     * @param[in] changed      the report differs from the last one delivered
+     * @param[in] timestamp    time (ns) the report arrived
+     * @param[in] sink         object with bool sendPortReport (int port, const uint8_t *report,
+     *                         bool queued, uint64_t timestamp). queued is false when report
+     *                         is port_report. timestamp is the arrival time of report.
+     *
+     * @returns false if the port still has undelivered reports
+     */
+    template <class Sink> bool deliver (int port, const uint8_t *port_report, bool changed, uint64_t timestamp, Sink &sink) {
+        if (empty (port)) {
+            if (!changed || sink.sendPortReport (port, port_report, false, timestamp)) {
+                return true;
+            }
+
+            push (port, port_report, timestamp);
+            return false;
+        }
+
+        /* even an unchanged report may differ from the newest queued one */
+        push (port, port_report, timestamp);
+
+        while (!empty (port)) {
+            unsigned int head = _head[port];
+            const uint8_t *edge = mergedEdges (port, head);
+
+            if (edge && !sink.sendPortReport (port, edge, true, _edge_timestamps[port][head])) {
+                return false;
+            }
+            _pressed[port][head] = _released[port][head] = 0;
+
+            if (!sink.sendPortReport (port, front (port), true, frontTimestamp (port))) {
+                return false;
+            }
+            pop (port);
+        }
+
+        return true;
+    }
+
+    /** discard everything queued for a port (e.g. the controller was removed) */
+    void reset (int port) {
+        memset (_pressed[port], 0, sizeof (_pressed[port]));
+        memset (_released[port], 0, sizeof (_released[port]));
+        _head[port] = _count[port] = 0;
+    }
+
+    /** reports that got their own entry */
+    uint64_t queuedCount (void) const {
+        return _queued;
+    }
+
+    /** reports merged into a queued report with the same buttons */
+    uint64_t coalescedCount (void) const {
+        return _coalesced;
+    }
+
+    /** reports with new buttons merged into the newest entry of a full mailbox */
+    uint64_t mergedCount (void) const {
+        return _merged;
+    }
+
+    /** buttons that changed back and forth within a merged entry (each lost a press and a release) */
+    uint64_t droppedCount (void) const {
+        return _dropped;
+    }
+
+private:
+    static uint16_t buttons (const uint8_t *port_report) {
+        return port_report[1] | (port_report[2] << 8);
+    }
+
+    /* the newest entry of a full mailbox is about to be replaced. remember how its buttons
+     * differ from the entry before it and keep it as the edge report of the entry */
+    void merge (int port, unsigned int tail) {
+        unsigned int previous = (tail + GCUSBMailboxDepth - 1) % GCUSBMailboxDepth;
+        uint16_t before = buttons (_reports[port][previous]), lost = buttons (_reports[port][tail]);
+        uint16_t changed = _pressed[port][tail] | _released[port][tail];
+
+        /* a button that already changed and is back where it started */
+        _dropped += __builtin_popcount (changed & ~(lost ^ before));
+
+        _pressed[port][tail] |= lost & ~before;
+        _released[port][tail] |= before & ~lost;
+        memcpy (_edges[port][tail], _reports[port][tail], GCUSBPortReportLength);
+        _edge_timestamps[port][tail] = _timestamps[port][tail];
+    }
+
+    /* edge report sent ahead of a merged entry: the buttons of the entry with everything
+     * the merged states pressed held and everything they released let go. NULL if that
+     * adds nothing to the entry itself */
+    const uint8_t *mergedEdges (int port, unsigned int slot) {
+        uint8_t *edge = _edges[port][slot];
+        uint16_t current = buttons (_reports[port][slot]);
+        uint16_t state = (current | _pressed[port][slot]) & ~_released[port][slot];
+
+        if (state == current) {
+            return NULL;
+        }
+
+        edge[1] = (uint8_t) state;
+        edge[2] = (uint8_t) (state >> 8);
+
+        return edge;
+    }
+
+    uint8_t _reports[GCUSBPortCount][GCUSBMailboxDepth][GCUSBPortReportLength];
+    uint64_t _timestamps[GCUSBPortCount][GCUSBMailboxDepth];
+    /* last report merged away in each entry and the buttons the merged states changed */
+    uint8_t _edges[GCUSBPortCount][GCUSBMailboxDepth][GCUSBPortReportLength];
+    uint64_t _edge_timestamps[GCUSBPortCount][GCUSBMailboxDepth];
+    uint16_t _pressed[GCUSBPortCount][GCUSBMailboxDepth], _released[GCUSBPortCount][GCUSBMailboxDepth];
+    uint8_t _head[GCUSBPortCount], _count[GCUSBPortCount];
+    uint64_t _queued, _coalesced, _merged, _dropped;
+};
+
+/**
+ * @brief Coalescing scheduler for the 0x11 rumble report
+ *
+ * Rumble requests from all four ports only update the pending state and mark it dirty.
+ * The owner flushes the merged state as a single report at most once per interval. A
+ * flush is skipped entirely if the merged state matches the last flushed report.
+ *
+ * set() may be called from any thread. flush(), transmitted() and failed() must be
+ * serialized by the caller.
+ */
+class GCUSBRumbleScheduler {
+public:
+    GCUSBRumbleScheduler () : _dirty(0), _flushed_valid(0), _requested(0), _transmitted(0) {
+        memset (_pending, 0, sizeof (_pending));
+        memset (_flushed, 0, sizeof (_flushed));
+    }
+
+    /**
+     * @brief Request a new rumble state for a port
+     *
+     * @returns true if the state was clean before this request (a flush should be scheduled)
+     */
+    bool set (int port, uint8_t value) {
+        __atomic_store_n (_pending + port, value, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&_requested, 1, __ATOMIC_RELAXED);
+        return 0 == __atomic_exchange_n (&_dirty, 1, __ATOMIC_ACQ_REL);
+    }
+
+    /** rumble state requested for a port */
+    uint8_t pending (int port) const {
+        return __atomic_load_n (_pending + port, __ATOMIC_RELAXED);
+    }
+
+    bool dirty (void) const {
+        return __atomic_load_n (&_dirty, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief Build the merged rumble report
+     *
+     * @param[out] report  rumble report to transmit
+     *
+     * @returns false if there is nothing new to transmit
+     */
+    bool flush (uint8_t report[GCUSBRumbleReportLength]) {
+        if (!__atomic_exchange_n (&_dirty, 0, __ATOMIC_ACQ_REL)) {
+            return false;
+        }
+
+        report[0] = GCUSBRumbleReportID;
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            report[i + 1] = pending (i);
+        }
+
+        if (_flushed_valid && 0 == memcmp (report + 1, _flushed, GCUSBPortCount)) {
+            return false;
+        }
+
+        memcpy (_flushed, report + 1, GCUSBPortCount);
+        _flushed_valid = 1;
+
+        return true;
+    }
+
+    /** a report built by flush() was transmitted */
+    void transmitted (void) {
+        ++_transmitted;
+    }
+
+    /** a report built by flush() could not be transmitted. try again on the next flush */
+    void failed (void) {
+        _flushed_valid = 0;
+        __atomic_store_n (&_dirty, 1, __ATOMIC_RELEASE);
+    }
+
+    uint64_t requestedCount (void) const {
+        return __atomic_load_n (&_requested, __ATOMIC_RELAXED);
+    }
+
+    uint64_t transmittedCount (void) const {
+        return _transmitted;
+    }
+
+private:
+    uint8_t _pending[GCUSBPortCount];
+    uint8_t _flushed[GCUSBPortCount];
+    uint8_t _dirty, _flushed_valid;
+    uint64_t _requested, _transmitted;
+};
+
+/**
+ * @brief Bounded queue of rumble reports waiting for an asynchronous transfer
+ *
+ * At most depth reports are in flight at a time. Any further report waits in a single
+ * slot where it is replaced by newer reports (the rumble report always carries the full
+ * state of all ports so an older report is never worth sending once a newer one exists).
+ *
+ * The queue does no locking. The caller must serialize all calls.
+ */
+class GCUSBRumbleQueue {
+public:
+    GCUSBRumbleQueue (unsigned int depth = 1) : _depth(depth ? depth : 1), _in_flight(0), _queued(0),
+                                                _submitted(0), _replaced(0), _completed(0) {
+        memset (_report, 0, sizeof (_report));
+    }
+
+    /**
+     * @brief Queue a report for transfer
+     *
+     * @returns true if the caller has to start the transfer engine
+     */
+    bool submit (const uint8_t report[GCUSBRumbleReportLength]) {
+        if (_queued) {
+            ++_replaced;
+        }
+
+        memcpy (_report, report, GCUSBRumbleReportLength);
+        _queued = 1;
+        ++_submitted;
+
+        return 0 == _in_flight;
+    }
+
+    /**
+     * @brief Take the next report to transfer
+     *
+     * @returns false if there is no report queued or the in-flight limit has been reached
+     */
+    bool next (uint8_t report[GCUSBRumbleReportLength]) {
+        if (!_queued || _in_flight >= _depth) {
+            return false;
+        }
+
+        memcpy (report, _report, GCUSBRumbleReportLength);
+        _queued = 0;
+        ++_in_flight;
+
+        return true;
+    }
+
+    /** a transfer started with next() finished */
+    void complete (void) {
+        --_in_flight;
+        ++_completed;
+    }
+
+    unsigned int inFlight (void) const {
+        return _in_flight;
+    }
+
+    uint64_t submittedCount (void) const {
+        return _submitted;
+    }
+
+    uint64_t replacedCount (void) const {
+        return _replaced;
+    }
+
+    uint64_t completedCount (void) const {
+        return _completed;
+    }
+
+private:
+    uint8_t _report[GCUSBRumbleReportLength];
+    unsigned int _depth, _in_flight;
+    uint8_t _queued;
+    uint64_t _submitted, _replaced, _completed;
+};
+
+/** tell the CPU it is spinning on a value another CPU is about to change */
+static inline void GCUSBCpuRelax (void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__ ("yield" ::: "memory");
+#endif
+}
+
+/**
+ * @brief Reader gate for a double buffered set of lookup tables
+ *
+ * One gate guards the two table sets of one port. Readers enter the active set and the
+ * writer only ever waits for the readers of the inactive set, so a steady stream of
+ * reports keeps the active set busy without delaying a configuration change. A reader
+ * that raced with publish() and counted itself on the set that just became inactive
+ * backs out and enters the new active set. The writer side (acquire() and publish())
+ * must be serialized by the caller.
+ */
+class GCUSBTableGate {
+public:
+    GCUSBTableGate () : _active(0) {
+        _readers[0] = _readers[1] = 0;
+    }
+
+    /** set readers currently enter */
+    unsigned int active (void) const {
+        return __atomic_load_n (&_active, __ATOMIC_SEQ_CST);
+    }
+
+    /**
+     * @brief Wait until no reader uses the inactive set
+     *
+     * Readers only stay in a set for a few table loads so the wait is short.
+     *
+     * @returns the set that may now be rebuilt
+     */
+    unsigned int acquire (void) const {
+        unsigned int next = !_active;
+
+        /* the sequentially consistent load pairs with the increment and recheck in enter() */
+        while (__atomic_load_n (_readers + next, __ATOMIC_SEQ_CST)) {
+            GCUSBCpuRelax ();
+        }
+
+        return next;
+    }
+
+    /** make a set rebuilt after acquire() the one readers enter */
+    void publish (unsigned int set) {
+        __atomic_store_n (&_active, (uint8_t) set, __ATOMIC_SEQ_CST);
+    }
+
+    /** @returns the set the reader may use until it calls leave() */
+    unsigned int enter (void) const {
+        for (;;) {
+            unsigned int set = __atomic_load_n (&_active, __ATOMIC_SEQ_CST);
+
+            __atomic_add_fetch (_readers + set, 1, __ATOMIC_SEQ_CST);
+            if (set == __atomic_load_n (&_active, __ATOMIC_SEQ_CST)) {
+                return set;
+            }
+
+            __atomic_sub_fetch (_readers + set, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    void leave (unsigned int set) const {
+        __atomic_sub_fetch (_readers + set, 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    mutable uint32_t _readers[2];
+    uint8_t _active;
+};
+
+#endif
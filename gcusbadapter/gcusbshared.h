@@ -0,0 +1,274 @@
+/* -*- Mode: C; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBSHARED_H)
+#define GCUSBSHARED_H
+
+/* Layouts of memory shared between the kext and user space. This header is included by
+ * the kext (C++), the rumble plug-in (C) and host-side tools so it must be valid C and
+ * C++ and must not depend on IOKit. */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/** user client type for GCUSBAdapterPort that maps the rumble ring ('GCRR') */
+#define GCUSBRumbleRingClientType 0x47435252
+/** identifies an initialized rumble ring ('GCRB') */
+#define GCUSBRumbleRingMagic      0x47435242
+/** number of commands in a rumble ring (power of two) */
+#define GCUSBRumbleRingSize       64
+
+#define GCUSBCacheLine            64
+
+/** user client type for GCUSBAdapter that maps the controller state region ('GCST') */
+#define GCUSBStateClientType      0x47435354
+/** identifies an initialized state region ('GCSR') */
+#define GCUSBStateMagic           0x47435352
+#define GCUSBStateVersion         1
+/** number of controller ports in a state region */
+#define GCUSBStatePorts           4
+
+/** controller type bits of the per-port status byte */
+#define GCUSBStatusTypeMask       0x30
+/** wired controller */
+#define GCUSBStatusWired          0x10
+/** WaveBird (wireless, no rumble motor) */
+#define GCUSBStatusWireless       0x20
+/** the adapter's second USB cable supplies power for the rumble motors */
+#define GCUSBStatusRumblePower    0x04
+
+/**
+ * @brief Single-producer/single-consumer ring of rumble commands
+ *
+ * The rumble plug-in is the only producer and the kext the only consumer. The head is
+ * only written by the producer and the tail only by the consumer, each on its own cache
+ * line. The indices run freely and are reduced modulo the size on access. A command is
+ * published by the release store of the head and its slot is handed back by the release
+ * store of the tail, so neither side ever takes a lock or makes a system call.
+ */
+typedef struct GCUSBRumbleRing {
+    /** GCUSBRumbleRingMagic and GCUSBRumbleRingSize once the kext set up the ring */
+    uint32_t magic;
+    uint32_t size;
+
+    /** next slot written by the producer */
+    uint32_t head __attribute__ ((aligned (GCUSBCacheLine)));
+    /** number of commands the producer could not queue */
+    uint32_t dropped;
+
+    /** next slot read by the consumer */
+    uint32_t tail __attribute__ ((aligned (GCUSBCacheLine)));
+    /** status byte of the controller in the port (written by the consumer when it changes) */
+    uint32_t status;
+
+    /** rumble values (same as the data byte of output report 0x60) */
+    uint8_t commands[GCUSBRumbleRingSize] __attribute__ ((aligned (GCUSBCacheLine)));
+} GCUSBRumbleRing;
+
+static inline void GCUSBRumbleRingInit (GCUSBRumbleRing *ring) {
+    ring->head = ring->tail = ring->dropped = ring->status = 0;
+    ring->size = GCUSBRumbleRingSize;
+    __atomic_store_n (&ring->magic, GCUSBRumbleRingMagic, __ATOMIC_RELEASE);
+}
+
+static inline bool GCUSBRumbleRingValid (const GCUSBRumbleRing *ring) {
+    return GCUSBRumbleRingMagic == __atomic_load_n (&ring->magic, __ATOMIC_ACQUIRE) &&
+        GCUSBRumbleRingSize == ring->size;
+}
+
+/** queue a command (producer). returns false if the ring is full */
+static inline bool GCUSBRumbleRingPush (GCUSBRumbleRing *ring, uint8_t value) {
+    uint32_t head = ring->head;
+
+    if (head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) >= GCUSBRumbleRingSize) {
+        ++ring->dropped;
+        return false;
+    }
+
+    ring->commands[head % GCUSBRumbleRingSize] = value;
+    __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/** take the oldest command (consumer). returns false if the ring is empty */
+static inline bool GCUSBRumbleRingPop (GCUSBRumbleRing *ring, uint8_t *value) {
+    uint32_t tail = ring->tail;
+
+    if (tail == __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    *value = ring->commands[tail % GCUSBRumbleRingSize];
+    __atomic_store_n (&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/**
+ * @brief Number of commands waiting (consumer)
+ *
+ * Both indices live in memory the producer can write. A result larger than
+ * GCUSBRumbleRingSize can only come from a corrupted ring and must not be used
+ * to bound a loop.
+ */
+static inline uint32_t GCUSBRumbleRingQueued (const GCUSBRumbleRing *ring) {
+    return __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+}
+
+/** the ring has commands waiting (either side) */
+static inline bool GCUSBRumbleRingPending (const GCUSBRumbleRing *ring) {
+    return __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) != __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/** publish the status byte of the port (consumer) */
+static inline void GCUSBRumbleRingSetStatus (GCUSBRumbleRing *ring, uint8_t status) {
+    if (status != __atomic_load_n (&ring->status, __ATOMIC_RELAXED)) {
+        __atomic_store_n (&ring->status, status, __ATOMIC_RELAXED);
+    }
+}
+
+/** status byte of the controller in the port (either side, 0 if no controller) */
+static inline uint8_t GCUSBRumbleRingStatus (const GCUSBRumbleRing *ring) {
+    return (uint8_t) __atomic_load_n (&ring->status, __ATOMIC_RELAXED);
+}
+
+/** the port has a wired controller whose motor has power (either side) */
+static inline bool GCUSBRumbleRingPowered (const GCUSBRumbleRing *ring) {
+    uint8_t status = GCUSBRumbleRingStatus (ring);
+
+    return (GCUSBStatusWired | GCUSBStatusRumblePower) == (status & (GCUSBStatusTypeMask | GCUSBStatusRumblePower));
+}
+
+/**
+ * @brief Drop all queued commands (consumer)
+ *
+ * Used when a new producer takes over the ring.
+ */
+static inline void GCUSBRumbleRingDiscard (GCUSBRumbleRing *ring) {
+    __atomic_store_n (&ring->tail, __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Latest state of one controller port, protected by a sequence lock
+ *
+ * The kext is the only writer. The sequence is odd while the state is being written.
+ * A reader copies the state between two loads of the sequence and retries if the
+ * sequence changed or was odd. The payload is stored as 64-bit words with relaxed
+ * atomic accesses so a torn read is detected instead of being undefined.
+ */
+typedef struct GCUSBPortState {
+    uint32_t sequence;
+    uint32_t reserved;
+    /** time (ns) the adapter delivered the report */
+    uint64_t timestamp;
+    /** number of reports written for this port */
+    uint64_t count;
+    /** status byte followed by the 8 decoded and calibrated bytes of the port report */
+    uint64_t data[2];
+} __attribute__ ((aligned (GCUSBCacheLine))) GCUSBPortState;
+
+/** consistent copy of a GCUSBPortState */
+typedef struct GCUSBPortSnapshot {
+    uint64_t timestamp;
+    uint64_t count;
+    /** report[0] is the status byte (0 if no controller is connected) */
+    uint8_t report[16];
+} GCUSBPortSnapshot;
+
+/** region mapped through GCUSBStateClientType (read-only for clients) */
+typedef struct GCUSBStateRegion {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ports;
+    uint32_t reserved;
+    GCUSBPortState port[GCUSBStatePorts];
+} GCUSBStateRegion;
+
+static inline void GCUSBStateRegionInit (GCUSBStateRegion *region) {
+    memset (region->port, 0, sizeof (region->port));
+    region->version = GCUSBStateVersion;
+    region->ports = GCUSBStatePorts;
+    region->reserved = 0;
+    __atomic_store_n (&region->magic, GCUSBStateMagic, __ATOMIC_RELEASE);
+}
+
+static inline bool GCUSBStateRegionValid (const GCUSBStateRegion *region) {
+    return GCUSBStateMagic == __atomic_load_n (&region->magic, __ATOMIC_ACQUIRE) &&
+        GCUSBStateVersion == region->version && GCUSBStatePorts == region->ports;
+}
+
+/**
+ * @brief Publish a new port state (writer)
+ *
+ * @param[in] report  status byte followed by 8 bytes of port report
+ */
+static inline void GCUSBPortStateWrite (GCUSBPortState *state, uint64_t timestamp, const uint8_t *report) {
+    uint32_t sequence = state->sequence;
+    uint64_t data[2] = {0, 0};
+
+    memcpy (data, report, 9);
+
+    __atomic_store_n (&state->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+
+    __atomic_store_n (&state->timestamp, timestamp, __ATOMIC_RELAXED);
+    __atomic_store_n (&state->count, state->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n (state->data, data[0], __ATOMIC_RELAXED);
+    __atomic_store_n (state->data + 1, data[1], __ATOMIC_RELAXED);
+
+    __atomic_store_n (&state->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Take a consistent snapshot of a port state (reader)
+ *
+ * @param[in] tries  number of attempts before giving up
+ *
+ * @returns false if no consistent snapshot could be taken
+ */
+static inline bool GCUSBPortStateRead (const GCUSBPortState *state, GCUSBPortSnapshot *snapshot, unsigned int tries) {
+    uint64_t data[2];
+    uint32_t begin, end;
+
+    while (tries--) {
+        begin = __atomic_load_n (&state->sequence, __ATOMIC_ACQUIRE);
+        if (begin & 1) {
+            continue;
+        }
+
+        snapshot->timestamp = __atomic_load_n (&state->timestamp, __ATOMIC_RELAXED);
+        snapshot->count = __atomic_load_n (&state->count, __ATOMIC_RELAXED);
+        data[0] = __atomic_load_n (state->data, __ATOMIC_RELAXED);
+        data[1] = __atomic_load_n (state->data + 1, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        end = __atomic_load_n (&state->sequence, __ATOMIC_RELAXED);
+
+        if (begin == end) {
+            memcpy (snapshot->report, data, sizeof (snapshot->report));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#endif
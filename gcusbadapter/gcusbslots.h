@@ -0,0 +1,242 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBSLOTS_H)
+#define GCUSBSLOTS_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stdint.h>
+
+#include "gcusbreport.h"
+
+enum {
+    /** number of player slots shared by all adapters */
+    GCUSBPlayerSlotCount = 16,
+    /** size of the (adapter location, port) -> slot hash. must be a power of two */
+    GCUSBPlayerSlotHash  = 32,
+};
+
+/**
+ * @brief Location ID of the virtual gamepad on an adapter port
+ *
+ * A USB location ID holds the bus in the top byte and one nibble per hub port below it.
+ * The adapter ports are treated like the ports of a hub behind the adapter so every pad
+ * gets a location that no other USB device can have. If the adapter is already at the
+ * deepest level the port is placed in the lowest nibble.
+ */
+static inline uint32_t GCUSBPortLocation (uint32_t location, int port) {
+    int shift = 20;
+
+    while (shift > 0 && (location & (0xfu << shift))) {
+        shift -= 4;
+    }
+
+    return (location & ~(0xfu << shift)) | ((uint32_t) (port + 1) << shift);
+}
+
+/**
+ * @brief Stable player slot assignment across adapters
+ *
+ * A controller is identified by the location of its adapter and the adapter port. The
+ * first time a controller is seen it gets the lowest free slot. When it disconnects the
+ * slot stays reserved for it so the same controller (or a replugged adapter in the same
+ * USB port) gets its old slot back. Reserved slots are only handed to a new controller
+ * once all slots are taken, least recently released first.
+ *
+ * Lookups go through a small open-addressed hash so they take constant time no matter
+ * how many adapters are attached. The table never allocates and does no locking;
+ * callers must serialize access.
+ */
+class GCUSBSlotTable {
+public:
+    GCUSBSlotTable () : _sequence(0) {
+        for (int i = 0 ; i < GCUSBPlayerSlotCount ; ++i) {
+            _slots[i].key = 0;
+            _slots[i].state = SlotFree;
+            _slots[i].released = 0;
+        }
+
+        for (int i = 0 ; i < GCUSBPlayerSlotHash ; ++i) {
+            _hash[i] = -1;
+        }
+    }
+
+    /**
+     * @brief Assign a player slot to a connected controller
+     *
+     * @returns the slot (0 based) or -1 if all slots are in use
+     */
+    int acquire (uint32_t location, int port) {
+        uint64_t key = makeKey (location, port);
+        int slot = lookup (key);
+
+        if (slot < 0) {
+            slot = freeSlot ();
+            if (slot < 0) {
+                return -1;
+            }
+
+            if (SlotFree != _slots[slot].state) {
+                /* evict the reservation of a controller that has not been back for longest */
+                remove (_slots[slot].key);
+            }
+
+            _slots[slot].key = key;
+            insert (key, slot);
+        }
+
+        _slots[slot].state = SlotActive;
+
+        return slot;
+    }
+
+    /** release the slot of a disconnected controller. the slot stays reserved for it */
+    void release (uint32_t location, int port) {
+        int slot = lookup (makeKey (location, port));
+
+        if (slot >= 0 && SlotActive == _slots[slot].state) {
+            _slots[slot].state = SlotReserved;
+            _slots[slot].released = ++_sequence;
+        }
+    }
+
+    /** slot of a connected controller or -1 */
+    int slot (uint32_t location, int port) const {
+        int slot = lookup (makeKey (location, port));
+        return (slot >= 0 && SlotActive == _slots[slot].state) ? slot : -1;
+    }
+
+    /** a connected controller holds the slot */
+    bool active (int slot) const {
+        return slot >= 0 && slot < GCUSBPlayerSlotCount && SlotActive == _slots[slot].state;
+    }
+
+    /** adapter location and port of the controller in a slot. returns false if the slot is not active */
+    bool owner (int slot, uint32_t *location, int *port) const {
+        if (!active (slot)) {
+            return false;
+        }
+
+        *location = (uint32_t) (_slots[slot].key >> 8);
+        *port = (int) (_slots[slot].key & 0xff) - 1;
+
+        return true;
+    }
+
+    /** hash bucket the lookup of a controller starts at. lets tests build colliding keys */
+    static unsigned int bucket (uint32_t location, int port) {
+        return hash (makeKey (location, port));
+    }
+
+private:
+    enum State {
+        SlotFree = 0,
+        SlotReserved,
+        SlotActive,
+    };
+
+    struct Slot {
+        uint64_t key;
+        uint8_t state;
+        uint64_t released;
+    };
+
+    /* keys are never 0 so 0 can mark an unused slot */
+    static uint64_t makeKey (uint32_t location, int port) {
+        return ((uint64_t) location << 8) | (uint64_t) (port + 1);
+    }
+
+    static unsigned int hash (uint64_t key) {
+        key *= 0x9e3779b97f4a7c15ULL;
+        return (unsigned int) (key >> 32) & (GCUSBPlayerSlotHash - 1);
+    }
+
+    int lookup (uint64_t key) const {
+        for (unsigned int i = hash (key) ; ; i = (i + 1) & (GCUSBPlayerSlotHash - 1)) {
+            int slot = _hash[i];
+            if (slot < 0) {
+                return -1;
+            }
+            if (_slots[slot].key == key) {
+                return slot;
+            }
+        }
+    }
+
+    void insert (uint64_t key, int slot) {
+        unsigned int i = hash (key);
+
+        while (_hash[i] >= 0) {
+            i = (i + 1) & (GCUSBPlayerSlotHash - 1);
+        }
+
+        _hash[i] = (int8_t) slot;
+    }
+
+    /* remove a key with backward shift deletion so no tombstones are needed */
+    void remove (uint64_t key) {
+        unsigned int i = hash (key), j;
+
+        while (_hash[i] >= 0 && _slots[_hash[i]].key != key) {
+            i = (i + 1) & (GCUSBPlayerSlotHash - 1);
+        }
+
+        if (_hash[i] < 0) {
+            return;
+        }
+
+        for (j = (i + 1) & (GCUSBPlayerSlotHash - 1) ; _hash[j] >= 0 ; j = (j + 1) & (GCUSBPlayerSlotHash - 1)) {
+            unsigned int home = hash (_slots[_hash[j]].key);
+
+            /* move the entry back unless its home lies cyclically in (i, j] */
+            if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+                _hash[i] = _hash[j];
+                i = j;
+            }
+        }
+
+        _hash[i] = -1;
+    }
+
+    /* lowest free slot or the least recently released reservation */
+    int freeSlot (void) const {
+        int reserved = -1;
+
+        for (int i = 0 ; i < GCUSBPlayerSlotCount ; ++i) {
+            if (SlotFree == _slots[i].state) {
+                return i;
+            }
+
+            if (SlotReserved == _slots[i].state &&
+                (reserved < 0 || _slots[i].released < _slots[reserved].released)) {
+                reserved = i;
+            }
+        }
+
+        return reserved;
+    }
+
+    Slot _slots[GCUSBPlayerSlotCount];
+    int8_t _hash[GCUSBPlayerSlotHash];
+    uint64_t _sequence;
+};
+
+#endif
@@ -0,0 +1,267 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This driver is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This driver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBSTATS_H)
+#define GCUSBSTATS_H
+
+/* This header is shared by the kext and by host-side tools. It must not depend
+ * on IOKit or on the C++ standard library. */
+#include <stdint.h>
+
+enum {
+    /** number of buckets in a latency histogram */
+    GCUSBHistogramBuckets = 32,
+    /** weight of a new sample in the interval averages (1/2^shift) */
+    GCUSBRateMonitorShift = 4,
+    /** default gap threshold (nominal intervals) */
+    GCUSBRateMonitorGap   = 2,
+};
+
+/**
+ * @brief Fixed-bucket latency histogram
+ *
+ * Bucket 0 counts samples of 0 ns. Bucket i > 0 counts samples in [2^(i-1), 2^i) ns and
+ * the last bucket also collects everything larger. Samples are recorded with relaxed
+ * atomics so any number of threads can record while another thread reads or resets the
+ * histogram. Readers may observe a sample in count() before it shows up in a bucket.
+ */
+class GCUSBHistogram {
+public:
+    GCUSBHistogram () {
+        reset ();
+    }
+
+    /** bucket a sample falls into */
+    static unsigned int bucket (uint64_t ns) {
+        if (0 == ns) {
+            return 0;
+        }
+
+        unsigned int b = 64 - __builtin_clzll (ns);
+        return b < GCUSBHistogramBuckets ? b : GCUSBHistogramBuckets - 1;
+    }
+
+    /** largest sample (ns) counted by a bucket */
+    static uint64_t bucketLimit (unsigned int bucket) {
+        return bucket ? (1ULL << bucket) - 1 : 0;
+    }
+
+    void record (uint64_t ns) {
+        __atomic_add_fetch (_buckets + bucket (ns), 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&_sum, ns, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n (&_max, __ATOMIC_RELAXED);
+        while (ns > max && !__atomic_compare_exchange_n (&_max, &max, ns, true, __ATOMIC_RELAXED,
+                                                          __ATOMIC_RELAXED)) {
+        }
+    }
+
+    void reset (void) {
+        for (int i = 0 ; i < GCUSBHistogramBuckets ; ++i) {
+            __atomic_store_n (_buckets + i, 0, __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n (&_count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_max, 0, __ATOMIC_RELAXED);
+    }
+
+    uint64_t bucketCount (unsigned int bucket) const {
+        return __atomic_load_n (_buckets + bucket, __ATOMIC_RELAXED);
+    }
+
+    uint64_t count (void) const {
+        return __atomic_load_n (&_count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t sum (void) const {
+        return __atomic_load_n (&_sum, __ATOMIC_RELAXED);
+    }
+
+    uint64_t max (void) const {
+        return __atomic_load_n (&_max, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief Estimate a percentile
+     *
+     * @param[in] pct  percentile (0-100)
+     *
+     * @returns upper limit (ns) of the bucket holding the percentile, clamped to the
+     * largest recorded sample. 0 if the histogram is empty.
+     */
+    uint64_t percentile (unsigned int pct) const {
+        uint64_t total = 0, target, seen = 0;
+
+        for (int i = 0 ; i < GCUSBHistogramBuckets ; ++i) {
+            total += bucketCount (i);
+        }
+
+        if (0 == total) {
+            return 0;
+        }
+
+        target = (total * pct + 99) / 100;
+        if (0 == target) {
+            target = 1;
+        }
+
+        for (int i = 0 ; i < GCUSBHistogramBuckets ; ++i) {
+            seen += bucketCount (i);
+            if (seen >= target) {
+                uint64_t limit = bucketLimit (i), largest = max ();
+                return (i == GCUSBHistogramBuckets - 1 || limit > largest) ? largest : limit;
+            }
+        }
+
+        return max ();
+    }
+
+private:
+    uint64_t _buckets[GCUSBHistogramBuckets];
+    uint64_t _count, _sum, _max;
+};
+
+/**
+ * @brief Report inter-arrival monitor
+ *
+ * Tracks the time between consecutive reports against the nominal polling interval of
+ * the endpoint. The mean interval and the jitter (mean absolute deviation from the mean)
+ * are exponentially weighted averages kept in fixed point so they can be updated in the
+ * kernel without floating point. An interval longer than the gap threshold is counted as
+ * a gap and every nominal interval it spans beyond the first as a missed report. There
+ * is a single writer (the report path); readers on other threads may see the fields of
+ * one sample partially updated.
+ */
+class GCUSBRateMonitor {
+public:
+    GCUSBRateMonitor () : _nominal(0), _gap_threshold(GCUSBRateMonitorGap) {
+        reset ();
+    }
+
+    /** nominal interval (ns) or 0 to compare against the measured mean */
+    void setNominal (uint64_t interval) {
+        __atomic_store_n (&_nominal, interval, __ATOMIC_RELAXED);
+    }
+
+    uint64_t nominal (void) const {
+        return __atomic_load_n (&_nominal, __ATOMIC_RELAXED);
+    }
+
+    /** number of intervals (at least 2) a gap has to exceed */
+    void setGapThreshold (unsigned int intervals) {
+        __atomic_store_n (&_gap_threshold, intervals < 2 ? 2 : intervals, __ATOMIC_RELAXED);
+    }
+
+    unsigned int gapThreshold (void) const {
+        return __atomic_load_n (&_gap_threshold, __ATOMIC_RELAXED);
+    }
+
+    /** record the arrival time (ns) of a report. returns the interval or 0 for the first report */
+    uint64_t record (uint64_t now) {
+        uint64_t last = _last, interval, average, reference, deviation;
+
+        _last = now;
+        if (0 == last || now <= last) {
+            return 0;
+        }
+
+        interval = now - last;
+
+        /* compare against the mean before this interval is added */
+        reference = nominal () ? nominal () : mean ();
+        if (reference && interval > reference * gapThreshold ()) {
+            __atomic_store_n (&_gaps, _gaps + 1, __ATOMIC_RELAXED);
+            __atomic_store_n (&_missed, _missed + (interval + reference / 2) / reference - 1, __ATOMIC_RELAXED);
+        }
+
+        average = _samples ? _mean + interval - (_mean >> GCUSBRateMonitorShift) : interval << GCUSBRateMonitorShift;
+        __atomic_store_n (&_mean, average, __ATOMIC_RELAXED);
+
+        average >>= GCUSBRateMonitorShift;
+        deviation = interval > average ? interval - average : average - interval;
+        __atomic_store_n (&_jitter, _jitter + deviation - (_jitter >> GCUSBRateMonitorShift), __ATOMIC_RELAXED);
+
+        if (interval > _max) {
+            __atomic_store_n (&_max, interval, __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n (&_samples, _samples + 1, __ATOMIC_RELAXED);
+
+        return interval;
+    }
+
+    /** forget all samples. a sample recorded at the same time may be partially kept */
+    void reset (void) {
+        _last = 0;
+        __atomic_store_n (&_mean, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_jitter, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_samples, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_gaps, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_missed, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&_max, 0, __ATOMIC_RELAXED);
+    }
+
+    /** number of intervals measured */
+    uint64_t samples (void) const {
+        return __atomic_load_n (&_samples, __ATOMIC_RELAXED);
+    }
+
+    /** average interval (ns) */
+    uint64_t mean (void) const {
+        return __atomic_load_n (&_mean, __ATOMIC_RELAXED) >> GCUSBRateMonitorShift;
+    }
+
+    /** average deviation (ns) of an interval from the mean */
+    uint64_t jitter (void) const {
+        return __atomic_load_n (&_jitter, __ATOMIC_RELAXED) >> GCUSBRateMonitorShift;
+    }
+
+    uint64_t max (void) const {
+        return __atomic_load_n (&_max, __ATOMIC_RELAXED);
+    }
+
+    /** number of intervals longer than the gap threshold */
+    uint64_t gaps (void) const {
+        return __atomic_load_n (&_gaps, __ATOMIC_RELAXED);
+    }
+
+    /** estimated number of reports the gaps should have contained */
+    uint64_t missed (void) const {
+        return __atomic_load_n (&_missed, __ATOMIC_RELAXED);
+    }
+
+    /** measured report rate in mHz (0 before the first interval) */
+    uint64_t rate (void) const {
+        uint64_t interval = mean ();
+        return interval ? 1000000000000ULL / interval : 0;
+    }
+
+private:
+    uint64_t _nominal;
+    unsigned int _gap_threshold;
+    uint64_t _last;
+    /* averages scaled by 2^GCUSBRateMonitorShift */
+    uint64_t _mean, _jitter;
+    uint64_t _samples, _gaps, _missed, _max;
+};
+
+#endif
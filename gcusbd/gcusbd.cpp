@@ -0,0 +1,1208 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * user-space driver for WUP-028 GameCube USB adapter on Linux
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs the kext's decode, calibration, button remap, filter, hotplug and rumble merge
+ * code in user space on Linux. Reports are read from an input source (a hidraw device,
+ * a capture recorded by gcusbadapter.kext or a datagram socket fed by a simulator) and
+ * every connected controller is exposed as a uinput game pad with rumble. Everything
+ * runs on a single thread driven by epoll. Builds without any project files:
+ *
+ *   c++ -O2 -o gcusbd gcusbd.cpp
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "../gcusbadapter/gcusbreport.h"
+#include "../gcusbadapter/gcusbhotplug.h"
+#include "../gcusbadapter/gcusbcapture.h"
+#include "../gcusbadapter/gcusbstats.h"
+#include "../gcusbadapter/gcusbaxis.h"
+#include "../gcusbadapter/gcusbbuttons.h"
+
+/** largest number of reports taken from the source per wakeup */
+#define GCUSBD_BATCH        32
+/** largest report read from a source */
+#define GCUSBD_REPORT_MAX   64
+/** number of force feedback effects a pad can hold */
+#define GCUSBD_EFFECTS      4
+
+/* epoll tags */
+enum {
+    GCUSBD_TAG_SOURCE = 0,
+    GCUSBD_TAG_SIGNAL,
+    GCUSBD_TAG_RUMBLE,
+    /* GCUSBD_TAG_PAD + port */
+    GCUSBD_TAG_PAD,
+};
+
+struct gcusbd_options_t {
+    /** do not create uinput devices */
+    bool no_uinput;
+    /** print every delivered port report */
+    bool verbose;
+    /** replay a capture as fast as possible */
+    bool fast;
+    /** keep-alive interval (ms) of the change filter */
+    unsigned int keep_alive;
+    /** longest time (ms) a rumble request waits before it is sent */
+    unsigned int rumble_interval;
+    GCUSBAxisConfig axes;
+    /** button remap profile applied to every port */
+    GCUSBButtonProfile buttons;
+    /** capture to replay */
+    const char *replay_path;
+    /** datagram socket to receive simulated reports on */
+    const char *socket_path;
+    /** hidraw device */
+    const char *device_path;
+};
+
+/** reports read from a source in one wakeup */
+struct gcusbd_batch_t {
+    uint8_t reports[GCUSBD_BATCH][GCUSBD_REPORT_MAX];
+    size_t lengths[GCUSBD_BATCH];
+    /** time (ns, CLOCK_MONOTONIC) the report was read */
+    uint64_t timestamps[GCUSBD_BATCH];
+    unsigned int count;
+};
+
+struct gcusbd_source_t;
+
+/**
+ * @brief Input source operations
+ *
+ * read fills a batch and returns the number of reports read, 0 if there is nothing to
+ * read right now and -1 if the source is finished or failed. write sends an output
+ * report (0x11 rumble) to the adapter.
+ */
+struct gcusbd_source_ops_t {
+    const char *name;
+    int (*read) (gcusbd_source_t *source, gcusbd_batch_t *batch);
+    int (*write) (gcusbd_source_t *source, const uint8_t *report, size_t length);
+    void (*close) (gcusbd_source_t *source);
+};
+
+struct gcusbd_source_t {
+    const gcusbd_source_ops_t *ops;
+    /** file descriptor polled by the event loop */
+    int fd;
+
+    /* replay source */
+    uint8_t *map;
+    size_t map_length;
+    GCUSBCaptureReader *reader;
+    GCUSBCaptureRecord record;
+    bool have_record, fast;
+    uint64_t start, first;
+
+    /* socket source: address of the simulator that sent the last report */
+    struct sockaddr_un peer;
+    socklen_t peer_length;
+};
+
+struct gcusbd_pad_t {
+    /** uinput device or -1 */
+    int fd;
+    bool connected;
+    bool rumble;
+    /** magnitude, length (ms, 0 for none), playing state and end time (ns, 0 for none) of
+     * every uploaded effect */
+    uint16_t magnitude[GCUSBD_EFFECTS];
+    uint16_t length[GCUSBD_EFFECTS];
+    bool playing[GCUSBD_EFFECTS];
+    uint64_t stop_time[GCUSBD_EFFECTS];
+    /** motor state last requested from the rumble scheduler */
+    uint8_t motor;
+    /** an effect is playing but the motor has no power */
+    bool unpowered;
+};
+
+struct gcusbd_stats_t {
+    uint64_t reads, batches, input_reports, invalid_reports;
+    uint64_t connects, disconnects;
+    uint64_t rumble_transmitted, rumble_failed, rumble_unpowered;
+    uint64_t events_written;
+};
+
+struct gcusbd_t {
+    gcusbd_options_t options;
+    gcusbd_source_t source;
+
+    GCUSBReportDecoder decoder;
+    GCUSBAxisMap axes;
+    GCUSBButtonMap buttons;
+    GCUSBChangeFilter filter;
+    GCUSBHotplug hotplug;
+    GCUSBRumbleScheduler rumble;
+    uint8_t report[GCUSBInputReportLength];
+
+    gcusbd_pad_t pads[GCUSBPortCount];
+    gcusbd_batch_t batch;
+
+    int epoll_fd, signal_fd, rumble_fd;
+    /** latest time (ns) a pending rumble request is sent and the time the rumble timer
+     * is armed for (0 for none) */
+    uint64_t rumble_deadline, rumble_wake;
+    bool running;
+
+    gcusbd_stats_t stats;
+    /** time from reading a report until its events are written */
+    GCUSBHistogram latency;
+    /** intervals between reports. hidraw has no report timestamps so these include the
+     * scheduling delay of the daemon */
+    GCUSBRateMonitor poll_rate;
+};
+
+static uint64_t gcusbd_now (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** arm (or disarm with 0) a one-shot timerfd relative to now */
+static int gcusbd_arm_timer (int fd, uint64_t delay) {
+    struct itimerspec its;
+
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = (time_t) (delay / 1000000000ULL);
+    its.it_value.tv_nsec = (long) (delay % 1000000000ULL);
+
+    return timerfd_settime (fd, 0, &its, NULL);
+}
+
+/* hidraw source. the adapter sends one report per read */
+
+static int gcusbd_hidraw_read (gcusbd_source_t *source, gcusbd_batch_t *batch) {
+    while (batch->count < GCUSBD_BATCH) {
+        ssize_t ret = read (source->fd, batch->reports[batch->count], GCUSBD_REPORT_MAX);
+        if (ret < 0) {
+            if (EAGAIN == errno || EINTR == errno) {
+                break;
+            }
+            fprintf (stderr, "Could not read from the adapter: %s\n", strerror (errno));
+            return -1;
+        }
+
+        if (0 == ret) {
+            return -1;
+        }
+
+        batch->lengths[batch->count] = (size_t) ret;
+        batch->timestamps[batch->count] = gcusbd_now ();
+        ++batch->count;
+    }
+
+    return (int) batch->count;
+}
+
+static int gcusbd_hidraw_write (gcusbd_source_t *source, const uint8_t *report, size_t length) {
+    return write (source->fd, report, length) == (ssize_t) length ? 0 : -1;
+}
+
+static void gcusbd_fd_close (gcusbd_source_t *source) {
+    if (source->fd >= 0) {
+        close (source->fd);
+        source->fd = -1;
+    }
+}
+
+static const gcusbd_source_ops_t gcusbd_hidraw_ops = {
+    .name = "hidraw",
+    .read = gcusbd_hidraw_read,
+    .write = gcusbd_hidraw_write,
+    .close = gcusbd_fd_close,
+};
+
+static int gcusbd_hidraw_open (gcusbd_source_t *source, const char *path) {
+    uint8_t start = GCUSBStartReportID;
+
+    source->ops = &gcusbd_hidraw_ops;
+    source->fd = open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (source->fd < 0) {
+        fprintf (stderr, "Could not open %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+
+    /* the adapter only starts sending 0x21 reports after it receives 0x13 */
+    if (gcusbd_hidraw_write (source, &start, 1)) {
+        fprintf (stderr, "Could not start the adapter: %s\n", strerror (errno));
+        gcusbd_fd_close (source);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* socket source. a simulator sends one 0x21 report per datagram and receives the 0x11
+ * rumble reports back at its own address */
+
+static int gcusbd_socket_read (gcusbd_source_t *source, gcusbd_batch_t *batch) {
+    struct mmsghdr messages[GCUSBD_BATCH];
+    struct iovec iov[GCUSBD_BATCH];
+    struct sockaddr_un peers[GCUSBD_BATCH];
+    unsigned int space = GCUSBD_BATCH - batch->count;
+    uint64_t now;
+    int ret;
+
+    memset (messages, 0, sizeof (messages[0]) * space);
+    for (unsigned int i = 0 ; i < space ; ++i) {
+        iov[i].iov_base = batch->reports[batch->count + i];
+        iov[i].iov_len = GCUSBD_REPORT_MAX;
+        messages[i].msg_hdr.msg_iov = iov + i;
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = peers + i;
+        messages[i].msg_hdr.msg_namelen = sizeof (peers[i]);
+    }
+
+    /* one system call for everything queued on the socket */
+    ret = recvmmsg (source->fd, messages, space, MSG_DONTWAIT, NULL);
+    if (ret < 0) {
+        if (EAGAIN == errno || EINTR == errno) {
+            return (int) batch->count;
+        }
+        fprintf (stderr, "Could not receive from the simulator: %s\n", strerror (errno));
+        return -1;
+    }
+
+    now = gcusbd_now ();
+    for (int i = 0 ; i < ret ; ++i) {
+        batch->lengths[batch->count] = messages[i].msg_len;
+        batch->timestamps[batch->count] = now;
+        ++batch->count;
+    }
+
+    if (ret > 0 && messages[ret - 1].msg_hdr.msg_namelen > sizeof (sa_family_t)) {
+        source->peer = peers[ret - 1];
+        source->peer_length = messages[ret - 1].msg_hdr.msg_namelen;
+    }
+
+    return (int) batch->count;
+}
+
+static int gcusbd_socket_write (gcusbd_source_t *source, const uint8_t *report, size_t length) {
+    if (0 == source->peer_length) {
+        /* the simulator did not bind an address to send rumble to */
+        return 0;
+    }
+
+    return sendto (source->fd, report, length, MSG_DONTWAIT, (struct sockaddr *) &source->peer,
+                   source->peer_length) == (ssize_t) length ? 0 : -1;
+}
+
+static const gcusbd_source_ops_t gcusbd_socket_ops = {
+    .name = "socket",
+    .read = gcusbd_socket_read,
+    .write = gcusbd_socket_write,
+    .close = gcusbd_fd_close,
+};
+
+static int gcusbd_socket_open (gcusbd_source_t *source, const char *path) {
+    struct sockaddr_un address;
+
+    source->ops = &gcusbd_socket_ops;
+
+    if (strlen (path) >= sizeof (address.sun_path)) {
+        fprintf (stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    source->fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (source->fd < 0) {
+        fprintf (stderr, "Could not create a socket: %s\n", strerror (errno));
+        return -1;
+    }
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy (address.sun_path, path);
+    unlink (path);
+
+    if (bind (source->fd, (struct sockaddr *) &address, sizeof (address))) {
+        fprintf (stderr, "Could not bind %s: %s\n", path, strerror (errno));
+        gcusbd_fd_close (source);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* replay source. a timerfd fires when the next input record is due */
+
+static void gcusbd_replay_schedule (gcusbd_source_t *source) {
+    uint64_t due, now;
+
+    /* output records are what the kext sent. the daemon produces its own */
+    while ((source->have_record = source->reader->next (&source->record))) {
+        if (GCUSBCaptureInput == source->record.direction) {
+            break;
+        }
+    }
+
+    if (!source->have_record) {
+        /* fire once more to report the end of the capture */
+        gcusbd_arm_timer (source->fd, 1);
+        return;
+    }
+
+    if (0 == source->start) {
+        source->start = gcusbd_now ();
+        source->first = source->record.timestamp;
+    }
+
+    due = source->start + (source->record.timestamp - source->first);
+    now = gcusbd_now ();
+    gcusbd_arm_timer (source->fd, (source->fast || due <= now) ? 1 : due - now);
+}
+
+static int gcusbd_replay_read (gcusbd_source_t *source, gcusbd_batch_t *batch) {
+    uint64_t expirations, now = gcusbd_now ();
+
+    if (read (source->fd, &expirations, sizeof (expirations)) < 0 && EAGAIN == errno) {
+        return 0;
+    }
+
+    if (!source->have_record) {
+        return -1;
+    }
+
+    /* take every record that is due */
+    while (source->have_record && batch->count < GCUSBD_BATCH &&
+           (source->fast || source->start + (source->record.timestamp - source->first) <= now)) {
+        size_t length = source->record.length < GCUSBD_REPORT_MAX ? source->record.length : GCUSBD_REPORT_MAX;
+
+        memcpy (batch->reports[batch->count], source->record.report, length);
+        batch->lengths[batch->count] = length;
+        batch->timestamps[batch->count] = now;
+        ++batch->count;
+
+        gcusbd_replay_schedule (source);
+    }
+
+    if (source->have_record && batch->count == GCUSBD_BATCH) {
+        gcusbd_arm_timer (source->fd, 1);
+    }
+
+    return (int) batch->count;
+}
+
+static int gcusbd_replay_write (gcusbd_source_t *, const uint8_t *, size_t) {
+    /* there is no adapter to send rumble to */
+    return 0;
+}
+
+static void gcusbd_replay_close (gcusbd_source_t *source) {
+    delete source->reader;
+    source->reader = NULL;
+
+    if (source->map) {
+        munmap (source->map, source->map_length);
+        source->map = NULL;
+    }
+
+    gcusbd_fd_close (source);
+}
+
+static const gcusbd_source_ops_t gcusbd_replay_ops = {
+    .name = "replay",
+    .read = gcusbd_replay_read,
+    .write = gcusbd_replay_write,
+    .close = gcusbd_replay_close,
+};
+
+static int gcusbd_replay_open (gcusbd_source_t *source, const char *path, bool fast) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    source->ops = &gcusbd_replay_ops;
+    source->fast = fast;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf (stderr, "Could not open %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+
+    if (fstat (fd, &st) || 0 == st.st_size) {
+        fprintf (stderr, "Could not stat %s or capture is empty\n", path);
+        close (fd);
+        return -1;
+    }
+
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (MAP_FAILED == map) {
+        fprintf (stderr, "Could not map %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+
+    source->map = (uint8_t *) map;
+    source->map_length = st.st_size;
+    source->reader = new GCUSBCaptureReader (source->map, source->map_length);
+    if (!source->reader->valid ()) {
+        fprintf (stderr, "%s is not a gcusbadapter capture\n", path);
+        gcusbd_replay_close (source);
+        return -1;
+    }
+
+    source->fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (source->fd < 0) {
+        fprintf (stderr, "Could not create a timer: %s\n", strerror (errno));
+        gcusbd_replay_close (source);
+        return -1;
+    }
+
+    gcusbd_replay_schedule (source);
+
+    return 0;
+}
+
+/* virtual pads */
+
+static const struct {
+    uint8_t offset, mask;
+    uint16_t code;
+} gcusbd_buttons[] = {
+    {1, 0x01, BTN_SOUTH},       /* A */
+    {1, 0x02, BTN_WEST},        /* B */
+    {1, 0x04, BTN_EAST},        /* X */
+    {1, 0x08, BTN_NORTH},       /* Y */
+    {1, 0x10, BTN_DPAD_LEFT},
+    {1, 0x20, BTN_DPAD_RIGHT},
+    {1, 0x40, BTN_DPAD_DOWN},
+    {1, 0x80, BTN_DPAD_UP},
+    {2, 0x01, BTN_START},
+    {2, 0x02, BTN_Z},
+    {2, 0x04, BTN_TR},
+    {2, 0x08, BTN_TL},
+};
+
+static const struct {
+    uint8_t offset;
+    uint16_t code;
+    /** stick axis (signed, Y up is negative on Linux) or trigger */
+    bool stick, invert;
+} gcusbd_axes[] = {
+    {GCUSBPortStickOffset,         ABS_X,  true,  false},
+    {GCUSBPortStickOffset + 1,     ABS_Y,  true,  true},
+    {GCUSBPortStickOffset + 2,     ABS_RX, true,  false},
+    {GCUSBPortStickOffset + 3,     ABS_RY, true,  true},
+    {GCUSBPortTriggerOffset,       ABS_Z,  false, false},
+    {GCUSBPortTriggerOffset + 1,   ABS_RZ, false, false},
+};
+
+#define GCUSBD_ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+/**
+ * @brief Create the uinput device for a newly connected controller
+ *
+ * WaveBirds have no rumble motor so their pads do not advertise force feedback.
+ */
+static int gcusbd_pad_create (gcusbd_t *gcusbd, int port, uint8_t status) {
+    gcusbd_pad_t *pad = gcusbd->pads + port;
+    struct uinput_setup setup;
+    struct epoll_event event;
+    int fd;
+
+    memset (pad, 0, sizeof (*pad));
+    pad->fd = -1;
+    pad->connected = true;
+    pad->rumble = !GCUSBPortFlags (status).wireless ();
+
+    if (gcusbd->options.no_uinput) {
+        return 0;
+    }
+
+    fd = open ("/dev/uinput", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf (stderr, "Could not open /dev/uinput: %s\n", strerror (errno));
+        return -1;
+    }
+
+    ioctl (fd, UI_SET_EVBIT, EV_KEY);
+    for (size_t i = 0 ; i < GCUSBD_ARRAY_SIZE(gcusbd_buttons) ; ++i) {
+        ioctl (fd, UI_SET_KEYBIT, gcusbd_buttons[i].code);
+    }
+
+    ioctl (fd, UI_SET_EVBIT, EV_ABS);
+    for (size_t i = 0 ; i < GCUSBD_ARRAY_SIZE(gcusbd_axes) ; ++i) {
+        struct uinput_abs_setup abs;
+
+        memset (&abs, 0, sizeof (abs));
+        abs.code = gcusbd_axes[i].code;
+        abs.absinfo.minimum = gcusbd_axes[i].stick ? -GCUSBStickRange : GCUSBTriggerMinimum;
+        abs.absinfo.maximum = gcusbd_axes[i].stick ? GCUSBStickRange : GCUSBTriggerMaximum;
+        ioctl (fd, UI_ABS_SETUP, &abs);
+    }
+
+    if (pad->rumble) {
+        ioctl (fd, UI_SET_EVBIT, EV_FF);
+        ioctl (fd, UI_SET_FFBIT, FF_RUMBLE);
+    }
+
+    memset (&setup, 0, sizeof (setup));
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = 0x057e;
+    setup.id.product = 0x0337;
+    setup.ff_effects_max = pad->rumble ? GCUSBD_EFFECTS : 0;
+    snprintf (setup.name, sizeof (setup.name), "GameCube %s Controller %d", pad->rumble ? "Wired" : "WaveBird",
+              port + 1);
+
+    if (ioctl (fd, UI_DEV_SETUP, &setup) || ioctl (fd, UI_DEV_CREATE)) {
+        fprintf (stderr, "Could not create a uinput device for port %d: %s\n", port + 1, strerror (errno));
+        close (fd);
+        return -1;
+    }
+
+    /* force feedback requests arrive on the uinput device */
+    event.events = EPOLLIN;
+    event.data.u64 = GCUSBD_TAG_PAD + port;
+    epoll_ctl (gcusbd->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    pad->fd = fd;
+
+    return 0;
+}
+
+static void gcusbd_pad_destroy (gcusbd_t *gcusbd, int port) {
+    gcusbd_pad_t *pad = gcusbd->pads + port;
+
+    if (pad->fd >= 0) {
+        epoll_ctl (gcusbd->epoll_fd, EPOLL_CTL_DEL, pad->fd, NULL);
+        ioctl (pad->fd, UI_DEV_DESTROY);
+        close (pad->fd);
+    }
+
+    memset (pad, 0, sizeof (*pad));
+    pad->fd = -1;
+
+    /* a disconnected controller must not keep the motor running */
+    gcusbd->rumble.set (port, 0);
+}
+
+/** write the state of a port to its pad with a single system call */
+static void gcusbd_pad_report (gcusbd_t *gcusbd, int port, const uint8_t *report) {
+    struct input_event events[GCUSBD_ARRAY_SIZE(gcusbd_buttons) + GCUSBD_ARRAY_SIZE(gcusbd_axes) + 1];
+    gcusbd_pad_t *pad = gcusbd->pads + port;
+    size_t count = 0;
+
+    if (gcusbd->options.verbose) {
+        printf ("port %d buttons %02x%02x stick %4d %4d c-stick %4d %4d triggers %3u %3u\n", port + 1, report[2],
+                report[1], (int8_t) report[3], (int8_t) report[4], (int8_t) report[5], (int8_t) report[6],
+                report[7], report[8]);
+    }
+
+    if (pad->fd < 0) {
+        return;
+    }
+
+    /* the input core drops values that did not change */
+    memset (events, 0, sizeof (events));
+    for (size_t i = 0 ; i < GCUSBD_ARRAY_SIZE(gcusbd_buttons) ; ++i, ++count) {
+        events[count].type = EV_KEY;
+        events[count].code = gcusbd_buttons[i].code;
+        events[count].value = !!(report[gcusbd_buttons[i].offset] & gcusbd_buttons[i].mask);
+    }
+
+    for (size_t i = 0 ; i < GCUSBD_ARRAY_SIZE(gcusbd_axes) ; ++i, ++count) {
+        int value = gcusbd_axes[i].stick ? (int8_t) report[gcusbd_axes[i].offset] : report[gcusbd_axes[i].offset];
+
+        events[count].type = EV_ABS;
+        events[count].code = gcusbd_axes[i].code;
+        events[count].value = gcusbd_axes[i].invert ? -value : value;
+    }
+
+    events[count].type = EV_SYN;
+    events[count].code = SYN_REPORT;
+    ++count;
+
+    if (write (pad->fd, events, sizeof (events[0]) * count) > 0) {
+        gcusbd->stats.events_written += count;
+    }
+}
+
+/** update the rumble request of a port from its effects */
+static void gcusbd_pad_update_rumble (gcusbd_t *gcusbd, int port, uint64_t now) {
+    gcusbd_pad_t *pad = gcusbd->pads + port;
+    uint8_t motor = 0;
+
+    for (int i = 0 ; i < GCUSBD_EFFECTS ; ++i) {
+        if (pad->playing[i] && pad->stop_time[i] && now >= pad->stop_time[i]) {
+            pad->playing[i] = false;
+        }
+
+        motor |= pad->playing[i] && pad->magnitude[i];
+    }
+
+    /* like the kext, do not send a transfer for a motor without power. the effect takes
+     * hold once the power comes back */
+    if (motor && !(gcusbd->decoder.rumble () & (1u << port))) {
+        gcusbd->stats.rumble_unpowered += !pad->unpowered;
+        pad->unpowered = true;
+        motor = 0;
+    } else {
+        pad->unpowered = false;
+    }
+
+    if (motor != pad->motor) {
+        pad->motor = motor;
+        gcusbd->rumble.set (port, motor);
+    }
+}
+
+/**
+ * @brief Handle force feedback requests from the clients of a pad
+ *
+ * Uploads and erases have to be acknowledged with the uinput handshake. The motor can
+ * only be switched on and off so any non-zero rumble magnitude turns it on.
+ */
+static void gcusbd_pad_event (gcusbd_t *gcusbd, int port) {
+    gcusbd_pad_t *pad = gcusbd->pads + port;
+    struct input_event event;
+    uint64_t now = gcusbd_now ();
+
+    while (pad->fd >= 0 && read (pad->fd, &event, sizeof (event)) == (ssize_t) sizeof (event)) {
+        if (EV_UINPUT == event.type && UI_FF_UPLOAD == event.code) {
+            struct uinput_ff_upload upload;
+
+            memset (&upload, 0, sizeof (upload));
+            upload.request_id = event.value;
+            if (ioctl (pad->fd, UI_BEGIN_FF_UPLOAD, &upload)) {
+                continue;
+            }
+
+            if (upload.effect.id >= 0 && upload.effect.id < GCUSBD_EFFECTS && FF_RUMBLE == upload.effect.type) {
+                const struct ff_rumble_effect *rumble = &upload.effect.u.rumble;
+
+                pad->magnitude[upload.effect.id] = rumble->strong_magnitude > rumble->weak_magnitude ?
+                    rumble->strong_magnitude : rumble->weak_magnitude;
+                pad->length[upload.effect.id] = upload.effect.replay.length;
+                upload.retval = 0;
+            } else {
+                upload.retval = -EINVAL;
+            }
+
+            ioctl (pad->fd, UI_END_FF_UPLOAD, &upload);
+        } else if (EV_UINPUT == event.type && UI_FF_ERASE == event.code) {
+            struct uinput_ff_erase erase;
+
+            memset (&erase, 0, sizeof (erase));
+            erase.request_id = event.value;
+            if (ioctl (pad->fd, UI_BEGIN_FF_ERASE, &erase)) {
+                continue;
+            }
+
+            if (erase.effect_id < GCUSBD_EFFECTS) {
+                pad->magnitude[erase.effect_id] = 0;
+                pad->length[erase.effect_id] = 0;
+                pad->playing[erase.effect_id] = false;
+            }
+
+            erase.retval = 0;
+            ioctl (pad->fd, UI_END_FF_ERASE, &erase);
+        } else if (EV_FF == event.type && event.code < GCUSBD_EFFECTS) {
+            /* the value is the play count. an effect with a length stops after playing that
+             * many times */
+            uint64_t count = event.value > 0xffff ? 0xffff : (uint64_t) (event.value > 0 ? event.value : 0);
+
+            pad->playing[event.code] = count > 0;
+            pad->stop_time[event.code] = (count && pad->length[event.code]) ?
+                now + count * pad->length[event.code] * 1000000ULL : 0;
+        }
+    }
+
+    gcusbd_pad_update_rumble (gcusbd, port, now);
+}
+
+/* rumble */
+
+/** end effects that ran out of time on every connected pad */
+static void gcusbd_update_effects (gcusbd_t *gcusbd, uint64_t now) {
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        if (gcusbd->pads[i].connected) {
+            gcusbd_pad_update_rumble (gcusbd, i, now);
+        }
+    }
+}
+
+/** send the merged rumble state if it changed */
+static void gcusbd_flush_rumble (gcusbd_t *gcusbd) {
+    uint8_t report[GCUSBRumbleReportLength];
+
+    if (!gcusbd->rumble.flush (report)) {
+        return;
+    }
+
+    if (0 == gcusbd->source.ops->write (&gcusbd->source, report, sizeof (report))) {
+        gcusbd->rumble.transmitted ();
+        ++gcusbd->stats.rumble_transmitted;
+    } else {
+        /* resend on the next flush */
+        gcusbd->rumble.failed ();
+        ++gcusbd->stats.rumble_failed;
+    }
+}
+
+/**
+ * @brief Schedule the rumble timer
+ *
+ * Like the kext a request waits at most RumbleInterval and is sent earlier if an
+ * input report arrives first. The timer also fires when the first effect with a length
+ * runs out so the motor stops even if the adapter sends no reports.
+ */
+static void gcusbd_schedule_rumble (gcusbd_t *gcusbd) {
+    uint64_t now = gcusbd_now (), wake;
+
+    if (!gcusbd->rumble.dirty ()) {
+        gcusbd->rumble_deadline = 0;
+    } else if (0 == gcusbd->rumble_deadline) {
+        gcusbd->rumble_deadline = now + (uint64_t) gcusbd->options.rumble_interval * 1000000ULL + 1;
+    }
+
+    wake = gcusbd->rumble_deadline;
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        const gcusbd_pad_t *pad = gcusbd->pads + i;
+
+        for (int j = 0 ; pad->connected && j < GCUSBD_EFFECTS ; ++j) {
+            if (pad->playing[j] && pad->stop_time[j] && (0 == wake || pad->stop_time[j] < wake)) {
+                wake = pad->stop_time[j];
+            }
+        }
+    }
+
+    if (wake != gcusbd->rumble_wake) {
+        /* a zero delay disarms the timer so a time that already passed fires right away */
+        gcusbd_arm_timer (gcusbd->rumble_fd, wake ? (wake > now ? wake - now : 1) : 0);
+        gcusbd->rumble_wake = wake;
+    }
+}
+
+/* report path */
+
+static void gcusbd_hotplug (gcusbd_t *gcusbd, int port) {
+    /* there is no work loop. do the hotplug work right away */
+    if (GCUSBHotplug::ActionAttach == gcusbd->hotplug.pending (port)) {
+        bool attached = 0 == gcusbd_pad_create (gcusbd, port, gcusbd->decoder.status (port));
+
+        gcusbd->hotplug.attached (port, attached);
+        if (attached) {
+            ++gcusbd->stats.connects;
+            fprintf (stderr, "Controller connected to port %d\n", port + 1);
+        }
+    } else if (GCUSBHotplug::ActionDetach == gcusbd->hotplug.pending (port)) {
+        gcusbd_pad_destroy (gcusbd, port);
+        gcusbd->hotplug.detached (port);
+        ++gcusbd->stats.disconnects;
+        fprintf (stderr, "Controller disconnected from port %d\n", port + 1);
+    }
+}
+
+/** decode one report and deliver the changed port states */
+static void gcusbd_handle_report (gcusbd_t *gcusbd, const uint8_t *data, size_t length, uint64_t timestamp) {
+    unsigned int connected = 0, deliver;
+
+    if (GCUSBInputReportLength != length) {
+        ++gcusbd->stats.invalid_reports;
+        return;
+    }
+
+    /* the decoder works in place, the same way it does on the kext's staging buffer */
+    memcpy (gcusbd->report, data, length);
+    if (!gcusbd->decoder.decode (gcusbd->report, length)) {
+        ++gcusbd->stats.invalid_reports;
+        return;
+    }
+
+    ++gcusbd->stats.input_reports;
+    gcusbd->poll_rate.record (timestamp);
+    gcusbd->axes.apply (gcusbd->report);
+    gcusbd->buttons.apply (gcusbd->report);
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        uint8_t status = gcusbd->decoder.status (i);
+
+        if (gcusbd->hotplug.update (i, status)) {
+            gcusbd_hotplug (gcusbd, i);
+        }
+
+        if (status && gcusbd->hotplug.active (i)) {
+            connected |= 1u << i;
+        }
+    }
+
+    deliver = gcusbd->filter.filter (gcusbd->report, connected, timestamp);
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        if (deliver & (1u << i)) {
+            gcusbd_pad_report (gcusbd, i, GCUSBReportDecoder::portReport (gcusbd->report, i));
+            gcusbd->filter.delivered (i, gcusbd->report, timestamp);
+        }
+    }
+
+    gcusbd->latency.record (gcusbd_now () - timestamp);
+}
+
+static int gcusbd_source_event (gcusbd_t *gcusbd) {
+    gcusbd_batch_t *batch = &gcusbd->batch;
+    uint64_t now;
+    int ret;
+
+    batch->count = 0;
+    ret = gcusbd->source.ops->read (&gcusbd->source, batch);
+    ++gcusbd->stats.reads;
+    if (ret <= 0) {
+        return ret;
+    }
+
+    ++gcusbd->stats.batches;
+    for (unsigned int i = 0 ; i < batch->count ; ++i) {
+        gcusbd_handle_report (gcusbd, batch->reports[i], batch->lengths[i], batch->timestamps[i]);
+    }
+
+    /* effects that ran out also end on the report clock */
+    now = gcusbd_now ();
+    gcusbd_update_effects (gcusbd, now);
+
+    /* pull a pending rumble flush forward to this batch */
+    if (gcusbd->rumble.dirty ()) {
+        gcusbd_flush_rumble (gcusbd);
+    }
+
+    return ret;
+}
+
+static void gcusbd_print_stats (const gcusbd_t *gcusbd) {
+    const gcusbd_stats_t *stats = &gcusbd->stats;
+
+    fprintf (stderr, "source:             %s\n", gcusbd->source.ops->name);
+    fprintf (stderr, "input reports:      %llu (%llu invalid)\n", (unsigned long long) stats->input_reports,
+             (unsigned long long) stats->invalid_reports);
+    fprintf (stderr, "reads:              %llu (%llu batches, %.2f reports/batch)\n",
+             (unsigned long long) stats->reads, (unsigned long long) stats->batches,
+             stats->batches ? (double) (stats->input_reports + stats->invalid_reports) / (double) stats->batches : 0.0);
+    fprintf (stderr, "delivered:          %llu (%llu suppressed)\n",
+             (unsigned long long) gcusbd->filter.deliveredCount (), (unsigned long long) gcusbd->filter.suppressedCount ());
+    fprintf (stderr, "events written:     %llu\n", (unsigned long long) stats->events_written);
+    fprintf (stderr, "connects:           %llu\n", (unsigned long long) stats->connects);
+    fprintf (stderr, "disconnects:        %llu\n", (unsigned long long) stats->disconnects);
+    fprintf (stderr, "rumble transmitted: %llu (%llu failed, %llu without power)\n",
+             (unsigned long long) stats->rumble_transmitted, (unsigned long long) stats->rumble_failed,
+             (unsigned long long) stats->rumble_unpowered);
+    fprintf (stderr, "report interval:    %.3f ms (jitter %.3f ms, max %.3f ms, %llu gaps)\n",
+             (double) gcusbd->poll_rate.mean () * 1e-6, (double) gcusbd->poll_rate.jitter () * 1e-6,
+             (double) gcusbd->poll_rate.max () * 1e-6, (unsigned long long) gcusbd->poll_rate.gaps ());
+    fprintf (stderr, "latency (ns):       p50 %llu p99 %llu max %llu\n",
+             (unsigned long long) gcusbd->latency.percentile (50), (unsigned long long) gcusbd->latency.percentile (99),
+             (unsigned long long) gcusbd->latency.max ());
+}
+
+/**
+ * @brief Event loop
+ *
+ * Waits on the input source, the uinput devices (force feedback), the rumble timer and
+ * a signalfd for SIGINT/SIGTERM. Everything runs on this thread so the pipeline needs
+ * no locking.
+ */
+static int gcusbd_run (gcusbd_t *gcusbd) {
+    struct epoll_event events[GCUSBPortCount + 3];
+    int ret = 0;
+
+    gcusbd->running = true;
+    while (gcusbd->running) {
+        int count = epoll_wait (gcusbd->epoll_fd, events, GCUSBD_ARRAY_SIZE(events), -1);
+        if (count < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            fprintf (stderr, "epoll_wait failed: %s\n", strerror (errno));
+            return -1;
+        }
+
+        for (int i = 0 ; i < count ; ++i) {
+            uint64_t tag = events[i].data.u64, expirations;
+
+            switch (tag) {
+            case GCUSBD_TAG_SOURCE:
+                if (gcusbd_source_event (gcusbd) < 0) {
+                    gcusbd->running = false;
+                }
+                break;
+            case GCUSBD_TAG_SIGNAL: {
+                struct signalfd_siginfo info;
+                if (read (gcusbd->signal_fd, &info, sizeof (info)) > 0) {
+                    gcusbd->running = false;
+                }
+                break;
+            }
+            case GCUSBD_TAG_RUMBLE:
+                if (read (gcusbd->rumble_fd, &expirations, sizeof (expirations)) > 0) {
+                    gcusbd->rumble_wake = 0;
+                    gcusbd_update_effects (gcusbd, gcusbd_now ());
+                    gcusbd_flush_rumble (gcusbd);
+                }
+                break;
+            default:
+                if (tag >= GCUSBD_TAG_PAD && tag < GCUSBD_TAG_PAD + GCUSBPortCount) {
+                    gcusbd_pad_event (gcusbd, (int) (tag - GCUSBD_TAG_PAD));
+                }
+                break;
+            }
+        }
+
+        gcusbd_schedule_rumble (gcusbd);
+    }
+
+    /* stop every motor before leaving */
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        gcusbd->rumble.set (i, 0);
+    }
+    gcusbd_flush_rumble (gcusbd);
+
+    return ret;
+}
+
+static int gcusbd_add_fd (gcusbd_t *gcusbd, int fd, uint64_t tag) {
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+
+    return epoll_ctl (gcusbd->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static int gcusbd_setup (gcusbd_t *gcusbd) {
+    sigset_t mask;
+    int ret;
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        gcusbd->pads[i].fd = -1;
+        gcusbd->axes.configure (i, gcusbd->options.axes);
+        gcusbd->buttons.configure (i, gcusbd->options.buttons);
+    }
+
+    gcusbd->filter.setKeepAlive ((uint64_t) gcusbd->options.keep_alive * 1000000ULL);
+
+    /* fail now instead of on every connect */
+    if (!gcusbd->options.no_uinput && access ("/dev/uinput", R_OK | W_OK)) {
+        fprintf (stderr, "Could not access /dev/uinput: %s (use -n to run without it)\n", strerror (errno));
+        return -1;
+    }
+
+    gcusbd->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    gcusbd->rumble_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+    gcusbd->signal_fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (gcusbd->epoll_fd < 0 || gcusbd->rumble_fd < 0 || gcusbd->signal_fd < 0) {
+        fprintf (stderr, "Could not set up the event loop: %s\n", strerror (errno));
+        return -1;
+    }
+
+    gcusbd->source.fd = -1;
+    if (gcusbd->options.replay_path) {
+        ret = gcusbd_replay_open (&gcusbd->source, gcusbd->options.replay_path, gcusbd->options.fast);
+    } else if (gcusbd->options.socket_path) {
+        ret = gcusbd_socket_open (&gcusbd->source, gcusbd->options.socket_path);
+    } else {
+        ret = gcusbd_hidraw_open (&gcusbd->source, gcusbd->options.device_path);
+    }
+
+    if (ret) {
+        return ret;
+    }
+
+    if (gcusbd_add_fd (gcusbd, gcusbd->source.fd, GCUSBD_TAG_SOURCE) ||
+        gcusbd_add_fd (gcusbd, gcusbd->signal_fd, GCUSBD_TAG_SIGNAL) ||
+        gcusbd_add_fd (gcusbd, gcusbd->rumble_fd, GCUSBD_TAG_RUMBLE)) {
+        fprintf (stderr, "Could not add to the event loop: %s\n", strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void gcusbd_cleanup (gcusbd_t *gcusbd) {
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        if (gcusbd->pads[i].connected) {
+            gcusbd_pad_destroy (gcusbd, i);
+        }
+    }
+
+    if (gcusbd->source.ops) {
+        gcusbd->source.ops->close (&gcusbd->source);
+    }
+
+    if (gcusbd->options.socket_path) {
+        unlink (gcusbd->options.socket_path);
+    }
+
+    if (gcusbd->signal_fd >= 0) {
+        close (gcusbd->signal_fd);
+    }
+
+    if (gcusbd->rumble_fd >= 0) {
+        close (gcusbd->rumble_fd);
+    }
+
+    if (gcusbd->epoll_fd >= 0) {
+        close (gcusbd->epoll_fd);
+    }
+}
+
+static void gcusbd_usage (const char *name) {
+    fprintf (stderr, "Usage: %s [-n] [-v] [-a axes] [-m map] [-k ms] [-i ms] <hidraw device>\n"
+             "       %s [-n] [-v] [-a axes] [-m map] [-k ms] [-i ms] [-f] -r capture\n"
+             "       %s [-n] [-v] [-a axes] [-m map] [-k ms] [-i ms] -u socket\n"
+             "  -n  do not create uinput devices\n"
+             "  -v  print every delivered port report\n"
+             "  -a  stick dead zone,stick curve,trigger dead zone,trigger curve (e.g. 10,1,20,0)\n"
+             "  -m  output button of A,B,X,Y,left,right,down,up,Start,Z,R,L (e.g. 1,0,3,2; -1 drops)\n"
+             "  -k  deliver unchanged controller states after the given interval (ms)\n"
+             "  -i  longest time (ms) a rumble request waits before it is sent (default 4)\n"
+             "  -r  replay a capture recorded by gcusbadapter.kext instead of reading an adapter\n"
+             "  -f  replay as fast as possible\n"
+             "  -u  receive 0x21 reports from a simulator on a datagram socket\n", name, name, name);
+}
+
+/* parse a comma separated list of output buttons. entries that are not given keep their button */
+static int gcusbd_parse_buttons (const char *arg, GCUSBButtonProfile *profile) {
+    char *end;
+
+    *profile = GCUSBButtonIdentity ();
+    for (int i = 0 ; i < GCUSBButtonCount && *arg ; ++i) {
+        long value = strtol (arg, &end, 0);
+
+        if (end == arg || (',' != *end && '\0' != *end)) {
+            return -1;
+        }
+
+        profile->output[i] = (value >= 0 && value < GCUSBButtonCount) ? (uint8_t) value : (uint8_t) GCUSBButtonNone;
+        arg = ',' == *end ? end + 1 : end;
+    }
+
+    return *arg ? -1 : 0;
+}
+
+static int gcusbd_parse (int argc, char *argv[], gcusbd_options_t *options) {
+    unsigned int axes[4];
+    int c;
+
+    memset (options, 0, sizeof (*options));
+    options->rumble_interval = 4;
+    options->buttons = GCUSBButtonIdentity ();
+
+    while (-1 != (c = getopt (argc, argv, "nva:m:k:i:r:fu:h"))) {
+        switch (c) {
+        case 'n':
+            options->no_uinput = true;
+            break;
+        case 'v':
+            options->verbose = true;
+            break;
+        case 'a':
+            if (4 != sscanf (optarg, "%u,%u,%u,%u", axes, axes + 1, axes + 2, axes + 3)) {
+                return -1;
+            }
+            options->axes.stick_dead_zone = axes[0] > 0xff ? 0xff : axes[0];
+            options->axes.stick_curve = axes[1] > 0xff ? 0xff : axes[1];
+            options->axes.trigger_dead_zone = axes[2] > 0xff ? 0xff : axes[2];
+            options->axes.trigger_curve = axes[3] > 0xff ? 0xff : axes[3];
+            break;
+        case 'm':
+            if (gcusbd_parse_buttons (optarg, &options->buttons)) {
+                return -1;
+            }
+            break;
+        case 'k':
+            options->keep_alive = strtoul (optarg, NULL, 0);
+            break;
+        case 'i':
+            options->rumble_interval = strtoul (optarg, NULL, 0);
+            break;
+        case 'r':
+            options->replay_path = optarg;
+            break;
+        case 'f':
+            options->fast = true;
+            break;
+        case 'u':
+            options->socket_path = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (options->replay_path || options->socket_path) {
+        return (optind == argc && !(options->replay_path && options->socket_path)) ? 0 : -1;
+    }
+
+    if (optind + 1 != argc) {
+        return -1;
+    }
+
+    options->device_path = argv[optind];
+
+    return 0;
+}
+
+int main (int argc, char *argv[]) {
+    static gcusbd_t gcusbd;
+    int ret;
+
+    if (gcusbd_parse (argc, argv, &gcusbd.options)) {
+        gcusbd_usage (argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    gcusbd.epoll_fd = gcusbd.signal_fd = gcusbd.rumble_fd = -1;
+
+    ret = gcusbd_setup (&gcusbd);
+    if (0 == ret) {
+        ret = gcusbd_run (&gcusbd);
+        gcusbd_print_stats (&gcusbd);
+    }
+
+    gcusbd_cleanup (&gcusbd);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,2853 @@
+/* -*- Mode: C++; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * replay tool for WUP-028 GameCube USB adapter captures
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This tool is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This tool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Feeds a capture recorded by gcusbadapter.kext (see the Capture property) or a
+ * synthetic trace through the same decode, calibration, filtering and rumble code used
+ * by the kext. With -b the hot paths are benchmarked instead and with -A every
+ * steady-state operation is checked for heap allocations. -R stress tests the shared
+ * rumble ring with a producer and a consumer thread and -S the state seqlock with a
+ * writer and several reader threads. -M checks the per-port mailbox against a
+ * simulated slow consumer and -B the button remap tables against a bit-by-bit
+ * reference. -L compares the latency of the synchronous and the asynchronous rumble
+ * flush. -T runs the named host check (or all of them) against the portable core
+ * and exits non-zero if any expectation fails, so it doubles as the unit test target.
+ * Builds on Linux and OS X without any project files:
+ *
+ *   c++ -O2 -pthread -o gcusbreplay gcusbreplay.cpp
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../gcusbadapter/gcusbreport.h"
+#include "../gcusbadapter/gcusbhotplug.h"
+#include "../gcusbadapter/gcusbcapture.h"
+#include "../gcusbadapter/gcusbstats.h"
+#include "../gcusbadapter/gcusbaxis.h"
+#include "../gcusbadapter/gcusbbuttons.h"
+#include "../gcusbadapter/gcusbdescriptor.h"
+#include "../gcusbadapter/gcusbshared.h"
+#include "../gcusbadapter/gcusbslots.h"
+
+struct gcusbreplay_options_t {
+    /** replay as fast as possible instead of at the recorded speed */
+    bool fast;
+    /** print every decoded port report */
+    bool verbose;
+    /** benchmark the hot paths */
+    bool benchmark;
+    /** count allocations made by every steady-state operation */
+    bool audit;
+    /** check the injected report descriptors */
+    bool descriptors;
+    /** check the button remap tables */
+    bool buttons_check;
+    /** host check to run ("all" for every check, NULL to skip) */
+    const char *check;
+    /** number of commands pushed through the rumble ring stress test (0 to skip) */
+    unsigned int ring_commands;
+    /** number of states written in the state seqlock stress test (0 to skip) */
+    unsigned int state_writes;
+    /** number of reports sent through the mailbox test (0 to skip) */
+    unsigned int mailbox_reports;
+    /** number of rumble requests in the rumble latency comparison (0 to skip) */
+    unsigned int rumble_requests;
+    /** number of times the trace is run in benchmark mode */
+    unsigned int repeat;
+    /** number of reports in a synthetic trace (0 to read a capture) */
+    unsigned int synthetic;
+    /** dead zones and curves applied to every port */
+    GCUSBAxisConfig axes;
+    /** button remap profile applied to every port */
+    GCUSBButtonProfile buttons;
+    const char *path;
+};
+
+struct gcusbreplay_stats_t {
+    uint64_t input_reports, output_reports, invalid_reports;
+    uint64_t connects, disconnects;
+    uint64_t rumble_transmitted;
+    /** input reports not recorded later than the one before them */
+    uint64_t backwards;
+    uint64_t elapsed;
+};
+
+/** the driver's processing chain for one adapter */
+struct gcusbreplay_pipeline_t {
+    GCUSBReportDecoder decoder;
+    GCUSBAxisMap axes;
+    GCUSBButtonMap buttons;
+    GCUSBChangeFilter filter;
+    GCUSBHotplug hotplug;
+    GCUSBRumbleScheduler rumble;
+    /* intervals between the recorded input reports */
+    GCUSBRateMonitor poll_rate;
+    uint8_t report[GCUSBInputReportLength];
+};
+
+/** per-stage timings collected in benchmark mode */
+struct gcusbreplay_timing_t {
+    GCUSBHistogram decode, axes, buttons, filter, rumble, total;
+};
+
+/* count heap allocations made by anything running in this process. the hot paths are
+ * expected to make none */
+static uint64_t gcusbreplay_allocations;
+
+void *operator new (size_t size) {
+    void *ptr;
+
+    ++gcusbreplay_allocations;
+    ptr = malloc (size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc ();
+    }
+
+    return ptr;
+}
+
+void operator delete (void *ptr) noexcept {
+    free (ptr);
+}
+
+void operator delete (void *ptr, size_t) noexcept {
+    free (ptr);
+}
+
+static uint64_t gcusbreplay_now (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void gcusbreplay_wait_until (uint64_t deadline) {
+    uint64_t now = gcusbreplay_now ();
+
+    if (deadline > now) {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)((deadline - now) / 1000000000ULL);
+        ts.tv_nsec = (long)((deadline - now) % 1000000000ULL);
+        nanosleep (&ts, NULL);
+    }
+}
+
+static void gcusbreplay_usage (const char *name) {
+    fprintf (stderr, "Usage: %s [-f] [-v] [-b|-A] [-r repeat] [-a axes] [-m map] <capture>\n"
+             "       %s [-f] [-v] [-b|-A] [-r repeat] [-a axes] [-m map] -s reports\n"
+             "       %s -D\n"
+             "       %s -B\n"
+             "       %s -R commands\n"
+             "       %s -S writes\n"
+             "       %s -M reports\n"
+             "       %s -L requests\n"
+             "       %s -T check|all|list\n"
+             "  -f  replay as fast as possible\n"
+             "  -v  print every delivered port report\n"
+             "  -a  stick dead zone,stick curve,trigger dead zone,trigger curve (e.g. 10,1,20,0)\n"
+             "  -m  output button of A,B,X,Y,left,right,down,up,Start,Z,R,L (e.g. 1,0,3,2; -1 drops)\n"
+             "  -b  benchmark the decode, axis, button, filter and rumble paths (implies -f)\n"
+             "  -A  fail if any steady-state operation allocates memory (implies -f)\n"
+             "  -r  number of times to run the trace when benchmarking or auditing (default 100)\n"
+             "  -s  use a synthetic trace with the given number of input reports\n"
+             "  -D  dump and check the report descriptors injected for each controller type\n"
+             "  -B  check the button remap tables against a bit-by-bit reference\n"
+             "  -R  stress test the shared rumble ring with the given number of commands\n"
+             "  -S  stress test the state seqlock with the given number of writes\n"
+             "  -M  check report coalescing with a slow consumer for the given number of reports\n"
+             "  -L  compare synchronous and asynchronous rumble latency for the given number of requests\n"
+             "  -T  run the named host check, all of them or list their names\n", name, name, name, name, name, name,
+             name, name, name);
+}
+
+/* parse a comma separated list of output buttons. entries that are not given keep their button */
+static int gcusbreplay_parse_buttons (const char *arg, GCUSBButtonProfile *profile) {
+    char *end;
+
+    *profile = GCUSBButtonIdentity ();
+    for (int i = 0 ; i < GCUSBButtonCount && *arg ; ++i) {
+        long value = strtol (arg, &end, 0);
+
+        if (end == arg || (',' != *end && '\0' != *end)) {
+            return -1;
+        }
+
+        profile->output[i] = (value >= 0 && value < GCUSBButtonCount) ? (uint8_t) value : (uint8_t) GCUSBButtonNone;
+        arg = ',' == *end ? end + 1 : end;
+    }
+
+    return *arg ? -1 : 0;
+}
+
+static int gcusbreplay_parse (int argc, char *argv[], gcusbreplay_options_t *options) {
+    unsigned int axes[4];
+    int c;
+
+    memset (options, 0, sizeof (*options));
+    options->repeat = 100;
+    options->buttons = GCUSBButtonIdentity ();
+
+    while (-1 != (c = getopt (argc, argv, "fva:m:bAr:s:DBR:S:M:L:T:h"))) {
+        switch (c) {
+        case 'D':
+            options->descriptors = true;
+            break;
+        case 'B':
+            options->buttons_check = true;
+            break;
+        case 'T':
+            options->check = optarg;
+            break;
+        case 'R':
+            options->ring_commands = strtoul (optarg, NULL, 0);
+            if (0 == options->ring_commands) {
+                return -1;
+            }
+            break;
+        case 'S':
+            options->state_writes = strtoul (optarg, NULL, 0);
+            if (0 == options->state_writes) {
+                return -1;
+            }
+            break;
+        case 'M':
+            options->mailbox_reports = strtoul (optarg, NULL, 0);
+            if (0 == options->mailbox_reports) {
+                return -1;
+            }
+            break;
+        case 'L':
+            options->rumble_requests = strtoul (optarg, NULL, 0);
+            if (0 == options->rumble_requests) {
+                return -1;
+            }
+            break;
+        case 'a':
+            if (4 != sscanf (optarg, "%u,%u,%u,%u", axes, axes + 1, axes + 2, axes + 3)) {
+                return -1;
+            }
+            options->axes.stick_dead_zone = axes[0] > 0xff ? 0xff : axes[0];
+            options->axes.stick_curve = axes[1] > 0xff ? 0xff : axes[1];
+            options->axes.trigger_dead_zone = axes[2] > 0xff ? 0xff : axes[2];
+            options->axes.trigger_curve = axes[3] > 0xff ? 0xff : axes[3];
+            break;
+        case 'm':
+            if (gcusbreplay_parse_buttons (optarg, &options->buttons)) {
+                return -1;
+            }
+            break;
+        case 'f':
+            options->fast = true;
+            break;
+        case 'v':
+            options->verbose = true;
+            break;
+        case 'b':
+            options->benchmark = options->fast = true;
+            break;
+        case 'A':
+            options->audit = options->fast = true;
+            break;
+        case 'r':
+            options->repeat = strtoul (optarg, NULL, 0);
+            break;
+        case 's':
+            options->synthetic = strtoul (optarg, NULL, 0);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (options->synthetic || options->descriptors || options->buttons_check || options->check || options->ring_commands ||
+        options->state_writes || options->mailbox_reports || options->rumble_requests) {
+        return optind == argc ? 0 : -1;
+    }
+
+    if (optind + 1 != argc) {
+        return -1;
+    }
+
+    options->path = argv[optind];
+
+    return 0;
+}
+
+/**
+ * @brief Build a synthetic trace
+ *
+ * Port 1 and 2 are connected for the whole trace, port 3 is a WaveBird that drops in
+ * and out and port 4 is empty. The sticks sweep slowly and buttons toggle every few
+ * reports so the trace mixes changed and unchanged reports. A rumble report is sent
+ * every 16 input reports. The returned buffer must be freed by the caller.
+ */
+static uint8_t *gcusbreplay_synthesize (unsigned int count, size_t *length) {
+    size_t capacity = GCUSBCaptureHeaderLength + (size_t) count * (GCUSBCaptureRecordHeader + GCUSBInputReportLength) +
+        (size_t) (count / 16 + 2) * (GCUSBCaptureRecordHeader + GCUSBRumbleReportLength);
+    uint8_t *buffer = (uint8_t *) malloc (capacity);
+    uint8_t start_report = GCUSBStartReportID;
+    GCUSBCaptureWriter writer;
+
+    if (!buffer || !writer.start (buffer, capacity)) {
+        free (buffer);
+        return NULL;
+    }
+
+    writer.append (0, GCUSBCaptureOutput, &start_report, 1);
+
+    for (unsigned int k = 0 ; k < count ; ++k) {
+        uint8_t report[GCUSBInputReportLength];
+        uint64_t timestamp = 1000000ULL * (k + 1);
+
+        memset (report, 0, sizeof (report));
+        report[0] = GCUSBInputReportID;
+
+        for (int i = 0 ; i < 3 ; ++i) {
+            uint8_t *port_report = GCUSBReportDecoder::portReport (report, i);
+
+            if (2 == i && (k / 500) % 4 == 3) {
+                /* WaveBird out of range */
+                continue;
+            }
+
+            port_report[0] = 2 == i ? 0x24 : 0x14;
+            port_report[1] = (k / 7) % 5 ? 0x00 : 0x01 << (k % 8);
+            port_report[2] = (k / 11) % 9 ? 0x00 : 0x02;
+            port_report[3] = 0x80 + (int) (k / 3 % 64) - 32;
+            port_report[4] = 0x80 + (int) (k / 5 % 64) - 32;
+            port_report[5] = 0x80;
+            port_report[6] = 0x80;
+            port_report[7] = 0x20 + (k / 13 % 8);
+            port_report[8] = 0x20;
+        }
+
+        writer.append (timestamp, GCUSBCaptureInput, report, sizeof (report));
+
+        if (15 == k % 16) {
+            uint8_t rumble[GCUSBRumbleReportLength] = {GCUSBRumbleReportID, (uint8_t) ((k / 16) & 1), 0, 0, 0};
+            writer.append (timestamp + 1, GCUSBCaptureOutput, rumble, sizeof (rumble));
+        }
+    }
+
+    *length = writer.used ();
+
+    return buffer;
+}
+
+/**
+ * @brief Parse an injected descriptor and check it against the decoder's report layout
+ *
+ * @returns 0 if the descriptor is well formed and its reports have the expected sizes
+ */
+static int gcusbreplay_check_descriptor (const char *name, const uint8_t *data, size_t length, bool rumble) {
+    uint32_t input_bits = GCUSBHIDReportBits (data, length, GCUSBPortReportID, GCUSBHIDInputTag);
+    uint32_t output_bits = GCUSBHIDReportBits (data, length, GCUSBPortRumbleReportID, GCUSBHIDOutputTag);
+    bool well_formed = GCUSBHIDWellFormed (data, length);
+    int ret = 0;
+
+    printf ("%s descriptor (%zu bytes):", name, length);
+    for (size_t i = 0 ; i < length ; ++i) {
+        printf ("%s%02x", (i % 16) ? " " : "\n  ", data[i]);
+    }
+    printf ("\n  well formed: %s\n", well_formed ? "yes" : "no");
+    printf ("  input report 0x%02x: %u bits\n", GCUSBPortReportID, input_bits);
+    printf ("  output report 0x%02x: %u bits\n", GCUSBPortRumbleReportID, output_bits);
+
+    if (!well_formed) {
+        ret = -1;
+    }
+
+    /* the decoder hands each port its slice with the status byte replaced by the report id */
+    if (8 * (GCUSBPortReportLength - 1) != input_bits) {
+        fprintf (stderr, "%s: input report 0x%02x should be %u bits\n", name, GCUSBPortReportID,
+                 8 * (GCUSBPortReportLength - 1));
+        ret = -1;
+    }
+
+    if ((rumble ? 8u : 0u) != output_bits) {
+        fprintf (stderr, "%s: unexpected size of output report 0x%02x\n", name, GCUSBPortRumbleReportID);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int gcusbreplay_check_descriptors (void) {
+    int ret;
+
+    ret = gcusbreplay_check_descriptor ("wired", GCUSBWiredDescriptor::data, GCUSBWiredDescriptor::length, true);
+    ret |= gcusbreplay_check_descriptor ("WaveBird", GCUSBWaveBirdDescriptor::data, GCUSBWaveBirdDescriptor::length,
+                                         false);
+
+    return ret;
+}
+
+/* compare the tables of a port against the reference for every button word */
+static uint64_t gcusbreplay_check_profile (GCUSBButtonMap *map, int port, const GCUSBButtonProfile &profile) {
+    const GCUSBButtonProfile &effective = map->configure (port, profile);
+    uint8_t report[GCUSBInputReportLength], expected[GCUSBInputReportLength];
+    uint64_t errors = 0;
+
+    for (unsigned int buttons = 0 ; buttons < 0x10000 ; ++buttons) {
+        uint16_t reference = GCUSBButtonRemap (profile, (uint16_t) buttons);
+
+        errors += map->remap (port, (uint16_t) buttons) != reference;
+        errors += GCUSBButtonRemap (effective, (uint16_t) buttons) != reference;
+
+        /* apply() only touches the button bytes of the port */
+        for (size_t i = 0 ; i < sizeof (report) ; ++i) {
+            report[i] = (uint8_t) (buttons * 7 + i * 13);
+        }
+        memcpy (expected, report, sizeof (report));
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            uint8_t *slice = GCUSBReportDecoder::portReport (expected, i) + GCUSBPortButtonOffset;
+            uint16_t output = map->remap (i, (uint16_t) (slice[0] | slice[1] << 8));
+
+            slice[0] = (uint8_t) output;
+            slice[1] = (uint8_t) (output >> 8);
+        }
+        GCUSBReportDecoder::portReport (report, port)[GCUSBPortButtonOffset] = (uint8_t) buttons;
+        GCUSBReportDecoder::portReport (report, port)[GCUSBPortButtonOffset + 1] = (uint8_t) (buttons >> 8);
+        GCUSBReportDecoder::portReport (expected, port)[GCUSBPortButtonOffset] = (uint8_t) reference;
+        GCUSBReportDecoder::portReport (expected, port)[GCUSBPortButtonOffset + 1] = (uint8_t) (reference >> 8);
+
+        map->apply (report);
+        errors += 0 != memcmp (report, expected, sizeof (report));
+    }
+
+    return errors;
+}
+
+/**
+ * @brief Check the button remap tables
+ *
+ * Builds tables for a set of fixed profiles (identity, swaps, dropped and merged buttons,
+ * out of range outputs) and pseudo-random profiles on every port and compares them with
+ * the bit-by-bit reference for all 65536 button words.
+ */
+static int gcusbreplay_check_buttons (void) {
+    GCUSBButtonMap map_storage, *map = &map_storage;
+    GCUSBButtonProfile profile;
+    uint64_t errors = 0, profiles = 0;
+    uint32_t seed = 0x47435553;
+
+    /* identity on every port */
+    for (int i = 0 ; i < GCUSBPortCount ; ++i, ++profiles) {
+        errors += gcusbreplay_check_profile (map, i, GCUSBButtonIdentity ());
+    }
+
+    /* swap A/B and X/Y */
+    profile = GCUSBButtonIdentity ();
+    profile.output[GCUSBButtonA] = GCUSBButtonB;
+    profile.output[GCUSBButtonB] = GCUSBButtonA;
+    profile.output[GCUSBButtonX] = GCUSBButtonY;
+    profile.output[GCUSBButtonY] = GCUSBButtonX;
+    errors += gcusbreplay_check_profile (map, 0, profile);
+    ++profiles;
+
+    /* drop the D-pad and report Z as A */
+    profile = GCUSBButtonIdentity ();
+    for (int i = GCUSBButtonDPadLeft ; i <= GCUSBButtonDPadUp ; ++i) {
+        profile.output[i] = GCUSBButtonNone;
+    }
+    profile.output[GCUSBButtonZ] = GCUSBButtonA;
+    errors += gcusbreplay_check_profile (map, 1, profile);
+    ++profiles;
+
+    /* every bit reversed and every bit out of range */
+    for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+        profile.output[i] = (uint8_t) (GCUSBButtonCount - 1 - i);
+    }
+    errors += gcusbreplay_check_profile (map, 2, profile);
+    memset (profile.output, GCUSBButtonCount, sizeof (profile.output));
+    errors += gcusbreplay_check_profile (map, 3, profile);
+    profiles += 2;
+
+    for (int k = 0 ; k < 64 ; ++k, ++profiles) {
+        for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            /* about one in nine outputs is out of range */
+            profile.output[i] = (uint8_t) ((seed >> 16) % (GCUSBButtonCount + 2));
+        }
+
+        errors += gcusbreplay_check_profile (map, k % GCUSBPortCount, profile);
+    }
+
+    printf ("profiles checked: %llu\n", (unsigned long long) profiles);
+    printf ("mismatches:       %llu\n", (unsigned long long) errors);
+
+    return errors ? -1 : 0;
+}
+
+/* report a failed expectation of a host check. returns 1 if the expectation failed */
+static int gcusbreplay_expect (const char *check, bool ok, const char *what) {
+    if (!ok) {
+        fprintf (stderr, "%s: %s\n", check, what);
+    }
+
+    return !ok;
+}
+
+/* fill a port slice of a 0x21 report */
+static void gcusbreplay_fill_port (uint8_t *report, int port, uint8_t status, uint16_t buttons, const uint8_t *sticks,
+                                   uint8_t left, uint8_t right) {
+    uint8_t *port_report = GCUSBReportDecoder::portReport (report, port);
+
+    port_report[0] = status;
+    port_report[1] = (uint8_t) buttons;
+    port_report[2] = (uint8_t) (buttons >> 8);
+    memcpy (port_report + GCUSBPortStickOffset, sticks, GCUSBPortStickCount);
+    port_report[7] = left;
+    port_report[8] = right;
+}
+
+/**
+ * @brief Check the in-place decode of the 0x21 report
+ *
+ * Covers rejected reports, the slice layout handed to the ports, the saved status bytes
+ * and flags, and that decoding never writes outside the report or changes anything but
+ * the report id and the stick bytes of each slice.
+ */
+static int gcusbreplay_check_decode (void) {
+    static const uint8_t centre[GCUSBPortStickCount] = {0x80, 0x80, 0x80, 0x80};
+    static const uint8_t origin[GCUSBPortStickCount] = {0x7a, 0x90, 0x85, 0x85};
+    uint8_t buffer[GCUSBInputReportLength + 16], expected[sizeof (buffer)];
+    uint8_t *report = buffer + 8;
+    GCUSBReportDecoder decoder;
+    int errors = 0;
+
+    memset (buffer, 0xa5, sizeof (buffer));
+    memset (report, 0, GCUSBInputReportLength);
+    report[0] = GCUSBInputReportID;
+    gcusbreplay_fill_port (report, 0, 0x14, 0x0101, origin, 0x20, 0x30);
+    gcusbreplay_fill_port (report, 1, 0x22, 0x0000, centre, 0x00, 0xff);
+    gcusbreplay_fill_port (report, 3, 0x10, 0x1000, origin, 0x40, 0x50);
+    memcpy (expected, buffer, sizeof (buffer));
+
+    /* anything but a complete 0x21 report is refused without touching the buffer */
+    errors += gcusbreplay_expect ("decode", !decoder.decode (report, GCUSBInputReportLength - 1), "short report accepted");
+    errors += gcusbreplay_expect ("decode", !decoder.decode (report, GCUSBInputReportLength + 1), "long report accepted");
+    report[0] = GCUSBRumbleReportID;
+    errors += gcusbreplay_expect ("decode", !decoder.decode (report, GCUSBInputReportLength), "wrong report id accepted");
+    report[0] = GCUSBInputReportID;
+    errors += gcusbreplay_expect ("decode", 0 == memcmp (buffer, expected, sizeof (buffer)), "refused report was modified");
+    errors += gcusbreplay_expect ("decode", 0 == decoder.status (0) && 0 == decoder.rumble (),
+                                  "refused report changed the decoder state");
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        errors += gcusbreplay_expect ("decode", GCUSBReportDecoder::portReport (report, i) ==
+                                      report + 1 + i * GCUSBPortReportLength, "port slice is not in place");
+    }
+
+    errors += gcusbreplay_expect ("decode", decoder.decode (report, GCUSBInputReportLength), "0x21 report refused");
+
+    /* connected slices become 0x50 reports with sticks relative to their origin. the empty
+     * slice keeps its status byte. buttons and triggers are never touched */
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        uint8_t *slice = GCUSBReportDecoder::portReport (expected + 8, i);
+
+        if (slice[0]) {
+            slice[0] = GCUSBPortReportID;
+        }
+        memset (slice + GCUSBPortStickOffset, 0, GCUSBPortStickCount);
+    }
+    errors += gcusbreplay_expect ("decode", 0 == memcmp (buffer, expected, sizeof (buffer)),
+                                  "first report decoded incorrectly");
+
+    errors += gcusbreplay_expect ("decode", 0x14 == decoder.status (0) && 0x22 == decoder.status (1) &&
+                                  0 == decoder.status (2) && 0x10 == decoder.status (3), "status bytes not saved");
+    errors += gcusbreplay_expect ("decode", decoder.flags (0).rumble () && !decoder.flags (1).rumble () &&
+                                  decoder.flags (1).wireless () && !decoder.flags (2).connected () &&
+                                  GCUSBStatusWired == decoder.flags (3).type () && !decoder.flags (3).rumblePower (),
+                                  "status flags decoded incorrectly");
+    errors += gcusbreplay_expect ("decode", 0x1 == decoder.rumble (), "rumble mask should only hold the first port");
+    errors += gcusbreplay_expect ("decode", 0 == memcmp (decoder.origin (0), origin, GCUSBPortStickCount) &&
+                                  0 == memcmp (decoder.origin (1), centre, GCUSBPortStickCount),
+                                  "origins not captured on connect");
+
+    printf ("decode:           %d failed expectations\n", errors);
+
+    return errors ? -1 : 0;
+}
+
+enum {
+    GCUSBREPLAY_CALIBRATION_REPORTS = 128,
+};
+
+/**
+ * @brief Raw port slice of report k of the calibration trace
+ *
+ * Port 1 is a wired pad connected throughout. Port 2 is a WaveBird whose sticks read
+ * zero until it powers up with report 3. Port 3 is recentered before report 40 and
+ * again before report 80, which has a zero stick so the origin is taken from report 81.
+ * Port 4 is unplugged for reports 60 to 69 and comes back with a different origin. The
+ * sticks sweep up to 127 away from the origin, the triggers sweep their whole range.
+ *
+ * @returns the stick origin the driver should be using for the slice
+ */
+static const uint8_t *gcusbreplay_calibration_port (unsigned int k, int port, uint8_t *slice) {
+    static const uint8_t origins[][GCUSBPortStickCount] = {
+        {0x7a, 0x90, 0x85, 0x7c}, {0x80, 0x7e, 0x82, 0x80}, {0x88, 0x77, 0x80, 0x80}, {0x70, 0x88, 0x80, 0x90},
+        {0x84, 0x84, 0x7b, 0x7f}, {0x80, 0x80, 0x80, 0x80}, {0x8c, 0x72, 0x7d, 0x83}, {0x00, 0x00, 0x00, 0x00},
+    };
+    const uint8_t *origin;
+    bool centred = 0 == k;
+
+    memset (slice, 0, GCUSBPortReportLength);
+
+    switch (port) {
+    case 0:
+        origin = origins[0];
+        break;
+    case 1:
+        if (k < 3) {
+            slice[0] = 0x22;
+            return origins[7];
+        }
+        origin = origins[1];
+        centred = 3 == k;
+        break;
+    case 2:
+        origin = k < 40 ? origins[2] : k < 81 ? origins[3] : origins[4];
+        centred = 0 == k || 40 == k || 81 == k;
+        break;
+    default:
+        if (k >= 60 && k < 70) {
+            return origins[7];
+        }
+        origin = k < 60 ? origins[5] : origins[6];
+        centred = 0 == k || 70 == k;
+        break;
+    }
+
+    slice[0] = 1 == port ? 0x24 : 0x14;
+    slice[1] = (uint8_t) (k * 3);
+    slice[2] = (uint8_t) (k & 0x1f);
+
+    for (int j = 0 ; j < GCUSBPortStickCount ; ++j) {
+        int offset = (int) ((k * 7 + j * 31 + port * 17) % 255) - 127;
+        int raw = origin[j] + offset;
+
+        slice[GCUSBPortStickOffset + j] = centred ? origin[j] : (uint8_t) (raw < 1 ? 1 : raw > 0xff ? 0xff : raw);
+    }
+
+    if (2 == port && 80 == k) {
+        slice[GCUSBPortStickOffset + 2] = 0;
+    }
+
+    slice[GCUSBPortTriggerOffset] = (uint8_t) (k * 13 + port);
+    slice[GCUSBPortTriggerOffset + 1] = (uint8_t) (0xff - k * 5);
+
+    return origin;
+}
+
+/**
+ * @brief Check stick origin capture and correction against a calibration trace
+ *
+ * The trace is written and read back in the capture format and every 0x21 report goes
+ * through the decoder and the default axis tables like in the kext. Every delivered
+ * stick has to be its raw offset from the true origin clamped to the declared range and
+ * every trigger its raw value clamped to the declared range. Deflections stay within
+ * 127 of the origin, which covers the travel of a real stick.
+ */
+static int gcusbreplay_check_calibration (void) {
+    static uint8_t capture[GCUSBCaptureHeaderLength +
+                           GCUSBREPLAY_CALIBRATION_REPORTS * (GCUSBCaptureRecordHeader + GCUSBInputReportLength)];
+    GCUSBAxisMap axes_storage, *axes = &axes_storage;
+    GCUSBReportDecoder decoder;
+    GCUSBCaptureWriter writer;
+    GCUSBCaptureRecord record;
+    uint64_t checked = 0;
+    unsigned int k = 0;
+    int errors = 0;
+
+    writer.start (capture, sizeof (capture));
+    for (k = 0 ; k < GCUSBREPLAY_CALIBRATION_REPORTS ; ++k) {
+        uint8_t report[GCUSBInputReportLength];
+
+        report[0] = GCUSBInputReportID;
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            gcusbreplay_calibration_port (k, i, GCUSBReportDecoder::portReport (report, i));
+        }
+
+        writer.append (1000000ULL * (k + 1), GCUSBCaptureInput, report, sizeof (report));
+    }
+
+    GCUSBCaptureReader reader (capture, writer.used ());
+    errors += gcusbreplay_expect ("calibration", reader.valid (), "calibration trace is not a capture");
+
+    for (k = 0 ; reader.next (&record) ; ++k) {
+        uint8_t report[GCUSBInputReportLength];
+
+        memcpy (report, record.report, record.length);
+
+        if (40 == k || 80 == k) {
+            decoder.recenter (2);
+        }
+
+        if (!decoder.decode (report, record.length)) {
+            errors += gcusbreplay_expect ("calibration", false, "calibration report refused");
+            continue;
+        }
+        axes->apply (report);
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            const uint8_t *slice = GCUSBReportDecoder::portReport (report, i);
+            uint8_t raw[GCUSBPortReportLength], expected[GCUSBPortReportLength];
+            const uint8_t *origin = gcusbreplay_calibration_port (k, i, raw);
+
+            if (0 == raw[0]) {
+                continue;
+            }
+
+            memcpy (expected, raw, sizeof (expected));
+            expected[0] = GCUSBPortReportID;
+            for (int j = 0 ; j < GCUSBPortStickCount ; ++j) {
+                int offset = (int) raw[GCUSBPortStickOffset + j] - (int) origin[j];
+
+                offset = offset > GCUSBStickRange ? GCUSBStickRange : offset < -GCUSBStickRange ? -GCUSBStickRange : offset;
+                expected[GCUSBPortStickOffset + j] = (uint8_t) offset;
+            }
+            for (int j = 0 ; j < GCUSBPortTriggerCount ; ++j) {
+                uint8_t value = raw[GCUSBPortTriggerOffset + j];
+
+                expected[GCUSBPortTriggerOffset + j] = value < GCUSBTriggerMinimum ? (uint8_t) GCUSBTriggerMinimum :
+                    value > GCUSBTriggerMaximum ? (uint8_t) GCUSBTriggerMaximum : value;
+            }
+
+            if (memcmp (slice, expected, sizeof (expected))) {
+                fprintf (stderr, "calibration: report %u port %d: got", k, i + 1);
+                for (int j = 0 ; j < GCUSBPortReportLength ; ++j) {
+                    fprintf (stderr, " %02x", slice[j]);
+                }
+                fprintf (stderr, " expected");
+                for (int j = 0 ; j < GCUSBPortReportLength ; ++j) {
+                    fprintf (stderr, " %02x", expected[j]);
+                }
+                fprintf (stderr, "\n");
+                ++errors;
+            }
+
+            /* the origin only changes on connect, power up or recenter */
+            if (memcmp (decoder.origin (i), origin, GCUSBPortStickCount)) {
+                fprintf (stderr, "calibration: report %u port %d: wrong origin\n", k, i + 1);
+                ++errors;
+            }
+
+            ++checked;
+        }
+    }
+
+    errors += gcusbreplay_expect ("calibration", GCUSBREPLAY_CALIBRATION_REPORTS == k, "calibration trace truncated");
+
+    printf ("calibration:      %llu port reports checked, %d failed expectations\n", (unsigned long long) checked,
+            errors);
+
+    return errors ? -1 : 0;
+}
+
+/** one input report of a hotplug sequence */
+struct gcusbreplay_hotplug_step_t {
+    /** status byte fed to update() */
+    uint8_t status;
+    /** work loop after the report: 0 idle, 'p' still busy, 'a' attach succeeds, 'f' attach fails, 'd' detach */
+    char work;
+    /** state expected once the work loop ran */
+    GCUSBHotplug::State state;
+};
+
+struct gcusbreplay_hotplug_sequence_t {
+    const char *name;
+    unsigned int connect, disconnect;
+    const gcusbreplay_hotplug_step_t *steps;
+    size_t count;
+    /** status byte expected from type() at the end */
+    uint8_t type;
+};
+
+#define GCUSBREPLAY_SEQUENCE(name, connect, disconnect, steps, type) \
+    {name, connect, disconnect, steps, sizeof (steps) / sizeof (steps[0]), type}
+
+/* run a hotplug sequence on one port and check the state after every report */
+static int gcusbreplay_check_hotplug_sequence (const gcusbreplay_hotplug_sequence_t *sequence, int port) {
+    GCUSBHotplug hotplug;
+    int errors = 0;
+
+    hotplug.setThresholds (sequence->connect, sequence->disconnect);
+
+    for (size_t i = 0 ; i < sequence->count ; ++i) {
+        const gcusbreplay_hotplug_step_t *step = sequence->steps + i;
+        GCUSBHotplug::State before = hotplug.state (port);
+        bool owned = GCUSBHotplug::StateAttaching == before || GCUSBHotplug::StateDetaching == before;
+        bool work = hotplug.update (port, step->status);
+        GCUSBHotplug::Action action = hotplug.pending (port);
+
+        /* update() asks for the work loop exactly when it hands the port over */
+        if (work != (!owned && GCUSBHotplug::ActionNone != action) || (owned && hotplug.state (port) != before)) {
+            fprintf (stderr, "hotplug: %s: report %zu: wrong hand-off to the work loop\n", sequence->name, i);
+            ++errors;
+        }
+
+        switch (step->work) {
+        case 'a':
+        case 'f':
+            errors += gcusbreplay_expect ("hotplug", GCUSBHotplug::ActionAttach == action, "attach not pending");
+            hotplug.attached (port, 'a' == step->work);
+            break;
+        case 'd':
+            errors += gcusbreplay_expect ("hotplug", GCUSBHotplug::ActionDetach == action, "detach not pending");
+            hotplug.detached (port);
+            break;
+        case 'p':
+            errors += gcusbreplay_expect ("hotplug", GCUSBHotplug::ActionNone != action, "no work pending");
+            break;
+        default:
+            errors += gcusbreplay_expect ("hotplug", GCUSBHotplug::ActionNone == action, "unexpected work pending");
+            break;
+        }
+
+        if (hotplug.state (port) != step->state || hotplug.active (port) != (GCUSBHotplug::StateActive == step->state)) {
+            fprintf (stderr, "hotplug: %s: report %zu: state %d, expected %d\n", sequence->name, i,
+                     (int) hotplug.state (port), (int) step->state);
+            ++errors;
+        }
+
+        for (int j = 0 ; j < GCUSBPortCount ; ++j) {
+            if (j != port && GCUSBHotplug::StateEmpty != hotplug.state (j)) {
+                fprintf (stderr, "hotplug: %s: report %zu: port %d changed\n", sequence->name, i, j + 1);
+                ++errors;
+            }
+        }
+    }
+
+    if (hotplug.type (port) != sequence->type) {
+        fprintf (stderr, "hotplug: %s: type %02x, expected %02x\n", sequence->name, hotplug.type (port), sequence->type);
+        ++errors;
+    }
+
+    return errors;
+}
+
+/**
+ * @brief Check the hotplug state machine against scripted connect sequences
+ *
+ * Covers connect, disconnect and reconnect with the kext's thresholds, controllers that
+ * flap around either threshold, status changes while the work loop owns the port,
+ * failed attaches and the smallest thresholds.
+ */
+static int gcusbreplay_check_hotplug (void) {
+    typedef GCUSBHotplug H;
+    static const gcusbreplay_hotplug_step_t reconnect[] = {
+        {0x00, 0, H::StateEmpty}, {0x14, 0, H::StateArming}, {0x14, 'a', H::StateActive}, {0x14, 0, H::StateActive},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 'd', H::StateEmpty}, {0x00, 0, H::StateEmpty},
+        {0x24, 0, H::StateArming}, {0x24, 'a', H::StateActive}, {0x24, 0, H::StateActive},
+    };
+    static const gcusbreplay_hotplug_step_t flapping[] = {
+        /* a loose cable never arms for long enough */
+        {0x14, 0, H::StateArming}, {0x00, 0, H::StateEmpty}, {0x14, 0, H::StateArming}, {0x00, 0, H::StateEmpty},
+        {0x14, 0, H::StateArming}, {0x14, 'a', H::StateActive},
+        /* short dropouts keep the port */
+        {0x00, 0, H::StateReleasing}, {0x14, 0, H::StateActive}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x14, 0, H::StateActive},
+        /* seven missing reports, one back: the count starts over */
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x14, 0, H::StateActive},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 'd', H::StateEmpty},
+    };
+    static const gcusbreplay_hotplug_step_t owned[] = {
+        /* reports are ignored while the work loop attaches or detaches */
+        {0x14, 0, H::StateArming}, {0x14, 'p', H::StateAttaching}, {0x00, 'p', H::StateAttaching},
+        {0x00, 'p', H::StateAttaching}, {0x00, 'a', H::StateActive},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing}, {0x00, 0, H::StateReleasing},
+        {0x00, 0, H::StateReleasing}, {0x00, 'p', H::StateDetaching}, {0x24, 'p', H::StateDetaching},
+        {0x24, 'd', H::StateEmpty}, {0x24, 0, H::StateArming}, {0x24, 'a', H::StateActive},
+    };
+    static const gcusbreplay_hotplug_step_t failed[] = {
+        {0x14, 0, H::StateArming}, {0x14, 'f', H::StateEmpty}, {0x14, 0, H::StateArming},
+        {0x14, 'f', H::StateEmpty}, {0x14, 0, H::StateArming}, {0x14, 'a', H::StateActive},
+        /* flags change while the controller stays connected */
+        {0x10, 0, H::StateActive},
+    };
+    static const gcusbreplay_hotplug_step_t immediate[] = {
+        {0x14, 'a', H::StateActive}, {0x00, 'd', H::StateEmpty}, {0x22, 'a', H::StateActive},
+        {0x00, 'd', H::StateEmpty}, {0x00, 0, H::StateEmpty}, {0x14, 'a', H::StateActive},
+    };
+    static const gcusbreplay_hotplug_sequence_t sequences[] = {
+        GCUSBREPLAY_SEQUENCE ("reconnect", 2, 8, reconnect, 0x24),
+        GCUSBREPLAY_SEQUENCE ("flapping", 2, 8, flapping, 0x14),
+        GCUSBREPLAY_SEQUENCE ("work loop", 2, 8, owned, 0x24),
+        GCUSBREPLAY_SEQUENCE ("failed attach", 2, 8, failed, 0x10),
+        /* thresholds of 0 are raised to 1 */
+        GCUSBREPLAY_SEQUENCE ("immediate", 0, 0, immediate, 0x14),
+    };
+    int errors = 0;
+
+    for (size_t i = 0 ; i < sizeof (sequences) / sizeof (sequences[0]) ; ++i) {
+        for (int port = 0 ; port < GCUSBPortCount ; ++port) {
+            errors += gcusbreplay_check_hotplug_sequence (sequences + i, port);
+        }
+    }
+
+    printf ("hotplug:          %zu sequences, %d failed expectations\n", sizeof (sequences) / sizeof (sequences[0]),
+            errors);
+
+    return errors ? -1 : 0;
+}
+
+/**
+ * @brief Check the latency histogram
+ *
+ * Covers the bucket of every power of two and its neighbours, samples too large for the
+ * last bucket, and percentiles of distributions with known answers.
+ */
+static int gcusbreplay_check_histogram (void) {
+    GCUSBHistogram histogram;
+    uint64_t sum = 0;
+    int errors = 0;
+
+    errors += gcusbreplay_expect ("histogram", 0 == GCUSBHistogram::bucket (0) && 1 == GCUSBHistogram::bucket (1),
+                                  "0 or 1 ns in the wrong bucket");
+    for (unsigned int b = 2 ; b < GCUSBHistogramBuckets ; ++b) {
+        uint64_t low = 1ULL << (b - 1);
+
+        /* bucket b holds [2^(b-1), 2^b) and bucketLimit() is its largest sample */
+        if (GCUSBHistogram::bucket (low) != b || GCUSBHistogram::bucket (low - 1) != b - 1 ||
+            GCUSBHistogram::bucketLimit (b) != 2 * low - 1 ||
+            GCUSBHistogram::bucket (GCUSBHistogram::bucketLimit (b)) != b) {
+            fprintf (stderr, "histogram: bucket %u has the wrong boundaries\n", b);
+            ++errors;
+        }
+    }
+
+    /* everything from 2^30 up lands in the last bucket */
+    errors += gcusbreplay_expect ("histogram", GCUSBHistogramBuckets - 1 == GCUSBHistogram::bucket (1ULL << 40) &&
+                                  GCUSBHistogramBuckets - 1 == GCUSBHistogram::bucket (~0ULL),
+                                  "overflow not clamped to the last bucket");
+
+    errors += gcusbreplay_expect ("histogram", 0 == histogram.percentile (50) && 0 == histogram.count () &&
+                                  0 == histogram.max (), "empty histogram not empty");
+
+    /* 1 to 100 ns: the median is in [32, 64) and the 99th percentile in [64, 128), clamped
+     * to the largest sample */
+    for (uint64_t ns = 1 ; ns <= 100 ; ++ns) {
+        histogram.record (ns);
+        sum += ns;
+    }
+    errors += gcusbreplay_expect ("histogram", 100 == histogram.count () && sum == histogram.sum () &&
+                                  100 == histogram.max (), "count, sum or max wrong");
+    errors += gcusbreplay_expect ("histogram", 32 == histogram.bucketCount (6) && 37 == histogram.bucketCount (7),
+                                  "uniform samples bucketed incorrectly");
+    errors += gcusbreplay_expect ("histogram", 1 == histogram.percentile (0) && 1 == histogram.percentile (1) &&
+                                  63 == histogram.percentile (50) && 63 == histogram.percentile (63) &&
+                                  100 == histogram.percentile (64) && 100 == histogram.percentile (99) &&
+                                  100 == histogram.percentile (100), "uniform percentiles wrong");
+
+    /* 990 fast samples and 10 outliers past the last bucket boundary */
+    histogram.reset ();
+    errors += gcusbreplay_expect ("histogram", 0 == histogram.count () && 0 == histogram.sum () &&
+                                  0 == histogram.max () && 0 == histogram.bucketCount (10), "reset left samples");
+    for (int i = 0 ; i < 990 ; ++i) {
+        histogram.record (1000);
+    }
+    for (int i = 0 ; i < 10 ; ++i) {
+        histogram.record ((1ULL << 32) + i);
+    }
+    errors += gcusbreplay_expect ("histogram", 990 == histogram.bucketCount (10) &&
+                                  10 == histogram.bucketCount (GCUSBHistogramBuckets - 1), "outliers bucketed incorrectly");
+    errors += gcusbreplay_expect ("histogram", 1023 == histogram.percentile (50) && 1023 == histogram.percentile (99) &&
+                                  (1ULL << 32) + 9 == histogram.percentile (100) && (1ULL << 32) + 9 == histogram.max (),
+                                  "outlier percentiles wrong");
+
+    /* zero latency is its own bucket and percentile */
+    histogram.reset ();
+    histogram.record (0);
+    histogram.record (0);
+    histogram.record (3);
+    errors += gcusbreplay_expect ("histogram", 2 == histogram.bucketCount (0) && 0 == histogram.percentile (66) &&
+                                  3 == histogram.percentile (67), "zero samples handled incorrectly");
+
+    printf ("histogram:        %d failed expectations\n", errors);
+
+    return errors ? -1 : 0;
+}
+
+/* record reports count intervals apart after start. returns the time of the last one */
+static uint64_t gcusbreplay_rate_feed (GCUSBRateMonitor *monitor, uint64_t start, uint64_t interval,
+                                       unsigned int count) {
+    for (unsigned int i = 0 ; i < count ; ++i) {
+        monitor->record (start + i * interval);
+    }
+
+    return start + (count - 1) * interval;
+}
+
+static int gcusbreplay_check_rate (void) {
+    GCUSBRateMonitor monitor;
+    uint64_t now;
+    int errors = 0;
+
+    errors += gcusbreplay_expect ("rate", 0 == monitor.rate () && 0 == monitor.samples () &&
+                                  GCUSBRateMonitorGap == monitor.gapThreshold (), "new monitor not empty");
+
+    /* a steady 1 kHz stream: the first interval seeds the mean, no jitter and no gaps */
+    errors += gcusbreplay_expect ("rate", 0 == monitor.record (1000000) && 1000000 == monitor.record (2000000),
+                                  "first report or interval returned wrong");
+    now = gcusbreplay_rate_feed (&monitor, 3000000, 1000000, 99);
+    errors += gcusbreplay_expect ("rate", 100 == monitor.samples () && 1000000 == monitor.mean () &&
+                                  0 == monitor.jitter () && 1000000 == monitor.max () &&
+                                  1000000 == monitor.rate (), "steady stream measured wrong");
+    errors += gcusbreplay_expect ("rate", 0 == monitor.gaps () && 0 == monitor.missed (), "steady stream has gaps");
+
+    /* one 2 ms interval moves the mean by 1/16 of the difference:
+     * mean = 1000000 + 1000000 / 16 = 1062500, jitter = |2000000 - 1062500| / 16 = 58593 and
+     * the rate is 10^12 / 1062500 mHz. it is not longer than twice the mean so no gap */
+    monitor.record (now + 2000000);
+    errors += gcusbreplay_expect ("rate", 1062500 == monitor.mean () && 58593 == monitor.jitter () &&
+                                  941176 == monitor.rate () && 2000000 == monitor.max (),
+                                  "averages after one long interval wrong");
+    errors += gcusbreplay_expect ("rate", 0 == monitor.gaps (), "interval at the threshold counted as a gap");
+
+    /* without a nominal interval gaps are measured against the mean before the interval:
+     * 4 ms after a mean of 1062500 ns is a gap that missed (4000000 + 531250) / 1062500 - 1 = 3 */
+    monitor.reset ();
+    now = gcusbreplay_rate_feed (&monitor, 1000000, 1000000, 2);
+    monitor.record (now + 2000000);
+    monitor.record (now + 6000000);
+    errors += gcusbreplay_expect ("rate", 1 == monitor.gaps () && 3 == monitor.missed (),
+                                  "gap against the measured mean miscounted");
+
+    /* with a nominal 1 ms interval: 2 ms is no gap, 2 ms + 1 ns misses one report and
+     * 5 ms four */
+    monitor.reset ();
+    monitor.setNominal (1000000);
+    errors += gcusbreplay_expect ("rate", 0 == monitor.samples () && 0 == monitor.max () && 0 == monitor.gaps () &&
+                                  1000000 == monitor.nominal (), "reset kept samples or the nominal interval");
+    now = gcusbreplay_rate_feed (&monitor, 1000000, 1000000, 10);
+    now = gcusbreplay_rate_feed (&monitor, now + 2000000, 1000000, 1);
+    errors += gcusbreplay_expect ("rate", 0 == monitor.gaps (), "interval of twice the nominal counted as a gap");
+    now = gcusbreplay_rate_feed (&monitor, now + 2000001, 1000000, 1);
+    now = gcusbreplay_rate_feed (&monitor, now + 5000000, 1000000, 1);
+    errors += gcusbreplay_expect ("rate", 2 == monitor.gaps () && 5 == monitor.missed () && 5000000 == monitor.max (),
+                                  "gaps against the nominal interval miscounted");
+
+    /* thresholds below 2 are raised to 2. at 4 a 4 ms interval is no gap but 5 ms is */
+    monitor.setGapThreshold (1);
+    errors += gcusbreplay_expect ("rate", 2 == monitor.gapThreshold (), "gap threshold below 2 accepted");
+    monitor.reset ();
+    monitor.setGapThreshold (4);
+    now = gcusbreplay_rate_feed (&monitor, 1000000, 1000000, 2);
+    now = gcusbreplay_rate_feed (&monitor, now + 4000000, 1000000, 1);
+    errors += gcusbreplay_expect ("rate", 0 == monitor.gaps (), "interval at a threshold of 4 counted as a gap");
+    now = gcusbreplay_rate_feed (&monitor, now + 5000000, 1000000, 1);
+    errors += gcusbreplay_expect ("rate", 1 == monitor.gaps () && 4 == monitor.missed (),
+                                  "gap above a threshold of 4 miscounted");
+
+    /* a timestamp that does not move forward is not an interval. the next one is
+     * measured from it */
+    monitor.reset ();
+    monitor.setGapThreshold (GCUSBRateMonitorGap);
+    gcusbreplay_rate_feed (&monitor, 5000000, 1000000, 2);
+    errors += gcusbreplay_expect ("rate", 0 == monitor.record (6000000) && 0 == monitor.record (4000000) &&
+                                  1 == monitor.samples (), "repeated or earlier timestamp measured");
+    errors += gcusbreplay_expect ("rate", 1000000 == monitor.record (5000000) && 2 == monitor.samples () &&
+                                  0 == monitor.gaps (), "interval after an earlier timestamp wrong");
+
+    printf ("rate:             %d failed expectations\n", errors);
+
+    return errors ? -1 : 0;
+}
+
+enum {
+    /** controllers whose lookups start in the last two or first two hash buckets */
+    GCUSBREPLAY_SLOT_KEYS = 64,
+};
+
+struct gcusbreplay_slot_key_t {
+    uint32_t location;
+    int port;
+    /* slot expected for the controller (-1 if it has none) */
+    int slot;
+};
+
+/* compare every controller against the slot it should hold */
+static int gcusbreplay_check_slot_keys (const GCUSBSlotTable &table, const gcusbreplay_slot_key_t *keys, size_t count,
+                                        const char *when) {
+    int errors = 0;
+
+    for (size_t i = 0 ; i < count ; ++i) {
+        uint32_t location;
+        int port;
+
+        if (table.slot (keys[i].location, keys[i].port) != keys[i].slot) {
+            fprintf (stderr, "slots: %s: %08x port %d in slot %d, expected %d\n", when, keys[i].location,
+                     keys[i].port + 1, table.slot (keys[i].location, keys[i].port), keys[i].slot);
+            ++errors;
+        }
+
+        if (keys[i].slot >= 0 && (!table.owner (keys[i].slot, &location, &port) || location != keys[i].location ||
+                                  port != keys[i].port)) {
+            fprintf (stderr, "slots: %s: slot %d has the wrong owner\n", when, keys[i].slot);
+            ++errors;
+        }
+    }
+
+    return errors;
+}
+
+/* release a controller and connect another one. the table is full so the new one takes
+ * the released slot and the released controller's entry is deleted from the hash */
+static int gcusbreplay_slot_replace (GCUSBSlotTable *table, gcusbreplay_slot_key_t *keys, size_t count, size_t victim,
+                                     size_t next) {
+    int slot = keys[victim].slot;
+
+    table->release (keys[victim].location, keys[victim].port);
+    keys[victim].slot = -1;
+    keys[next].slot = slot;
+
+    return table->acquire (keys[next].location, keys[next].port) != slot ?
+        gcusbreplay_expect ("slots", false, "new controller did not take the released slot") :
+        gcusbreplay_check_slot_keys (*table, keys, count, "after a delete");
+}
+
+/**
+ * @brief Check the player slot hash with colliding keys
+ *
+ * Every controller used here hashes to bucket 30, 31, 0 or 1, so all of them share one
+ * cluster that wraps around the end of the table. Deleting an entry exercises the
+ * backward shift across the wrap and through entries displaced from other home buckets.
+ * After every delete all controllers are looked up again.
+ */
+static int gcusbreplay_check_slots (void) {
+    GCUSBSlotTable table_storage, *table = &table_storage;
+    gcusbreplay_slot_key_t keys[GCUSBREPLAY_SLOT_KEYS];
+    unsigned int homes[4] = {0, 0, 0, 0};
+    size_t count = 0;
+    uint32_t random = 0x13579bdf;
+    int errors = 0;
+
+    for (uint32_t location = 0x14100000 ; count < GCUSBREPLAY_SLOT_KEYS ; location += 0x10000) {
+        for (int port = 0 ; port < GCUSBPortCount && count < GCUSBREPLAY_SLOT_KEYS ; ++port) {
+            unsigned int home = (GCUSBSlotTable::bucket (location, port) + 2) & (GCUSBPlayerSlotHash - 1);
+
+            if (home < 4) {
+                keys[count].location = location;
+                keys[count].port = port;
+                keys[count++].slot = -1;
+                ++homes[home];
+            }
+        }
+    }
+
+    /* the first controllers get the lowest slots in order */
+    for (size_t i = 0 ; i < GCUSBPlayerSlotCount ; ++i) {
+        keys[i].slot = (int) i;
+        errors += gcusbreplay_expect ("slots", table->acquire (keys[i].location, keys[i].port) == (int) i,
+                                      "first controllers not given the lowest slots");
+    }
+    errors += gcusbreplay_check_slot_keys (*table, keys, count, "after filling");
+
+    /* a full table refuses another controller only if no slot is reserved */
+    errors += gcusbreplay_expect ("slots", table->acquire (keys[GCUSBPlayerSlotCount].location,
+                                                           keys[GCUSBPlayerSlotCount].port) < 0,
+                                  "full table accepted a controller");
+
+    /* a reconnecting controller gets its reserved slot back without a delete */
+    table->release (keys[3].location, keys[3].port);
+    errors += gcusbreplay_expect ("slots", table->slot (keys[3].location, keys[3].port) < 0,
+                                  "released controller still active");
+    errors += gcusbreplay_expect ("slots", 3 == table->acquire (keys[3].location, keys[3].port),
+                                  "reserved slot not given back");
+
+    /* delete the head of the cluster, an entry in the middle and the tail, then random ones */
+    errors += gcusbreplay_slot_replace (table, keys, count, 0, 16);
+    errors += gcusbreplay_slot_replace (table, keys, count, 7, 17);
+    errors += gcusbreplay_slot_replace (table, keys, count, 15, 18);
+
+    for (int k = 0 ; k < 2000 ; ++k) {
+        size_t victim, next;
+
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+
+        do {
+            victim = random % count;
+            random = random * 1103515245u + 12345u;
+        } while (keys[victim].slot < 0);
+
+        do {
+            next = random % count;
+            random = random * 1103515245u + 12345u;
+        } while (keys[next].slot >= 0);
+
+        errors += gcusbreplay_slot_replace (table, keys, count, victim, next);
+    }
+
+    /* release everyone. a returning controller gets its own slot back, an evicted one the
+     * oldest reservation */
+    int reserved[GCUSBREPLAY_SLOT_KEYS], oldest = -1;
+    size_t evicted = count, returning = count;
+
+    for (size_t i = 0 ; i < count ; ++i) {
+        reserved[i] = keys[i].slot;
+        if (keys[i].slot >= 0) {
+            table->release (keys[i].location, keys[i].port);
+            keys[i].slot = -1;
+            if (oldest < 0) {
+                oldest = reserved[i];
+            } else {
+                returning = i;
+            }
+        } else {
+            evicted = i;
+        }
+    }
+    errors += gcusbreplay_check_slot_keys (*table, keys, count, "after releasing everything");
+
+    if (evicted < count && returning < count) {
+        errors += gcusbreplay_expect ("slots", table->acquire (keys[returning].location, keys[returning].port) ==
+                                      reserved[returning], "returning controller lost its slot");
+        errors += gcusbreplay_expect ("slots", table->acquire (keys[evicted].location, keys[evicted].port) == oldest,
+                                      "evicted controller did not get the oldest reservation");
+    }
+
+    printf ("slots:            %zu keys homed at 30/31/0/1: %u/%u/%u/%u, %d failed expectations\n", count,
+            homes[0], homes[1], homes[2], homes[3], errors);
+
+    return errors ? -1 : 0;
+}
+
+/** shared state of the concurrent axis map check */
+struct gcusbreplay_axes_test_t {
+    GCUSBAxisMap axes;
+    GCUSBAxisConfig configs[3];
+    /* sticks and triggers fed to apply() and their values under each configuration */
+    uint8_t input[GCUSBPortStickCount + GCUSBPortTriggerCount];
+    uint8_t expected[3][GCUSBPortStickCount + GCUSBPortTriggerCount];
+    bool done;
+    uint64_t reports, torn;
+};
+
+/* report path: every port has to come out entirely under one configuration */
+static void *gcusbreplay_axes_reader (void *arg) {
+    gcusbreplay_axes_test_t *test = (gcusbreplay_axes_test_t *) arg;
+    const size_t length = sizeof (test->input);
+
+    while (!__atomic_load_n (&test->done, __ATOMIC_ACQUIRE)) {
+        uint8_t report[GCUSBInputReportLength];
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            memcpy (GCUSBReportDecoder::portReport (report, i) + GCUSBPortStickOffset, test->input, length);
+        }
+
+        test->axes.apply (report);
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            const uint8_t *values = GCUSBReportDecoder::portReport (report, i) + GCUSBPortStickOffset;
+
+            if (memcmp (values, test->expected[0], length) && memcmp (values, test->expected[1], length) &&
+                memcmp (values, test->expected[2], length)) {
+                ++test->torn;
+            }
+        }
+
+        ++test->reports;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Check the axis map while the configuration changes under the report path
+ *
+ * A reader thread applies the map to the same report over and over while the main
+ * thread cycles every port through three configurations, so each table set keeps
+ * getting different contents. Each port of every report has to match one configuration
+ * completely; a mix means a table was rebuilt while a report was still reading it.
+ */
+static int gcusbreplay_check_axes (void) {
+    static gcusbreplay_axes_test_t test;
+    static const uint8_t input[] = {0x05, 0x30, 0xd0, 0xfc, 0x20, 0xe0};
+    pthread_t reader;
+    int errors = 0;
+
+    memset (test.configs, 0, sizeof (test.configs));
+    test.configs[1].stick_dead_zone = 40;
+    test.configs[1].stick_curve = GCUSBCurveCubic;
+    test.configs[1].trigger_dead_zone = 60;
+    test.configs[1].trigger_curve = GCUSBCurveQuadratic;
+    test.configs[2].stick_dead_zone = 20;
+    test.configs[2].stick_curve = GCUSBCurveQuadratic;
+    test.configs[2].trigger_dead_zone = 10;
+    memcpy (test.input, input, sizeof (input));
+
+    for (int k = 0 ; k < 3 ; ++k) {
+        for (int j = 0 ; j < GCUSBPortStickCount ; ++j) {
+            test.expected[k][j] = GCUSBStickValue (input[j], test.configs[k].stick_dead_zone, test.configs[k].stick_curve);
+        }
+        for (int j = 0 ; j < GCUSBPortTriggerCount ; ++j) {
+            test.expected[k][GCUSBPortStickCount + j] =
+                GCUSBTriggerValue (input[GCUSBPortStickCount + j], test.configs[k].trigger_dead_zone,
+                                   test.configs[k].trigger_curve);
+        }
+    }
+
+    if (pthread_create (&reader, NULL, gcusbreplay_axes_reader, &test)) {
+        fprintf (stderr, "Could not start the axis reader thread\n");
+        return -1;
+    }
+
+    for (int k = 0 ; k < 20000 ; ++k) {
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            test.axes.configure (i, test.configs[(k + i) % 3]);
+        }
+    }
+
+    __atomic_store_n (&test.done, true, __ATOMIC_RELEASE);
+    pthread_join (reader, NULL);
+
+    errors += gcusbreplay_expect ("axes", 0 == test.torn, "report read a table that was being rebuilt");
+    errors += gcusbreplay_expect ("axes", memcmp (test.expected[0], test.expected[1], sizeof (input)) &&
+                                  memcmp (test.expected[1], test.expected[2], sizeof (input)) &&
+                                  memcmp (test.expected[0], test.expected[2], sizeof (input)),
+                                  "configurations are not distinguishable");
+
+    printf ("axes:             %llu reports, %llu torn\n", (unsigned long long) test.reports,
+            (unsigned long long) test.torn);
+
+    return errors ? -1 : 0;
+}
+
+/** shared state of the table gate check */
+struct gcusbreplay_gate_test_t {
+    GCUSBTableGate gate;
+    unsigned int set;
+    bool published;
+};
+
+/* configuration side: rebuild the inactive set and publish it */
+static void *gcusbreplay_gate_writer (void *arg) {
+    gcusbreplay_gate_test_t *test = (gcusbreplay_gate_test_t *) arg;
+
+    test->set = test->gate.acquire ();
+    test->gate.publish (test->set);
+    __atomic_store_n (&test->published, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* wait up to timeout ns for the writer to publish */
+static bool gcusbreplay_gate_published (gcusbreplay_gate_test_t *test, uint64_t timeout) {
+    uint64_t deadline = gcusbreplay_now () + timeout;
+
+    while (!__atomic_load_n (&test->published, __ATOMIC_ACQUIRE) && gcusbreplay_now () < deadline) {
+        gcusbreplay_wait_until (gcusbreplay_now () + 100000);
+    }
+
+    return __atomic_load_n (&test->published, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Check who a configuration change waits for
+ *
+ * A report that holds the active set must not delay a change (otherwise a steady stream
+ * of reports could hold one off forever), while a report that still holds the set a
+ * change is about to rebuild must. Readers that enter after a change use the new set.
+ */
+static int gcusbreplay_check_gate (void) {
+    static gcusbreplay_gate_test_t test;
+    unsigned int first, second;
+    pthread_t writer;
+    int errors = 0;
+
+    first = test.gate.enter ();
+
+    if (pthread_create (&writer, NULL, gcusbreplay_gate_writer, &test)) {
+        fprintf (stderr, "Could not start the gate writer thread\n");
+        return -1;
+    }
+
+    if (gcusbreplay_expect ("gate", gcusbreplay_gate_published (&test, 1000000000ULL),
+                            "change waited for a reader of the active set")) {
+        test.gate.leave (first);
+        pthread_join (writer, NULL);
+        return -1;
+    }
+    pthread_join (writer, NULL);
+
+    second = test.gate.enter ();
+    errors += gcusbreplay_expect ("gate", first != second && second == test.set,
+                                  "reader did not enter the published set");
+
+    /* the first reader still holds the set the next change rebuilds */
+    test.published = false;
+    if (pthread_create (&writer, NULL, gcusbreplay_gate_writer, &test)) {
+        fprintf (stderr, "Could not start the gate writer thread\n");
+        test.gate.leave (first);
+        test.gate.leave (second);
+        return -1;
+    }
+
+    errors += gcusbreplay_expect ("gate", !gcusbreplay_gate_published (&test, 20000000ULL),
+                                  "change rebuilt a set a reader still held");
+    test.gate.leave (first);
+    errors += gcusbreplay_expect ("gate", gcusbreplay_gate_published (&test, 1000000000ULL),
+                                  "change kept waiting after the reader left");
+    pthread_join (writer, NULL);
+
+    test.gate.leave (second);
+    errors += gcusbreplay_expect ("gate", first == test.gate.active (), "second change was not published");
+
+    return errors ? -1 : 0;
+}
+
+/** shared state of the concurrent button map check */
+struct gcusbreplay_remap_test_t {
+    GCUSBButtonMap map;
+    GCUSBButtonProfile profiles[3];
+    /* button word fed to apply() and remap() and its output under each profile */
+    uint16_t input;
+    uint16_t expected[3];
+    bool done;
+    uint64_t reports, torn;
+};
+
+static bool gcusbreplay_remap_valid (const gcusbreplay_remap_test_t *test, uint16_t output) {
+    return output == test->expected[0] || output == test->expected[1] || output == test->expected[2];
+}
+
+/* report path: every port has to come out entirely under one profile */
+static void *gcusbreplay_remap_reader (void *arg) {
+    gcusbreplay_remap_test_t *test = (gcusbreplay_remap_test_t *) arg;
+
+    while (!__atomic_load_n (&test->done, __ATOMIC_ACQUIRE)) {
+        uint8_t report[GCUSBInputReportLength];
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            uint8_t *buttons = GCUSBReportDecoder::portReport (report, i) + GCUSBPortButtonOffset;
+
+            buttons[0] = (uint8_t) test->input;
+            buttons[1] = (uint8_t) (test->input >> 8);
+        }
+
+        test->map.apply (report);
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            const uint8_t *buttons = GCUSBReportDecoder::portReport (report, i) + GCUSBPortButtonOffset;
+
+            if (!gcusbreplay_remap_valid (test, buttons[0] | (buttons[1] << 8)) ||
+                !gcusbreplay_remap_valid (test, test->map.remap (i, test->input))) {
+                ++test->torn;
+            }
+        }
+
+        ++test->reports;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Check the button map while profiles change under the report path
+ *
+ * Same as the axes check: a reader thread remaps a fixed button word with apply() and
+ * remap() while the main thread cycles every port through three profiles. Each result
+ * has to match one profile; anything else means a table was rebuilt while it was read.
+ */
+static int gcusbreplay_check_remap (void) {
+    static gcusbreplay_remap_test_t test;
+    pthread_t reader;
+    int errors = 0;
+
+    test.profiles[0] = GCUSBButtonIdentity ();
+    for (int i = 0 ; i < GCUSBButtonCount ; ++i) {
+        test.profiles[1].output[i] = (uint8_t) (GCUSBButtonCount - 1 - i);
+        test.profiles[2].output[i] = (uint8_t) (i ^ 1);
+    }
+    /* the tables are filled from entry 0 up. a low byte near the end and a high byte near
+     * the start of the tables make a half built set give a mix of two profiles */
+    test.input = 0x00ff | (1u << GCUSBButtonStart) | (1u << GCUSBButtonZ) | (1u << GCUSBButtonL);
+
+    for (int k = 0 ; k < 3 ; ++k) {
+        test.expected[k] = GCUSBButtonRemap (test.profiles[k], test.input);
+    }
+
+    if (pthread_create (&reader, NULL, gcusbreplay_remap_reader, &test)) {
+        fprintf (stderr, "Could not start the button map reader thread\n");
+        return -1;
+    }
+
+    for (int k = 0 ; k < 20000 ; ++k) {
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            test.map.configure (i, test.profiles[(k + i) % 3]);
+        }
+    }
+
+    __atomic_store_n (&test.done, true, __ATOMIC_RELEASE);
+    pthread_join (reader, NULL);
+
+    errors += gcusbreplay_expect ("remap", 0 == test.torn, "report read a table that was being rebuilt");
+    errors += gcusbreplay_expect ("remap", test.expected[0] != test.expected[1] && test.expected[1] != test.expected[2] &&
+                                  test.expected[0] != test.expected[2], "profiles are not distinguishable");
+
+    printf ("remap:            %llu reports, %llu torn\n", (unsigned long long) test.reports,
+            (unsigned long long) test.torn);
+
+    return errors ? -1 : 0;
+}
+
+static void gcusbreplay_print_port (uint64_t timestamp, int port, const uint8_t *report) {
+    printf ("%12.6f port %d buttons %02x%02x stick %4d %4d c-stick %4d %4d triggers %3u %3u\n",
+            (double) timestamp * 1e-9, port + 1, report[2], report[1], (int8_t) report[3], (int8_t) report[4],
+            (int8_t) report[5], (int8_t) report[6], report[7], report[8]);
+}
+
+/**
+ * @brief Run an output record through the rumble scheduler
+ *
+ * Rumble reports in a capture are what the kext sent after merging. Splitting them back
+ * into per-port requests exercises the same merge and skip logic.
+ */
+static void gcusbreplay_output (gcusbreplay_pipeline_t *pipeline, const GCUSBCaptureRecord *record,
+                                const gcusbreplay_options_t *options, gcusbreplay_stats_t *stats) {
+    ++stats->output_reports;
+
+    if (options->verbose && record->length) {
+        printf ("%12.6f output report 0x%02x (%u bytes)\n", (double) record->timestamp * 1e-9,
+                record->report[0], record->length);
+    }
+
+    if (GCUSBRumbleReportLength == record->length && GCUSBRumbleReportID == record->report[0]) {
+        uint8_t rumble[GCUSBRumbleReportLength];
+
+        for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+            pipeline->rumble.set (i, record->report[i + 1]);
+        }
+
+        if (pipeline->rumble.flush (rumble)) {
+            pipeline->rumble.transmitted ();
+            ++stats->rumble_transmitted;
+        }
+    }
+}
+
+static void gcusbreplay_setup (gcusbreplay_pipeline_t *pipeline, const gcusbreplay_options_t *options) {
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        pipeline->axes.configure (i, options->axes);
+        pipeline->buttons.configure (i, options->buttons);
+    }
+}
+
+/** split and calibrate an input record. returns false if the record is not a 0x21 report */
+static bool gcusbreplay_decode (gcusbreplay_pipeline_t *pipeline, const GCUSBCaptureRecord *record) {
+    if (record->length != sizeof (pipeline->report)) {
+        return false;
+    }
+
+    /* the decoder works in place, the same way it does on the kext's staging buffer */
+    memcpy (pipeline->report, record->report, sizeof (pipeline->report));
+    return pipeline->decoder.decode (pipeline->report, sizeof (pipeline->report));
+}
+
+static void gcusbreplay_deliver (gcusbreplay_pipeline_t *pipeline, const GCUSBCaptureRecord *record,
+                                 const gcusbreplay_options_t *options, gcusbreplay_stats_t *stats) {
+    unsigned int connected = 0, deliver;
+
+    ++stats->input_reports;
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        uint8_t status = pipeline->decoder.status (i);
+
+        if (pipeline->hotplug.update (i, status)) {
+            /* there is no work loop here. complete the hotplug work immediately */
+            if (GCUSBHotplug::ActionAttach == pipeline->hotplug.pending (i)) {
+                pipeline->hotplug.attached (i, true);
+                ++stats->connects;
+            } else {
+                pipeline->hotplug.detached (i);
+                ++stats->disconnects;
+            }
+        }
+
+        if (status && pipeline->hotplug.active (i)) {
+            connected |= 1u << i;
+        }
+    }
+
+    deliver = pipeline->filter.filter (pipeline->report, connected, record->timestamp);
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        if (deliver & (1u << i)) {
+            if (options->verbose) {
+                gcusbreplay_print_port (record->timestamp, i, GCUSBReportDecoder::portReport (pipeline->report, i));
+            }
+            pipeline->filter.delivered (i, pipeline->report, record->timestamp);
+        }
+    }
+}
+
+static void gcusbreplay_run (GCUSBCaptureReader &reader, const gcusbreplay_options_t *options,
+                             gcusbreplay_pipeline_t *pipeline, gcusbreplay_stats_t *stats,
+                             gcusbreplay_timing_t *timing) {
+    GCUSBCaptureRecord record;
+    uint64_t first = 0, start, t0, t1, t2, t3, t4;
+    bool have_first = false;
+
+    start = gcusbreplay_now ();
+
+    while (reader.next (&record)) {
+        if (!options->fast) {
+            if (!have_first) {
+                first = record.timestamp;
+                have_first = true;
+            }
+            gcusbreplay_wait_until (start + (record.timestamp - first));
+        }
+
+        if (GCUSBCaptureOutput == record.direction) {
+            if (timing) {
+                t0 = gcusbreplay_now ();
+                gcusbreplay_output (pipeline, &record, options, stats);
+                timing->rumble.record (gcusbreplay_now () - t0);
+            } else {
+                gcusbreplay_output (pipeline, &record, options, stats);
+            }
+            continue;
+        }
+
+        if (0 == pipeline->poll_rate.record (record.timestamp) && stats->input_reports) {
+            ++stats->backwards;
+        }
+
+        t0 = timing ? gcusbreplay_now () : 0;
+        if (!gcusbreplay_decode (pipeline, &record)) {
+            ++stats->invalid_reports;
+            continue;
+        }
+
+        t1 = timing ? gcusbreplay_now () : 0;
+        pipeline->axes.apply (pipeline->report);
+
+        t2 = timing ? gcusbreplay_now () : 0;
+        pipeline->buttons.apply (pipeline->report);
+
+        t3 = timing ? gcusbreplay_now () : 0;
+        gcusbreplay_deliver (pipeline, &record, options, stats);
+
+        if (timing) {
+            t4 = gcusbreplay_now ();
+            timing->decode.record (t1 - t0);
+            timing->axes.record (t2 - t1);
+            timing->buttons.record (t3 - t2);
+            timing->filter.record (t4 - t3);
+            timing->total.record (t4 - t0);
+        }
+    }
+
+    stats->elapsed = gcusbreplay_now () - start;
+}
+
+static void gcusbreplay_print_stats (const gcusbreplay_pipeline_t *pipeline, const gcusbreplay_stats_t *stats) {
+    printf ("input reports:    %llu\n", (unsigned long long) stats->input_reports);
+    printf ("output reports:   %llu\n", (unsigned long long) stats->output_reports);
+    printf ("invalid reports:  %llu\n", (unsigned long long) stats->invalid_reports);
+    printf ("connects:         %llu\n", (unsigned long long) stats->connects);
+    printf ("disconnects:      %llu\n", (unsigned long long) stats->disconnects);
+    printf ("delivered:        %llu\n", (unsigned long long) pipeline->filter.deliveredCount ());
+    printf ("suppressed:       %llu\n", (unsigned long long) pipeline->filter.suppressedCount ());
+    printf ("rumble requested: %llu\n", (unsigned long long) pipeline->rumble.requestedCount ());
+    printf ("rumble sent:      %llu\n", (unsigned long long) stats->rumble_transmitted);
+    printf ("out of order:     %llu\n", (unsigned long long) stats->backwards);
+    if (pipeline->poll_rate.samples ()) {
+        printf ("report interval:  %.3f ms (jitter %.3f ms, max %.3f ms)\n", (double) pipeline->poll_rate.mean () * 1e-6,
+                (double) pipeline->poll_rate.jitter () * 1e-6, (double) pipeline->poll_rate.max () * 1e-6);
+        printf ("gaps:             %llu (%llu reports missed)\n", (unsigned long long) pipeline->poll_rate.gaps (),
+                (unsigned long long) pipeline->poll_rate.missed ());
+    }
+    printf ("elapsed:          %.3f ms\n", (double) stats->elapsed * 1e-6);
+    if (stats->input_reports) {
+        printf ("ns/report:        %.1f\n", (double) stats->elapsed / (double) stats->input_reports);
+    }
+}
+
+static void gcusbreplay_print_histogram (const char *name, const GCUSBHistogram &histogram) {
+    if (0 == histogram.count ()) {
+        return;
+    }
+
+    printf ("%-14s %12llu %10.1f %8llu %8llu %8llu\n", name, (unsigned long long) histogram.count (),
+            (double) histogram.sum () / (double) histogram.count (), (unsigned long long) histogram.percentile (50),
+            (unsigned long long) histogram.percentile (99), (unsigned long long) histogram.max ());
+}
+
+/**
+ * @brief Benchmark the hot paths
+ *
+ * The trace is first run untimed to measure throughput (ns/report) and allocations. It
+ * is then run again timing every stage of every report to get the latency
+ * distribution. Per-report timing includes the overhead of reading the clock.
+ */
+static void gcusbreplay_benchmark (GCUSBCaptureReader &reader, const gcusbreplay_options_t *options) {
+    gcusbreplay_pipeline_t pipeline_storage, *pipeline = &pipeline_storage;
+    gcusbreplay_timing_t timing_storage, *timing = &timing_storage;
+    gcusbreplay_stats_t stats;
+    uint64_t allocations, elapsed = 0, reports = 0;
+
+    gcusbreplay_setup (pipeline, options);
+
+    /* warm up. this also completes all hotplug work */
+    memset (&stats, 0, sizeof (stats));
+    reader.rewind ();
+    gcusbreplay_run (reader, options, pipeline, &stats, NULL);
+
+    allocations = gcusbreplay_allocations;
+    for (unsigned int i = 0 ; i < options->repeat ; ++i) {
+        memset (&stats, 0, sizeof (stats));
+        reader.rewind ();
+        gcusbreplay_run (reader, options, pipeline, &stats, NULL);
+        elapsed += stats.elapsed;
+        reports += stats.input_reports;
+    }
+    allocations = gcusbreplay_allocations - allocations;
+
+    for (unsigned int i = 0 ; i < options->repeat ; ++i) {
+        memset (&stats, 0, sizeof (stats));
+        reader.rewind ();
+        gcusbreplay_run (reader, options, pipeline, &stats, timing);
+    }
+
+    printf ("reports:          %llu\n", (unsigned long long) reports);
+    printf ("ns/report:        %.1f\n", reports ? (double) elapsed / (double) reports : 0.0);
+    printf ("allocations:      %llu (%.3f/report)\n", (unsigned long long) allocations,
+            reports ? (double) allocations / (double) reports : 0.0);
+    printf ("\n%-14s %12s %10s %8s %8s %8s\n", "stage", "samples", "mean(ns)", "p50", "p99", "max");
+    gcusbreplay_print_histogram ("decode", timing->decode);
+    gcusbreplay_print_histogram ("axes", timing->axes);
+    gcusbreplay_print_histogram ("buttons", timing->buttons);
+    gcusbreplay_print_histogram ("filter", timing->filter);
+    gcusbreplay_print_histogram ("rumble", timing->rumble);
+    gcusbreplay_print_histogram ("total", timing->total);
+}
+
+enum {
+    GCUSBREPLAY_AUDIT_DECODE = 0,
+    GCUSBREPLAY_AUDIT_AXES,
+    GCUSBREPLAY_AUDIT_BUTTONS,
+    GCUSBREPLAY_AUDIT_HOTPLUG,
+    GCUSBREPLAY_AUDIT_FILTER,
+    GCUSBREPLAY_AUDIT_MAILBOX,
+    GCUSBREPLAY_AUDIT_STATE,
+    GCUSBREPLAY_AUDIT_MONITOR,
+    GCUSBREPLAY_AUDIT_CAPTURE,
+    GCUSBREPLAY_AUDIT_RUMBLE,
+    GCUSBREPLAY_AUDIT_RING,
+    GCUSBREPLAY_AUDIT_STAGES,
+};
+
+static const char *gcusbreplay_audit_names[GCUSBREPLAY_AUDIT_STAGES] = {
+    "decode", "axes", "buttons", "hotplug", "filter", "mailbox", "state", "monitor", "capture", "rumble", "ring",
+};
+
+/** everything the kext touches on the report and rumble paths */
+struct gcusbreplay_audit_t {
+    gcusbreplay_pipeline_t pipeline;
+    GCUSBPortMailbox mailbox;
+    GCUSBRumbleQueue queue;
+    GCUSBHistogram latency;
+    GCUSBStateRegion *region;
+    GCUSBRumbleRing *ring;
+    GCUSBCaptureWriter capture;
+    uint8_t *capture_buffer;
+    uint64_t operations[GCUSBREPLAY_AUDIT_STAGES];
+    uint64_t allocations[GCUSBREPLAY_AUDIT_STAGES];
+    /** number of port reports offered to the mailbox sink */
+    uint64_t sent;
+
+    /* mailbox sink that refuses every fifth report so the backlog path runs too */
+    bool sendPortReport (int port, const uint8_t *report, bool, uint64_t timestamp) {
+        if (0 == ++sent % 5) {
+            return false;
+        }
+
+        pipeline.filter.deliveredPort (port, report, timestamp);
+
+        return true;
+    }
+};
+
+/* run an operation and charge the allocations it made to a stage */
+#define GCUSBREPLAY_AUDIT(audit, stage, op)                             \
+    do {                                                                \
+        uint64_t _before = gcusbreplay_allocations;                     \
+        op;                                                             \
+        (audit)->allocations[stage] += gcusbreplay_allocations - _before; \
+        ++(audit)->operations[stage];                                   \
+    } while (0)
+
+static void gcusbreplay_audit_input (gcusbreplay_audit_t *audit, const GCUSBCaptureRecord *record) {
+    gcusbreplay_pipeline_t *pipeline = &audit->pipeline;
+    unsigned int connected = 0, deliver = 0;
+    GCUSBPortSnapshot snapshot;
+    bool decoded = false;
+
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_CAPTURE,
+                      audit->capture.append (record->timestamp, GCUSBCaptureInput, record->report, record->length));
+
+    if (GCUSBInputReportLength != record->length) {
+        return;
+    }
+
+    memcpy (pipeline->report, record->report, GCUSBInputReportLength);
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_DECODE,
+                      decoded = pipeline->decoder.decode (pipeline->report, GCUSBInputReportLength));
+    if (!decoded) {
+        return;
+    }
+
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_AXES, pipeline->axes.apply (pipeline->report));
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_BUTTONS, pipeline->buttons.apply (pipeline->report));
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_MONITOR,
+                      audit->latency.record (pipeline->poll_rate.record (record->timestamp)));
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        uint8_t status = pipeline->decoder.status (i);
+        uint8_t state[GCUSBPortReportLength];
+
+        GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_HOTPLUG,
+            if (pipeline->hotplug.update (i, status)) {
+                if (GCUSBHotplug::ActionAttach == pipeline->hotplug.pending (i)) {
+                    pipeline->hotplug.attached (i, true);
+                } else {
+                    pipeline->hotplug.detached (i);
+                }
+            });
+
+        if (status && pipeline->hotplug.active (i)) {
+            connected |= 1u << i;
+        }
+
+        state[0] = status;
+        memcpy (state + 1, GCUSBReportDecoder::portReport (pipeline->report, i) + 1, GCUSBPortReportLength - 1);
+        GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_STATE,
+                          GCUSBPortStateWrite (audit->region->port + i, record->timestamp, state);
+                          GCUSBPortStateRead (audit->region->port + i, &snapshot, 16));
+    }
+
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_FILTER,
+                      deliver = pipeline->filter.filter (pipeline->report, connected, record->timestamp));
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        if (!(connected & (1u << i))) {
+            audit->mailbox.reset (i);
+            continue;
+        }
+
+        GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_MAILBOX,
+                          audit->mailbox.deliver (i, GCUSBReportDecoder::portReport (pipeline->report, i),
+                                                  deliver & (1u << i), record->timestamp, *audit));
+    }
+}
+
+static void gcusbreplay_audit_output (gcusbreplay_audit_t *audit, const GCUSBCaptureRecord *record) {
+    gcusbreplay_pipeline_t *pipeline = &audit->pipeline;
+    uint8_t report[GCUSBRumbleReportLength];
+    uint8_t value = 0;
+
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_CAPTURE,
+                      audit->capture.append (record->timestamp, GCUSBCaptureOutput, record->report, record->length));
+
+    if (GCUSBRumbleReportLength != record->length || GCUSBRumbleReportID != record->report[0]) {
+        return;
+    }
+
+    for (int i = 0 ; i < GCUSBPortCount ; ++i) {
+        /* the plug-in's commands arrive through the ring before they are merged */
+        GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_RING,
+                          GCUSBRumbleRingPush (audit->ring, record->report[1 + i]);
+                          GCUSBRumbleRingPop (audit->ring, &value));
+        GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_RUMBLE, pipeline->rumble.set (i, value));
+    }
+
+    GCUSBREPLAY_AUDIT(audit, GCUSBREPLAY_AUDIT_RUMBLE,
+        if (pipeline->rumble.flush (report) && audit->queue.submit (report)) {
+            while (audit->queue.next (report)) {
+                audit->queue.complete ();
+                pipeline->rumble.transmitted ();
+            }
+        });
+}
+
+/**
+ * @brief Audit the steady state for heap allocations
+ *
+ * Runs every operation of the kext's report and rumble paths (decode, calibration,
+ * hotplug tracking, filtering, the mailbox with a consumer that refuses some reports,
+ * the state seqlock, the poll rate monitor, capture, rumble merging and the rumble ring)
+ * over the trace and counts the allocations each one makes. The first run warms up and
+ * completes all hotplug work and is not counted. Fixed buffers are set up before that.
+ *
+ * @returns 0 if no operation allocated memory in the steady state
+ */
+static int gcusbreplay_audit (GCUSBCaptureReader &reader, const gcusbreplay_options_t *options) {
+    gcusbreplay_audit_t audit_storage, *audit = &audit_storage;
+    GCUSBCaptureRecord record;
+    uint64_t total = 0;
+    size_t capture_size = 1024 * 1024;
+    void *region = NULL, *ring = NULL;
+
+    audit->capture_buffer = (uint8_t *) malloc (capture_size);
+    if (!audit->capture_buffer || posix_memalign (&region, GCUSBCacheLine, sizeof (GCUSBStateRegion)) ||
+        posix_memalign (&ring, GCUSBCacheLine, sizeof (GCUSBRumbleRing))) {
+        fprintf (stderr, "Could not allocate the audit buffers\n");
+        free (audit->capture_buffer);
+        free (region);
+        return -1;
+    }
+
+    gcusbreplay_setup (&audit->pipeline, options);
+    audit->region = (GCUSBStateRegion *) region;
+    audit->ring = (GCUSBRumbleRing *) ring;
+    GCUSBStateRegionInit (audit->region);
+    memset (audit->ring, 0, sizeof (*audit->ring));
+    GCUSBRumbleRingInit (audit->ring);
+    audit->capture.start (audit->capture_buffer, capture_size);
+    audit->sent = 0;
+
+    for (unsigned int i = 0 ; i <= options->repeat ; ++i) {
+        if (1 == i) {
+            /* the warm-up run is done */
+            memset (audit->operations, 0, sizeof (audit->operations));
+            memset (audit->allocations, 0, sizeof (audit->allocations));
+        }
+
+        reader.rewind ();
+        while (reader.next (&record)) {
+            if (GCUSBCaptureInput == record.direction) {
+                gcusbreplay_audit_input (audit, &record);
+            } else {
+                gcusbreplay_audit_output (audit, &record);
+            }
+        }
+    }
+
+    printf ("%-8s %12s %12s\n", "stage", "operations", "allocations");
+    for (int i = 0 ; i < GCUSBREPLAY_AUDIT_STAGES ; ++i) {
+        printf ("%-8s %12llu %12llu\n", gcusbreplay_audit_names[i], (unsigned long long) audit->operations[i],
+                (unsigned long long) audit->allocations[i]);
+        total += audit->allocations[i];
+    }
+    printf ("\nsteady-state allocations: %llu\n", (unsigned long long) total);
+
+    free (audit->capture_buffer);
+    free (region);
+    free (ring);
+
+    return total ? -1 : 0;
+}
+
+struct gcusbreplay_ring_test_t {
+    GCUSBRumbleRing *ring;
+    unsigned int commands;
+    uint64_t full, empty, errors;
+};
+
+static void *gcusbreplay_ring_producer (void *arg) {
+    gcusbreplay_ring_test_t *test = (gcusbreplay_ring_test_t *) arg;
+
+    for (unsigned int i = 0 ; i < test->commands ; ) {
+        if (GCUSBRumbleRingPush (test->ring, (uint8_t) i)) {
+            ++i;
+        } else {
+            ++test->full;
+            sched_yield ();
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Stress test the shared rumble ring
+ *
+ * A producer thread pushes a counting sequence through the ring as fast as it can while
+ * the main thread pops it. Every command has to arrive exactly once and in order.
+ *
+ * @returns 0 if the test passed
+ */
+static int gcusbreplay_ring_stress (unsigned int commands) {
+    gcusbreplay_ring_test_t test;
+    pthread_t producer;
+    uint64_t start, elapsed;
+    void *memory;
+    uint8_t value;
+
+    if (posix_memalign (&memory, GCUSBCacheLine, sizeof (GCUSBRumbleRing))) {
+        fprintf (stderr, "Could not allocate a rumble ring\n");
+        return -1;
+    }
+
+    memset (&test, 0, sizeof (test));
+    memset (memory, 0, sizeof (GCUSBRumbleRing));
+    test.ring = (GCUSBRumbleRing *) memory;
+    test.commands = commands;
+    GCUSBRumbleRingInit (test.ring);
+
+    /* start in the middle of the index space so the test covers wrap-around */
+    test.ring->head = test.ring->tail = UINT32_MAX - GCUSBRumbleRingSize / 2;
+    test.ring->dropped = 0;
+
+    start = gcusbreplay_now ();
+    if (pthread_create (&producer, NULL, gcusbreplay_ring_producer, &test)) {
+        fprintf (stderr, "Could not start the producer thread\n");
+        free (memory);
+        return -1;
+    }
+
+    for (unsigned int i = 0 ; i < commands ; ) {
+        if (!GCUSBRumbleRingPop (test.ring, &value)) {
+            ++test.empty;
+            sched_yield ();
+            continue;
+        }
+
+        if ((uint8_t) i != value) {
+            ++test.errors;
+        }
+        ++i;
+    }
+
+    pthread_join (producer, NULL);
+    elapsed = gcusbreplay_now () - start;
+
+    if (GCUSBRumbleRingPending (test.ring)) {
+        ++test.errors;
+    }
+
+    printf ("commands:         %u\n", commands);
+    printf ("ns/command:       %.1f\n", (double) elapsed / (double) commands);
+    printf ("ring full:        %llu (dropped %u)\n", (unsigned long long) test.full, test.ring->dropped);
+    printf ("ring empty:       %llu\n", (unsigned long long) test.empty);
+    printf ("errors:           %llu\n", (unsigned long long) test.errors);
+
+    free (memory);
+
+    return test.errors ? -1 : 0;
+}
+
+enum {
+    GCUSBREPLAY_STATE_READERS = 3,
+    /** checked snapshots every reader has to take while the writer is still writing */
+    GCUSBREPLAY_STATE_OVERLAP = 1000,
+};
+
+/** longest time (ns) the writer keeps going to give the readers their snapshots */
+#define GCUSBREPLAY_STATE_DEADLINE 10000000000ULL
+
+struct gcusbreplay_state_test_t {
+    GCUSBStateRegion *region;
+    /** readers that are running. the writer does not start before all of them are */
+    int ready;
+    /** the writer stopped writing */
+    bool stopped;
+    bool done;
+};
+
+struct gcusbreplay_state_reader_t {
+    gcusbreplay_state_test_t *test;
+    /** reads counts all snapshots, checked the ones of a written state and overlapped the
+     * checked ones taken before the writer stopped */
+    uint64_t reads, checked, overlapped, failed, torn, backwards;
+};
+
+/* every byte of a state written by the stress test is derived from its count */
+static void gcusbreplay_state_pattern (uint64_t count, uint8_t *report) {
+    for (int i = 0 ; i < GCUSBPortReportLength ; ++i) {
+        report[i] = (uint8_t) (count * 7 + i);
+    }
+}
+
+static void *gcusbreplay_state_reader (void *arg) {
+    gcusbreplay_state_reader_t *reader = (gcusbreplay_state_reader_t *) arg;
+    GCUSBStateRegion *region = reader->test->region;
+    uint64_t last[GCUSBStatePorts] = {0};
+    uint8_t expected[GCUSBPortReportLength];
+    GCUSBPortSnapshot snapshot;
+
+    __atomic_add_fetch (&reader->test->ready, 1, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n (&reader->test->done, __ATOMIC_ACQUIRE)) {
+        for (int i = 0 ; i < GCUSBStatePorts ; ++i) {
+            if (!GCUSBPortStateRead (region->port + i, &snapshot, 16)) {
+                ++reader->failed;
+                sched_yield ();
+                continue;
+            }
+
+            ++reader->reads;
+            if (0 == snapshot.count) {
+                continue;
+            }
+
+            gcusbreplay_state_pattern (snapshot.count, expected);
+            if (memcmp (expected, snapshot.report, sizeof (expected)) || snapshot.timestamp != snapshot.count * 1000) {
+                ++reader->torn;
+            } else {
+                ++reader->checked;
+                if (!__atomic_load_n (&reader->test->stopped, __ATOMIC_ACQUIRE)) {
+                    __atomic_store_n (&reader->overlapped, reader->overlapped + 1, __ATOMIC_RELAXED);
+                }
+            }
+
+            if (snapshot.count < last[i]) {
+                ++reader->backwards;
+            }
+            last[i] = snapshot.count;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Stress test the state seqlock
+ *
+ * The main thread writes states to all ports while reader threads take snapshots. Every
+ * snapshot has to be internally consistent and the count of a port may never go
+ * backwards. Writing starts once every reader is running. The writer writes at least
+ * the requested number of states and then keeps going until every reader has checked
+ * GCUSBREPLAY_STATE_OVERLAP snapshots taken while it was still writing. A reader that
+ * falls short within GCUSBREPLAY_STATE_DEADLINE fails the test.
+ *
+ * @returns 0 if the test passed
+ */
+static int gcusbreplay_state_stress (unsigned int writes) {
+    gcusbreplay_state_reader_t readers[GCUSBREPLAY_STATE_READERS];
+    pthread_t threads[GCUSBREPLAY_STATE_READERS];
+    uint8_t report[GCUSBPortReportLength];
+    gcusbreplay_state_test_t test;
+    uint64_t start, elapsed, written, reads = 0, checked = 0, failed = 0, errors = 0;
+    int started, idle = 0;
+    void *memory;
+
+    if (posix_memalign (&memory, GCUSBCacheLine, sizeof (GCUSBStateRegion))) {
+        fprintf (stderr, "Could not allocate a state region\n");
+        return -1;
+    }
+
+    test.region = (GCUSBStateRegion *) memory;
+    test.ready = 0;
+    test.stopped = false;
+    test.done = false;
+    GCUSBStateRegionInit (test.region);
+
+    memset (readers, 0, sizeof (readers));
+    for (started = 0 ; started < GCUSBREPLAY_STATE_READERS ; ++started) {
+        readers[started].test = &test;
+        if (pthread_create (threads + started, NULL, gcusbreplay_state_reader, readers + started)) {
+            break;
+        }
+    }
+
+    while (__atomic_load_n (&test.ready, __ATOMIC_ACQUIRE) < started) {
+        sched_yield ();
+    }
+
+    start = gcusbreplay_now ();
+    for (written = 1 ; ; ++written) {
+        gcusbreplay_state_pattern (written, report);
+        for (int j = 0 ; j < GCUSBStatePorts ; ++j) {
+            GCUSBPortStateWrite (test.region->port + j, written * 1000, report);
+        }
+
+        if (written < writes || (written & 0x3ff)) {
+            continue;
+        }
+
+        /* on a single CPU the readers only run when the writer is preempted */
+        int behind = 0;
+        for (int i = 0 ; i < started ; ++i) {
+            behind += __atomic_load_n (&readers[i].overlapped, __ATOMIC_RELAXED) < GCUSBREPLAY_STATE_OVERLAP;
+        }
+
+        if (0 == behind || gcusbreplay_now () - start > GCUSBREPLAY_STATE_DEADLINE) {
+            break;
+        }
+    }
+    elapsed = gcusbreplay_now () - start;
+
+    __atomic_store_n (&test.stopped, true, __ATOMIC_RELEASE);
+    __atomic_store_n (&test.done, true, __ATOMIC_RELEASE);
+    for (int i = 0 ; i < started ; ++i) {
+        pthread_join (threads[i], NULL);
+        reads += readers[i].reads;
+        checked += readers[i].checked;
+        failed += readers[i].failed;
+        errors += readers[i].torn + readers[i].backwards;
+        idle += readers[i].overlapped < GCUSBREPLAY_STATE_OVERLAP;
+    }
+
+    printf ("writes:           %llu x %d ports\n", (unsigned long long) written, GCUSBStatePorts);
+    printf ("ns/write:         %.1f\n", (double) elapsed / ((double) written * GCUSBStatePorts));
+    printf ("readers:          %d\n", started);
+    printf ("snapshots:        %llu (%llu checked, %llu retried out)\n", (unsigned long long) reads,
+            (unsigned long long) checked, (unsigned long long) failed);
+    for (int i = 0 ; i < started ; ++i) {
+        printf ("reader %d:         %llu checked during writes\n", i, (unsigned long long) readers[i].overlapped);
+    }
+    printf ("errors:           %llu\n", (unsigned long long) errors);
+
+    if (idle) {
+        fprintf (stderr, "%d readers checked fewer than %d snapshots during writes\n", idle,
+                 GCUSBREPLAY_STATE_OVERLAP);
+    }
+
+    free (memory);
+
+    return (errors || idle || GCUSBREPLAY_STATE_READERS != started) ? -1 : 0;
+}
+
+/**
+ * @brief Consumer for the mailbox test
+ *
+ * Port 0 stalls for random stretches of reports like a client that stopped draining its
+ * event queue. The other ports take every report. The index of each report is stored in
+ * its stick bytes and report i arrives at time i - 1 so the order of deliveries and the
+ * timestamp carried with every report can be checked.
+ */
+struct gcusbreplay_mailbox_sink_t {
+    GCUSBChangeFilter *filter;
+    uint32_t random;
+    unsigned int stall;
+    uint64_t delivered[GCUSBPortCount], refused;
+    uint32_t last_index[GCUSBPortCount];
+    uint64_t last_timestamp[GCUSBPortCount];
+    /** index and buttons of every report port 0 got */
+    uint32_t *indices;
+    uint16_t *buttons;
+    size_t button_count, button_limit;
+    uint64_t errors;
+
+    uint32_t next_random (void) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        return random;
+    }
+
+    bool sendPortReport (int port, const uint8_t *report, bool, uint64_t timestamp) {
+        uint32_t index;
+
+        if (0 == port) {
+            if (stall) {
+                --stall;
+                ++refused;
+                return false;
+            }
+
+            if (0 == next_random () % 8) {
+                stall = 1 + next_random () % (3 * GCUSBMailboxDepth);
+            }
+        }
+
+        memcpy (&index, report + GCUSBPortStickOffset, sizeof (index));
+        if (delivered[port] && (index <= last_index[port] || timestamp <= last_timestamp[port])) {
+            ++errors;
+        }
+
+        /* the timestamp has to be the one of the report, not of the delivery */
+        if (timestamp + 1 != index) {
+            ++errors;
+        }
+
+        last_index[port] = index;
+        last_timestamp[port] = timestamp;
+        ++delivered[port];
+
+        if (0 == port && button_count < button_limit) {
+            indices[button_count] = index;
+            buttons[button_count++] = report[1] | (report[2] << 8);
+        }
+
+        filter->deliveredPort (port, report, timestamp);
+
+        return true;
+    }
+};
+
+/**
+ * @brief Check the mailbox against a slow consumer
+ *
+ * Reports go through the same filter and mailbox calls as in the kext. Without merges
+ * port 0 has to see exactly the button states that were produced, in order. With merges
+ * no button edge may vanish: a button that changed between two reports port 0 got has
+ * to differ between them. Every port has to end on the last report, the ports that
+ * never stall have to get every report and every delivered report has to carry its own
+ * arrival time, increasing on each port.
+ *
+ * @returns 0 if the test passed
+ */
+static int gcusbreplay_mailbox_test (unsigned int reports) {
+    unsigned int total = reports + GCUSBMailboxDepth * 4;
+    uint8_t report[GCUSBInputReportLength];
+    uint16_t *produced = (uint16_t *) calloc (total + 1, sizeof (uint16_t));
+    uint16_t *seen = (uint16_t *) calloc (total + 1, sizeof (uint16_t));
+    uint32_t *seen_index = (uint32_t *) calloc (total + 1, sizeof (uint32_t));
+    gcusbreplay_mailbox_sink_t sink;
+    GCUSBChangeFilter filter;
+    GCUSBPortMailbox mailbox;
+    size_t produced_count = 0, seen_count = 0, edges = 0, lost = 0;
+    uint16_t state = 0, last = 0;
+    uint32_t index = 0;
+    uint64_t errors;
+
+    if (!produced || !seen || !seen_index) {
+        fprintf (stderr, "Could not allocate the mailbox test\n");
+        free (produced);
+        free (seen);
+        free (seen_index);
+        return -1;
+    }
+
+    memset (&sink, 0, sizeof (sink));
+    sink.filter = &filter;
+    sink.random = 0x9e3779b9;
+    sink.indices = seen_index;
+    sink.buttons = seen;
+    sink.button_limit = total + 1;
+
+    memset (report, 0, sizeof (report));
+    report[0] = GCUSBInputReportID;
+
+    /* the buttons stop changing after the requested number of reports and port 0 stops
+     * stalling so it can drain its backlog. produced[i] holds the buttons of report i */
+    for (unsigned int i = 0 ; i < total ; ++i) {
+        unsigned int deliver;
+
+        if (i < reports) {
+            if (0 == sink.next_random () % 3) {
+                state ^= 1u << (sink.next_random () % 12);
+            }
+        } else {
+            sink.stall = 0;
+        }
+        produced[i + 1] = state;
+
+        for (int j = 0 ; j < GCUSBPortCount ; ++j) {
+            uint8_t *port_report = GCUSBReportDecoder::portReport (report, j);
+            uint32_t report_index = i + 1;
+
+            port_report[0] = GCUSBPortReportID;
+            port_report[1] = (uint8_t) state;
+            port_report[2] = (uint8_t) (state >> 8);
+            memcpy (port_report + GCUSBPortStickOffset, &report_index, sizeof (report_index));
+        }
+
+        deliver = filter.filter (report, 0xf, i);
+        for (int j = 0 ; j < GCUSBPortCount ; ++j) {
+            mailbox.deliver (j, GCUSBReportDecoder::portReport (report, j), deliver & (1u << j), i, sink);
+        }
+    }
+
+    errors = sink.errors;
+
+    /* between two reports port 0 got, every button that moved away from the first one
+     * has to be different in the second. the port starts out with no buttons held */
+    for (size_t i = 0 ; i < sink.button_count ; ++i) {
+        uint16_t changed = 0;
+
+        for (uint32_t j = index + 1 ; j <= seen_index[i] && j <= total ; ++j) {
+            changed |= produced[j] ^ last;
+        }
+
+        if (changed & ~(seen[i] ^ last)) {
+            ++lost;
+        }
+
+        index = seen_index[i];
+        last = seen[i];
+    }
+
+    /* only the edge reports sent ahead of merged entries carry buttons of their own.
+     * without merges port 0 sees every button state exactly once, in order */
+    for (unsigned int i = 1 ; i <= total ; ++i) {
+        produced_count += 1 == i || produced[i] != produced[i - 1];
+    }
+    for (size_t i = 0 ; i < sink.button_count ; ++i) {
+        seen_count += 0 == i || seen[i] != seen[i - 1];
+        edges += seen[i] != produced[seen_index[i] <= total ? seen_index[i] : 0];
+    }
+
+    if (lost || edges > mailbox.mergedCount () || (0 == mailbox.mergedCount () && seen_count != produced_count)) {
+        ++errors;
+    }
+
+    for (int j = 0 ; j < GCUSBPortCount ; ++j) {
+        if (sink.last_index[j] != total || (j && sink.delivered[j] != total)) {
+            ++errors;
+        }
+    }
+
+    if (!mailbox.empty (0)) {
+        ++errors;
+    }
+
+    printf ("reports:          %u x %d ports\n", total, GCUSBPortCount);
+    printf ("refused:          %llu\n", (unsigned long long) sink.refused);
+    printf ("delivered:        %llu %llu %llu %llu\n", (unsigned long long) sink.delivered[0],
+            (unsigned long long) sink.delivered[1], (unsigned long long) sink.delivered[2],
+            (unsigned long long) sink.delivered[3]);
+    printf ("queued:           %llu\n", (unsigned long long) mailbox.queuedCount ());
+    printf ("coalesced:        %llu\n", (unsigned long long) mailbox.coalescedCount ());
+    printf ("merged:           %llu\n", (unsigned long long) mailbox.mergedCount ());
+    printf ("dropped:          %llu\n", (unsigned long long) mailbox.droppedCount ());
+    printf ("button states:    %zu produced, %zu seen\n", produced_count, seen_count);
+    printf ("edge reports:     %zu\n", edges);
+    printf ("lost edges:       %zu\n", lost);
+    printf ("errors:           %llu\n", (unsigned long long) errors);
+
+    free (produced);
+    free (seen);
+    free (seen_index);
+
+    return errors ? -1 : 0;
+}
+
+enum {
+    /** time a synchronous rumble setReport waits for the adapter (one USB frame) */
+    GCUSBREPLAY_RUMBLE_TRANSFER = 1000000,
+    /** interval of the input reports that pull a pending rumble flush forward */
+    GCUSBREPLAY_RUMBLE_TICK     = 1000000,
+};
+
+/**
+ * @brief State of one run of the rumble latency harness
+ *
+ * Models the kext's rumble path with threads: a client thread requests rumble changes
+ * like the plug-in, a work loop thread wakes up with every input report and flushes the
+ * scheduler, and in asynchronous mode a transfer thread stands in for the thread call.
+ * The USB transfer itself is a sleep of GCUSBREPLAY_RUMBLE_TRANSFER since setReport
+ * blocks until the adapter took the report.
+ */
+struct gcusbreplay_rumble_test_t {
+    bool async;
+    unsigned int requests;
+    /* _rumble_lock */
+    pthread_mutex_t lock;
+    /* thread_call_enter() */
+    pthread_cond_t call;
+    bool call_pending, client_done, done;
+    GCUSBRumbleScheduler rumble;
+    GCUSBRumbleQueue queue;
+    /* time of the oldest request not in a flushed report and of the oldest one in the
+     * queued report (0 if none) */
+    uint64_t requested_at, queued_at;
+    /* request until the report holding it was on the wire */
+    GCUSBHistogram latency;
+    /* time a flush kept the work loop busy */
+    GCUSBHistogram stall;
+    /* how late the work loop got to each input report */
+    GCUSBHistogram lateness;
+};
+
+/* the adapter accepted a report carrying requests made since requested. lock held */
+static void gcusbreplay_rumble_done (gcusbreplay_rumble_test_t *test, uint64_t requested) {
+    test->rumble.transmitted ();
+    test->latency.record (gcusbreplay_now () - requested);
+}
+
+static void *gcusbreplay_rumble_client (void *arg) {
+    gcusbreplay_rumble_test_t *test = (gcusbreplay_rumble_test_t *) arg;
+    uint32_t random = 0x2545f491;
+    uint64_t next = gcusbreplay_now ();
+
+    for (unsigned int i = 0 ; i < test->requests ; ++i) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+
+        /* requests arrive 0.25 to 4 ms apart */
+        next += 250000 + random % 3750000;
+        gcusbreplay_wait_until (next);
+
+        pthread_mutex_lock (&test->lock);
+        test->rumble.set (i % GCUSBPortCount, (uint8_t) ((i / GCUSBPortCount + 1) & 1));
+        if (0 == test->requested_at) {
+            test->requested_at = gcusbreplay_now ();
+        }
+        pthread_mutex_unlock (&test->lock);
+    }
+
+    __atomic_store_n (&test->client_done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* thread call of the asynchronous path (GCUSBAdapter::transferRumble) */
+static void *gcusbreplay_rumble_transfer (void *arg) {
+    gcusbreplay_rumble_test_t *test = (gcusbreplay_rumble_test_t *) arg;
+    uint8_t report[GCUSBRumbleReportLength];
+
+    pthread_mutex_lock (&test->lock);
+    for (;;) {
+        while (!test->call_pending && !test->done) {
+            pthread_cond_wait (&test->call, &test->lock);
+        }
+
+        if (!test->call_pending) {
+            break;
+        }
+
+        test->call_pending = false;
+        while (test->queue.next (report)) {
+            uint64_t requested = test->queued_at;
+
+            test->queued_at = 0;
+            pthread_mutex_unlock (&test->lock);
+            gcusbreplay_wait_until (gcusbreplay_now () + GCUSBREPLAY_RUMBLE_TRANSFER);
+            pthread_mutex_lock (&test->lock);
+
+            test->queue.complete ();
+            gcusbreplay_rumble_done (test, requested);
+        }
+    }
+    pthread_mutex_unlock (&test->lock);
+
+    return NULL;
+}
+
+/* GCUSBAdapter::flushRumble before (synchronous) and after (asynchronous) the thread call */
+static void gcusbreplay_rumble_flush (gcusbreplay_rumble_test_t *test) {
+    uint8_t report[GCUSBRumbleReportLength];
+    uint64_t requested;
+    bool flushed, start = false;
+
+    pthread_mutex_lock (&test->lock);
+    flushed = test->rumble.flush (report);
+    requested = test->requested_at;
+    test->requested_at = 0;
+
+    if (flushed && test->async) {
+        /* a replaced report passes its requests on to the one replacing it */
+        if (0 == test->queued_at || requested < test->queued_at) {
+            test->queued_at = requested;
+        }
+
+        start = test->queue.submit (report);
+        if (start) {
+            test->call_pending = true;
+            pthread_cond_signal (&test->call);
+        }
+    }
+    pthread_mutex_unlock (&test->lock);
+
+    if (flushed && !test->async) {
+        gcusbreplay_wait_until (gcusbreplay_now () + GCUSBREPLAY_RUMBLE_TRANSFER);
+
+        pthread_mutex_lock (&test->lock);
+        gcusbreplay_rumble_done (test, requested);
+        pthread_mutex_unlock (&test->lock);
+    }
+}
+
+/* run the work loop until the client is done and every request was sent */
+static int gcusbreplay_rumble_run (gcusbreplay_rumble_test_t *test) {
+    pthread_t client, transfer;
+    uint64_t tick = gcusbreplay_now ();
+
+    pthread_mutex_init (&test->lock, NULL);
+    pthread_cond_init (&test->call, NULL);
+
+    if (test->async && pthread_create (&transfer, NULL, gcusbreplay_rumble_transfer, test)) {
+        fprintf (stderr, "Could not start the rumble transfer thread\n");
+        return -1;
+    }
+
+    if (pthread_create (&client, NULL, gcusbreplay_rumble_client, test)) {
+        fprintf (stderr, "Could not start the rumble client thread\n");
+        test->done = true;
+        if (test->async) {
+            pthread_cond_signal (&test->call);
+            pthread_join (transfer, NULL);
+        }
+        return -1;
+    }
+
+    for (;;) {
+        bool client_done = __atomic_load_n (&test->client_done, __ATOMIC_ACQUIRE);
+
+        tick += GCUSBREPLAY_RUMBLE_TICK;
+        gcusbreplay_wait_until (tick);
+        test->lateness.record (gcusbreplay_now () - tick);
+
+        if (test->rumble.dirty ()) {
+            uint64_t start = gcusbreplay_now ();
+
+            gcusbreplay_rumble_flush (test);
+            test->stall.record (gcusbreplay_now () - start);
+        } else if (client_done) {
+            pthread_mutex_lock (&test->lock);
+            bool idle = 0 == test->queue.inFlight () && 0 == test->queued_at && !test->call_pending;
+            pthread_mutex_unlock (&test->lock);
+
+            if (idle) {
+                break;
+            }
+        }
+    }
+
+    pthread_join (client, NULL);
+
+    if (test->async) {
+        pthread_mutex_lock (&test->lock);
+        test->done = true;
+        pthread_cond_signal (&test->call);
+        pthread_mutex_unlock (&test->lock);
+        pthread_join (transfer, NULL);
+    }
+
+    pthread_cond_destroy (&test->call);
+    pthread_mutex_destroy (&test->lock);
+
+    return 0;
+}
+
+/**
+ * @brief Compare rumble latency of the synchronous and the asynchronous flush
+ *
+ * Runs the same request schedule through both paths and prints the request to wire
+ * latency, the time each flush holds the work loop and how late the work loop gets to
+ * the input reports.
+ *
+ * @returns 0 if both runs transmitted the final rumble state
+ */
+static int gcusbreplay_rumble_latency (unsigned int requests) {
+    static gcusbreplay_rumble_test_t tests[2];
+    int ret = 0;
+
+    printf ("%-14s %12s %10s %8s %8s %8s\n", "(ns)", "samples", "mean", "p50", "p99", "max");
+
+    for (int i = 0 ; i < 2 ; ++i) {
+        gcusbreplay_rumble_test_t *test = tests + i;
+        uint8_t report[GCUSBRumbleReportLength];
+        char name[32];
+
+        test->async = 1 == i;
+        test->requests = requests;
+        if (gcusbreplay_rumble_run (test)) {
+            return -1;
+        }
+
+        /* nothing may be left behind: the last state has to be the one on the wire */
+        if (test->rumble.dirty () || test->rumble.flush (report) || test->requested_at || test->queued_at) {
+            fprintf (stderr, "%s: rumble state not transmitted\n", test->async ? "async" : "sync");
+            ret = -1;
+        }
+
+        snprintf (name, sizeof (name), "%s latency", test->async ? "async" : "sync");
+        gcusbreplay_print_histogram (name, test->latency);
+        snprintf (name, sizeof (name), "%s stall", test->async ? "async" : "sync");
+        gcusbreplay_print_histogram (name, test->stall);
+        snprintf (name, sizeof (name), "%s late", test->async ? "async" : "sync");
+        gcusbreplay_print_histogram (name, test->lateness);
+        printf ("%-14s %12llu requested, %llu transmitted, %llu replaced\n", test->async ? "async" : "sync",
+                (unsigned long long) test->rumble.requestedCount (),
+                (unsigned long long) test->rumble.transmittedCount (),
+                (unsigned long long) test->queue.replacedCount ());
+    }
+
+    return ret;
+}
+
+/** host checks run by -T. each returns 0 if all of its expectations hold */
+struct gcusbreplay_check_t {
+    const char *name;
+    int (*run) (void);
+};
+
+static const gcusbreplay_check_t gcusbreplay_checks[] = {
+    {"decode", gcusbreplay_check_decode},
+    {"calibration", gcusbreplay_check_calibration},
+    {"axes", gcusbreplay_check_axes},
+    {"gate", gcusbreplay_check_gate},
+    {"hotplug", gcusbreplay_check_hotplug},
+    {"histogram", gcusbreplay_check_histogram},
+    {"rate", gcusbreplay_check_rate},
+    {"slots", gcusbreplay_check_slots},
+    {"descriptors", gcusbreplay_check_descriptors},
+    {"buttons", gcusbreplay_check_buttons},
+    {"remap", gcusbreplay_check_remap},
+};
+
+/**
+ * @brief Run the named host check or all of them
+ *
+ * @returns 0 if every check that ran passed and at least one check ran
+ */
+static int gcusbreplay_run_checks (const char *name) {
+    size_t count = sizeof (gcusbreplay_checks) / sizeof (gcusbreplay_checks[0]);
+    bool all = 0 == strcmp (name, "all"), list = 0 == strcmp (name, "list");
+    int ran = 0, failed = 0;
+
+    for (size_t i = 0 ; i < count ; ++i) {
+        const gcusbreplay_check_t *check = gcusbreplay_checks + i;
+
+        if (list) {
+            printf ("%s\n", check->name);
+            continue;
+        }
+
+        if (!all && strcmp (name, check->name)) {
+            continue;
+        }
+
+        int ret = check->run ();
+        printf ("check %s: %s\n", check->name, ret ? "FAILED" : "ok");
+        failed += 0 != ret;
+        ++ran;
+    }
+
+    if (list) {
+        return 0;
+    }
+
+    if (0 == ran) {
+        fprintf (stderr, "Unknown check %s\n", name);
+        return -1;
+    }
+
+    return failed ? -1 : 0;
+}
+
+int main (int argc, char *argv[]) {
+    gcusbreplay_options_t options;
+    uint8_t *data = NULL;
+    size_t length = 0;
+    int ret = 0;
+
+    if (gcusbreplay_parse (argc, argv, &options)) {
+        gcusbreplay_usage (argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options.check) {
+        return gcusbreplay_run_checks (options.check) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.descriptors) {
+        return gcusbreplay_check_descriptors () ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.buttons_check) {
+        return gcusbreplay_check_buttons () ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.ring_commands) {
+        return gcusbreplay_ring_stress (options.ring_commands) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.state_writes) {
+        return gcusbreplay_state_stress (options.state_writes) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.mailbox_reports) {
+        return gcusbreplay_mailbox_test (options.mailbox_reports) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.rumble_requests) {
+        return gcusbreplay_rumble_latency (options.rumble_requests) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (options.synthetic) {
+        data = gcusbreplay_synthesize (options.synthetic, &length);
+        if (!data) {
+            fprintf (stderr, "Could not allocate a synthetic trace of %u reports\n", options.synthetic);
+            return EXIT_FAILURE;
+        }
+    } else {
+        struct stat st;
+        void *map;
+        int fd;
+
+        fd = open (options.path, O_RDONLY);
+        if (fd < 0) {
+            fprintf (stderr, "Could not open %s: %s\n", options.path, strerror (errno));
+            return EXIT_FAILURE;
+        }
+
+        if (fstat (fd, &st) || 0 == st.st_size) {
+            fprintf (stderr, "Could not stat %s or capture is empty\n", options.path);
+            close (fd);
+            return EXIT_FAILURE;
+        }
+
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (MAP_FAILED == map) {
+            fprintf (stderr, "Could not map %s: %s\n", options.path, strerror (errno));
+            return EXIT_FAILURE;
+        }
+
+        data = (uint8_t *) map;
+        length = st.st_size;
+    }
+
+    GCUSBCaptureReader reader (data, length);
+    bool valid = reader.valid ();
+
+    if (!valid) {
+        fprintf (stderr, "%s is not a gcusbadapter capture\n", options.path);
+    } else if (options.benchmark) {
+        gcusbreplay_benchmark (reader, &options);
+    } else if (options.audit) {
+        ret = gcusbreplay_audit (reader, &options);
+    } else {
+        gcusbreplay_pipeline_t pipeline;
+        gcusbreplay_stats_t stats;
+
+        memset (&stats, 0, sizeof (stats));
+        gcusbreplay_setup (&pipeline, &options);
+        gcusbreplay_run (reader, &options, &pipeline, &stats, NULL);
+        gcusbreplay_print_stats (&pipeline, &stats);
+    }
+
+    if (options.synthetic) {
+        free (data);
+    } else {
+        munmap (data, length);
+    }
+
+    return (valid && 0 == ret) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
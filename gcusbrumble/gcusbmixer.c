@@ -0,0 +1,286 @@
+/* -*- Mode: C; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter CFPlugIn Bundle
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This bundle is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This bundle is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "gcusbmixer.h"
+
+/* M_PI is not part of C99 */
+#define GCUSBMIXER_PI 3.14159265358979323846
+
+static bool gcusbmixer_valid (const gcusbmixer_t *mixer, int slot) {
+    return slot >= 0 && slot < GCUSBMIXER_SLOTS && mixer->slots[slot].downloaded;
+}
+
+void gcusbmixer_init (gcusbmixer_t *mixer) {
+    memset (mixer, 0, sizeof (*mixer));
+    mixer->gain = GCUSBMIXER_MAX;
+    gcusbpwm_init (&mixer->pwm, GCUSBPWM_DEFAULT_RATE, GCUSBPWM_DEFAULT_REPORT_RATE);
+}
+
+void gcusbmixer_configure (gcusbmixer_t *mixer, uint32_t rate, uint32_t report_rate) {
+    gcusbpwm_init (&mixer->pwm, rate, report_rate);
+    mixer->motor = 0;
+}
+
+void gcusbmixer_reset (gcusbmixer_t *mixer) {
+    memset (mixer->slots, 0, sizeof (mixer->slots));
+    mixer->num_downloaded = 0;
+    mixer->paused = false;
+}
+
+int gcusbmixer_alloc (gcusbmixer_t *mixer) {
+    for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+        if (!mixer->slots[i].downloaded) {
+            memset (mixer->slots + i, 0, sizeof (mixer->slots[i]));
+            mixer->slots[i].downloaded = true;
+            ++mixer->num_downloaded;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void gcusbmixer_free (gcusbmixer_t *mixer, int slot) {
+    if (gcusbmixer_valid (mixer, slot)) {
+        memset (mixer->slots + slot, 0, sizeof (mixer->slots[slot]));
+        --mixer->num_downloaded;
+    }
+}
+
+bool gcusbmixer_set (gcusbmixer_t *mixer, int slot, const gcusbmixer_effect_t *effect) {
+    if (!gcusbmixer_valid (mixer, slot)) {
+        return false;
+    }
+
+    mixer->slots[slot].effect = *effect;
+    if (0 == mixer->slots[slot].effect.duration) {
+        mixer->slots[slot].effect.duration = GCUSBMIXER_INFINITE;
+    }
+
+    return true;
+}
+
+bool gcusbmixer_start (gcusbmixer_t *mixer, int slot, uint64_t now, uint32_t iterations) {
+    if (!gcusbmixer_valid (mixer, slot)) {
+        return false;
+    }
+
+    /* a start while paused takes effect when playback continues */
+    mixer->slots[slot].start_time = mixer->paused ? mixer->pause_time : now;
+    mixer->slots[slot].iterations = iterations ? iterations : 1;
+    mixer->slots[slot].playing = true;
+
+    return true;
+}
+
+bool gcusbmixer_stop (gcusbmixer_t *mixer, int slot) {
+    if (!gcusbmixer_valid (mixer, slot)) {
+        return false;
+    }
+
+    mixer->slots[slot].playing = false;
+
+    return true;
+}
+
+void gcusbmixer_stop_all (gcusbmixer_t *mixer) {
+    for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+        mixer->slots[i].playing = false;
+    }
+}
+
+void gcusbmixer_pause (gcusbmixer_t *mixer, uint64_t now, bool pause) {
+    if (pause == mixer->paused) {
+        return;
+    }
+
+    if (pause) {
+        mixer->pause_time = now;
+    } else {
+        /* shift every playing effect by the time spent paused */
+        for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+            if (mixer->slots[i].playing) {
+                mixer->slots[i].start_time += now - mixer->pause_time;
+            }
+        }
+    }
+
+    mixer->paused = pause;
+}
+
+/* time into the effect or false if the effect finished */
+static bool gcusbmixer_effect_time (const gcusbmixer_slot_t *slot, uint64_t now, uint64_t *offset) {
+    const gcusbmixer_effect_t *effect = &slot->effect;
+    uint64_t elapsed = now > slot->start_time ? now - slot->start_time : 0;
+
+    if (elapsed < effect->start_delay) {
+        *offset = UINT64_MAX;
+        return true;
+    }
+
+    elapsed -= effect->start_delay;
+    if (GCUSBMIXER_INFINITE == effect->duration) {
+        *offset = elapsed;
+        return true;
+    }
+
+    if (GCUSBMIXER_INFINITE != slot->iterations && elapsed / effect->duration >= slot->iterations) {
+        return false;
+    }
+
+    *offset = elapsed % effect->duration;
+
+    return true;
+}
+
+/* magnitude of a constant or periodic effect after its envelope is applied */
+static int32_t gcusbmixer_envelope (const gcusbmixer_effect_t *effect, uint64_t t) {
+    int64_t sustain = effect->magnitude < 0 ? -(int64_t) effect->magnitude : effect->magnitude;
+    int64_t level = sustain;
+
+    if (t < effect->attack_time) {
+        level = effect->attack_level + (sustain - effect->attack_level) * (int64_t) t / effect->attack_time;
+    } else if (effect->fade_time && GCUSBMIXER_INFINITE != effect->duration &&
+               t + effect->fade_time > effect->duration) {
+        level = effect->fade_level + (sustain - effect->fade_level) * (int64_t) (effect->duration - t) /
+            effect->fade_time;
+    }
+
+    return (int32_t) (effect->magnitude < 0 ? -level : level);
+}
+
+/* signed level of an effect before its gain is applied */
+static int32_t gcusbmixer_waveform_level (const gcusbmixer_effect_t *effect, uint64_t t) {
+    uint64_t angle;
+    int32_t magnitude = gcusbmixer_envelope (effect, t);
+
+    switch (effect->waveform) {
+    case GCUSBMIXER_CONSTANT:
+        return magnitude;
+    case GCUSBMIXER_RAMP:
+        if (GCUSBMIXER_INFINITE == effect->duration) {
+            return effect->ramp_start;
+        }
+        return effect->ramp_start + (int32_t) (((int64_t) effect->ramp_end - effect->ramp_start) * (int64_t) t /
+                                               effect->duration);
+    case GCUSBMIXER_SINE:
+    case GCUSBMIXER_SQUARE:
+        if (0 == effect->period) {
+            return effect->offset + magnitude;
+        }
+
+        angle = ((t % effect->period) * 36000 / effect->period + effect->phase) % 36000;
+        if (GCUSBMIXER_SQUARE == effect->waveform) {
+            return effect->offset + (angle < 18000 ? magnitude : -magnitude);
+        }
+
+        return effect->offset + (int32_t) lrint (magnitude * sin ((double) angle * GCUSBMIXER_PI / 18000.0));
+    }
+
+    return 0;
+}
+
+/**
+ * A rumble motor has no direction. Constant and ramp forces drive the motor with their
+ * absolute level. Periodic forces only drive it during the positive part of their
+ * waveform so their period is felt as pulses.
+ */
+uint32_t gcusbmixer_effect_level (const gcusbmixer_slot_t *slot, uint64_t now) {
+    const gcusbmixer_effect_t *effect = &slot->effect;
+    uint64_t t;
+    int32_t level;
+
+    if (!slot->playing || !gcusbmixer_effect_time (slot, now, &t) || UINT64_MAX == t) {
+        return 0;
+    }
+
+    level = gcusbmixer_waveform_level (effect, t);
+    if (GCUSBMIXER_SINE == effect->waveform || GCUSBMIXER_SQUARE == effect->waveform) {
+        level = level > 0 ? level : 0;
+    } else if (level < 0) {
+        level = -level;
+    }
+
+    if (level > GCUSBMIXER_MAX) {
+        level = GCUSBMIXER_MAX;
+    }
+
+    return (uint32_t) ((uint64_t) level * effect->gain / GCUSBMIXER_MAX);
+}
+
+bool gcusbmixer_playing (gcusbmixer_t *mixer, int slot, uint64_t now) {
+    uint64_t t;
+
+    if (!gcusbmixer_valid (mixer, slot) || !mixer->slots[slot].playing) {
+        return false;
+    }
+
+    if (!mixer->paused && !gcusbmixer_effect_time (mixer->slots + slot, now, &t)) {
+        mixer->slots[slot].playing = false;
+    }
+
+    return mixer->slots[slot].playing;
+}
+
+bool gcusbmixer_update (gcusbmixer_t *mixer, uint64_t now, int *motor, uint64_t *next) {
+    uint32_t level = 0;
+
+    ++mixer->updates;
+
+    if (!mixer->paused) {
+        for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+            if (gcusbmixer_playing (mixer, i, now)) {
+                level += gcusbmixer_effect_level (mixer->slots + i, now);
+            }
+        }
+    }
+
+    if (level > GCUSBMIXER_MAX) {
+        level = GCUSBMIXER_MAX;
+    }
+
+    mixer->level = (uint32_t) ((uint64_t) level * mixer->gain / GCUSBMIXER_MAX);
+
+    if (!gcusbpwm_update (&mixer->pwm, now, mixer->muted ? 0 : mixer->level, motor, next)) {
+        return false;
+    }
+
+    mixer->motor = *motor;
+    ++mixer->changes;
+
+    return true;
+}
+
+bool gcusbmixer_active (const gcusbmixer_t *mixer) {
+    if (mixer->paused) {
+        return false;
+    }
+
+    for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+        if (mixer->slots[i].playing) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,175 @@
+/* -*- Mode: C; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter CFPlugIn Bundle
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This bundle is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This bundle is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBMIXER_H)
+#define GCUSBMIXER_H
+
+/* The mixer is plain C with no dependency on CoreFoundation or ForceFeedback so it can
+ * be built and exercised on any platform. */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gcusbpwm.h"
+
+/** number of effects that can be downloaded at the same time */
+#define GCUSBMIXER_SLOTS     16
+/** largest magnitude and gain (same scale as FF_FFNOMINALMAX) */
+#define GCUSBMIXER_MAX       10000
+/** duration or iteration count that never ends (same value as FF_INFINITE) */
+#define GCUSBMIXER_INFINITE  0xffffffffu
+
+enum gcusbmixer_waveform_t {
+    GCUSBMIXER_CONSTANT = 0,
+    GCUSBMIXER_RAMP,
+    GCUSBMIXER_SINE,
+    GCUSBMIXER_SQUARE,
+};
+typedef enum gcusbmixer_waveform_t gcusbmixer_waveform_t;
+
+struct gcusbmixer_effect_t {
+    gcusbmixer_waveform_t waveform;
+
+    /** constant or periodic magnitude (-GCUSBMIXER_MAX - GCUSBMIXER_MAX) */
+    int32_t magnitude;
+
+    /** offset added to a periodic waveform */
+    int32_t offset;
+
+    /** ramp start and end levels */
+    int32_t ramp_start, ramp_end;
+
+    /** period of a periodic waveform in us */
+    uint32_t period;
+
+    /** phase of a periodic waveform in hundredths of a degree (0 - 35999) */
+    uint32_t phase;
+
+    /** length of one iteration in us or GCUSBMIXER_INFINITE */
+    uint32_t duration;
+
+    /** delay before the effect starts in us */
+    uint32_t start_delay;
+
+    /** effect gain (0 - GCUSBMIXER_MAX) */
+    uint32_t gain;
+
+    /** envelope of a constant or periodic magnitude. the attack starts and the fade ends
+     * every iteration. a time of 0 disables that part of the envelope */
+    uint32_t attack_level, attack_time;
+    uint32_t fade_level, fade_time;
+};
+typedef struct gcusbmixer_effect_t gcusbmixer_effect_t;
+
+struct gcusbmixer_slot_t {
+    gcusbmixer_effect_t effect;
+
+    /** slot holds a downloaded effect */
+    bool downloaded;
+
+    /** effect is playing */
+    bool playing;
+
+    /** time (us) the effect was started */
+    uint64_t start_time;
+
+    /** number of iterations to play or GCUSBMIXER_INFINITE */
+    uint32_t iterations;
+};
+typedef struct gcusbmixer_slot_t gcusbmixer_slot_t;
+
+struct gcusbmixer_t {
+    gcusbmixer_slot_t slots[GCUSBMIXER_SLOTS];
+
+    /** number of downloaded effects */
+    unsigned int num_downloaded;
+
+    /** device gain (0 - GCUSBMIXER_MAX) */
+    uint32_t gain;
+
+    /** turns the mixed level into motor pulses */
+    gcusbpwm_t pwm;
+
+    /** output is forced off (paused or actuators off) */
+    bool muted;
+
+    /** time (us) the mixer was paused */
+    uint64_t pause_time;
+    bool paused;
+
+    /** last mixed level and motor state */
+    uint32_t level;
+    int motor;
+
+    /** number of updates and number of motor changes */
+    uint64_t updates, changes;
+};
+typedef struct gcusbmixer_t gcusbmixer_t;
+
+void gcusbmixer_init (gcusbmixer_t *mixer);
+
+/** set the PWM carrier rate and the report rate limit (Hz, 0 selects the default) */
+void gcusbmixer_configure (gcusbmixer_t *mixer, uint32_t rate, uint32_t report_rate);
+
+/** remove all effects and stop the motor (the next update reports the change) */
+void gcusbmixer_reset (gcusbmixer_t *mixer);
+
+/** allocate a slot for a new effect. returns the slot or -1 if all slots are in use */
+int gcusbmixer_alloc (gcusbmixer_t *mixer);
+
+/** release a slot */
+void gcusbmixer_free (gcusbmixer_t *mixer, int slot);
+
+/** set the parameters of a downloaded effect. returns false if the slot is not in use */
+bool gcusbmixer_set (gcusbmixer_t *mixer, int slot, const gcusbmixer_effect_t *effect);
+
+/** start (or restart) an effect */
+bool gcusbmixer_start (gcusbmixer_t *mixer, int slot, uint64_t now, uint32_t iterations);
+
+bool gcusbmixer_stop (gcusbmixer_t *mixer, int slot);
+
+void gcusbmixer_stop_all (gcusbmixer_t *mixer);
+
+/** pause or continue every playing effect. paused time does not count toward durations */
+void gcusbmixer_pause (gcusbmixer_t *mixer, uint64_t now, bool pause);
+
+/** effect in a slot is still playing at the given time */
+bool gcusbmixer_playing (gcusbmixer_t *mixer, int slot, uint64_t now);
+
+/** level (0 - GCUSBMIXER_MAX) of a single effect at the given time */
+uint32_t gcusbmixer_effect_level (const gcusbmixer_slot_t *slot, uint64_t now);
+
+/**
+ * @brief Mix all playing effects
+ *
+ * The mixed level is synthesized as a duty cycle (see gcusbpwm_t) since the motor
+ * can only be switched on and off.
+ *
+ * @param[in]  now    current time in us
+ * @param[out] motor  new motor state (0 or 1)
+ * @param[out] next   time (us) of the next motor edge or UINT64_MAX if the motor is steady
+ *
+ * @returns true if the motor state changed since the last update
+ */
+bool gcusbmixer_update (gcusbmixer_t *mixer, uint64_t now, int *motor, uint64_t *next);
+
+/** at least one effect is playing (the mixer needs periodic updates) */
+bool gcusbmixer_active (const gcusbmixer_t *mixer);
+
+#endif
@@ -0,0 +1,131 @@
+/* -*- Mode: C; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter CFPlugIn Bundle
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This bundle is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This bundle is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include "gcusbpwm.h"
+
+void gcusbpwm_init (gcusbpwm_t *pwm, uint32_t rate, uint32_t report_rate) {
+    memset (pwm, 0, sizeof (*pwm));
+
+    pwm->period = 1000000 / (rate ? rate : GCUSBPWM_DEFAULT_RATE);
+    pwm->min_interval = 1000000 / (report_rate ? report_rate : GCUSBPWM_DEFAULT_REPORT_RATE);
+
+    /* a period has to fit an on and an off pulse */
+    if (pwm->period < 2 * pwm->min_interval) {
+        pwm->period = 2 * pwm->min_interval;
+    }
+}
+
+uint32_t gcusbpwm_on_time (const gcusbpwm_t *pwm, uint32_t level) {
+    uint32_t on;
+
+    if (0 == level) {
+        return 0;
+    }
+
+    if (level >= GCUSBPWM_MAX) {
+        return pwm->period;
+    }
+
+    on = (uint32_t) ((uint64_t) pwm->period * level / GCUSBPWM_MAX);
+
+    /* pulses shorter than the report interval can not be produced */
+    if (on < pwm->min_interval) {
+        on = pwm->min_interval;
+    } else if (on > pwm->period - pwm->min_interval) {
+        on = pwm->period - pwm->min_interval;
+    }
+
+    return on;
+}
+
+bool gcusbpwm_update (gcusbpwm_t *pwm, uint64_t now, uint32_t level, int *state, uint64_t *next) {
+    uint32_t on = gcusbpwm_on_time (pwm, level);
+    uint64_t ideal, edge = UINT64_MAX;
+    int want;
+
+    if (0 == on || pwm->period == on) {
+        /* steady output */
+        want = 0 != on;
+        ideal = now;
+        pwm->running = false;
+    } else {
+        if (!pwm->running) {
+            pwm->cycle_start = now;
+            pwm->running = true;
+        } else if (now >= pwm->cycle_start + pwm->period) {
+            pwm->cycle_start += (now - pwm->cycle_start) / pwm->period * pwm->period;
+        }
+
+        want = now - pwm->cycle_start < on;
+        ideal = want ? pwm->cycle_start : pwm->cycle_start + on;
+        edge = want ? pwm->cycle_start + on : pwm->cycle_start + pwm->period;
+    }
+
+    *state = pwm->state;
+
+    if (want == pwm->state) {
+        pwm->pending = false;
+        *next = edge;
+        return false;
+    }
+
+    if (pwm->edges && now - pwm->last_edge < pwm->min_interval) {
+        /* too soon after the last report */
+        if (!pwm->pending) {
+            ++pwm->delayed;
+            pwm->pending = true;
+        }
+        *next = pwm->last_edge + pwm->min_interval;
+        return false;
+    }
+
+    if (now > ideal) {
+        pwm->error_total += now - ideal;
+        if (now - ideal > pwm->error_max) {
+            pwm->error_max = now - ideal;
+        }
+    }
+
+    if (0 == pwm->edges++) {
+        pwm->first_edge = now;
+    }
+
+    pwm->pending = false;
+    pwm->state = want;
+    pwm->last_edge = now;
+    *state = want;
+
+    if (UINT64_MAX != edge && edge < now + pwm->min_interval) {
+        edge = now + pwm->min_interval;
+    }
+    *next = edge;
+
+    return true;
+}
+
+double gcusbpwm_report_rate (const gcusbpwm_t *pwm, uint64_t now) {
+    if (pwm->edges < 2 || now <= pwm->first_edge) {
+        return 0.0;
+    }
+
+    return (double) (pwm->edges - 1) * 1000000.0 / (double) (now - pwm->first_edge);
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * driver for WUP-028 GameCube USB adapter CFPlugIn Bundle
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This bundle is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This bundle is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(GCUSBPWM_H)
+#define GCUSBPWM_H
+
+/* Plain C with no dependency on CoreFoundation. All functions take the current time
+ * (us) as an argument so they can be driven by a virtual clock. */
+#include <stdbool.h>
+#include <stdint.h>
+
+/** largest level (same scale as GCUSBMIXER_MAX) */
+#define GCUSBPWM_MAX                 10000
+/** default carrier rate (Hz) */
+#define GCUSBPWM_DEFAULT_RATE        25
+/** default limit on rumble reports per second */
+#define GCUSBPWM_DEFAULT_REPORT_RATE 125
+
+/**
+ * @brief Duty cycle synthesis for an on/off motor
+ *
+ * A level between 0 and GCUSBPWM_MAX is turned into a duty cycle of a fixed carrier
+ * period. Only edges are reported. Edges are never closer together than the minimum
+ * report interval: pulses are stretched to at least that length and an edge that comes
+ * too early is delayed. The delay of every edge against its ideal time is recorded.
+ */
+struct gcusbpwm_t {
+    /** carrier period (us) */
+    uint32_t period;
+
+    /** shortest time between two reports (us) */
+    uint32_t min_interval;
+
+    /** current output and the time it was last changed */
+    int state;
+    uint64_t last_edge;
+
+    /** start of the current carrier period */
+    uint64_t cycle_start;
+    bool running;
+
+    /** number of edges sent and the time of the first one */
+    uint64_t edges;
+    uint64_t first_edge;
+
+    /** an edge is waiting for the report rate limit */
+    bool pending;
+
+    /** number of edges that had to wait for the report rate limit */
+    uint64_t delayed;
+
+    /** total and largest edge timing error (us) */
+    uint64_t error_total, error_max;
+};
+typedef struct gcusbpwm_t gcusbpwm_t;
+
+/**
+ * @brief Initialize a PWM scheduler
+ *
+ * @param[in] rate         carrier rate in Hz
+ * @param[in] report_rate  largest number of reports per second
+ */
+void gcusbpwm_init (gcusbpwm_t *pwm, uint32_t rate, uint32_t report_rate);
+
+/**
+ * @brief Advance the scheduler
+ *
+ * @param[in]  now    current time (us)
+ * @param[in]  level  requested level (0 - GCUSBPWM_MAX)
+ * @param[out] state  motor state to send if an edge is due
+ * @param[out] next   time (us) of the next edge or UINT64_MAX if the output is steady
+ *
+ * @returns true if the motor state has to change now
+ */
+bool gcusbpwm_update (gcusbpwm_t *pwm, uint64_t now, uint32_t level, int *state, uint64_t *next);
+
+/** time (us) the motor is on during one carrier period for a level */
+uint32_t gcusbpwm_on_time (const gcusbpwm_t *pwm, uint32_t level);
+
+/** average number of reports per second since the first edge */
+double gcusbpwm_report_rate (const gcusbpwm_t *pwm, uint64_t now);
+
+#endif
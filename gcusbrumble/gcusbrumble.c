@@ -41,25 +41,164 @@
 #define gcusbrumbleUUID CFUUIDGetConstantUUIDWithBytes(kCFAllocatorSystemDefault, \
 0x6b, 0x8b, 0x24, 0x7d, 0xa6, 0x37, 0x4e, 0x36, 0xb5, 0x8d, 0x4a, 0x2e, 0x57, 0x3c, 0xf9, 0xf4);
 
-static HRESULT gcusbrumble_stop_effect (void *self, UInt32 downloadID);
+/** CFBundleIdentifier of the plug-in (com.eno.$(PRODUCT_NAME:rfc1034identifier) in Info.plist) */
+#define GCUSBRUMBLE_BUNDLE_ID "com.eno.gcusbrumble"
 
-static void gcusb_set_rumble (IOHIDDeviceInterface121 **object, int value) {
+/** interval (s) between mixer updates while effects are playing */
+#define GCUSBRUMBLE_TICK    0.005
+/** fire date used to park the update timer while nothing is playing */
+#define GCUSBRUMBLE_IDLE    1.0e10
+
+/* the motor has power. without the ring the kext drops the commands it cannot carry out */
+static bool gcusbrumble_powered (const gcusbrumble_t *rumble) {
+    return NULL == rumble->ring || GCUSBRumbleRingPowered (rumble->ring);
+}
+
+/* the port has a WaveBird, which has no motor */
+static bool gcusbrumble_wireless (const gcusbrumble_t *rumble) {
+    return NULL != rumble->ring && (GCUSBRumbleRingStatus (rumble->ring) & GCUSBStatusWireless);
+}
+
+/**
+ * @brief Send a rumble command to the adapter port
+ *
+ * The command goes through the shared rumble ring if it is mapped. setReport (a call
+ * into the kernel) is only used without a ring or when the ring is full. Turning on a
+ * motor without power is skipped.
+ */
+static void gcusb_set_rumble (gcusbrumble_t *rumble, int value) {
+    IOHIDDeviceInterface121 **object = rumble->adapter_port;
     uint8_t report[2] = {0x60, (uint8_t) value};
 
-    (*object)->setReport (object, kIOHIDReportTypeOutput, 0x60, report, 2, 0, NULL, NULL, NULL);
+    if (value && !gcusbrumble_powered (rumble)) {
+        ++rumble->unpowered;
+        return;
+    }
+
+    if (rumble->ring && GCUSBRumbleRingPush (rumble->ring, (uint8_t) value)) {
+        return;
+    }
+
+    if (object) {
+        (*object)->setReport (object, kIOHIDReportTypeOutput, 0x60, report, 2, 0, NULL, NULL, NULL);
+    }
 }
 
-static void gcusbrumble_destroy_timer (gcusbrumble_effect_t *effect) {
-    if (effect->timer) {
-        CFRunLoopTimerInvalidate(effect->timer);
-        CFRelease(effect->timer);
-        effect->timer = NULL;
+/* map the rumble ring of the adapter port. the plugin falls back on setReport if this fails */
+static void gcusbrumble_open_ring (gcusbrumble_t *rumble, io_service_t service) {
+    mach_vm_size_t size = 0;
+    IOReturn kresult;
+
+    kresult = IOServiceOpen (service, mach_task_self (), GCUSBRumbleRingClientType, &rumble->ring_connect);
+    if (kIOReturnSuccess != kresult) {
+        GCRumbleDebug(rumble, "Could not open the rumble ring: 0x%08x\n", kresult);
+        rumble->ring_connect = IO_OBJECT_NULL;
+        return;
+    }
+
+    kresult = IOConnectMapMemory64 (rumble->ring_connect, 0, mach_task_self (), &rumble->ring_address, &size,
+                                    kIOMapAnywhere);
+    if (kIOReturnSuccess != kresult || size < sizeof (GCUSBRumbleRing) ||
+        !GCUSBRumbleRingValid ((GCUSBRumbleRing *) (uintptr_t) rumble->ring_address)) {
+        GCRumbleDebug(rumble, "Could not map the rumble ring: 0x%08x\n", kresult);
+        if (kIOReturnSuccess == kresult) {
+            IOConnectUnmapMemory64 (rumble->ring_connect, 0, mach_task_self (), rumble->ring_address);
+        }
+        IOServiceClose (rumble->ring_connect);
+        rumble->ring_connect = IO_OBJECT_NULL;
+        return;
+    }
+
+    rumble->ring = (GCUSBRumbleRing *) (uintptr_t) rumble->ring_address;
+    GCRumbleDebug(rumble, "Mapped rumble ring at %p\n", rumble->ring);
+}
+
+static void gcusbrumble_close_ring (gcusbrumble_t *rumble) {
+    if (rumble->ring) {
+        GCRumbleDebug(rumble, "Rumble ring dropped %u commands\n", rumble->ring->dropped);
+        IOConnectUnmapMemory64 (rumble->ring_connect, 0, mach_task_self (), rumble->ring_address);
+        rumble->ring = NULL;
+    }
+
+    if (IO_OBJECT_NULL != rumble->ring_connect) {
+        /* the kext sends the last queued command when the ring is closed */
+        IOServiceClose (rumble->ring_connect);
+        rumble->ring_connect = IO_OBJECT_NULL;
+    }
+}
+
+/* current time in us for the mixer */
+static uint64_t gcusbrumble_now (void) {
+    return (uint64_t) (CFAbsoluteTimeGetCurrent () * 1000000.0);
+}
+
+/**
+ * @brief Mix all playing effects and update the motor
+ *
+ * A report is only sent on a motor edge. While effects are playing the update timer
+ * fires every tick or at the next PWM edge, whichever comes first. Otherwise it only
+ * fires for a pending edge (e.g. the motor turning off after the last effect stopped)
+ * and is parked after that.
+ */
+static void gcusbrumble_update (gcusbrumble_t *rumble) {
+    uint64_t now = gcusbrumble_now (), next;
+    double delay = GCUSBRUMBLE_IDLE;
+    bool powered = gcusbrumble_powered (rumble);
+    int motor;
+
+    if (gcusbmixer_update (&rumble->mixer, now, &motor, &next)) {
+        GCRumbleDebug(rumble, "Motor %s (level %u)\n", motor ? "on" : "off", rumble->mixer.level);
+        gcusb_set_rumble (rumble, motor);
+    } else if (powered && !rumble->powered && rumble->mixer.motor) {
+        /* the motor was dropped while it had no power. it is steady so no edge will follow */
+        gcusb_set_rumble (rumble, rumble->mixer.motor);
+    }
+
+    rumble->powered = powered;
+
+    if (UINT64_MAX != next) {
+        delay = next > now ? (double) (next - now) / 1000000.0 : 0.0;
+    }
+
+    if (gcusbmixer_active (&rumble->mixer) && delay > GCUSBRUMBLE_TICK) {
+        delay = GCUSBRUMBLE_TICK;
+    }
+
+    if (rumble->timer) {
+        CFRunLoopTimerSetNextFireDate(rumble->timer, CFAbsoluteTimeGetCurrent () + delay);
+    }
+}
+
+/* print the PWM instrumentation */
+static void gcusbrumble_print_stats (gcusbrumble_t *rumble) {
+    const gcusbpwm_t *pwm = &rumble->mixer.pwm;
+
+    GCRumbleDebug(rumble, "PWM carrier period %u us, minimum report interval %u us\n", pwm->period, pwm->min_interval);
+    GCRumbleDebug(rumble, "Sent %llu motor reports (%.1f/s), %llu delayed by the rate limit\n",
+                  (unsigned long long) pwm->edges, gcusbpwm_report_rate (pwm, gcusbrumble_now ()),
+                  (unsigned long long) pwm->delayed);
+    GCRumbleDebug(rumble, "Edge timing error: mean %llu us, max %llu us\n",
+                  (unsigned long long) (pwm->edges ? pwm->error_total / pwm->edges : 0),
+                  (unsigned long long) pwm->error_max);
+    GCRumbleDebug(rumble, "Skipped %llu motor reports without rumble power\n", (unsigned long long) rumble->unpowered);
+}
+
+static void gcusbrumble_timer (CFRunLoopTimerRef timer, void *info) {
+    gcusbrumble_update ((gcusbrumble_t *) info);
+}
+
+static void gcusbrumble_destroy_timer (gcusbrumble_t *rumble) {
+    if (rumble->timer) {
+        CFRunLoopTimerInvalidate(rumble->timer);
+        CFRelease(rumble->timer);
+        rumble->timer = NULL;
     }
 }
 
 static void gcusbrumble_free (gcusbrumble_t **rumble) {
     if (*rumble) {
-        gcusbrumble_destroy_timer ((*rumble)->effects);
+        gcusbrumble_destroy_timer (*rumble);
+        gcusbrumble_close_ring (*rumble);
         if ((*rumble)->factory_id) {
             CFPlugInRemoveInstanceForFactory((*rumble)->factory_id);
             CFRelease((*rumble)->factory_id);
@@ -83,24 +222,25 @@ static HRESULT gcusbrumble_get_version (void *self, ForceFeedbackVersion *versio
     return S_OK;
 }
 
+/* compare the interface id against a constant UUID without creating a CFUUID for it */
+static bool gcusbrumble_iid_equal (REFIID iid, CFUUIDRef uuid) {
+    CFUUIDBytes bytes = CFUUIDGetUUIDBytes(uuid);
+    return 0 == memcmp (&iid, &bytes, sizeof (bytes));
+}
+
 static HRESULT gcusbrumble_query (void *self, REFIID iid, LPVOID *ppv) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
-    CFUUIDRef interface;
 
     GCRumbleDebug(rumble, "Query called for rumble %p\n", rumble);
 
-    interface = CFUUIDCreateFromUUIDBytes(kCFAllocatorDefault, iid);
-
-    if (CFEqual (interface, kIOForceFeedbackDeviceInterfaceID)) {
+    if (gcusbrumble_iid_equal (iid, kIOForceFeedbackDeviceInterfaceID)) {
         *ppv = &rumble->device_interface;
-    } else if (CFEqual(interface, IUnknownUUID) || CFEqual(interface, kIOCFPlugInInterfaceID)) {
+    } else if (gcusbrumble_iid_equal (iid, IUnknownUUID) || gcusbrumble_iid_equal (iid, kIOCFPlugInInterfaceID)) {
         *ppv = &rumble->plugin_interface;
     } else {
         *ppv = NULL;
     }
 
-    CFRelease(interface);
-
     if (*ppv == NULL) {
         return E_NOINTERFACE;
     }
@@ -137,6 +277,9 @@ HRESULT	gcusbrumble_initialize_terminate (void *self, NumVersion forceFeedbackAP
     GCRumbleDebug(rumble, "Initialize called for rumble %p, hidDevice %p, begin %d\n", rumble, (void *)(intptr_t)hidDevice, begin);
 
     if (!begin) {
+        gcusbrumble_destroy_timer (rumble);
+        gcusbrumble_print_stats (rumble);
+        gcusbrumble_close_ring (rumble);
         if (rumble->adapter_port) {
             (*rumble->adapter_port)->close (rumble->adapter_port);
             (*rumble->adapter_port)->Release (rumble->adapter_port);
@@ -165,38 +308,134 @@ HRESULT	gcusbrumble_initialize_terminate (void *self, NumVersion forceFeedbackAP
 
     GCRumbleDebug(rumble, "Opening adapter port %p\n", rumble->adapter_port);
 
+    gcusbrumble_open_ring (rumble, hidDevice);
+
+    if (NULL == rumble->timer) {
+        CFRunLoopTimerContext timer_context = {.version = 0, .info = rumble, .retain = NULL,
+                                               .release = NULL, .copyDescription = NULL};
+
+        rumble->timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent () + GCUSBRUMBLE_IDLE,
+                                             GCUSBRUMBLE_TICK, 0, 0, gcusbrumble_timer, &timer_context);
+        if (rumble->timer) {
+            CFRunLoopAddTimer(CFRunLoopGetCurrent(), rumble->timer, kCFRunLoopCommonModes);
+        }
+    }
+
     return FF_OK;
 }
 
 static HRESULT gcusbrumble_destroy_effect (void *self, FFEffectDownloadID downloadID) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
+    int slot = (int) downloadID - 1;
+
     GCRumbleDebug(rumble, "Destroy Effect called for rumble %p, downloadID = %u\n", rumble, downloadID);
 
-    if (1 != downloadID || ! rumble->effects[0].downloaded) {
+    if (slot < 0 || slot >= GCUSBMIXER_SLOTS || !rumble->mixer.slots[slot].downloaded) {
         return FFERR_INVALIDPARAM;
     }
 
-    rumble->effects[0].downloaded = 0;
-    --rumble->num_effects_downloaded;
-
-    gcusbrumble_destroy_timer (rumble->effects);
+    gcusbmixer_free (&rumble->mixer, slot);
+    gcusbrumble_update (rumble);
 
     return FF_OK;
 }
 
-static void gcusbrumble_timer (CFRunLoopTimerRef timer, void *info) {
-    gcusbrumble_effect_t *effect = (gcusbrumble_effect_t *) info;
-    gcusbrumble_t *rumble = (gcusbrumble_t *)((intptr_t) effect - offsetof (gcusbrumble_t, effects) - sizeof (*effect) * (effect->identifier - 1));
-    fprintf (stderr, "Timer fired. left = %d\n", effect->iterations - 1);
-    if (0 == --effect->iterations) {
-        gcusbrumble_stop_effect(&rumble->device_interface.vtbl, 1);
+/**
+ * @brief Convert the parameters of a ForceFeedback effect for the mixer
+ *
+ * Only the parameters selected by flags are updated so an effect can be modified in
+ * place.
+ */
+static HRESULT gcusbrumble_convert_effect (CFUUIDRef effectType, const FFEFFECT *pEffect, FFEffectParameterFlag flags,
+                                           gcusbmixer_effect_t *effect) {
+    if (CFEqual(effectType, kFFEffectType_ConstantForce_ID)) {
+        effect->waveform = GCUSBMIXER_CONSTANT;
+    } else if (CFEqual(effectType, kFFEffectType_RampForce_ID)) {
+        effect->waveform = GCUSBMIXER_RAMP;
+    } else if (CFEqual(effectType, kFFEffectType_Sine_ID)) {
+        effect->waveform = GCUSBMIXER_SINE;
+    } else if (CFEqual(effectType, kFFEffectType_Square_ID)) {
+        effect->waveform = GCUSBMIXER_SQUARE;
+    } else {
+        return FFERR_UNSUPPORTED;
+    }
+
+    if (flags & FFEP_DURATION) {
+        /* duration is in us */
+        effect->duration = pEffect->dwDuration;
+    }
+
+    if (flags & FFEP_GAIN) {
+        effect->gain = pEffect->dwGain > GCUSBMIXER_MAX ? GCUSBMIXER_MAX : pEffect->dwGain;
+    }
+
+    if (flags & FFEP_STARTDELAY) {
+        effect->start_delay = pEffect->dwStartDelay;
     }
+
+    if (flags & FFEP_ENVELOPE) {
+        const FFENVELOPE *envelope = pEffect->lpEnvelope;
+
+        if (envelope && envelope->dwSize >= sizeof (*envelope)) {
+            effect->attack_level = envelope->dwAttackLevel > GCUSBMIXER_MAX ? GCUSBMIXER_MAX : envelope->dwAttackLevel;
+            effect->attack_time = envelope->dwAttackTime;
+            effect->fade_level = envelope->dwFadeLevel > GCUSBMIXER_MAX ? GCUSBMIXER_MAX : envelope->dwFadeLevel;
+            effect->fade_time = envelope->dwFadeTime;
+        } else {
+            /* no envelope */
+            effect->attack_time = effect->fade_time = 0;
+        }
+    }
+
+    if (!(flags & FFEP_TYPESPECIFICPARAMS)) {
+        return FF_OK;
+    }
+
+    if (NULL == pEffect->lpvTypeSpecificParams) {
+        return FFERR_INVALIDPARAM;
+    }
+
+    switch (effect->waveform) {
+    case GCUSBMIXER_CONSTANT: {
+        const FFCONSTANTFORCE *constant = (const FFCONSTANTFORCE *) pEffect->lpvTypeSpecificParams;
+        if (pEffect->cbTypeSpecificParams < sizeof (*constant)) {
+            return FFERR_INVALIDPARAM;
+        }
+        effect->magnitude = constant->lMagnitude;
+        break;
+    }
+    case GCUSBMIXER_RAMP: {
+        const FFRAMPFORCE *ramp = (const FFRAMPFORCE *) pEffect->lpvTypeSpecificParams;
+        if (pEffect->cbTypeSpecificParams < sizeof (*ramp)) {
+            return FFERR_INVALIDPARAM;
+        }
+        effect->ramp_start = ramp->lStart;
+        effect->ramp_end = ramp->lEnd;
+        break;
+    }
+    case GCUSBMIXER_SINE:
+    case GCUSBMIXER_SQUARE: {
+        const FFPERIODIC *periodic = (const FFPERIODIC *) pEffect->lpvTypeSpecificParams;
+        if (pEffect->cbTypeSpecificParams < sizeof (*periodic)) {
+            return FFERR_INVALIDPARAM;
+        }
+        effect->magnitude = (int32_t) (periodic->dwMagnitude > GCUSBMIXER_MAX ? GCUSBMIXER_MAX : periodic->dwMagnitude);
+        effect->offset = periodic->lOffset;
+        effect->phase = periodic->dwPhase % 36000;
+        effect->period = periodic->dwPeriod;
+        break;
+    }
+    }
+
+    return FF_OK;
 }
 
 static HRESULT gcusbrumble_download_effect (void *self, CFUUIDRef effectType, FFEffectDownloadID *pDownloadID,
                                      FFEFFECT *pEffect, FFEffectParameterFlag flags) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
-    int effect_index = 0;
+    gcusbmixer_effect_t effect;
+    int slot = (int) *pDownloadID - 1;
+    HRESULT ret;
 
     if (rumble->debug) {
         CFUUIDBytes GCRUMBLE = CFUUIDGetUUIDBytes(effectType);
@@ -212,40 +451,43 @@ static HRESULT gcusbrumble_download_effect (void *self, CFUUIDRef effectType, FF
                       GCRUMBLE.byte8, GCRUMBLE.byte9,GCRUMBLE.byte10, GCRUMBLE.byte11, GCRUMBLE.byte12, GCRUMBLE.byte13, GCRUMBLE.byte14, GCRUMBLE.byte15);
     }
 
-    if (!CFEqual(effectType, kFFEffectType_ConstantForce_ID) &&
-        !CFEqual(effectType, kFFEffectType_Sine_ID) &&
-        !CFEqual(effectType, kFFEffectType_Square_ID)) {
-        return FFERR_UNSUPPORTED;
-    }
-
-    if (FFSFFC_PAUSE == rumble->state) {
+    if (FFGFFS_PAUSED & rumble->state) {
         return FFERR_DEVICEPAUSED;
     }
 
-    /* no need to allow more than one effect be downloaded at a time */
-    if (rumble->effects[effect_index].downloaded && 0 == *pDownloadID) {
-        return FFERR_OUTOFMEMORY;
+    if (0 == *pDownloadID) {
+        /* new effect. every parameter has to be supplied */
+        memset (&effect, 0, sizeof (effect));
+        effect.gain = GCUSBMIXER_MAX;
+        effect.duration = GCUSBMIXER_INFINITE;
+        flags |= FFEP_DURATION | FFEP_GAIN | FFEP_STARTDELAY | FFEP_ENVELOPE | FFEP_TYPESPECIFICPARAMS;
+    } else if (slot >= GCUSBMIXER_SLOTS || !rumble->mixer.slots[slot].downloaded) {
+        return FFERR_INVALIDDOWNLOADID;
+    } else {
+        /* modify the effect in place */
+        effect = rumble->mixer.slots[slot].effect;
     }
 
-    *pDownloadID = effect_index + 1;
-
-    if (FF_INFINITE != pEffect->dwDuration) {
-        /* duration is in us */
-        CFAbsoluteTime interval = (float) pEffect->dwDuration * 0.000001f;
-        CFRunLoopTimerContext timer_context = {.version = 0, .info = rumble->effects, .retain = NULL,
-                                               .release = NULL, .copyDescription = NULL};
+    ret = gcusbrumble_convert_effect (effectType, pEffect, flags, &effect);
+    if (FF_OK != ret || (flags & FFEP_NODOWNLOAD)) {
+        return ret;
+    }
 
-        rumble->effects[effect_index].timer = CFRunLoopTimerCreate(kCFAllocatorDefault, interval, interval, 0, 0,
-                                                                   gcusbrumble_timer, &timer_context);
+    if (0 == *pDownloadID) {
+        slot = gcusbmixer_alloc (&rumble->mixer);
+        if (slot < 0) {
+            return FFERR_OUTOFMEMORY;
+        }
+        *pDownloadID = slot + 1;
     }
 
+    gcusbmixer_set (&rumble->mixer, slot, &effect);
+
     if (flags & FFEP_START) {
-        gcusb_set_rumble (rumble->adapter_port, 1);
-        rumble->effects[effect_index].status = FFEGES_PLAYING;
+        gcusbmixer_start (&rumble->mixer, slot, gcusbrumble_now (), 1);
     }
 
-    rumble->effects[effect_index].downloaded = 1;
-    ++rumble->num_effects_downloaded;
+    gcusbrumble_update (rumble);
 
     return FF_OK;
 }
@@ -254,7 +496,7 @@ static HRESULT gcusbrumble_escape (void *self, FFEffectDownloadID downloadID, FF
     gcusbrumble_t *rumble = GCRUMBLE(self);
     GCRumbleDebug(rumble, "Escape Effect called for rumble %p, pDownloadID = %u\n", rumble, downloadID);
 
-    if (downloadID > 1) {
+    if (downloadID > GCUSBMIXER_SLOTS) {
         return FFERR_INVALIDDOWNLOADID;
     }
 
@@ -266,11 +508,12 @@ static HRESULT gcusbrumble_get_effect_status (void *self, FFEffectDownloadID dow
 
     GCRumbleDebug(rumble, "Escape Status called for rumble %p, pDownloadID = %u\n", rumble, downloadID);
 
-    if (1 != downloadID || !rumble->effects[downloadID - 1].downloaded) {
+    if (0 == downloadID || downloadID > GCUSBMIXER_SLOTS || !rumble->mixer.slots[downloadID - 1].downloaded) {
         return FFERR_INVALIDDOWNLOADID;
     }
 
-    *pStatusCode = rumble->effects[downloadID - 1].status;
+    *pStatusCode = gcusbmixer_playing (&rumble->mixer, downloadID - 1, gcusbrumble_now ()) ? FFEGES_PLAYING :
+        FFEGES_NOTPLAYING;
 
     return FF_OK;
 }
@@ -284,15 +527,21 @@ static HRESULT gcusbrumble_get_force_feedback_capabilities (void * self, FFCAPAB
     pCapabilities->ffSpecVer.minorAndBugRev = kFFPlugInAPIMinorAndBugRev;
     pCapabilities->ffSpecVer.stage = kFFPlugInAPIStage;
     pCapabilities->ffSpecVer.nonRelRev = kFFPlugInAPINonRelRev;
-    /* probably can add more "supported" types */
-    pCapabilities->supportedEffects = FFCAP_ET_CONSTANTFORCE | FFCAP_ET_SINE;
+    pCapabilities->supportedEffects = FFCAP_ET_CONSTANTFORCE | FFCAP_ET_RAMPFORCE | FFCAP_ET_SINE | FFCAP_ET_SQUARE;
     pCapabilities->emulatedEffects = 0;
     pCapabilities->subType = FFCAP_ST_VIBRATION;
     pCapabilities->numFfAxes = 1;
     memset (pCapabilities->ffAxes, 0, sizeof (pCapabilities->ffAxes));
     pCapabilities->ffAxes[0] = FFJOFS_X;
-    pCapabilities->storageCapacity = 1;
-    pCapabilities->playbackCapacity = 1;
+    pCapabilities->storageCapacity = GCUSBMIXER_SLOTS;
+    pCapabilities->playbackCapacity = GCUSBMIXER_SLOTS;
+    if (gcusbrumble_wireless (rumble)) {
+        /* a WaveBird has no motor */
+        pCapabilities->supportedEffects = 0;
+        pCapabilities->numFfAxes = 0;
+        pCapabilities->ffAxes[0] = 0;
+        pCapabilities->playbackCapacity = 0;
+    }
     pCapabilities->driverVer.majorRev = gcusbrumble_major;
     pCapabilities->driverVer.minorAndBugRev = gcusbrumble_minor;
     pCapabilities->driverVer.stage = gcusbrumble_stage;
@@ -308,51 +557,48 @@ static HRESULT gcusbrumble_get_force_feedback_capabilities (void * self, FFCAPAB
 static HRESULT gcusbrumble_get_force_feedback_state (void *self, ForceFeedbackDeviceState *pDeviceState) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
 
-    pDeviceState->dwState = rumble->state;
-    pDeviceState->dwLoad = rumble->num_effects_downloaded * 100;
+    /* rumble power is reported live from the status byte the kext publishes in the ring */
+    pDeviceState->dwState = rumble->state | (gcusbrumble_powered (rumble) ? FFGFFS_POWERON : FFGFFS_POWEROFF);
+    pDeviceState->dwLoad = rumble->mixer.num_downloaded * 100 / GCUSBMIXER_SLOTS;
 
     return FF_OK;
 }
 
 static HRESULT gcusbrumble_send_force_feedback_command (void *self, FFCommandFlag state) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
-    int rumble_state = 0;
 
     GCRumbleDebug(rumble, "Send command called for rumble %p, state %d\n", rumble, state);
 
     switch (state) {
     case FFSFFC_RESET:
-            rumble->effects[0].downloaded = 0;
+            gcusbmixer_reset (&rumble->mixer);
             rumble->state = FFGFFS_EMPTY;
-            rumble->effects[0].status = FFEGES_NOTPLAYING;
-            gcusbrumble_destroy_timer (rumble->effects);
             break;
     case FFSFFC_STOPALL:
-            gcusbrumble_stop_effect (self, 1);
-            rumble->state = FFGFFS_STOPPED;
+            gcusbmixer_stop_all (&rumble->mixer);
+            rumble->state |= FFGFFS_STOPPED;
             break;
     case FFSFFC_SETACTUATORSOFF:
+            rumble->mixer.muted = true;
+            rumble->state &= ~FFGFFS_ACTUATORSON;
             rumble->state |= FFGFFS_ACTUATORSOFF;
             break;
     case FFSFFC_PAUSE:
-            rumble->state = FFGFFS_PAUSED;
+            gcusbmixer_pause (&rumble->mixer, gcusbrumble_now (), true);
+            rumble->state |= FFGFFS_PAUSED;
             break;
     case FFSFFC_SETACTUATORSON:
+            rumble->mixer.muted = false;
             rumble->state &= ~FFGFFS_ACTUATORSOFF;
             rumble->state |= FFGFFS_ACTUATORSON;
-            if (FFEGES_PLAYING == rumble->effects[0].status) {
-                rumble_state = 1;
-            }
             break;
     case FFSFFC_CONTINUE:
+            gcusbmixer_pause (&rumble->mixer, gcusbrumble_now (), false);
             rumble->state &= ~FFGFFS_PAUSED;
-            if (FFEGES_PLAYING == rumble->effects[0].status) {
-                rumble_state = 1;
-            }
             break;
     }
 
-    gcusb_set_rumble (rumble->adapter_port, rumble_state);
+    gcusbrumble_update (rumble);
 
     return FF_OK;
 }
@@ -362,40 +608,51 @@ static HRESULT gcusbrumble_set_property (void *self, FFProperty property, void *
 
     GCRumbleDebug(rumble, "Set property called for rumble %p, property %d\n", rumble, property);
 
-#pragma unused(pValue)
+    if (FFPROP_FFGAIN == property && pValue) {
+        UInt32 gain = *(UInt32 *) pValue;
+
+        rumble->mixer.gain = gain > GCUSBMIXER_MAX ? GCUSBMIXER_MAX : gain;
+        gcusbrumble_update (rumble);
+
+        return FF_OK;
+    }
+
     return FFERR_UNSUPPORTED;
 }
 
 static HRESULT gcusbrumble_start_effect (void *self, FFEffectDownloadID downloadID, FFEffectStartFlag mode, UInt32 iterations) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
-    int rumble_index = downloadID - 1;
+    int slot = (int) downloadID - 1;
 
     GCRumbleDebug(rumble, "Start effect called for rumble %p, downloadID %d, mode %d, iterations %d\n", rumble, downloadID, mode, iterations);
 
-    if (!(FFGFFS_PAUSED & rumble->state)) {
-        gcusb_set_rumble (rumble->adapter_port, 1);
-        rumble->effects[rumble_index].status = FFEGES_PLAYING;
-        if (FF_INFINITE != iterations && rumble->effects[rumble_index].timer) {
-            rumble->effects[rumble_index].iterations = iterations;
-            CFRunLoopAddTimer(CFRunLoopGetCurrent(), rumble->effects[rumble_index].timer, kCFRunLoopCommonModes);
-        }
+    if (slot < 0 || slot >= GCUSBMIXER_SLOTS || !rumble->mixer.slots[slot].downloaded) {
+        return FFERR_INVALIDDOWNLOADID;
     }
 
+    if (mode & FFES_SOLO) {
+        gcusbmixer_stop_all (&rumble->mixer);
+    }
+
+    /* FF_INFINITE and GCUSBMIXER_INFINITE are the same value */
+    gcusbmixer_start (&rumble->mixer, slot, gcusbrumble_now (), iterations);
+    rumble->state &= ~FFGFFS_STOPPED;
+    gcusbrumble_update (rumble);
+
     return FF_OK;
 }
 
 static HRESULT gcusbrumble_stop_effect (void *self, UInt32 downloadID) {
     gcusbrumble_t *rumble = GCRUMBLE(self);
-    int rumble_index = downloadID - 1;
 
     GCRumbleDebug(rumble, "Stop effect called for rumble %p, downloadID %d\n", rumble, downloadID);
 
-    gcusb_set_rumble (rumble->adapter_port, 0);
-    rumble->effects[rumble_index].status = FFEGES_NOTPLAYING;
-    if (rumble->effects[rumble_index].timer) {
-        CFRunLoopTimerInvalidate(rumble->effects[rumble_index].timer);
+    if (!gcusbmixer_stop (&rumble->mixer, (int) downloadID - 1)) {
+        return FFERR_INVALIDDOWNLOADID;
     }
 
+    gcusbrumble_update (rumble);
+
     return FF_OK;
 }
 
@@ -448,11 +705,29 @@ static IOCFPlugInInterface gcusbrumble_plugin_interface = {
     .Stop = gcusbrumble_stop,
 };
 
+/* integer setting from the plug-in's Info dictionary or the environment. the plug-in is
+ * loaded into the client application so the main bundle is the wrong place to look. */
+static long gcusbrumble_setting (CFStringRef key, const char *env, long value) {
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier(CFSTR(GCUSBRUMBLE_BUNDLE_ID));
+    CFNumberRef number = NULL;
+    char *tmp;
+
+    if (bundle) {
+        number = CFBundleGetValueForInfoDictionaryKey(bundle, key);
+    }
+
+    if (number && CFNumberGetTypeID () == CFGetTypeID (number)) {
+        CFNumberGetValue(number, kCFNumberLongType, &value);
+    } else if (NULL != (tmp = getenv (env))) {
+        value = strtol (tmp, NULL, 0);
+    }
+
+    return value;
+}
+
 static IOCFPlugInInterface **gcusbrumble_alloc (CFUUIDRef uuid) {
-    CFBundleRef my_bundle = CFBundleGetMainBundle();
-    CFNumberRef debug_level;
     gcusbrumble_t *new_plugin;
-    char *tmp;
+    long rate, report_rate;
 
     new_plugin = (gcusbrumble_t *) calloc (1, sizeof (*new_plugin));
 
@@ -462,14 +737,12 @@ static IOCFPlugInInterface **gcusbrumble_alloc (CFUUIDRef uuid) {
     new_plugin->plugin_interface.ctx = new_plugin;
     new_plugin->factory_id = (CFUUIDRef) CFRetain(uuid);
     new_plugin->ref_cnt = 1;
-    new_plugin->effects[0].identifier = 1;
+    new_plugin->debug = gcusbrumble_setting (CFSTR("Debug"), "GCUSBRUMBLE_DEBUG", 0);
 
-    debug_level = CFBundleGetValueForInfoDictionaryKey(my_bundle, CFSTR("Debug"));
-    if (debug_level) {
-        CFNumberGetValue(debug_level, kCFNumberLongType, &new_plugin->debug);
-    } else if (NULL != (tmp = getenv ("GCUSBRUMBLE_DEBUG"))) {
-        new_plugin->debug = strtol (tmp, NULL, 0);
-    }
+    rate = gcusbrumble_setting (CFSTR("PWMCarrierRate"), "GCUSBRUMBLE_PWM_RATE", GCUSBPWM_DEFAULT_RATE);
+    report_rate = gcusbrumble_setting (CFSTR("MaxReportRate"), "GCUSBRUMBLE_REPORT_RATE", GCUSBPWM_DEFAULT_REPORT_RATE);
+    gcusbmixer_init (&new_plugin->mixer);
+    gcusbmixer_configure (&new_plugin->mixer, rate > 0 ? (uint32_t) rate : 0, report_rate > 0 ? (uint32_t) report_rate : 0);
 
     CFPlugInAddInstanceForFactory(uuid);
 
@@ -22,30 +22,15 @@
 
 #pragma GCC visibility push(hidden)
 
+#include "gcusbmixer.h"
+#include "../gcusbadapter/gcusbshared.h"
+
 struct gcusbrumble_interface_t {
     IUnknownVTbl *vtbl;
     void *ctx;
 };
 typedef struct gcusbrumble_interface_t gcusbrumble_interface_t;
 
-struct gcusbrumble_effect_t {
-    /** identifier of effect */
-    FFEffectDownloadID identifier;
-
-    /** effect is downloaded */
-    bool downloaded;
-
-    /* current effect status */
-    FFEffectStatusFlag status;
-
-    /** timer for periodic effects */
-    CFRunLoopTimerRef timer;
-
-    /** affect iterations */
-    int iterations;
-};
-typedef struct gcusbrumble_effect_t gcusbrumble_effect_t;
-
 struct gcusbrumble_t {
     /** ForceFeedback Plugin interface */
     gcusbrumble_interface_t device_interface;
@@ -60,15 +45,26 @@ struct gcusbrumble_t {
      * when this reaches 0 */
     UInt32 ref_cnt;
 
-    /** force feedback effects (only support 1 at a time) */
-    gcusbrumble_effect_t effects[1];
+    /** downloaded force feedback effects and the mixer combining them */
+    gcusbmixer_t mixer;
 
-    /** number of effects downloaded (max 1 at this time) */
-    unsigned int num_effects_downloaded;
+    /** updates the motor while effects are playing */
+    CFRunLoopTimerRef timer;
 
     /** adapter port in use */
     IOHIDDeviceInterface121 **adapter_port;
 
+    /** shared rumble ring of the adapter port. rumble commands are written here
+     * instead of going through setReport when the ring is available */
+    io_connect_t ring_connect;
+    mach_vm_address_t ring_address;
+    GCUSBRumbleRing *ring;
+
+    /** the motor had power at the last update and the number of commands dropped
+     * because it had none */
+    bool powered;
+    uint64_t unpowered;
+
     /** force feedback state */
     int state;
 
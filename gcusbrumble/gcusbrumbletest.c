@@ -0,0 +1,446 @@
+/* -*- Mode: C; indent-tabs-mode:nil; c-basic-offset:4 -*- */
+/*
+ * host tests for the WUP-028 GameCube USB adapter CFPlugIn Bundle
+ * Copyright © 2015 Nathan Hjelm <hjelmn@cs.unm.edu>
+ *
+ * This bundle is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This bundle is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Drives the effect mixer and the PWM scheduler with a virtual clock and checks the
+ * mixed level and the motor edges against values worked out by hand. Neither has
+ * CoreFoundation or ForceFeedback dependencies so this builds on Linux and OS X
+ * without the plug-in:
+ *
+ *   cc -std=c99 -O2 -o gcusbrumbletest gcusbrumbletest.c gcusbmixer.c gcusbpwm.c -lm
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcusbmixer.h"
+#include "gcusbpwm.h"
+
+/* most motor edges recorded by one PWM run */
+#define GCUSBRUMBLETEST_EDGES 256
+
+/* number of failed expectations of the running test */
+static int gcusbrumbletest_errors;
+
+static void gcusbrumbletest_expect (const char *test, bool ok, const char *what) {
+    if (!ok) {
+        fprintf (stderr, "%s: %s\n", test, what);
+        ++gcusbrumbletest_errors;
+    }
+}
+
+/* mix at a time and check the level */
+static void gcusbrumbletest_level (const char *test, gcusbmixer_t *mixer, uint64_t now, uint32_t expected) {
+    uint64_t next;
+    int motor;
+
+    (void) gcusbmixer_update (mixer, now, &motor, &next);
+    if (mixer->level != expected) {
+        fprintf (stderr, "%s: level %u at %llu us, expected %u\n", test, mixer->level, (unsigned long long) now,
+                 expected);
+        ++gcusbrumbletest_errors;
+    }
+}
+
+/* download and start an effect. returns the slot */
+static int gcusbrumbletest_play (gcusbmixer_t *mixer, const gcusbmixer_effect_t *effect, uint64_t now,
+                                 uint32_t iterations) {
+    int slot = gcusbmixer_alloc (mixer);
+
+    gcusbmixer_set (mixer, slot, effect);
+    gcusbmixer_start (mixer, slot, now, iterations);
+
+    return slot;
+}
+
+static void gcusbrumbletest_effect (gcusbmixer_effect_t *effect, gcusbmixer_waveform_t waveform, int32_t magnitude,
+                                    uint32_t duration) {
+    memset (effect, 0, sizeof (*effect));
+    effect->waveform = waveform;
+    effect->magnitude = magnitude;
+    effect->duration = duration;
+    effect->gain = GCUSBMIXER_MAX;
+}
+
+static void gcusbrumbletest_constant (void) {
+    gcusbmixer_effect_t effect;
+    gcusbmixer_t mixer;
+    int slot;
+
+    /* 100 ms at 60% after a 20 ms delay */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_CONSTANT, 6000, 100000);
+    effect.start_delay = 20000;
+    slot = gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("constant", &mixer, 0, 0);
+    gcusbrumbletest_level ("constant", &mixer, 19999, 0);
+    gcusbrumbletest_level ("constant", &mixer, 20000, 6000);
+    gcusbrumbletest_level ("constant", &mixer, 119999, 6000);
+    gcusbrumbletest_level ("constant", &mixer, 120000, 0);
+    gcusbrumbletest_expect ("constant", !gcusbmixer_playing (&mixer, slot, 120000), "finished effect still playing");
+
+    /* a negative force drives the motor as hard as a positive one. the effect gain scales it */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_CONSTANT, -4000, GCUSBMIXER_INFINITE);
+    effect.gain = 5000;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("constant", &mixer, 0, 2000);
+    gcusbrumbletest_level ("constant", &mixer, 1000000000, 2000);
+
+    /* attack from 20% over 10 ms and fade to 0 over the last 20 ms */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_CONSTANT, 6000, 100000);
+    effect.attack_level = 2000;
+    effect.attack_time = 10000;
+    effect.fade_time = 20000;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("constant", &mixer, 0, 2000);
+    gcusbrumbletest_level ("constant", &mixer, 5000, 4000);
+    gcusbrumbletest_level ("constant", &mixer, 10000, 6000);
+    gcusbrumbletest_level ("constant", &mixer, 80000, 6000);
+    gcusbrumbletest_level ("constant", &mixer, 90000, 3000);
+    gcusbrumbletest_level ("constant", &mixer, 99999, 0);
+}
+
+static void gcusbrumbletest_ramp (void) {
+    gcusbmixer_effect_t effect;
+    gcusbmixer_t mixer;
+
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_RAMP, 0, 100000);
+    effect.ramp_start = 0;
+    effect.ramp_end = GCUSBMIXER_MAX;
+    gcusbrumbletest_play (&mixer, &effect, 1000, 1);
+    gcusbrumbletest_level ("ramp", &mixer, 1000, 0);
+    gcusbrumbletest_level ("ramp", &mixer, 26000, 2500);
+    gcusbrumbletest_level ("ramp", &mixer, 51000, 5000);
+    gcusbrumbletest_level ("ramp", &mixer, 100999, 9999);
+    gcusbrumbletest_level ("ramp", &mixer, 101000, 0);
+
+    /* a ramp through zero drives the motor with its absolute level */
+    gcusbmixer_init (&mixer);
+    effect.ramp_start = GCUSBMIXER_MAX;
+    effect.ramp_end = -GCUSBMIXER_MAX;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("ramp", &mixer, 25000, 5000);
+    gcusbrumbletest_level ("ramp", &mixer, 50000, 0);
+    gcusbrumbletest_level ("ramp", &mixer, 75000, 5000);
+
+    /* without a duration the ramp never leaves its start */
+    gcusbmixer_init (&mixer);
+    effect.duration = GCUSBMIXER_INFINITE;
+    effect.ramp_start = 3000;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("ramp", &mixer, 500000, 3000);
+}
+
+static void gcusbrumbletest_sine (void) {
+    gcusbmixer_effect_t effect;
+    gcusbmixer_t mixer;
+
+    /* 25 Hz at 80%. only the positive half drives the motor */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_SINE, 8000, GCUSBMIXER_INFINITE);
+    effect.period = 40000;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("sine", &mixer, 0, 0);
+    gcusbrumbletest_level ("sine", &mixer, 5000, 5657);
+    gcusbrumbletest_level ("sine", &mixer, 10000, 8000);
+    gcusbrumbletest_level ("sine", &mixer, 20000, 0);
+    gcusbrumbletest_level ("sine", &mixer, 30000, 0);
+    gcusbrumbletest_level ("sine", &mixer, 50000, 8000);
+
+    /* a 90 degree phase starts at the peak. the offset shifts the whole wave */
+    gcusbmixer_init (&mixer);
+    effect.phase = 9000;
+    effect.offset = 2000;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("sine", &mixer, 0, 10000);
+    gcusbrumbletest_level ("sine", &mixer, 10000, 2000);
+    gcusbrumbletest_level ("sine", &mixer, 20000, 0);
+}
+
+static void gcusbrumbletest_square (void) {
+    gcusbmixer_effect_t effect;
+    gcusbmixer_t mixer;
+
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_SQUARE, 5000, GCUSBMIXER_INFINITE);
+    effect.period = 20000;
+    effect.offset = -1000;
+    gcusbrumbletest_play (&mixer, &effect, 0, 1);
+    gcusbrumbletest_level ("square", &mixer, 0, 4000);
+    gcusbrumbletest_level ("square", &mixer, 9999, 4000);
+    gcusbrumbletest_level ("square", &mixer, 10000, 0);
+    gcusbrumbletest_level ("square", &mixer, 19999, 0);
+    gcusbrumbletest_level ("square", &mixer, 20000, 4000);
+}
+
+static void gcusbrumbletest_mix (void) {
+    gcusbmixer_effect_t constant, square;
+    gcusbmixer_t mixer;
+    int slot;
+
+    /* levels add up and clip. the device gain applies to the mix */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&constant, GCUSBMIXER_CONSTANT, 6000, GCUSBMIXER_INFINITE);
+    gcusbrumbletest_effect (&square, GCUSBMIXER_SQUARE, 5000, GCUSBMIXER_INFINITE);
+    square.period = 20000;
+    gcusbrumbletest_play (&mixer, &constant, 0, 1);
+    gcusbrumbletest_play (&mixer, &square, 0, 1);
+    gcusbrumbletest_level ("mix", &mixer, 0, 10000);
+    gcusbrumbletest_level ("mix", &mixer, 10000, 6000);
+    mixer.gain = 5000;
+    gcusbrumbletest_level ("mix", &mixer, 20000, 5000);
+    gcusbrumbletest_level ("mix", &mixer, 30000, 3000);
+
+    /* three iterations of 10 ms */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&constant, GCUSBMIXER_CONSTANT, 6000, 10000);
+    slot = gcusbrumbletest_play (&mixer, &constant, 0, 3);
+    gcusbrumbletest_level ("mix", &mixer, 29999, 6000);
+    gcusbrumbletest_level ("mix", &mixer, 30000, 0);
+    gcusbrumbletest_expect ("mix", !gcusbmixer_playing (&mixer, slot, 30000), "iterations not counted");
+
+    /* 50 ms paused for 50 ms after 10 ms. the pause does not count */
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&constant, GCUSBMIXER_CONSTANT, 6000, 50000);
+    gcusbrumbletest_play (&mixer, &constant, 0, 1);
+    gcusbmixer_pause (&mixer, 10000, true);
+    gcusbrumbletest_level ("mix", &mixer, 30000, 0);
+    gcusbmixer_pause (&mixer, 60000, false);
+    gcusbrumbletest_level ("mix", &mixer, 99999, 6000);
+    gcusbrumbletest_level ("mix", &mixer, 100000, 0);
+}
+
+static void gcusbrumbletest_slots (void) {
+    gcusbmixer_effect_t effect;
+    gcusbmixer_t mixer;
+    int slot;
+
+    gcusbmixer_init (&mixer);
+    gcusbrumbletest_effect (&effect, GCUSBMIXER_CONSTANT, 1000, GCUSBMIXER_INFINITE);
+
+    for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+        gcusbrumbletest_expect ("slots", i == gcusbrumbletest_play (&mixer, &effect, 0, 1), "slots not handed out in order");
+    }
+
+    gcusbrumbletest_expect ("slots", -1 == gcusbmixer_alloc (&mixer), "more effects than slots");
+    gcusbrumbletest_expect ("slots", GCUSBMIXER_SLOTS == mixer.num_downloaded, "wrong number of downloaded effects");
+
+    /* 16 effects at 10% clip at the maximum */
+    gcusbrumbletest_level ("slots", &mixer, 0, GCUSBMIXER_MAX);
+
+    /* a freed slot is the next one handed out. freeing it twice or freeing a bad slot
+     * changes nothing */
+    gcusbmixer_free (&mixer, 5);
+    gcusbmixer_free (&mixer, 5);
+    gcusbmixer_free (&mixer, -1);
+    gcusbmixer_free (&mixer, GCUSBMIXER_SLOTS);
+    gcusbrumbletest_expect ("slots", GCUSBMIXER_SLOTS - 1 == mixer.num_downloaded, "free miscounted");
+    gcusbrumbletest_expect ("slots", !gcusbmixer_set (&mixer, 5, &effect) && !gcusbmixer_start (&mixer, 5, 0, 1) &&
+                            !gcusbmixer_stop (&mixer, 5), "freed slot still usable");
+    slot = gcusbmixer_alloc (&mixer);
+    gcusbrumbletest_expect ("slots", 5 == slot, "freed slot not reused");
+    gcusbrumbletest_expect ("slots", !mixer.slots[slot].playing && 0 == mixer.slots[slot].effect.magnitude,
+                            "reused slot kept the old effect");
+    gcusbrumbletest_expect ("slots", -1 == gcusbmixer_alloc (&mixer), "more effects than slots");
+
+    /* stopping leaves the effect downloaded */
+    for (int i = 0 ; i < GCUSBMIXER_SLOTS ; ++i) {
+        gcusbmixer_stop (&mixer, i);
+    }
+    gcusbrumbletest_level ("slots", &mixer, 1000, 0);
+    gcusbrumbletest_expect ("slots", GCUSBMIXER_SLOTS == mixer.num_downloaded && !gcusbmixer_active (&mixer),
+                            "stopped effects miscounted");
+
+    gcusbmixer_reset (&mixer);
+    gcusbrumbletest_expect ("slots", 0 == mixer.num_downloaded && 0 == gcusbmixer_alloc (&mixer),
+                            "reset did not free every slot");
+}
+
+/* motor edges seen while driving a PWM scheduler */
+struct gcusbrumbletest_edges_t {
+    uint64_t time[GCUSBRUMBLETEST_EDGES];
+    int state[GCUSBRUMBLETEST_EDGES];
+    int count;
+};
+
+/* run the scheduler at a fixed level from now until end, waking up only when it asks to.
+ * returns the time of the last wake up */
+static uint64_t gcusbrumbletest_pwm_run (gcusbpwm_t *pwm, struct gcusbrumbletest_edges_t *edges, uint64_t now,
+                                         uint64_t end, uint32_t level) {
+    uint64_t next;
+    int motor;
+
+    while (now < end) {
+        if (gcusbpwm_update (pwm, now, level, &motor, &next) && edges->count < GCUSBRUMBLETEST_EDGES) {
+            edges->time[edges->count] = now;
+            edges->state[edges->count++] = motor;
+        }
+
+        if (UINT64_MAX == next) {
+            break;
+        }
+
+        now = next;
+    }
+
+    return now;
+}
+
+/* check a steady carrier: on at every period start and off after the on time */
+static void gcusbrumbletest_pwm_carrier (uint32_t rate, uint32_t report_rate, uint32_t level, uint32_t period,
+                                         uint32_t on) {
+    struct gcusbrumbletest_edges_t edges = {.count = 0};
+    uint64_t end = 10 * (uint64_t) period, on_total = 0;
+    gcusbpwm_t pwm;
+    char what[128];
+
+    gcusbpwm_init (&pwm, rate, report_rate);
+    if (pwm.period != period || gcusbpwm_on_time (&pwm, level) != on) {
+        snprintf (what, sizeof (what), "%u Hz level %u: period %u on %u, expected %u and %u", rate, level, pwm.period,
+                  gcusbpwm_on_time (&pwm, level), period, on);
+        gcusbrumbletest_expect ("pwm", false, what);
+        return;
+    }
+
+    (void) gcusbrumbletest_pwm_run (&pwm, &edges, 0, end, level);
+
+    for (int i = 0 ; i < edges.count ; ++i) {
+        uint64_t expected = (uint64_t) (i / 2) * period + ((i & 1) ? on : 0);
+
+        if (edges.time[i] != expected || edges.state[i] != !(i & 1)) {
+            snprintf (what, sizeof (what), "%u Hz level %u: edge %d to %d at %llu us, expected %d at %llu us", rate,
+                      level, i, edges.state[i], (unsigned long long) edges.time[i], !(i & 1),
+                      (unsigned long long) expected);
+            gcusbrumbletest_expect ("pwm", false, what);
+            return;
+        }
+
+        if (edges.state[i]) {
+            on_total += ((i + 1 < edges.count) ? edges.time[i + 1] : end) - edges.time[i];
+        }
+    }
+
+    snprintf (what, sizeof (what), "%u Hz level %u: %d edges in 10 periods", rate, level, edges.count);
+    gcusbrumbletest_expect ("pwm", 20 == edges.count, what);
+    snprintf (what, sizeof (what), "%u Hz level %u: duty %llu/%llu, expected %u/%u", rate, level,
+              (unsigned long long) on_total, (unsigned long long) end, on, period);
+    gcusbrumbletest_expect ("pwm", on_total * period == end * on, what);
+    snprintf (what, sizeof (what), "%u Hz level %u: edges late or delayed", rate, level);
+    gcusbrumbletest_expect ("pwm", 0 == pwm.error_max && 0 == pwm.delayed, what);
+}
+
+static void gcusbrumbletest_pwm (void) {
+    struct gcusbrumbletest_edges_t edges = {.count = 0};
+    uint64_t now;
+    gcusbpwm_t pwm;
+
+    /* 25 Hz with 125 reports per second: 40 ms periods, pulses of at least 8 ms */
+    gcusbrumbletest_pwm_carrier (25, 125, 2500, 40000, 10000);
+    gcusbrumbletest_pwm_carrier (25, 125, 5000, 40000, 20000);
+    gcusbrumbletest_pwm_carrier (25, 125, 500, 40000, 8000);
+    gcusbrumbletest_pwm_carrier (25, 125, 9000, 40000, 32000);
+
+    /* 50 and 10 Hz */
+    gcusbrumbletest_pwm_carrier (50, 125, 5000, 20000, 10000);
+    gcusbrumbletest_pwm_carrier (50, 125, 1000, 20000, 8000);
+    gcusbrumbletest_pwm_carrier (10, 125, 7500, 100000, 75000);
+    gcusbrumbletest_pwm_carrier (10, 1000, 100, 100000, 1000);
+
+    /* a 100 Hz carrier can not fit two 8 ms pulses and is slowed to 62.5 Hz */
+    gcusbrumbletest_pwm_carrier (100, 125, 5000, 16000, 8000);
+
+    /* off and full levels are steady: no edge for off, one for full */
+    gcusbpwm_init (&pwm, 25, 125);
+    now = gcusbrumbletest_pwm_run (&pwm, &edges, 0, 1000000, 0);
+    gcusbrumbletest_expect ("pwm", 0 == edges.count && 0 == now, "off level produced edges");
+    now = gcusbrumbletest_pwm_run (&pwm, &edges, 1000, 1000000, GCUSBPWM_MAX);
+    gcusbrumbletest_expect ("pwm", 1 == edges.count && 1000 == edges.time[0] && 1 == edges.state[0] && 1000 == now,
+                            "full level not steady");
+
+    /* raising the level right after an off edge: the on edge waits out the report interval
+     * and the following off edge is pushed back so no two edges are closer than 8 ms */
+    gcusbpwm_init (&pwm, 25, 125);
+    edges.count = 0;
+    now = gcusbrumbletest_pwm_run (&pwm, &edges, 0, 24000, 5000);
+    gcusbrumbletest_expect ("pwm", 2 == edges.count && 20000 == edges.time[1] && 0 == edges.state[1],
+                            "wrong edges before the level change");
+    (void) gcusbrumbletest_pwm_run (&pwm, &edges, 24000, 200000, 9000);
+    gcusbrumbletest_expect ("pwm", 1 == pwm.delayed, "early edge not delayed");
+    gcusbrumbletest_expect ("pwm", edges.count > 3 && 28000 == edges.time[2] && 1 == edges.state[2] &&
+                            36000 == edges.time[3] && 0 == edges.state[3], "delayed edges at the wrong time");
+
+    for (int i = 1 ; i < edges.count ; ++i) {
+        gcusbrumbletest_expect ("pwm", edges.time[i] - edges.time[i - 1] >= pwm.min_interval,
+                                "edges closer than the report interval");
+    }
+}
+
+struct gcusbrumbletest_t {
+    const char *name;
+    void (*run) (void);
+};
+
+static const struct gcusbrumbletest_t gcusbrumbletest_tests[] = {
+    {"constant", gcusbrumbletest_constant},
+    {"ramp", gcusbrumbletest_ramp},
+    {"sine", gcusbrumbletest_sine},
+    {"square", gcusbrumbletest_square},
+    {"mix", gcusbrumbletest_mix},
+    {"slots", gcusbrumbletest_slots},
+    {"pwm", gcusbrumbletest_pwm},
+};
+
+int main (int argc, char *argv[]) {
+    size_t count = sizeof (gcusbrumbletest_tests) / sizeof (gcusbrumbletest_tests[0]);
+    int failed = 0, ran = 0;
+
+    for (size_t i = 0 ; i < count ; ++i) {
+        const struct gcusbrumbletest_t *test = gcusbrumbletest_tests + i;
+
+        /* run everything or only the tests named on the command line */
+        if (argc > 1) {
+            int j;
+
+            for (j = 1 ; j < argc && strcmp (argv[j], test->name) ; ++j) {
+            }
+
+            if (j == argc) {
+                continue;
+            }
+        }
+
+        gcusbrumbletest_errors = 0;
+        test->run ();
+        printf ("%-10s %s\n", test->name, gcusbrumbletest_errors ? "FAILED" : "ok");
+        failed += 0 != gcusbrumbletest_errors;
+        ++ran;
+    }
+
+    if (0 == ran) {
+        fprintf (stderr, "Usage: %s [test...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}